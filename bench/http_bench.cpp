@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "../rpi/http.hpp"
+
+// Requests/s of the node's HTTP client (rpi/http.hpp). --clients connections, each with --depth requests
+// pipelined on it at all times, for --time s; it reports the requests answered per s, their latency, and the
+// ones that failed.
+//
+// The server is a stand-in for the PHP server, in this process on 127.0.0.1: it answers every GET with
+// --size bytes, with Content-Length, chunked (--encoding=chunked), or by turns (--encoding=mixed), and with
+// --close-every=<n> it closes each connection after n responses, so that reconnecting is measured too. With
+// --server=<host>:<port> the client goes to a real one instead (e.g. pc_sw --http), for --path.
+//
+// The stand-in shares the thread, so the numbers are of the client and the server together.
+
+typedef boost::asio::ip::tcp tcp;
+typedef boost::chrono::steady_clock Clock;
+
+class Program {
+public:
+	struct Config {
+		std::string host_, port_; // Empty for the stand-in
+		std::string path_;
+		unsigned int clients_, depth_;
+		std::size_t size_; // Of the stand-in's responses
+		std::string encoding_;
+		unsigned int closeEvery_; // 0 for never
+		double time_;
+		Config() : path_("/sensor_longpoll.php?token="), clients_(1), depth_(8), size_(64), encoding_("length"), closeEvery_(0), time_(5) { }
+		static Config fromArgv(int argc, char const * const * argv);
+	};
+
+	Program(const Config & config);
+	void operator()();
+private:
+	// One connection of the stand-in: requests are answered in order, as they're read.
+	class Session
+		:	public boost::enable_shared_from_this<Session> {
+	public:
+		Session(Program & program) : program_(program), sock_(program.io_), responses_(0), writing_(false), closing_(false), readBuf_(4096) { }
+		void start();
+		tcp::socket & sock() { return sock_; }
+	private:
+		void startRead();
+		void onRead(const boost::system::error_code & error, std::size_t bytes_transferred);
+		void respond();
+		void startWrite();
+		void onWrite(const boost::system::error_code & error);
+
+		Program & program_;
+		tcp::socket sock_;
+		unsigned int responses_;
+		bool writing_, closing_;
+		std::vector<char> readBuf_;
+		std::string request_, out_, writeBuf_;
+	};
+
+	// One client connection, with config_.depth_ requests always pending
+	struct Client {
+		boost::shared_ptr<Http> http_;
+	};
+
+	void startAccept();
+	void onAccept(const boost::system::error_code & error, boost::shared_ptr<Session> session);
+	void sendReq(Client & client);
+	void onResponse(Client & client, Clock::time_point sent, const Http::Res & res);
+	void onTimer(const boost::system::error_code & error);
+
+	Config config_;
+	boost::asio::io_service io_;
+	tcp::acceptor acceptor_;
+	boost::asio::basic_waitable_timer<Clock> timer_;
+	std::vector<Client> clients_;
+	std::string body_; // Of the stand-in's responses
+	bool running_;
+	Clock::time_point start_, stop_;
+
+	// Statistics
+	std::vector<uint32_t> latencies_; // us, of the requests answered while running
+	unsigned long long failed_, bytes_, connections_;
+};
+
+Program::Config Program::Config::fromArgv(int argc, char const * const * argv) {
+	Config config;
+	for (int i = 1; i < argc; i++) {
+		std::string arg(argv[i]);
+		std::string::size_type eq = arg.find('=');
+		if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+			throw std::runtime_error("expected --<name>=<value>, not " + arg);
+		}
+		std::string name(arg.substr(2, eq - 2)), value(arg.substr(eq + 1));
+		if (name == "server") {
+			std::string::size_type colon = value.rfind(':');
+			if (colon == std::string::npos) {
+				throw std::runtime_error("expected --server=<host>:<port>, not " + arg);
+			}
+			config.host_ = value.substr(0, colon);
+			config.port_ = value.substr(colon + 1);
+		}
+		else if (name == "path") {
+			config.path_ = value;
+		}
+		else if (name == "clients") {
+			config.clients_ = std::max(1u, boost::lexical_cast<unsigned int>(value));
+		}
+		else if (name == "depth") {
+			config.depth_ = std::max(1u, boost::lexical_cast<unsigned int>(value));
+		}
+		else if (name == "size") {
+			config.size_ = boost::lexical_cast<std::size_t>(value);
+		}
+		else if (name == "encoding") {
+			if (value != "length" && value != "chunked" && value != "mixed") {
+				throw std::runtime_error("unknown encoding " + value);
+			}
+			config.encoding_ = value;
+		}
+		else if (name == "close-every") {
+			config.closeEvery_ = boost::lexical_cast<unsigned int>(value);
+		}
+		else if (name == "time") {
+			config.time_ = boost::lexical_cast<double>(value);
+		}
+		else {
+			throw std::runtime_error("unknown option --" + name);
+		}
+	}
+	return config;
+}
+
+Program::Program(const Config & config)
+	:	config_(config),
+		acceptor_(io_),
+		timer_(io_),
+		clients_(config.clients_),
+		body_(config.size_, 'x'),
+		running_(true),
+		failed_(0),
+		bytes_(0),
+		connections_(0) {
+}
+
+void Program::operator()() {
+	std::string host(config_.host_), port(config_.port_);
+	if (host.empty()) {
+		tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), 0);
+		acceptor_.open(endpoint.protocol());
+		acceptor_.set_option(tcp::acceptor::reuse_address(true));
+		acceptor_.bind(endpoint);
+		acceptor_.listen();
+		startAccept();
+		host = "127.0.0.1";
+		port = boost::lexical_cast<std::string>(acceptor_.local_endpoint().port());
+	}
+	for (std::size_t i = 0; i < clients_.size(); i++) {
+		clients_[i].http_ = Http::create(io_, host, port);
+		for (unsigned int j = 0; j < config_.depth_; j++) {
+			sendReq(clients_[i]);
+		}
+	}
+	start_ = Clock::now();
+	timer_.expires_from_now(boost::chrono::milliseconds(long(config_.time_ * 1000)));
+	timer_.async_wait(boost::bind(&Program::onTimer, this, boost::asio::placeholders::error));
+	io_.run();
+
+	double elapsed = boost::chrono::duration<double>(stop_ - start_).count();
+	std::sort(latencies_.begin(), latencies_.end());
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << "Requests: " << latencies_.size() << " answered (" << latencies_.size() / elapsed << "/s), " << failed_ << " failed, "
+		<< bytes_ / elapsed / 1e6 << " MB/s of content";
+	if (config_.host_.empty()) {
+		std::cout << "; " << connections_ << " connections";
+	}
+	std::cout << std::endl;
+	if (!latencies_.empty()) {
+		std::size_t n = latencies_.size();
+		std::cout << "Latency (us): p50 " << latencies_[n / 2] << " p99 " << latencies_[n * 99 / 100] << " max " << latencies_[n - 1] << std::endl;
+	}
+}
+
+void Program::startAccept() {
+	boost::shared_ptr<Session> session(new Session(*this));
+	acceptor_.async_accept(session->sock(), boost::bind(&Program::onAccept, this, boost::asio::placeholders::error, session));
+}
+
+void Program::onAccept(const boost::system::error_code & error, boost::shared_ptr<Session> session) {
+	if (error == boost::asio::error::operation_aborted) {
+		return;
+	}
+	if (!error) {
+		connections_++;
+		session->start();
+	}
+	startAccept();
+}
+
+void Program::Session::start() {
+	sock_.set_option(tcp::no_delay(true));
+	startRead();
+}
+
+void Program::Session::startRead() {
+	sock_.async_read_some(boost::asio::buffer(readBuf_), boost::bind(&Session::onRead, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+}
+
+void Program::Session::onRead(const boost::system::error_code & error, std::size_t bytes_transferred) {
+	if (error || closing_) {
+		return;
+	}
+	// GETs only, so a request ends with its blank line.
+	request_.append(readBuf_.data(), bytes_transferred);
+	std::string::size_type end;
+	while (!closing_ && (end = request_.find("\r\n\r\n")) != std::string::npos) {
+		request_.erase(0, end + 4);
+		respond();
+	}
+	startWrite();
+	if (!closing_) {
+		startRead();
+	}
+}
+
+void Program::Session::respond() {
+	responses_++;
+	bool chunked = program_.config_.encoding_ == "chunked" || (program_.config_.encoding_ == "mixed" && responses_ % 2 == 0);
+	closing_ = program_.config_.closeEvery_ && responses_ % program_.config_.closeEvery_ == 0;
+	std::ostringstream msg;
+	msg << "HTTP/1.1 200 OK\r\n";
+	msg << "Content-Type: application/octet-stream\r\n";
+	if (closing_) {
+		msg << "Connection: close\r\n";
+	}
+	if (chunked) {
+		// In two chunks, so that the chunk boundaries are parsed too
+		std::size_t half = program_.body_.size() / 2;
+		msg << "Transfer-Encoding: chunked\r\n\r\n";
+		if (half) {
+			msg << std::hex << half << "\r\n" << program_.body_.substr(0, half) << "\r\n";
+		}
+		msg << std::hex << program_.body_.size() - half << "\r\n" << program_.body_.substr(half) << "\r\n0\r\n\r\n";
+	}
+	else {
+		msg << "Content-Length: " << program_.body_.size() << "\r\n\r\n" << program_.body_;
+	}
+	out_ += msg.str();
+}
+
+void Program::Session::startWrite() {
+	if (writing_ || out_.empty()) {
+		return;
+	}
+	writing_ = true;
+	writeBuf_.swap(out_);
+	out_.clear();
+	boost::asio::async_write(sock_, boost::asio::buffer(writeBuf_), boost::bind(&Session::onWrite, shared_from_this(), boost::asio::placeholders::error));
+}
+
+void Program::Session::onWrite(const boost::system::error_code & error) {
+	writing_ = false;
+	if (error) {
+		return;
+	}
+	startWrite();
+	if (!writing_ && closing_) {
+		boost::system::error_code ignored;
+		sock_.shutdown(tcp::socket::shutdown_both, ignored);
+		sock_.close(ignored);
+	}
+}
+
+void Program::sendReq(Client & client) {
+	Http::Req req;
+	req.path_ = config_.path_;
+	req.retry_ = true; // Only reads
+	client.http_->sendReq(req, boost::bind(&Program::onResponse, this, boost::ref(client), Clock::now(), _1));
+}
+
+void Program::onResponse(Client & client, Clock::time_point sent, const Http::Res & res) {
+	if (!running_) {
+		return;
+	}
+	if (res.headers_.empty() || res.status_ != 200) {
+		failed_++;
+	}
+	else {
+		latencies_.push_back(boost::chrono::duration_cast<boost::chrono::microseconds>(Clock::now() - sent).count());
+		bytes_ += res.content_.size();
+	}
+	sendReq(client);
+}
+
+void Program::onTimer(const boost::system::error_code & error) {
+	if (error) {
+		return;
+	}
+	running_ = false;
+	stop_ = Clock::now();
+	// The clients' pending requests hold nothing up once the io_service is stopped.
+	io_.stop();
+}
+
+int main(int argc, char const * const * argv) {
+	try {
+		Program(Program::Config::fromArgv(argc, argv))();
+	}
+	catch (const std::exception & e) {
+		std::cerr << e.what() << std::endl;
+		return 2;
+	}
+	return 0;
+}
@@ -0,0 +1,537 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "../common/audio_codec.hpp"
+#include "../common/frame_decoder.hpp"
+#include "../common/protocol.hpp"
+#include "../pc/buffer.hpp"
+#include "../pc/longpoll_encoder.hpp"
+#include "../pc/metrics.hpp"
+#include "../rpi/mixer.hpp"
+#include "../rpi/signal_chain.hpp"
+
+// Microbenchmarks of the hot paths that don't need a socket:
+// - protocol: the wire formats (common/protocol.hpp), per message size. On the pc_sw side, sensor longpoll
+//   responses put together by pc_sw's own code (pc/longpoll_encoder.hpp) for events nobody has encoded yet (the
+//   audio in the nodes' codec, --codec), GUI longpoll responses, and sensor event lines parsed. On the node side, longpoll
+//   responses taken apart as Longpoll and Program::onMessage do, audio decoded, and event lines written.
+// - mixer: every mixing kernel this build and CPU can run
+// - signal: the signal chains of the node's inputs, sample by sample
+// - metrics: pc_sw's metrics (pc/metrics.hpp) recorded, one at a time, and rendered for a scrape
+// Each case reports ns, bytes/s and allocations per operation (a message, a block of audio or a sample).
+// Allocations are counted by this program's operator new, so they include those of the libraries it calls.
+//
+// --suite=<name>,... picks suites, --filter=<text> the cases whose names have it, --time=<s> is the least
+// time each case runs for.
+
+namespace {
+	// Single-threaded, so a plain counter does
+	unsigned long long allocations = 0;
+}
+
+void * operator new(std::size_t size) throw(std::bad_alloc) {
+	allocations++;
+	void * p = std::malloc(size ? size : 1);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void * operator new[](std::size_t size) throw(std::bad_alloc) {
+	return operator new(size);
+}
+
+// Out of line, or GCC mistakes the free() of what operator new returned for a mismatch
+__attribute__((noinline)) void operator delete(void * p) throw() {
+	std::free(p);
+}
+
+void operator delete[](void * p) throw() {
+	operator delete(p);
+}
+
+enum {
+	AUDIO_SMALL = 1024,
+	AUDIO_LARGE = Protocol::MAX_CONTENT,
+	BATCH_SIZE = 100,
+	BLOCK_SIZE = 4096, // Samples per mixer block, and of the signal chains' input pattern
+	SMOKE_STOP_TIME = 1000, // As sensor_sw's defaults
+	MOTION_DELAY_TIME = 200
+};
+
+typedef boost::chrono::steady_clock Clock;
+
+class Program {
+public:
+	struct Config {
+		std::vector<std::string> suites_;
+		std::string filter_;
+		double time_; // s per case, at least
+		AudioCodec::Type codec_;
+		Config() : time_(0.2), codec_(AudioCodec::PCM8) { }
+		static Config fromArgv(int argc, char const * const * argv);
+	};
+
+	Program(const Config & config);
+	void operator()();
+private:
+	typedef boost::shared_ptr<const GatherMessage> Response;
+
+	// A message for the node, as the GUI sent it
+	struct Msg {
+		Protocol::MsgType type_;
+		SharedBuffer content_;
+	};
+
+	// Does one operation, and returns something of what it made, so that it isn't optimized away
+	typedef boost::function<std::size_t()> Op;
+
+	void protocolSuite();
+	void mixerSuite();
+	void signalSuite();
+	void metricsSuite();
+	bool wanted(const std::string & name) const { return name.find(config_.filter_) != std::string::npos; }
+	void run(const std::string & name, std::size_t bytes, std::size_t ops, Op op); // ops per call of op
+
+	// pc_sw
+	Response sensorResponse(const std::vector<Msg> & msgs);
+	std::size_t encodeSensor(const std::vector<Msg> & msgs);
+	std::size_t encodeGui(std::size_t events);
+	std::size_t parseEvents(const std::string & lines);
+	// The node
+	std::size_t decodeSensor(const std::vector<uint8_t> & response);
+	void onMessage(uint8_t type, const uint8_t * content, std::size_t size);
+	std::size_t writeEvents(std::size_t events);
+
+	static std::vector<uint8_t> flatten(const GatherMessage & msg);
+
+	template <typename Chain>
+	void runChain(const std::string & name);
+
+	Config config_;
+	uint64_t token_;
+	std::string nodes_[BATCH_SIZE];
+	// The node's, reused from message to message as it does
+	FrameDecoder decoder_;
+	std::string nodeToken_;
+	std::vector<int16_t> audio_;
+	unsigned int numbers_;
+	std::vector<uint8_t> pattern_; // Sensor levels
+};
+
+Program::Config Program::Config::fromArgv(int argc, char const * const * argv) {
+	Config config;
+	for (int i = 1; i < argc; i++) {
+		std::string arg(argv[i]);
+		std::string::size_type eq = arg.find('=');
+		std::string name(arg.substr(0, eq)), value(eq == std::string::npos ? "" : arg.substr(eq + 1));
+		if (name == "--suite") {
+			std::string::size_type begin = 0;
+			while (begin <= value.size()) {
+				std::string::size_type end = std::min(value.find(',', begin), value.size());
+				config.suites_.push_back(value.substr(begin, end - begin));
+				begin = end + 1;
+			}
+		}
+		else if (name == "--filter") {
+			config.filter_ = value;
+		}
+		else if (name == "--time") {
+			config.time_ = boost::lexical_cast<double>(value);
+		}
+		else if (name == "--codec") {
+			if (!AudioCodec::parse(value, config.codec_)) {
+				throw std::runtime_error("unknown codec " + value);
+			}
+		}
+		else {
+			throw std::runtime_error("usage: " + std::string(argv[0]) + " [--suite=protocol,mixer,signal,metrics] [--filter=<text>] [--time=<s>] [--codec=pcm8|mulaw|ima_adpcm]");
+		}
+	}
+	if (config.suites_.empty()) {
+		config.suites_.push_back("protocol");
+		config.suites_.push_back("mixer");
+		config.suites_.push_back("signal");
+		config.suites_.push_back("metrics");
+	}
+	return config;
+}
+
+Program::Program(const Config & config)
+	:	config_(config),
+		token_(1792277012781841ull),
+		decoder_(boost::bind(&Program::onMessage, this, _1, _2, _3)),
+		numbers_(0),
+		pattern_(BLOCK_SIZE) {
+	for (std::size_t i = 0; i < BATCH_SIZE; i++) {
+		nodes_[i] = "node" + boost::lexical_cast<std::string>(i);
+	}
+	// Runs of random lengths, like a bouncing contact: more short ones than long ones
+	uint32_t seed = 12345;
+	bool level = false;
+	for (std::size_t i = 0; i < pattern_.size(); ) {
+		seed = seed * 1103515245 + 12345;
+		std::size_t run = 1 + ((seed >> 16) % 64) * ((seed >> 8) % 4 == 0 ? 16 : 1);
+		for (std::size_t j = 0; j < run && i < pattern_.size(); j++, i++) {
+			pattern_[i] = level;
+		}
+		level = !level;
+	}
+}
+
+void Program::operator()() {
+	std::cout << std::left << std::setw(36) << "case" << std::right << std::setw(10) << "bytes/op" << std::setw(12) << "ns/op"
+		<< std::setw(14) << "ops/s" << std::setw(12) << "MB/s" << std::setw(12) << "allocs/op" << std::endl;
+	for (std::vector<std::string>::const_iterator it = config_.suites_.begin(); it != config_.suites_.end(); ++it) {
+		if (*it == "protocol") {
+			protocolSuite();
+		}
+		else if (*it == "mixer") {
+			mixerSuite();
+		}
+		else if (*it == "signal") {
+			signalSuite();
+		}
+		else if (*it == "metrics") {
+			metricsSuite();
+		}
+		else {
+			throw std::runtime_error("unknown suite " + *it);
+		}
+	}
+}
+
+void Program::protocolSuite() {
+	std::vector<uint8_t> pcm(AUDIO_LARGE);
+	for (std::size_t i = 0; i < pcm.size(); i++) {
+		// A 400 Hz sawtooth at half scale, so that the codecs have something to work on
+		pcm[i] = uint8_t(int((i * 400 * 128 / 8000) % 128) - 64);
+	}
+	Msg led = { Protocol::LED, SharedBuffer::copyOf(std::string("4 16 50")) };
+	Msg small = { Protocol::AUDIO_STREAM, SharedBuffer::copyOf(pcm.data(), AUDIO_SMALL) };
+	Msg large = { Protocol::AUDIO_STREAM, SharedBuffer::copyOf(pcm.data(), AUDIO_LARGE) };
+	struct Case {
+		const char * name_;
+		std::vector<Msg> msgs_;
+	} cases[5];
+	cases[0].name_ = "empty";
+	cases[1].name_ = "led";
+	cases[1].msgs_.push_back(led);
+	cases[2].name_ = "audio_1k";
+	cases[2].msgs_.push_back(small);
+	cases[3].name_ = "audio_64k";
+	cases[3].msgs_.push_back(large);
+	cases[4].name_ = "batch_100";
+	for (std::size_t i = 0; i < BATCH_SIZE; i++) {
+		cases[4].msgs_.push_back(led);
+	}
+	std::string codec(config_.codec_ == AudioCodec::PCM8 ? "" : std::string("/") + AudioCodec::name(config_.codec_));
+
+	for (std::size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		const std::vector<Msg> & msgs = cases[i].msgs_;
+		bool audio = !msgs.empty() && msgs[0].type_ == Protocol::AUDIO_STREAM;
+		std::string suffix(std::string(cases[i].name_) + (audio ? codec : ""));
+		std::vector<uint8_t> response(flatten(*sensorResponse(msgs))); // What the node gets
+		if (wanted("pc.sensor_longpoll." + suffix)) {
+			run("pc.sensor_longpoll." + suffix, response.size(), 1, boost::bind(&Program::encodeSensor, this, boost::cref(msgs)));
+		}
+		if (wanted("node.longpoll." + suffix)) {
+			run("node.longpoll." + suffix, response.size(), 1, boost::bind(&Program::decodeSensor, this, boost::cref(response)));
+		}
+	}
+
+	const std::size_t guiCases[] = { 0, 1, BATCH_SIZE };
+	for (std::size_t i = 0; i < sizeof(guiCases) / sizeof(guiCases[0]); i++) {
+		std::string name(std::string("pc.gui_longpoll.") + (guiCases[i] == 0 ? "empty" : guiCases[i] == 1 ? "event" : "batch_100"));
+		if (wanted(name)) {
+			run(name, encodeGui(guiCases[i]), 1, boost::bind(&Program::encodeGui, this, guiCases[i]));
+		}
+	}
+
+	const std::size_t eventCases[] = { 1, BATCH_SIZE };
+	for (std::size_t i = 0; i < sizeof(eventCases) / sizeof(eventCases[0]); i++) {
+		std::string suffix(eventCases[i] == 1 ? "event" : "batch_100");
+		std::string lines;
+		for (std::size_t j = 0; j < eventCases[i]; j++) {
+			Protocol::EventLine line;
+			line.node_ = nodes_[j];
+			line.event_ = Protocol::MOTION;
+			line.count_ = 3;
+			line.firstAge_ = 1200;
+			line.lastAge_ = 40;
+			Protocol::appendEventLine(lines, line);
+		}
+		if (wanted("pc.sensor_event." + suffix)) {
+			run("pc.sensor_event." + suffix, lines.size(), 1, boost::bind(&Program::parseEvents, this, boost::cref(lines)));
+		}
+		if (wanted("node.sensor_event." + suffix)) {
+			run("node.sensor_event." + suffix, lines.size(), 1, boost::bind(&Program::writeEvents, this, eventCases[i]));
+		}
+	}
+
+	const AudioCodec::Type codecs[] = { AudioCodec::PCM8, AudioCodec::MULAW, AudioCodec::IMA_ADPCM };
+	for (std::size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+		std::string name(std::string("codec.decode.") + AudioCodec::name(codecs[i]) + ".audio_1k");
+		if (wanted(name)) {
+			SharedBuffer encoded(codecs[i] == AudioCodec::PCM8 ? small.content_ : LongpollEncoder::encodeAudio(small.content_, codecs[i]));
+			Msg msg = { codecs[i] == AudioCodec::PCM8 ? Protocol::AUDIO_STREAM : codecs[i] == AudioCodec::MULAW ? Protocol::AUDIO_MULAW : Protocol::AUDIO_IMA_ADPCM, encoded };
+			GatherMessage framed;
+			framed.append(LongpollEncoder::frame(msg.type_, msg.content_));
+			std::vector<uint8_t> bytes(flatten(framed));
+			run(name, bytes.size(), 1, boost::bind(&Program::decodeSensor, this, bytes));
+		}
+	}
+}
+
+namespace {
+	std::size_t mixBlock(Mixer::Kernel kernel, std::vector<int16_t> & out, const std::vector<int16_t> & in) {
+		kernel(out.data(), in.data(), out.size(), Mixer::gain(70));
+		return out[0];
+	}
+}
+
+void Program::mixerSuite() {
+	std::vector<int16_t> out(BLOCK_SIZE), in(BLOCK_SIZE);
+	for (std::size_t i = 0; i < BLOCK_SIZE; i++) {
+		in[i] = int16_t((i * 7919) % 65536 - 32768);
+	}
+	std::size_t count;
+	const Mixer::KernelInfo * kernels = Mixer::kernels(count);
+	for (std::size_t i = 0; i < count; i++) {
+		std::string name(std::string("mixer.") + kernels[i].name_ + ".block_4k");
+		if (wanted(name)) {
+			run(name, BLOCK_SIZE * sizeof(int16_t), 1, boost::bind(&mixBlock, kernels[i].kernel_, boost::ref(out), boost::cref(in)));
+		}
+	}
+}
+
+namespace {
+	template <typename Chain>
+	std::size_t runPattern(Chain & chain, const std::vector<uint8_t> & pattern) {
+		std::size_t ons = 0;
+		for (std::size_t i = 0; i < pattern.size(); i++) {
+			ons += chain(pattern[i] != 0);
+		}
+		return ons;
+	}
+}
+
+template <typename Chain>
+void Program::runChain(const std::string & name) {
+	if (!wanted("signal." + name)) {
+		return;
+	}
+	Chain chain;
+	run("signal." + name, 0, pattern_.size(), boost::bind(&runPattern<Chain>, boost::ref(chain), boost::cref(pattern_)));
+}
+
+void Program::signalSuite() {
+	runChain<Signal::Chain<Signal::Invert, Signal::Hold<SMOKE_STOP_TIME> > >("smoke_default");
+	runChain<Signal::Lockout<MOTION_DELAY_TIME> >("motion_default");
+	runChain<Signal::Debounce<20> >("debounce_20");
+	runChain<Signal::Majority<5> >("majority_5");
+	runChain<Signal::Chain<Signal::Invert, Signal::Debounce<20>, Signal::Hold<SMOKE_STOP_TIME> > >("invert_debounce_hold");
+	runChain<Signal::Chain<Signal::Majority<5>, Signal::Lockout<MOTION_DELAY_TIME>, Signal::Edge<Signal::RISING> > >("majority_lockout_edge");
+}
+
+namespace {
+	std::size_t addCounter(Metrics::Counter counter) {
+		for (std::size_t i = 0; i < BLOCK_SIZE; i++) {
+			counter.add();
+		}
+		return counter.value();
+	}
+	
+	std::size_t addGauge(Metrics::Gauge gauge) {
+		for (std::size_t i = 0; i < BLOCK_SIZE; i++) {
+			gauge.add(i & 1 ? -1 : 1);
+		}
+		return gauge.value();
+	}
+	
+	std::size_t recordValues(Metrics::Histogram histogram, const std::vector<uint32_t> & values) {
+		for (std::size_t i = 0; i < values.size(); i++) {
+			histogram.record(values[i]);
+		}
+		return values.size();
+	}
+	
+	std::size_t render(const Metrics & metrics) {
+		return metrics.render().size();
+	}
+}
+
+void Program::metricsSuite() {
+	// As many as pc_sw has, with its latencies in µs: mostly small, some up to a few s
+	Metrics metrics;
+	Metrics::Counter counter(metrics.counter("bench_counter_total", "A counter."));
+	Metrics::Gauge gauge(metrics.gauge("bench_gauge", "A gauge."));
+	Metrics::Histogram histogram(metrics.histogram("bench_seconds", "A histogram.", 1e-6));
+	for (std::size_t i = 0; i < 8; i++) {
+		std::string label("manager=\"m" + boost::lexical_cast<std::string>(i) + '"');
+		metrics.counter("bench_labeled_total", "Counters with labels.", label);
+		metrics.gauge("bench_labeled", "Gauges with labels.", label);
+	}
+	std::vector<uint32_t> values(BLOCK_SIZE);
+	uint32_t seed = 12345;
+	for (std::size_t i = 0; i < values.size(); i++) {
+		seed = seed * 1103515245 + 12345;
+		values[i] = (seed >> 8) % (2u << ((seed >> 4) % 22));
+	}
+	if (wanted("metrics.counter.add")) {
+		run("metrics.counter.add", 0, BLOCK_SIZE, boost::bind(&addCounter, counter));
+	}
+	if (wanted("metrics.gauge.add")) {
+		run("metrics.gauge.add", 0, BLOCK_SIZE, boost::bind(&addGauge, gauge));
+	}
+	if (wanted("metrics.histogram.record")) {
+		run("metrics.histogram.record", 0, values.size(), boost::bind(&recordValues, histogram, boost::cref(values)));
+	}
+	if (wanted("metrics.render")) {
+		run("metrics.render", metrics.render().size(), 1, boost::bind(&render, boost::cref(metrics)));
+	}
+}
+
+void Program::run(const std::string & name, std::size_t bytes, std::size_t ops, Op op) {
+	std::size_t sink = op(); // Warm up
+	Clock::duration least = boost::chrono::duration_cast<Clock::duration>(boost::chrono::duration<double>(config_.time_));
+	uint64_t calls = 0, batch = 1;
+	unsigned long long allocs = allocations;
+	Clock::time_point start = Clock::now();
+	Clock::duration elapsed;
+	for (;;) {
+		for (uint64_t i = 0; i < batch; i++) {
+			sink += op();
+		}
+		calls += batch;
+		elapsed = Clock::now() - start;
+		if (elapsed >= least) {
+			break;
+		}
+		batch *= 2;
+	}
+	allocs = allocations - allocs;
+	double seconds = boost::chrono::duration<double>(elapsed).count();
+	double count = double(calls) * ops;
+	std::cout << std::left << std::setw(36) << name << std::right << std::setw(10) << bytes
+		<< std::fixed << std::setprecision(1) << std::setw(12) << seconds * 1e9 / count
+		<< std::setprecision(0) << std::setw(14) << count / seconds
+		<< std::setprecision(1) << std::setw(12) << count * bytes / seconds / 1e6
+		<< std::setprecision(2) << std::setw(12) << allocs / count
+		<< (sink == 42 ? " " : "") << std::endl;
+}
+
+std::size_t Program::encodeSensor(const std::vector<Msg> & msgs) {
+	return sensorResponse(msgs)->size();
+}
+
+Program::Response Program::sensorResponse(const std::vector<Msg> & msgs) {
+	// As SensorLongpollMgr::eventResponse, for events nobody has encoded yet
+	boost::shared_ptr<GatherMessage> response(new GatherMessage);
+	for (std::size_t i = 0; i < msgs.size(); i++) {
+		response->append(LongpollEncoder::encode(msgs[i].type_, msgs[i].content_, config_.codec_));
+	}
+	LongpollEncoder::putToken(*response, token_);
+	return response;
+}
+
+std::size_t Program::encodeGui(std::size_t events) {
+	// As GuiLongpollMgr::eventResponse, in the text format
+	std::string text;
+	text.reserve(events * (24 + Protocol::NODE_NAME_LEN_MAX) + 32);
+	for (std::size_t i = 0; i < events; i++) {
+		Protocol::appendGuiEventLine(text, 1792277013, Protocol::MOTION, nodes_[i]);
+	}
+	Protocol::appendGuiToken(text, token_);
+	Response response(LongpollEncoder::guiResponse(text, token_, false));
+	return response->size();
+}
+
+std::size_t Program::parseEvents(const std::string & lines) {
+	// As SensorEventMgr::processLine, for each line
+	std::size_t parsed = 0;
+	Protocol::EventLine evt;
+	for (std::string::size_type begin = 0, end; begin < lines.size(); begin = end + 1) {
+		end = std::min(lines.find('\n', begin), lines.size());
+		parsed += Protocol::parseEventLine(lines.data() + begin, end - begin + (end < lines.size()), evt) ? evt.count_ : 0;
+	}
+	return parsed;
+}
+
+std::size_t Program::decodeSensor(const std::vector<uint8_t> & response) {
+	// As the node's Longpoll: fed as read, then handled as Program::onMessage does
+	nodeToken_.clear();
+	decoder_.reset();
+	decoder_.feed(response.data(), response.size());
+	return nodeToken_.size() + audio_.size() + numbers_;
+}
+
+void Program::onMessage(uint8_t type, const uint8_t * content, std::size_t size) {
+	unsigned int numbers[3] = { 0, 0, 0 };
+	switch (type) {
+	case Protocol::TOKEN:
+		nodeToken_.assign(content, content + size);
+		break;
+	case Protocol::LED:
+	case Protocol::SIREN_CTRL:
+	case Protocol::SMOKE_SLEEP:
+		numbers_ += Protocol::parseNumbers(content, size, numbers, 3);
+		break;
+	case Protocol::AUDIO_STREAM:
+	case Protocol::AUDIO_MULAW:
+	case Protocol::AUDIO_IMA_ADPCM:
+		audio_.clear();
+		AudioCodec::decode(type == Protocol::AUDIO_MULAW ? AudioCodec::MULAW : type == Protocol::AUDIO_IMA_ADPCM ? AudioCodec::IMA_ADPCM : AudioCodec::PCM8, content, size, audio_);
+		break;
+	default:
+		break;
+	}
+}
+
+std::size_t Program::writeEvents(std::size_t events) {
+	// As the node's EventOut::flush
+	std::string lines;
+	for (std::size_t i = 0; i < events; i++) {
+		Protocol::EventLine line;
+		line.node_ = nodes_[i];
+		line.event_ = Protocol::MOTION;
+		line.count_ = 3;
+		line.firstAge_ = 1200;
+		line.lastAge_ = 40;
+		Protocol::appendEventLine(lines, line);
+	}
+	return lines.size();
+}
+
+std::vector<uint8_t> Program::flatten(const GatherMessage & msg) {
+	std::vector<uint8_t> bytes;
+	for (GatherMessage::Buffers::const_iterator it = msg.buffers().begin(); it != msg.buffers().end(); ++it) {
+		const uint8_t * data = boost::asio::buffer_cast<const uint8_t *>(*it);
+		bytes.insert(bytes.end(), data, data + boost::asio::buffer_size(*it));
+	}
+	return bytes;
+}
+
+int main(int argc, char const * const * argv) {
+	try {
+		Program(Program::Config::fromArgv(argc, argv))();
+	}
+	catch (const std::exception & e) {
+		std::cerr << e.what() << std::endl;
+		return 2;
+	}
+	return 0;
+}
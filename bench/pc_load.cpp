@@ -0,0 +1,890 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "../common/frame_decoder.hpp"
+#include "../common/protocol.hpp"
+
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Load generator for pc_sw: spawns it on unix sockets in a temporary directory, and drives it with
+// - synthetic sensor nodes, each with a sensor longpoll always pending, sending motion events at a steady rate
+//   (one sensor_event connection per event, as the nodes do)
+// - GUI longpoll clients
+// - audio uploaders, streaming 8 kHz audio at playback pace
+// It reports the latency from sending a sensor event to its delivery on every GUI longpoll, the event rates,
+// and the peak RSS and CPU time of pc_sw. Everything is local, so it can gate performance regressions: with
+// --max-p99 or --max-rss, it fails (exit status 1) if they're exceeded. Measure a pc_sw built with -O2 and
+// without BOOST_ASIO_ENABLE_HANDLER_TRACKING, which pc/compile_cmd.txt has.
+//
+// With --http=<port>, pc_sw also serves its HTTP front end on 127.0.0.1:<port>, and the nodes and GUI clients use
+// that instead, on keep-alive connections: a node has one for its longpolls and one for its events. The audio
+// uploaders still use the gui_event socket, which is the only way to stream audio up.
+//
+// --nodes=1000 --event-rate=1 is the many-nodes case. The generator itself is one thread, so with heavy audio
+// to many nodes, it can be what falls behind; compare pc_sw's CPU time with the elapsed time.
+//
+// Each event names its node as "<node>.<number>", so that its deliveries can be told apart, even those
+// to clients that missed some.
+
+enum {
+	RETRY_TIME = 100, // ms after a failed connection
+	START_TIMEOUT = 5000, // ms for pc_sw to open its sockets
+	AUDIO_RATE = 8000, // bytes/s
+	AUDIO_CHUNK_TIME = 40 // ms
+};
+
+typedef boost::asio::local::stream_protocol strm;
+typedef boost::asio::ip::tcp tcp;
+typedef boost::chrono::steady_clock Clock;
+typedef boost::asio::basic_waitable_timer<Clock> Timer;
+
+class Program {
+public:
+	struct Config {
+		std::string pcSw_; // The binary
+		unsigned int threads_; // pc_sw's
+		unsigned int nodes_;
+		double eventRate_; // Per node, per s
+		unsigned int guiClients_;
+		unsigned int audioUploaders_;
+		std::string codec_; // Of the nodes' audio
+		double duration_, drain_; // s of load, and then s for the last events to get through
+		unsigned int maxP99_; // us; 0 for no limit
+		unsigned long maxRss_; // KB; 0 for no limit
+		unsigned int httpPort_; // Of pc_sw's HTTP front end, for the nodes and GUI clients; 0 to use the sockets
+		Config() : pcSw_("../pc/pc_sw.elf"), threads_(1), nodes_(10), eventRate_(1), guiClients_(10), audioUploaders_(0), codec_("pcm8"), duration_(10), drain_(1), maxP99_(0), maxRss_(0), httpPort_(0) { }
+		static Config fromArgv(int argc, char const * const * argv);
+	};
+
+	Program(const Config & config);
+	~Program();
+	int operator()(); // The exit status
+private:
+	enum Socket {
+		SENSOR_LONGPOLL,
+		SENSOR_EVENT,
+		GUI_LONGPOLL,
+		GUI_EVENT,
+		SOCKETS
+	};
+
+	// A keep-alive HTTP/1.1 connection to pc_sw's front end, making one request at a time, in order. It only
+	// understands what pc_sw sends: bodies with a Content-Length. A lost connection is made again for the next
+	// request; the one that lost it fails.
+	class HttpClient {
+	public:
+		typedef boost::function<void(bool ok, const std::string & body)> Handler;
+		HttpClient(Program & program);
+		void get(const std::string & target, Handler handler);
+	private:
+		void startRequest();
+		void onConnect(const boost::system::error_code & error);
+		void onWrite(const boost::system::error_code & error);
+		void onHeaders(const boost::system::error_code & error, std::size_t bytes_transferred);
+		void onBody(const boost::system::error_code & error);
+		void finish(bool ok);
+
+		Program & program_;
+		tcp::socket sock_;
+		std::deque<std::pair<std::string, Handler> > queue_; // The first one is being made if busy_
+		std::string request_;
+		boost::asio::streambuf buf_;
+		std::size_t bodySize_;
+		bool busy_;
+	};
+
+	// A sensor node: longpolls, and sends events once they're started.
+	class Node {
+	public:
+		Node(Program & program, unsigned int index);
+		void start();
+		void startEvents(Clock::time_point first);
+		void stopEvents() { eventTimer_.cancel(); }
+	private:
+		void startPoll();
+		void onPollConnect(const boost::system::error_code & error);
+		void onPollResponse(const boost::system::error_code & error);
+		void onHttpPoll(bool ok, const std::string & body);
+		void onPollBody(const uint8_t * data, std::size_t size);
+		void onMessage(uint8_t type, const uint8_t * content, std::size_t size);
+		void onPollError();
+		void onEventTimer(const boost::system::error_code & error);
+		void onEventConnect(boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> line, const boost::system::error_code & error);
+		void onHttpEvent(bool ok, const std::string & body);
+
+		Program & program_;
+		unsigned int index_;
+		std::string name_;
+		strm::socket pollSock_;
+		std::string pollLine_, token_;
+		boost::asio::streambuf pollBuf_;
+		FrameDecoder decoder_; // Of a whole response at a time
+		boost::scoped_ptr<HttpClient> pollHttp_, eventHttp_; // With --http
+		Timer retryTimer_, eventTimer_;
+		Clock::time_point nextEvent_;
+	};
+
+	class GuiClient {
+	public:
+		GuiClient(Program & program);
+		void start();
+		bool ready() const { return !token_.empty(); }
+	private:
+		void startPoll();
+		void onConnect(const boost::system::error_code & error);
+		void onResponse(const boost::system::error_code & error);
+		void onHttpResponse(bool ok, const std::string & body);
+		void onBody(std::istream & in);
+		void onError();
+
+		Program & program_;
+		strm::socket sock_;
+		std::string line_, token_;
+		boost::asio::streambuf buf_;
+		boost::scoped_ptr<HttpClient> http_; // With --http
+		Timer retryTimer_;
+	};
+
+	class AudioUploader {
+	public:
+		AudioUploader(Program & program);
+		void start();
+	private:
+		void onConnect(const boost::system::error_code & error);
+		void onTimer(const boost::system::error_code & error);
+		void onWrite(const boost::system::error_code & error, std::size_t bytes_transferred);
+
+		Program & program_;
+		strm::socket sock_;
+		std::vector<uint8_t> chunk_;
+		Timer timer_;
+		Clock::time_point next_;
+		bool writing_;
+		unsigned int phase_;
+	};
+
+	strm::endpoint endpoint(Socket socket) const { return strm::endpoint(dir_ + "/" + SOCKET_NAMES[socket]); }
+	tcp::endpoint httpEndpoint() const { return tcp::endpoint(boost::asio::ip::address_v4::loopback(), config_.httpPort_); }
+	static std::string urlEncode(const std::string & str);
+	void spawn();
+	void waitForSockets();
+	void stopPcSw();
+	void onReady();
+	void onPhaseTimer(const boost::system::error_code & error);
+	void onDelivery(const std::string & node, Clock::time_point time);
+	void report(std::ostream & out, double elapsed);
+
+	static const char * const SOCKET_NAMES[SOCKETS];
+
+	const Config config_;
+	boost::asio::io_service io_;
+	std::string dir_;
+	pid_t pid_;
+	struct rusage usage_; // pc_sw's, once it's gone
+	bool running_; // Until the drain is over
+	bool sending_;
+	Timer phaseTimer_;
+	std::vector<boost::shared_ptr<Node> > nodes_;
+	std::vector<boost::shared_ptr<GuiClient> > guiClients_;
+	std::vector<boost::shared_ptr<AudioUploader> > audioUploaders_;
+	unsigned int readyClients_;
+	Clock::time_point sendStart_, sendStop_;
+
+	// Statistics
+	std::vector<std::vector<Clock::time_point> > sent_; // Per node: the times its events were sent
+	std::vector<uint32_t> latencies_; // us, of every delivery
+	unsigned long long guiResponses_, resyncs_, sensorResponses_, audioUploaded_, audioDelivered_, connectErrors_;
+};
+
+const char * const Program::SOCKET_NAMES[SOCKETS] = { "sensor_longpoll", "sensor_event", "gui_longpoll", "gui_event" };
+
+Program::Config Program::Config::fromArgv(int argc, char const * const * argv) {
+	Config config;
+	for (int i = 1; i < argc; i++) {
+		std::string arg(argv[i]);
+		std::string::size_type eq = arg.find('=');
+		if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+			throw std::runtime_error("expected --<name>=<value>, not " + arg);
+		}
+		std::string name(arg.substr(2, eq - 2)), value(arg.substr(eq + 1));
+		if (name == "pc-sw") {
+			config.pcSw_ = value;
+		}
+		else if (name == "threads") {
+			config.threads_ = std::max(1u, boost::lexical_cast<unsigned int>(value));
+		}
+		else if (name == "nodes") {
+			config.nodes_ = boost::lexical_cast<unsigned int>(value);
+		}
+		else if (name == "event-rate") {
+			config.eventRate_ = boost::lexical_cast<double>(value);
+		}
+		else if (name == "gui") {
+			config.guiClients_ = boost::lexical_cast<unsigned int>(value);
+		}
+		else if (name == "audio") {
+			config.audioUploaders_ = boost::lexical_cast<unsigned int>(value);
+		}
+		else if (name == "codec") {
+			config.codec_ = value;
+		}
+		else if (name == "duration") {
+			config.duration_ = boost::lexical_cast<double>(value);
+		}
+		else if (name == "drain") {
+			config.drain_ = boost::lexical_cast<double>(value);
+		}
+		else if (name == "max-p99") {
+			config.maxP99_ = boost::lexical_cast<unsigned int>(value);
+		}
+		else if (name == "max-rss") {
+			config.maxRss_ = boost::lexical_cast<unsigned long>(value);
+		}
+		else if (name == "http") {
+			config.httpPort_ = boost::lexical_cast<unsigned int>(value);
+		}
+		else {
+			throw std::runtime_error("unknown option " + arg);
+		}
+	}
+	return config;
+}
+
+Program::Program(const Config & config)
+	:	config_(config),
+		pid_(-1),
+		running_(true),
+		sending_(false),
+		phaseTimer_(io_),
+		readyClients_(0),
+		sent_(config.nodes_),
+		guiResponses_(0),
+		resyncs_(0),
+		sensorResponses_(0),
+		audioUploaded_(0),
+		audioDelivered_(0),
+		connectErrors_(0) {
+	std::memset(&usage_, 0, sizeof(usage_));
+	for (unsigned int i = 0; i < config.nodes_; i++) {
+		nodes_.push_back(boost::shared_ptr<Node>(new Node(*this, i)));
+	}
+	for (unsigned int i = 0; i < config.guiClients_; i++) {
+		guiClients_.push_back(boost::shared_ptr<GuiClient>(new GuiClient(*this)));
+	}
+	for (unsigned int i = 0; i < config.audioUploaders_; i++) {
+		audioUploaders_.push_back(boost::shared_ptr<AudioUploader>(new AudioUploader(*this)));
+	}
+}
+
+Program::~Program() {
+	stopPcSw();
+	if (!dir_.empty()) {
+		for (unsigned int i = 0; i < SOCKETS; i++) {
+			::unlink((dir_ + "/" + SOCKET_NAMES[i]).c_str());
+		}
+		::rmdir(dir_.c_str());
+	}
+}
+
+int Program::operator()() {
+	// Connections that pc_sw drops show as write errors.
+	std::signal(SIGPIPE, SIG_IGN);
+	// Every node and client holds sockets open.
+	struct rlimit files;
+	if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+	spawn();
+	waitForSockets();
+	Clock::time_point start = Clock::now();
+	for (std::size_t i = 0; i < nodes_.size(); i++) {
+		nodes_[i]->start();
+	}
+	for (std::size_t i = 0; i < audioUploaders_.size(); i++) {
+		audioUploaders_[i]->start();
+	}
+	for (std::size_t i = 0; i < guiClients_.size(); i++) {
+		guiClients_[i]->start();
+	}
+	if (guiClients_.empty()) {
+		onReady();
+	}
+	io_.run();
+	stopPcSw();
+	report(std::cout, boost::chrono::duration<double>(Clock::now() - start).count());
+
+	std::vector<uint32_t> sorted(latencies_);
+	std::sort(sorted.begin(), sorted.end());
+	int status = 0;
+	if (config_.maxP99_ > 0 && !sorted.empty() && sorted[std::min(sorted.size() - 1, sorted.size() * 99 / 100)] > config_.maxP99_) {
+		std::cout << "FAIL: p99 latency over " << config_.maxP99_ << " us" << std::endl;
+		status = 1;
+	}
+	if (config_.maxRss_ > 0 && static_cast<unsigned long>(usage_.ru_maxrss) > config_.maxRss_) {
+		std::cout << "FAIL: peak RSS over " << config_.maxRss_ << " KB" << std::endl;
+		status = 1;
+	}
+	return status;
+}
+
+void Program::spawn() {
+	char dir[] = "/tmp/pc_load.XXXXXX";
+	if (!::mkdtemp(dir)) {
+		throw std::runtime_error(std::string("can't make a temporary directory: ") + std::strerror(errno));
+	}
+	dir_ = dir;
+	std::vector<std::string> args;
+	args.push_back(config_.pcSw_);
+	for (unsigned int i = 0; i < SOCKETS; i++) {
+		args.push_back(dir_ + "/" + SOCKET_NAMES[i]);
+	}
+	args.push_back("--threads=" + boost::lexical_cast<std::string>(config_.threads_));
+	if (config_.httpPort_ != 0) {
+		args.push_back("--http=127.0.0.1:" + boost::lexical_cast<std::string>(config_.httpPort_));
+	}
+	std::vector<char *> argv;
+	for (std::size_t i = 0; i < args.size(); i++) {
+		argv.push_back(const_cast<char *>(args[i].c_str()));
+	}
+	argv.push_back(0);
+	pid_ = ::fork();
+	if (pid_ < 0) {
+		throw std::runtime_error(std::string("can't fork: ") + std::strerror(errno));
+	}
+	if (pid_ == 0) {
+		std::signal(SIGPIPE, SIG_DFL);
+		::execv(argv[0], &argv[0]);
+		std::cerr << "Can't run " << argv[0] << ": " << std::strerror(errno) << std::endl;
+		::_exit(127);
+	}
+}
+
+void Program::waitForSockets() {
+	Clock::time_point deadline = Clock::now() + boost::chrono::milliseconds(int(START_TIMEOUT));
+	// Then the HTTP port, if any
+	for (unsigned int i = 0; i < SOCKETS + (config_.httpPort_ != 0); i++) {
+		for (;;) {
+			boost::system::error_code error;
+			if (i < SOCKETS) {
+				strm::socket sock(io_);
+				sock.connect(endpoint(Socket(i)), error);
+			}
+			else {
+				tcp::socket sock(io_);
+				sock.connect(httpEndpoint(), error);
+			}
+			if (!error) {
+				break;
+			}
+			int status;
+			if (::waitpid(pid_, &status, WNOHANG) == pid_) {
+				pid_ = -1;
+				throw std::runtime_error("pc_sw exited");
+			}
+			if (Clock::now() > deadline) {
+				throw std::runtime_error("pc_sw didn't open its sockets");
+			}
+			::usleep(10000);
+		}
+	}
+}
+
+void Program::stopPcSw() {
+	if (pid_ <= 0) {
+		return;
+	}
+	::kill(pid_, SIGTERM);
+	int status;
+	while (::wait4(pid_, &status, 0, &usage_) < 0 && errno == EINTR) {
+	}
+	pid_ = -1;
+}
+
+void Program::onReady() {
+	// Every GUI client has its first token, so every event from now on should reach all of them.
+	sendStart_ = Clock::now();
+	sending_ = true;
+	for (std::size_t i = 0; i < nodes_.size(); i++) {
+		// Spread over the first interval, so that the nodes don't all send at once
+		double offset = (config_.eventRate_ > 0 ? (i + 0.5) / nodes_.size() / config_.eventRate_ : 0);
+		nodes_[i]->startEvents(sendStart_ + boost::chrono::duration_cast<Clock::duration>(boost::chrono::duration<double>(offset)));
+	}
+	phaseTimer_.expires_at(sendStart_ + boost::chrono::duration_cast<Clock::duration>(boost::chrono::duration<double>(config_.duration_)));
+	phaseTimer_.async_wait(boost::bind(&Program::onPhaseTimer, this, boost::asio::placeholders::error));
+}
+
+void Program::onPhaseTimer(const boost::system::error_code & error) {
+	if (error) {
+		return;
+	}
+	if (sending_) {
+		sending_ = false;
+		sendStop_ = Clock::now();
+		for (std::size_t i = 0; i < nodes_.size(); i++) {
+			nodes_[i]->stopEvents();
+		}
+		phaseTimer_.expires_at(sendStop_ + boost::chrono::duration_cast<Clock::duration>(boost::chrono::duration<double>(config_.drain_)));
+		phaseTimer_.async_wait(boost::bind(&Program::onPhaseTimer, this, boost::asio::placeholders::error));
+	}
+	else {
+		running_ = false;
+		io_.stop();
+	}
+}
+
+void Program::onDelivery(const std::string & node, Clock::time_point time) {
+	// "n<index>.<number>"
+	std::string::size_type dot = node.find('.');
+	unsigned int index, number;
+	if (node.empty() || node[0] != 'n' || dot == std::string::npos
+			|| !boost::conversion::try_lexical_convert(node.substr(1, dot - 1), index) || index >= sent_.size()
+			|| !boost::conversion::try_lexical_convert(node.substr(dot + 1), number) || number >= sent_[index].size()) {
+		return;
+	}
+	latencies_.push_back(uint32_t(boost::chrono::duration_cast<boost::chrono::microseconds>(time - sent_[index][number]).count()));
+}
+
+std::string Program::urlEncode(const std::string & str) {
+	static const char HEX[] = "0123456789ABCDEF";
+	std::string out;
+	for (std::string::const_iterator it = str.begin(); it != str.end(); ++it) {
+		unsigned char c = *it;
+		if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+			out += char(c);
+		}
+		else {
+			out += '%';
+			out += HEX[c >> 4];
+			out += HEX[c & 15];
+		}
+	}
+	return out;
+}
+
+void Program::report(std::ostream & out, double elapsed) {
+	double sendTime = boost::chrono::duration<double>(sendStop_ - sendStart_).count();
+	unsigned long long sent = 0;
+	for (std::size_t i = 0; i < sent_.size(); i++) {
+		sent += sent_[i].size();
+	}
+	unsigned long long expected = sent * guiClients_.size();
+	out << std::fixed << std::setprecision(1);
+	out << "Load: " << nodes_.size() << " nodes at " << config_.eventRate_ << " events/s, " << guiClients_.size() << " GUI clients, "
+		<< audioUploaders_.size() << " audio uploaders" << (config_.httpPort_ != 0 ? ", over HTTP" : "") << "; pc_sw with " << config_.threads_
+		<< " threads; " << elapsed << " s" << std::endl;
+	out << "Events: " << sent << " sent (" << (sendTime > 0 ? sent / sendTime : 0) << "/s), " << latencies_.size() << " of " << expected
+		<< " deliveries (" << (sendTime > 0 ? latencies_.size() / sendTime : 0) << "/s), " << resyncs_ << " resyncs" << std::endl;
+	std::vector<uint32_t> sorted(latencies_);
+	std::sort(sorted.begin(), sorted.end());
+	if (!sorted.empty()) {
+		static const double QUANTILES[] = { 0.5, 0.99, 0.999 };
+		static const char * const NAMES[] = { "p50", "p99", "p999" };
+		out << "Latency (us):";
+		for (std::size_t i = 0; i < sizeof(QUANTILES) / sizeof(QUANTILES[0]); i++) {
+			out << ' ' << NAMES[i] << ' ' << sorted[std::min(sorted.size() - 1, std::size_t(sorted.size() * QUANTILES[i]))];
+		}
+		out << " max " << sorted.back() << std::endl;
+	}
+	out << "Longpolls: " << guiResponses_ << " GUI, " << sensorResponses_ << " sensor; audio " << audioUploaded_ << " bytes up, "
+		<< audioDelivered_ << " bytes to nodes; " << connectErrors_ << " failed connections" << std::endl;
+	double cpu = usage_.ru_utime.tv_sec + usage_.ru_utime.tv_usec / 1e6 + usage_.ru_stime.tv_sec + usage_.ru_stime.tv_usec / 1e6;
+	out << "pc_sw: peak RSS " << usage_.ru_maxrss << " KB, CPU " << cpu << " s" << std::endl;
+}
+
+Program::HttpClient::HttpClient(Program & program)
+	:	program_(program),
+		sock_(program.io_),
+		bodySize_(0),
+		busy_(false) {
+}
+
+void Program::HttpClient::get(const std::string & target, Handler handler) {
+	queue_.push_back(std::make_pair(target, handler));
+	if (!busy_) {
+		startRequest();
+	}
+}
+
+void Program::HttpClient::startRequest() {
+	busy_ = true;
+	request_ = "GET " + queue_.front().first + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	if (sock_.is_open()) {
+		onConnect(boost::system::error_code());
+	}
+	else {
+		sock_.async_connect(program_.httpEndpoint(), boost::bind(&HttpClient::onConnect, this, boost::asio::placeholders::error));
+	}
+}
+
+void Program::HttpClient::onConnect(const boost::system::error_code & error) {
+	if (error) {
+		finish(false);
+		return;
+	}
+	boost::asio::async_write(sock_, boost::asio::buffer(request_), boost::bind(&HttpClient::onWrite, this, boost::asio::placeholders::error));
+}
+
+void Program::HttpClient::onWrite(const boost::system::error_code & error) {
+	if (error) {
+		finish(false);
+		return;
+	}
+	boost::asio::async_read_until(sock_, buf_, "\r\n\r\n", boost::bind(&HttpClient::onHeaders, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+}
+
+void Program::HttpClient::onHeaders(const boost::system::error_code & error, std::size_t bytes_transferred) {
+	if (error) {
+		finish(false);
+		return;
+	}
+	std::string headers(boost::asio::buffer_cast<const char *>(buf_.data()), bytes_transferred);
+	buf_.consume(bytes_transferred);
+	static const std::string LENGTH("\r\nContent-Length: ");
+	std::string::size_type length = headers.find(LENGTH);
+	if (headers.compare(0, 13, "HTTP/1.1 200 ") != 0 || length == std::string::npos
+			|| !boost::conversion::try_lexical_convert(headers.substr(length + LENGTH.size(), headers.find('\r', length + LENGTH.size()) - length - LENGTH.size()), bodySize_)) {
+		finish(false);
+		return;
+	}
+	if (buf_.size() >= bodySize_) {
+		onBody(boost::system::error_code());
+	}
+	else {
+		boost::asio::async_read(sock_, buf_, boost::asio::transfer_exactly(bodySize_ - buf_.size()), boost::bind(&HttpClient::onBody, this, boost::asio::placeholders::error));
+	}
+}
+
+void Program::HttpClient::onBody(const boost::system::error_code & error) {
+	finish(!error);
+}
+
+void Program::HttpClient::finish(bool ok) {
+	std::string body;
+	if (ok) {
+		body.assign(boost::asio::buffer_cast<const char *>(buf_.data()), bodySize_);
+		buf_.consume(bodySize_);
+	}
+	else {
+		sock_.close();
+		buf_.consume(buf_.size());
+	}
+	Handler handler(queue_.front().second);
+	queue_.pop_front();
+	busy_ = false;
+	// Which may make the next request
+	handler(ok, body);
+	if (!busy_ && !queue_.empty()) {
+		startRequest();
+	}
+}
+
+Program::Node::Node(Program & program, unsigned int index)
+	:	program_(program),
+		index_(index),
+		name_("n" + boost::lexical_cast<std::string>(index)),
+		pollSock_(program.io_),
+		decoder_(boost::bind(&Node::onMessage, this, _1, _2, _3)),
+		retryTimer_(program.io_),
+		eventTimer_(program.io_) {
+	if (program.config_.httpPort_ != 0) {
+		pollHttp_.reset(new HttpClient(program));
+		eventHttp_.reset(new HttpClient(program));
+	}
+}
+
+void Program::Node::start() {
+	startPoll();
+}
+
+void Program::Node::startPoll() {
+	if (!program_.running_) {
+		return;
+	}
+	if (pollHttp_) {
+		pollHttp_->get("/sensor_longpoll?token=" + urlEncode(token_) + "&codecs=" + urlEncode(program_.config_.codec_) + "&node=" + name_,
+			boost::bind(&Node::onHttpPoll, this, _1, _2));
+		return;
+	}
+	pollSock_.close();
+	pollSock_.async_connect(program_.endpoint(SENSOR_LONGPOLL), boost::bind(&Node::onPollConnect, this, boost::asio::placeholders::error));
+}
+
+void Program::Node::onPollConnect(const boost::system::error_code & error) {
+	if (error) {
+		onPollError();
+		return;
+	}
+	pollLine_ = token_ + " codecs=" + program_.config_.codec_ + " node=" + name_ + "\n";
+	boost::asio::write(pollSock_, boost::asio::buffer(pollLine_));
+	pollBuf_.consume(pollBuf_.size());
+	boost::asio::async_read(pollSock_, pollBuf_, boost::bind(&Node::onPollResponse, this, boost::asio::placeholders::error));
+}
+
+void Program::Node::onPollResponse(const boost::system::error_code & error) {
+	if (error != boost::asio::error::eof) {
+		program_.connectErrors_++;
+	}
+	else {
+		onPollBody(boost::asio::buffer_cast<const uint8_t *>(pollBuf_.data()), pollBuf_.size());
+	}
+	startPoll();
+}
+
+void Program::Node::onHttpPoll(bool ok, const std::string & body) {
+	if (!ok) {
+		onPollError();
+		return;
+	}
+	onPollBody(reinterpret_cast<const uint8_t *>(body.data()), body.size());
+	startPoll();
+}
+
+void Program::Node::onPollError() {
+	program_.connectErrors_++;
+	retryTimer_.expires_from_now(boost::chrono::milliseconds(int(RETRY_TIME)));
+	retryTimer_.async_wait(boost::bind(&Node::startPoll, this));
+}
+
+void Program::Node::onPollBody(const uint8_t * data, std::size_t size) {
+	program_.sensorResponses_++;
+	decoder_.reset();
+	decoder_.feed(data, size);
+}
+
+void Program::Node::onMessage(uint8_t type, const uint8_t * content, std::size_t size) {
+	switch (type) {
+	case Protocol::TOKEN:
+		token_.assign(content, content + size);
+		break;
+	case Protocol::AUDIO_STREAM:
+	case Protocol::AUDIO_MULAW:
+	case Protocol::AUDIO_IMA_ADPCM:
+		program_.audioDelivered_ += size;
+		break;
+	default:
+		break;
+	}
+}
+
+void Program::Node::startEvents(Clock::time_point first) {
+	if (program_.config_.eventRate_ <= 0) {
+		return;
+	}
+	nextEvent_ = first;
+	eventTimer_.expires_at(nextEvent_);
+	eventTimer_.async_wait(boost::bind(&Node::onEventTimer, this, boost::asio::placeholders::error));
+}
+
+void Program::Node::onEventTimer(const boost::system::error_code & error) {
+	if (error || !program_.sending_) {
+		return;
+	}
+	std::vector<Clock::time_point> & sent = program_.sent_[index_];
+	std::string node(name_ + "." + boost::lexical_cast<std::string>(sent.size()));
+	sent.push_back(Clock::now());
+	if (eventHttp_) {
+		// Queued behind the previous one, if that's not answered yet
+		eventHttp_->get("/sensor_event?event=motion&node=" + node, boost::bind(&Node::onHttpEvent, this, _1, _2));
+	}
+	else {
+		boost::shared_ptr<std::string> line(new std::string("node=" + node + " motion\n"));
+		boost::shared_ptr<strm::socket> sock(new strm::socket(program_.io_));
+		sock->async_connect(program_.endpoint(SENSOR_EVENT), boost::bind(&Node::onEventConnect, this, sock, line, boost::asio::placeholders::error));
+	}
+	nextEvent_ += boost::chrono::duration_cast<Clock::duration>(boost::chrono::duration<double>(1 / program_.config_.eventRate_));
+	eventTimer_.expires_at(nextEvent_);
+	eventTimer_.async_wait(boost::bind(&Node::onEventTimer, this, boost::asio::placeholders::error));
+}
+
+void Program::Node::onEventConnect(boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> line, const boost::system::error_code & error) {
+	if (error) {
+		// The event is lost, and shows as an undelivered one.
+		program_.connectErrors_++;
+		return;
+	}
+	// A short line into an empty socket buffer: it doesn't block.
+	boost::system::error_code writeError;
+	boost::asio::write(*sock, boost::asio::buffer(*line), writeError);
+	sock->close();
+}
+
+void Program::Node::onHttpEvent(bool ok, const std::string & body) {
+	(void) body;
+	if (!ok) {
+		// As with a failed connection
+		program_.connectErrors_++;
+	}
+}
+
+Program::GuiClient::GuiClient(Program & program)
+	:	program_(program),
+		sock_(program.io_),
+		retryTimer_(program.io_) {
+	if (program.config_.httpPort_ != 0) {
+		http_.reset(new HttpClient(program));
+	}
+}
+
+void Program::GuiClient::start() {
+	startPoll();
+}
+
+void Program::GuiClient::startPoll() {
+	if (!program_.running_) {
+		return;
+	}
+	if (http_) {
+		http_->get("/gui_longpoll?token=" + urlEncode(token_), boost::bind(&GuiClient::onHttpResponse, this, _1, _2));
+		return;
+	}
+	sock_.close();
+	sock_.async_connect(program_.endpoint(GUI_LONGPOLL), boost::bind(&GuiClient::onConnect, this, boost::asio::placeholders::error));
+}
+
+void Program::GuiClient::onConnect(const boost::system::error_code & error) {
+	if (error) {
+		onError();
+		return;
+	}
+	line_ = token_ + "\n";
+	boost::asio::write(sock_, boost::asio::buffer(line_));
+	buf_.consume(buf_.size());
+	boost::asio::async_read(sock_, buf_, boost::bind(&GuiClient::onResponse, this, boost::asio::placeholders::error));
+}
+
+void Program::GuiClient::onResponse(const boost::system::error_code & error) {
+	if (error != boost::asio::error::eof) {
+		program_.connectErrors_++;
+		startPoll();
+		return;
+	}
+	std::istream in(&buf_);
+	onBody(in);
+}
+
+void Program::GuiClient::onHttpResponse(bool ok, const std::string & body) {
+	if (!ok) {
+		onError();
+		return;
+	}
+	std::istringstream in(body);
+	onBody(in);
+}
+
+void Program::GuiClient::onError() {
+	program_.connectErrors_++;
+	retryTimer_.expires_from_now(boost::chrono::milliseconds(int(RETRY_TIME)));
+	retryTimer_.async_wait(boost::bind(&GuiClient::startPoll, this));
+}
+
+void Program::GuiClient::onBody(std::istream & in) {
+	Clock::time_point now = Clock::now();
+	program_.guiResponses_++;
+	// A state response (the first one, or a resync) only repeats the last events.
+	bool state = token_.empty(), wasReady = ready();
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line == "resync") {
+			program_.resyncs_++;
+			state = true;
+		}
+		else if (line.compare(0, 6, "token:") == 0) {
+			token_ = line.substr(6);
+		}
+		else if (!state) {
+			// "<time> <event> <node>"
+			std::string::size_type space = line.rfind(' ');
+			if (space != std::string::npos) {
+				program_.onDelivery(line.substr(space + 1), now);
+			}
+		}
+	}
+	if (!wasReady && ready() && ++program_.readyClients_ == program_.guiClients_.size()) {
+		program_.onReady();
+	}
+	startPoll();
+}
+
+Program::AudioUploader::AudioUploader(Program & program)
+	:	program_(program),
+		sock_(program.io_),
+		chunk_(AUDIO_RATE * AUDIO_CHUNK_TIME / 1000),
+		timer_(program.io_),
+		writing_(false),
+		phase_(0) {
+}
+
+void Program::AudioUploader::start() {
+	sock_.async_connect(program_.endpoint(GUI_EVENT), boost::bind(&AudioUploader::onConnect, this, boost::asio::placeholders::error));
+}
+
+void Program::AudioUploader::onConnect(const boost::system::error_code & error) {
+	if (error) {
+		program_.connectErrors_++;
+		return;
+	}
+	boost::asio::write(sock_, boost::asio::buffer(std::string("audio_stream\n")));
+	next_ = Clock::now();
+	onTimer(boost::system::error_code());
+}
+
+void Program::AudioUploader::onTimer(const boost::system::error_code & error) {
+	if (error || !program_.running_) {
+		return;
+	}
+	// Once pc_sw holds the upload back, chunks are dropped rather than queued.
+	if (!writing_) {
+		// A 400 Hz tone, signed 8-bit
+		for (std::size_t i = 0; i < chunk_.size(); i++, phase_++) {
+			chunk_[i] = uint8_t(int8_t(64 * std::sin(2 * 3.14159265358979 * 400 * phase_ / AUDIO_RATE)));
+		}
+		writing_ = true;
+		boost::asio::async_write(sock_, boost::asio::buffer(chunk_), boost::bind(&AudioUploader::onWrite, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+	}
+	next_ += boost::chrono::milliseconds(int(AUDIO_CHUNK_TIME));
+	timer_.expires_at(next_);
+	timer_.async_wait(boost::bind(&AudioUploader::onTimer, this, boost::asio::placeholders::error));
+}
+
+void Program::AudioUploader::onWrite(const boost::system::error_code & error, std::size_t bytes_transferred) {
+	writing_ = false;
+	program_.audioUploaded_ += bytes_transferred;
+	if (error) {
+		program_.connectErrors_++;
+		timer_.cancel();
+	}
+}
+
+int main(int argc, char const * const * argv) {
+	try {
+		return Program(Program::Config::fromArgv(argc, argv))();
+	}
+	catch (const std::exception & e) {
+		std::cerr << e.what() << std::endl;
+		return 2;
+	}
+}
@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <cstdlib>
+#include "audio_codec.hpp"
+
+namespace {
+	enum {
+		STEP_COUNT = 89,
+		MULAW_BIAS = 0x84,
+		MULAW_CLIP = 32635
+	};
+
+	const int32_t STEPS[STEP_COUNT] = {
+		7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97,
+		107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+		876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871,
+		5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623,
+		27086, 29794, 32767
+	};
+
+	const int INDEX_SHIFT[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+
+	// Everything the decoders need, worked out once: an ADPCM code only costs two lookups, a mu-law byte one.
+	struct Tables {
+		int32_t diff_[STEP_COUNT][16]; // Change of the prediction, by step index and code
+		uint8_t next_[STEP_COUNT][16]; // Next step index
+		int16_t mulaw_[256];
+
+		Tables() {
+			for (int index = 0; index < STEP_COUNT; index++) {
+				for (int code = 0; code < 16; code++) {
+					int32_t step = STEPS[index], diff = step >> 3;
+					if (code & 4) diff += step;
+					if (code & 2) diff += step >> 1;
+					if (code & 1) diff += step >> 2;
+					diff_[index][code] = (code & 8) ? -diff : diff;
+					next_[index][code] = uint8_t(std::min(STEP_COUNT - 1, std::max(0, index + INDEX_SHIFT[code])));
+				}
+			}
+			for (int i = 0; i < 256; i++) {
+				uint8_t u = ~uint8_t(i);
+				int32_t t = ((int32_t(u & 0x0f) << 3) + MULAW_BIAS) << ((u & 0x70) >> 4);
+				mulaw_[i] = int16_t((u & 0x80) ? MULAW_BIAS - t : t - MULAW_BIAS);
+			}
+		}
+	};
+
+	const Tables TABLES;
+
+	int32_t clamp16(int32_t value) {
+		return std::min<int32_t>(32767, std::max<int32_t>(-32768, value));
+	}
+
+	uint8_t mulawEncode(int16_t sample) {
+		int32_t magnitude = sample, sign = 0;
+		if (magnitude < 0) {
+			magnitude = -magnitude;
+			sign = 0x80;
+		}
+		magnitude = std::min<int32_t>(MULAW_CLIP, magnitude) + MULAW_BIAS;
+		int32_t exponent = 7;
+		for (int32_t mask = 0x4000; !(magnitude & mask) && exponent > 0; mask >>= 1) {
+			exponent--;
+		}
+		return ~uint8_t(sign | exponent << 4 | ((magnitude >> (exponent + 3)) & 0x0f));
+	}
+
+	// A block starts from a step that suits the first few samples, so it doesn't need to adapt first.
+	int adpcmInitialIndex(const int16_t * samples, std::size_t count) {
+		std::size_t n = std::min<std::size_t>(8, count - 1);
+		int32_t sum = 0;
+		for (std::size_t i = 1; i <= n; i++) {
+			sum += std::abs(int32_t(samples[i]) - samples[i - 1]);
+		}
+		int32_t mean = n ? sum / int32_t(n) : 0;
+		int index = 0;
+		while (index < STEP_COUNT - 1 && STEPS[index] < mean) {
+			index++;
+		}
+		return index;
+	}
+
+	void adpcmEncode(const int16_t * samples, std::size_t count, std::vector<uint8_t> & out) {
+		if (count == 0) {
+			return;
+		}
+		int32_t prediction = samples[0];
+		int index = adpcmInitialIndex(samples, count);
+		out.push_back(uint8_t(prediction));
+		out.push_back(uint8_t(uint16_t(prediction) >> 8));
+		out.push_back(uint8_t(index));
+		out.push_back(uint8_t((count - 1) % 2)); // The last nibble is padding
+		uint8_t low = 0;
+		for (std::size_t i = 1; i < count; i++) {
+			int32_t diff = samples[i] - prediction, step = STEPS[index];
+			uint8_t code = 0;
+			if (diff < 0) {
+				code = 8;
+				diff = -diff;
+			}
+			if (diff >= step) { code |= 4; diff -= step; }
+			step >>= 1;
+			if (diff >= step) { code |= 2; diff -= step; }
+			step >>= 1;
+			if (diff >= step) { code |= 1; }
+			// Track what the decoder will make of it, so the errors don't add up.
+			prediction = clamp16(prediction + TABLES.diff_[index][code]);
+			index = TABLES.next_[index][code];
+			if (i % 2) {
+				low = code;
+			}
+			else {
+				out.push_back(uint8_t(low | code << 4));
+			}
+		}
+		if ((count - 1) % 2) {
+			out.push_back(low);
+		}
+	}
+
+	void adpcmDecode(const uint8_t * data, std::size_t size, std::vector<int16_t> & out) {
+		if (size < 4) {
+			return;
+		}
+		int32_t prediction = int16_t(uint16_t(data[0] | data[1] << 8));
+		int index = std::min<int>(data[2], STEP_COUNT - 1);
+		std::size_t codes = (size - 4) * 2 - ((data[3] & 1) && size > 4 ? 1 : 0);
+		const uint8_t * p = data + 4;
+		std::size_t base = out.size();
+		out.resize(base + 1 + codes);
+		out[base] = int16_t(prediction);
+		int16_t * dest = &out[base + 1];
+		for (std::size_t i = 0; i < codes; i++) {
+			uint8_t code = (i & 1) ? p[i >> 1] >> 4 : p[i >> 1] & 0x0f;
+			prediction = clamp16(prediction + TABLES.diff_[index][code]);
+			index = TABLES.next_[index][code];
+			dest[i] = int16_t(prediction);
+		}
+	}
+}
+
+const char * AudioCodec::name(Type type) {
+	switch (type) {
+	case PCM8:      return "pcm8"     ;
+	case MULAW:     return "mulaw"    ;
+	case IMA_ADPCM: return "ima_adpcm";
+	}
+	return "";
+}
+
+bool AudioCodec::parse(const std::string & name, Type & type) {
+	const Type types[] = { PCM8, MULAW, IMA_ADPCM };
+	for (std::size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		if (name == AudioCodec::name(types[i])) {
+			type = types[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+void AudioCodec::encode(Type type, const int16_t * samples, std::size_t count, std::vector<uint8_t> & out) {
+	switch (type) {
+	case PCM8:
+		for (std::size_t i = 0; i < count; i++) {
+			out.push_back(uint8_t(samples[i] >> 8));
+		}
+		break;
+	case MULAW:
+		for (std::size_t i = 0; i < count; i++) {
+			out.push_back(mulawEncode(samples[i]));
+		}
+		break;
+	case IMA_ADPCM:
+		adpcmEncode(samples, count, out);
+		break;
+	}
+}
+
+void AudioCodec::decode(Type type, const uint8_t * data, std::size_t size, std::vector<int16_t> & out) {
+	std::size_t base = out.size();
+	switch (type) {
+	case PCM8:
+		out.resize(base + size);
+		for (std::size_t i = 0; i < size; i++) {
+			out[base + i] = int16_t(int8_t(data[i]) * 256);
+		}
+		break;
+	case MULAW:
+		out.resize(base + size);
+		for (std::size_t i = 0; i < size; i++) {
+			out[base + i] = TABLES.mulaw_[data[i]];
+		}
+		break;
+	case IMA_ADPCM:
+		adpcmDecode(data, size, out);
+		break;
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef AUDIO_CODEC_HPP
+#define AUDIO_CODEC_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Codecs for the audio sent to the sensor, shared by both ends.
+// Every message is encoded on its own, so each one can be decoded without the ones before it.
+// - PCM8: signed 8-bit samples, as uploaded by the GUI.
+// - MULAW: G.711 mu-law, 8 bits per sample with 14 bits of range.
+// - IMA_ADPCM: 4 bits per sample. A 4-byte header (first sample as 16-bit little-endian, step index,
+//   padding flag) is followed by the codes of the rest, two per byte, low nibble first.
+class AudioCodec {
+public:
+	enum Type {
+		PCM8,
+		MULAW,
+		IMA_ADPCM
+	};
+
+	static const char * name(Type type);
+	static bool parse(const std::string & name, Type & type);
+
+	// Both append to out.
+	static void encode(Type type, const int16_t * samples, std::size_t count, std::vector<uint8_t> & out);
+	static void decode(Type type, const uint8_t * data, std::size_t size, std::vector<int16_t> & out);
+private:
+	AudioCodec();
+};
+
+#endif
@@ -0,0 +1,47 @@
+#include <algorithm>
+#include <cstring>
+#include "frame_decoder.hpp"
+
+FrameDecoder::FrameDecoder(Handler handler)
+	:	handler_(handler),
+		headerSize_(0),
+		content_(MAX_CONTENT),
+		contentSize_(0),
+		contentGot_(0) {
+}
+
+void FrameDecoder::feed(const uint8_t * data, std::size_t size) {
+	const uint8_t * end = data + size;
+	while (data != end) {
+		if (headerSize_ < HEADER_SIZE) {
+			if (headerSize_ == 0 && std::size_t(end - data) >= HEADER_SIZE) {
+				// The usual case: the whole message may be right here.
+				std::size_t length = std::size_t(data[1]) << 8 | data[2];
+				if (std::size_t(end - data) >= HEADER_SIZE + length) {
+					handler_(data[0], data + HEADER_SIZE, length);
+					data += HEADER_SIZE + length;
+					continue;
+				}
+			}
+			header_[headerSize_++] = *data++;
+			if (headerSize_ == HEADER_SIZE) {
+				contentSize_ = std::size_t(header_[1]) << 8 | header_[2];
+				contentGot_ = 0;
+			}
+		}
+		else {
+			std::size_t n = std::min<std::size_t>(end - data, contentSize_ - contentGot_);
+			std::memcpy(&content_[contentGot_], data, n);
+			contentGot_ += n;
+			data += n;
+		}
+		if (headerSize_ == HEADER_SIZE && contentGot_ == contentSize_) {
+			headerSize_ = 0;
+			handler_(header_[0], &content_[0], contentSize_);
+		}
+	}
+}
+
+void FrameDecoder::reset() {
+	headerSize_ = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef FRAME_DECODER_HPP
+#define FRAME_DECODER_HPP
+
+#include <vector>
+#include <stdint.h>
+#include <boost/function.hpp>
+
+// Push-style decoder for the sensor's messages: 1 byte of type, 2 bytes of content length (big-endian), content.
+// Bytes are fed in as they arrive, and every message is handed on as soon as it's complete. A message that
+// arrived in one piece is passed straight from the fed data; only split ones are gathered, into a buffer that
+// is allocated once.
+class FrameDecoder {
+public:
+	enum {
+		HEADER_SIZE = 3,
+		MAX_CONTENT = 0xffff
+	};
+
+	// The content is only valid during the call.
+	typedef boost::function<void(uint8_t type, const uint8_t * content, std::size_t size)> Handler;
+
+	FrameDecoder(Handler handler);
+	void feed(const uint8_t * data, std::size_t size);
+	void reset(); // Drops a partial message
+	bool idle() const { return headerSize_ == 0; } // Not in the middle of a message
+private:
+	Handler handler_;
+	uint8_t header_[HEADER_SIZE];
+	std::size_t headerSize_;
+	std::vector<uint8_t> content_;
+	std::size_t contentSize_; // Of the current message; content_ has got contentGot_ bytes of it so far
+	std::size_t contentGot_;
+};
+
+#endif
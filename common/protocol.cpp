@@ -0,0 +1,180 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include "protocol.hpp"
+
+namespace {
+	bool isSpace(char c) {
+		return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+	}
+
+	// The next whitespace-separated word at or after pos; false if there's none.
+	bool nextWord(const char * line, std::size_t size, std::size_t & pos, const char *& word, std::size_t & length) {
+		while (pos < size && isSpace(line[pos])) {
+			pos++;
+		}
+		if (pos == size) {
+			return false;
+		}
+		word = line + pos;
+		while (pos < size && !isSpace(line[pos])) {
+			pos++;
+		}
+		length = line + pos - word;
+		return true;
+	}
+
+	bool parseUnsigned(const char * word, std::size_t length, unsigned int & value) {
+		if (length == 0) {
+			return false;
+		}
+		unsigned int result = 0;
+		for (std::size_t i = 0; i < length; i++) {
+			if (word[i] < '0' || word[i] > '9') {
+				return false;
+			}
+			result = result * 10 + (word[i] - '0');
+		}
+		value = result;
+		return true;
+	}
+}
+
+std::size_t Protocol::putHeader(uint8_t * header, uint8_t type, std::size_t size) {
+	size = std::min<std::size_t>(MAX_CONTENT, size);
+	header[0] = type;
+	header[1] = uint8_t(size >> 8);
+	header[2] = uint8_t(size);
+	return size;
+}
+
+void Protocol::appendNumber(std::string & out, uint64_t value) {
+	char digits[20];
+	char * begin = digits + sizeof(digits);
+	do {
+		*--begin = char('0' + value % 10);
+		value /= 10;
+	} while (value != 0);
+	out.append(begin, digits + sizeof(digits));
+}
+
+std::size_t Protocol::parseNumbers(const uint8_t * content, std::size_t size, unsigned int * numbers, std::size_t count) {
+	std::size_t n = 0, i = 0;
+	while (n < count) {
+		while (i < size && (content[i] == ' ' || content[i] == '\t' || content[i] == '\n')) {
+			i++;
+		}
+		if (i == size || content[i] < '0' || content[i] > '9') {
+			break;
+		}
+		unsigned int value = 0;
+		for (; i < size && content[i] >= '0' && content[i] <= '9'; i++) {
+			value = value * 10 + (content[i] - '0');
+		}
+		numbers[n++] = value;
+	}
+	return n;
+}
+
+const char * Protocol::sensorEventName(SensorEvent evt) {
+	switch (evt) {
+	case SMOKE_ON:  return "smoke_on" ;
+	case SMOKE_OFF: return "smoke_off";
+	case MOTION:    return "motion"   ;
+	}
+	return "";
+}
+
+bool Protocol::parseSensorEvent(const char * name, std::size_t size, SensorEvent & evt) {
+	const SensorEvent events[] = { SMOKE_ON, SMOKE_OFF, MOTION };
+	for (std::size_t i = 0; i < sizeof(events) / sizeof(events[0]); i++) {
+		const char * known = sensorEventName(events[i]);
+		if (std::strlen(known) == size && std::memcmp(known, name, size) == 0) {
+			evt = events[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Protocol::isNodeName(const char * name, std::size_t size) {
+	if (size == 0 || size > NODE_NAME_LEN_MAX) {
+		return false;
+	}
+	for (std::size_t i = 0; i < size; i++) {
+		if (!std::isalnum(static_cast<unsigned char>(name[i])) && name[i] != '_' && name[i] != '-' && name[i] != '.') {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Protocol::parseEventLine(const char * line, std::size_t size, EventLine & evt) {
+	std::size_t pos = 0, length;
+	const char * word;
+	if (!nextWord(line, size, pos, word, length)) {
+		return false;
+	}
+	evt.node_.clear();
+	if (length >= 5 && std::memcmp(word, "node=", 5) == 0) {
+		if (!isNodeName(word + 5, length - 5)) {
+			return false;
+		}
+		evt.node_.assign(word + 5, length - 5);
+		if (!nextWord(line, size, pos, word, length)) {
+			return false;
+		}
+	}
+	if (!parseSensorEvent(word, length, evt.event_)) {
+		return false;
+	}
+	evt.count_ = 1;
+	evt.firstAge_ = evt.lastAge_ = 0;
+	// Anything after the event that isn't a count is ignored.
+	if (nextWord(line, size, pos, word, length) && parseUnsigned(word, length, evt.count_)) {
+		const char * ages[2];
+		std::size_t lengths[2];
+		if (!nextWord(line, size, pos, ages[0], lengths[0]) || !parseUnsigned(ages[0], lengths[0], evt.firstAge_)
+			|| !nextWord(line, size, pos, ages[1], lengths[1]) || !parseUnsigned(ages[1], lengths[1], evt.lastAge_)
+			|| evt.count_ == 0 || evt.firstAge_ < evt.lastAge_) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void Protocol::appendEventLine(std::string & out, const EventLine & evt) {
+	if (!evt.node_.empty()) {
+		out += "node=";
+		out += evt.node_;
+		out += ' ';
+	}
+	out += sensorEventName(evt.event_);
+	out += ' ';
+	appendNumber(out, evt.count_);
+	out += ' ';
+	appendNumber(out, evt.firstAge_);
+	out += ' ';
+	appendNumber(out, evt.lastAge_);
+	out += '\n';
+}
+
+void Protocol::appendGuiEventLine(std::string & out, int64_t time, SensorEvent evt, const std::string & node) {
+	if (time < 0) {
+		out += '-';
+	}
+	appendNumber(out, time < 0 ? uint64_t(-(time + 1)) + 1 : uint64_t(time));
+	out += ' ';
+	out += sensorEventName(evt);
+	if (!node.empty()) {
+		out += ' ';
+		out += node;
+	}
+	out += '\n';
+}
+
+void Protocol::appendGuiToken(std::string & out, uint64_t token) {
+	out += "token:";
+	appendNumber(out, token);
+	out += '\n';
+}
@@ -0,0 +1,88 @@
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include <string>
+#include <stdint.h>
+
+// The wire formats, shared by both ends (see protocol.txt): messages to the node, the sensor event lines it
+// sends back, and the GUI's event lines. Everything works on plain bytes and appends to the caller's buffers,
+// without streams, so that encoding or decoding a message allocates nothing the caller didn't ask for.
+class Protocol {
+public:
+	// Messages to the node: 1 byte of type, 2 bytes of content length (big-endian), content.
+	// FrameDecoder takes them apart.
+	enum MsgType {
+		LED = 1,
+		SIREN_CTRL,
+		SMOKE_SLEEP,
+		AUDIO_STREAM,
+
+		TOKEN, // not an actual event, but reported at the end of longpolls
+		RESYNC, // not an actual event either: the client missed events, and the full state follows
+		AUDIO_MULAW, // AUDIO_STREAM, encoded with the codec the sensor asked for
+		AUDIO_IMA_ADPCM,
+
+		// Only on node links
+		HELLO, // From the node: the same options as on a longpoll request line
+		SENSOR_EVENT, // From the node: a sensor event line
+		HEARTBEAT
+	};
+
+	enum SensorEvent {
+		SMOKE_ON,
+		SMOKE_OFF,
+		MOTION
+	};
+
+	enum {
+		HEADER_SIZE = 3,
+		MAX_CONTENT = 0xffff, // Longer content is cut
+		NODE_NAME_LEN_MAX = 32 // Of node and group names
+	};
+
+	// "[node=<name> ]<event>[ <count> <first_age> <last_age>]": a batch of count events, the first and last of
+	// them that many ms ago. A bare event is a single one that just happened.
+	struct EventLine {
+		std::string node_; // Empty if the line has none
+		SensorEvent event_;
+		unsigned int count_, firstAge_, lastAge_;
+		EventLine() : event_(SMOKE_ON), count_(1), firstAge_(0), lastAge_(0) { }
+	};
+
+	// Writes the header of a message with size bytes of content, and returns how many of them fit.
+	static std::size_t putHeader(uint8_t * header, uint8_t type, std::size_t size);
+	// Appends a whole message to a std::string or a std::vector<uint8_t>.
+	template <typename Bytes>
+	static void appendMsg(Bytes & out, uint8_t type, const void * content, std::size_t size) {
+		uint8_t header[HEADER_SIZE];
+		size = putHeader(header, type, size);
+		const uint8_t * bytes = static_cast<const uint8_t *>(content);
+		out.reserve(out.size() + HEADER_SIZE + size);
+		out.insert(out.end(), header, header + HEADER_SIZE);
+		out.insert(out.end(), bytes, bytes + size);
+	}
+
+	// Decimal, as in tokens and in the numbers of message contents
+	static void appendNumber(std::string & out, uint64_t value);
+	// Reads up to count unsigned numbers, separated by whitespace, from the start of the content. Returns how
+	// many there were.
+	static std::size_t parseNumbers(const uint8_t * content, std::size_t size, unsigned int * numbers, std::size_t count);
+
+	static const char * sensorEventName(SensorEvent evt);
+	static bool parseSensorEvent(const char * name, std::size_t size, SensorEvent & evt);
+	// Nodes and groups are named with letters, digits, '_', '-' and '.'.
+	static bool isNodeName(const char * name, std::size_t size);
+	static bool isNodeName(const std::string & name) { return isNodeName(name.data(), name.size()); }
+
+	// With or without the newline. False if it's malformed.
+	static bool parseEventLine(const char * line, std::size_t size, EventLine & evt);
+	static void appendEventLine(std::string & out, const EventLine & evt); // With the count and ages, and the newline
+
+	// GUI longpolls: "<time> <event>[ <node>]\n", the time in s since the epoch, and "token:<token>\n" at the end.
+	static void appendGuiEventLine(std::string & out, int64_t time, SensorEvent evt, const std::string & node);
+	static void appendGuiToken(std::string & out, uint64_t token);
+private:
+	Protocol();
+};
+
+#endif
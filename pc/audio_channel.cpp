@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <boost/bind.hpp>
+#include "audio_channel.hpp"
+
+AudioChannel::AudioChannel(boost::asio::io_service & io, Sink sink)
+	:	io_(io),
+		strand_(io),
+		timer_(io),
+		running_(false),
+		sink_(sink) {
+}
+
+AudioChannel::StreamPtr AudioChannel::open() {
+	return StreamPtr(new Stream);
+}
+
+void AudioChannel::push(StreamPtr stream, const SharedBuffer & audio, Resume resume) {
+	strand_.dispatch(boost::bind(&AudioChannel::onPush, this, stream, audio, resume));
+}
+
+void AudioChannel::close(StreamPtr stream) {
+	strand_.dispatch(boost::bind(&AudioChannel::onClose, this, stream));
+}
+
+void AudioChannel::onPush(StreamPtr stream, const SharedBuffer & audio, Resume resume) {
+	if (!audio.empty()) {
+		if (!stream->listed_) {
+			streams_.push_back(stream);
+			stream->listed_ = true;
+		}
+		stream->queue_.push_back(audio);
+		stream->size_ += audio.size();
+		if (stream->size_ >= PREBUFFER_FRAMES * FRAME_SIZE) {
+			stream->playing_ = true;
+		}
+	}
+	if (resume) {
+		if (stream->size_ < HIGH_WATER) {
+			io_.post(resume);
+		}
+		else {
+			stream->resume_ = resume;
+		}
+	}
+	startTimer();
+}
+
+void AudioChannel::onClose(StreamPtr stream) {
+	stream->closed_ = true;
+	// Whatever is left is all there is going to be, so don't wait for a full prebuffer.
+	stream->playing_ = true;
+	startTimer();
+}
+
+void AudioChannel::startTimer() {
+	if (running_ || !isPlaying()) {
+		return;
+	}
+	running_ = true;
+	next_ = boost::asio::high_resolution_timer::clock_type::now();
+	timer_.expires_at(next_);
+	timer_.async_wait(strand_.wrap(boost::bind(&AudioChannel::onTimer, this, boost::asio::placeholders::error)));
+}
+
+void AudioChannel::onTimer(const boost::system::error_code & error) {
+	running_ = false;
+	if (error) {
+		return;
+	}
+	releaseFrame();
+	if (!isPlaying()) {
+		// Either everything is played, or the uploads ran dry and prebuffer again.
+		return;
+	}
+	running_ = true;
+	// Frames are due at fixed times, so the pace doesn't drift with the timer's latency.
+	boost::chrono::milliseconds frameTime(static_cast<int>(FRAME_TIME));
+	next_ += frameTime;
+	if (boost::asio::high_resolution_timer::clock_type::now() - next_ > frameTime * int(MAX_LATE_FRAMES)) {
+		next_ = boost::asio::high_resolution_timer::clock_type::now();
+	}
+	timer_.expires_at(next_);
+	timer_.async_wait(strand_.wrap(boost::bind(&AudioChannel::onTimer, this, boost::asio::placeholders::error)));
+}
+
+void AudioChannel::releaseFrame() {
+	std::vector<Stream *> playing;
+	for (std::list<StreamPtr>::const_iterator it = streams_.begin(); it != streams_.end(); ++it) {
+		if ((*it)->playing_) {
+			playing.push_back(it->get());
+		}
+	}
+	SharedBuffer frame;
+	if (playing.size() == 1) {
+		frame = take(*playing[0], FRAME_SIZE);
+	}
+	else if (playing.size() > 1) {
+		int16_t sum[FRAME_SIZE] = { };
+		std::size_t size = 0;
+		for (std::size_t i = 0; i < playing.size(); i++) {
+			SharedBuffer part(take(*playing[i], FRAME_SIZE));
+			const int8_t * samples = reinterpret_cast<const int8_t *>(part.data());
+			for (std::size_t j = 0; j < part.size(); j++) {
+				sum[j] += samples[j];
+			}
+			size = std::max(size, part.size());
+		}
+		boost::shared_ptr<SharedBuffer::Data> mixed(new SharedBuffer::Data(size));
+		for (std::size_t j = 0; j < size; j++) {
+			(*mixed)[j] = uint8_t(int8_t(std::min<int16_t>(127, std::max<int16_t>(-128, sum[j]))));
+		}
+		frame = SharedBuffer(mixed);
+	}
+	for (std::list<StreamPtr>::iterator it = streams_.begin(); it != streams_.end(); ) {
+		Stream & stream = **it;
+		if (stream.size_ == 0 && stream.closed_) {
+			stream.listed_ = false;
+			it = streams_.erase(it);
+		}
+		else {
+			if (stream.size_ == 0) {
+				stream.playing_ = false;
+			}
+			++it;
+		}
+	}
+	if (!frame.empty()) {
+		sink_(frame);
+	}
+}
+
+SharedBuffer AudioChannel::take(Stream & stream, std::size_t size) {
+	size = std::min(size, stream.size_);
+	SharedBuffer result;
+	if (size == 0) {
+		return result;
+	}
+	SharedBuffer & front = stream.queue_.front();
+	if (front.size() >= size) {
+		// The usual case: the frame lies within one uploaded buffer.
+		result = front.slice(0, size);
+		front = front.slice(size, front.size() - size);
+		if (front.empty()) {
+			stream.queue_.pop_front();
+		}
+	}
+	else {
+		boost::shared_ptr<SharedBuffer::Data> data(new SharedBuffer::Data);
+		data->reserve(size);
+		while (data->size() < size) {
+			SharedBuffer & piece = stream.queue_.front();
+			std::size_t n = std::min(piece.size(), size - data->size());
+			data->insert(data->end(), piece.data(), piece.data() + n);
+			piece = piece.slice(n, piece.size() - n);
+			if (piece.empty()) {
+				stream.queue_.pop_front();
+			}
+		}
+		result = SharedBuffer(data);
+	}
+	stream.size_ -= size;
+	if (stream.resume_ && stream.size_ <= LOW_WATER) {
+		io_.post(stream.resume_);
+		stream.resume_.clear();
+	}
+	return result;
+}
+
+bool AudioChannel::isPlaying() const {
+	for (std::list<StreamPtr>::const_iterator it = streams_.begin(); it != streams_.end(); ++it) {
+		if ((*it)->playing_) {
+			return true;
+		}
+	}
+	return false;
+}
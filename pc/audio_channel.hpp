@@ -0,0 +1,74 @@
+#ifndef AUDIO_CHANNEL_HPP
+#define AUDIO_CHANNEL_HPP
+
+#include <deque>
+#include <list>
+#include <boost/asio.hpp>
+#include <boost/asio/high_resolution_timer.hpp>
+#include <boost/function.hpp>
+#include "buffer.hpp"
+
+// Carries audio uploads (8 kHz, signed 8-bit samples) to the sensor at real-time pace.
+// Uploads may arrive at any speed. Each one gets its own jitter buffer, which starts playing once
+// PREBUFFER_FRAMES are in. A timer then releases one frame per FRAME_TIME: a single playing upload is
+// passed on as slices of the buffers it was read into, several are mixed with saturation.
+// An upload more than HIGH_WATER ahead is paused until it has drained to LOW_WATER.
+// Thread-safe; all the work is done on the channel's own strand.
+class AudioChannel {
+public:
+	enum {
+		SAMPLE_RATE = 8000,
+		FRAME_TIME = 40, // ms
+		FRAME_SIZE = SAMPLE_RATE * FRAME_TIME / 1000, // bytes
+		PREBUFFER_FRAMES = 3,
+		HIGH_WATER = SAMPLE_RATE * 2, // bytes queued per upload
+		LOW_WATER = SAMPLE_RATE,
+		MAX_LATE_FRAMES = 5 // If the timer is further behind, it skips ahead instead of catching up.
+	};
+
+	typedef boost::function<void(const SharedBuffer & frame)> Sink;
+	typedef boost::function<void()> Resume;
+	class Stream;
+	typedef boost::shared_ptr<Stream> StreamPtr;
+
+	AudioChannel(boost::asio::io_service & io, Sink sink);
+
+	StreamPtr open();
+	// Queues audio of an upload. resume is called once the uploader may push more: right away if it's
+	// below HIGH_WATER, otherwise when it has drained to LOW_WATER.
+	void push(StreamPtr stream, const SharedBuffer & audio, Resume resume);
+	// The upload is over; what's queued is still played.
+	void close(StreamPtr stream);
+private:
+	AudioChannel(const AudioChannel &);
+	AudioChannel & operator=(const AudioChannel &);
+
+	void onPush(StreamPtr stream, const SharedBuffer & audio, Resume resume);
+	void onClose(StreamPtr stream);
+	void startTimer();
+	void onTimer(const boost::system::error_code & error);
+	void releaseFrame();
+	SharedBuffer take(Stream & stream, std::size_t size);
+	bool isPlaying() const;
+
+	boost::asio::io_service & io_;
+	boost::asio::io_service::strand strand_;
+	boost::asio::high_resolution_timer timer_;
+	boost::asio::high_resolution_timer::time_point next_; // When the next frame is due
+	bool running_;
+	Sink sink_;
+	std::list<StreamPtr> streams_; // Those with queued audio
+};
+
+class AudioChannel::Stream {
+private:
+	friend class AudioChannel;
+	Stream() : size_(), listed_(false), playing_(false), closed_(false) { }
+
+	std::deque<SharedBuffer> queue_;
+	std::size_t size_; // Bytes in queue_
+	bool listed_, playing_, closed_;
+	Resume resume_; // Set while the uploader is paused
+};
+
+#endif
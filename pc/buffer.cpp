@@ -0,0 +1,40 @@
+#include <algorithm>
+#include "buffer.hpp"
+
+SharedBuffer SharedBuffer::copyOf(const void * data, std::size_t size) {
+	const uint8_t * bytes = static_cast<const uint8_t *>(data);
+	return SharedBuffer(boost::shared_ptr<const Data>(new Data(bytes, bytes + size)));
+}
+
+void GatherMessage::append(const void * data, std::size_t size) {
+	if (size == 0) {
+		return;
+	}
+	SharedBuffer::Data * chunk = chunks_.empty() ? NULL : chunks_.back().get();
+	bool extend = chunk && chunk->capacity() - chunk->size() >= size;
+	if (!extend) {
+		chunks_.push_back(boost::shared_ptr<SharedBuffer::Data>(new SharedBuffer::Data));
+		chunk = chunks_.back().get();
+		chunk->reserve(std::max<std::size_t>(CHUNK_SIZE, size));
+	}
+	const uint8_t * bytes = static_cast<const uint8_t *>(data);
+	const uint8_t * dest = chunk->data() + chunk->size();
+	chunk->insert(chunk->end(), bytes, bytes + size);
+	// Consecutive copied pieces become a single buffer.
+	if (extend && !buffers_.empty() && boost::asio::buffer_cast<const uint8_t *>(buffers_.back()) + boost::asio::buffer_size(buffers_.back()) == dest) {
+		buffers_.back() = boost::asio::const_buffer(boost::asio::buffer_cast<const uint8_t *>(buffers_.back()), boost::asio::buffer_size(buffers_.back()) + size);
+	}
+	else {
+		buffers_.push_back(boost::asio::const_buffer(dest, size));
+	}
+	size_ += size;
+}
+
+void GatherMessage::append(const SharedBuffer & buf) {
+	if (buf.empty()) {
+		return;
+	}
+	refs_.push_back(buf);
+	buffers_.push_back(boost::asio::const_buffer(buf.data(), buf.size()));
+	size_ += buf.size();
+}
@@ -0,0 +1,66 @@
+#ifndef BUFFER_HPP
+#define BUFFER_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/asio/buffer.hpp>
+#include <boost/chrono.hpp>
+#include <boost/shared_ptr.hpp>
+
+// A reference-counted, immutable slice of bytes. Copying or slicing one only copies the reference.
+class SharedBuffer {
+public:
+	typedef std::vector<uint8_t> Data;
+
+	SharedBuffer() : offset_(), size_() { }
+	// Takes over data; nobody may modify it afterwards.
+	SharedBuffer(boost::shared_ptr<const Data> data, std::size_t offset, std::size_t size) : data_(data), offset_(offset), size_(size) { }
+	explicit SharedBuffer(boost::shared_ptr<const Data> data) : data_(data), offset_(), size_(data->size()) { }
+	static SharedBuffer copyOf(const void * data, std::size_t size);
+	static SharedBuffer copyOf(const std::string & str) { return copyOf(str.data(), str.size()); }
+
+	const uint8_t * data() const { return size_ ? &(*data_)[offset_] : NULL; }
+	std::size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	SharedBuffer slice(std::size_t offset, std::size_t size) const { return SharedBuffer(data_, offset_ + offset, size); }
+	std::string str() const { return std::string(data(), data() + size_); }
+private:
+	boost::shared_ptr<const Data> data_;
+	std::size_t offset_, size_;
+};
+
+// An outgoing message as a sequence of buffers, ready for a gathering async_write.
+// Small pieces like headers are copied into chunks owned by the message; payloads are only referenced.
+// Once built, it is shared read-only by every connection it is written to.
+class GatherMessage {
+public:
+	typedef std::vector<boost::asio::const_buffer> Buffers;
+
+	GatherMessage() : size_() { }
+	void append(const void * data, std::size_t size); // Copies
+	void append(const std::string & str) { append(str.data(), str.size()); }
+	void append(const SharedBuffer & buf);             // References
+
+	const Buffers & buffers() const { return buffers_; }
+	std::size_t size() const { return size_; }
+	// When what it reports came in, for timing its delivery. The epoch if it isn't timed.
+	boost::chrono::steady_clock::time_point origin() const { return origin_; }
+	void setOrigin(boost::chrono::steady_clock::time_point origin) { origin_ = origin; }
+private:
+	enum {
+		CHUNK_SIZE = 256
+	};
+
+	GatherMessage(const GatherMessage &);
+	GatherMessage & operator=(const GatherMessage &);
+
+	Buffers buffers_;
+	// Chunks never grow past their reserved capacity, so the buffers pointing into them stay valid.
+	std::vector< boost::shared_ptr<SharedBuffer::Data> > chunks_;
+	std::vector<SharedBuffer> refs_;
+	std::size_t size_;
+	boost::chrono::steady_clock::time_point origin_;
+};
+
+#endif
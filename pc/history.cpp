@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
+#include <boost/crc.hpp>
+#include "history.hpp"
+
+namespace {
+	const char BLOCK_MAGIC[4] = { 'H', 'B', 'L', 'K' };
+
+	void putVarint(std::vector<uint8_t> & out, uint64_t value) {
+		while (value >= 0x80) {
+			out.push_back(uint8_t(value) | 0x80);
+			value >>= 7;
+		}
+		out.push_back(uint8_t(value));
+	}
+
+	uint64_t getVarint(const uint8_t * & p, const uint8_t * end) {
+		uint64_t value = 0;
+		for (unsigned int shift = 0; p != end && shift < 64; shift += 7) {
+			uint8_t b = *p++;
+			value |= uint64_t(b & 0x7f) << shift;
+			if (!(b & 0x80)) {
+				break;
+			}
+		}
+		return value;
+	}
+
+	uint64_t zigzag(int64_t v) { return (uint64_t(v) << 1) ^ uint64_t(v >> 63); }
+	int64_t unzigzag(uint64_t v) { return int64_t(v >> 1) ^ -int64_t(v & 1); }
+
+	int64_t hourOf(int64_t time) {
+		int64_t hour = 3600 * 1000;
+		return (time >= 0 ? time : time - hour + 1) / hour * hour;
+	}
+
+	uint32_t checksum(const void * data, std::size_t size) {
+		boost::crc_32_type crc;
+		crc.process_bytes(data, size);
+		return crc.checksum();
+	}
+
+	struct FirstBefore {
+		template <typename BlockPtr>
+		bool operator()(const BlockPtr & block, int64_t time) const { return block->first_ < time; }
+	};
+}
+
+History::History(const std::string & path, unsigned int threads)
+	:	path_(path),
+		fd_(-1),
+		threads_(threads),
+		poolWork_(new boost::asio::io_service::work(pool_)) {
+	for (unsigned int i = 0; i < threads_; i++) {
+		workers_.create_thread(boost::bind(&boost::asio::io_service::run, &pool_));
+	}
+	open_.reserve(BLOCK_EVENTS);
+	if (!path_.empty()) {
+		load();
+		fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+		if (fd_ < 0) {
+			throw std::runtime_error("cannot open " + path_);
+		}
+	}
+}
+
+History::~History() {
+	poolWork_.reset();
+	workers_.join_all();
+	boost::mutex::scoped_lock lock(mutex_);
+	sealLocked();
+	if (fd_ >= 0) {
+		::close(fd_);
+	}
+}
+
+void History::append(int64_t first, int64_t last, uint8_t type, uint32_t count) {
+	boost::mutex::scoped_lock lock(mutex_);
+	for (uint32_t i = 0; i < count; i++) {
+		Event evt = { count == 1 ? last : first + (last - first) * int64_t(i) / int64_t(count - 1), uint8_t(type % TYPES) };
+		open_.push_back(evt);
+		if (open_.size() >= BLOCK_EVENTS) {
+			sealLocked();
+		}
+	}
+}
+
+void History::seal(int64_t olderThan) {
+	boost::mutex::scoped_lock lock(mutex_);
+	if (!open_.empty() && open_.front().time_ < olderThan) {
+		sealLocked();
+	}
+}
+
+bool History::events(int64_t from, int64_t to, std::size_t max, std::vector<Event> & result) const {
+	std::vector<BlockPtr> blocks;
+	std::vector<Event> open;
+	snapshot(from, to, blocks, open);
+	result.clear();
+	// Once the blocks wholly in range make more than max events, the ones after them aren't needed.
+	std::size_t found = 0, end = 0;
+	while (end < blocks.size() && found <= max) {
+		const Block & block = *blocks[end++];
+		if (from <= block.first_ && block.last_ < to) {
+			found += block.count_;
+		}
+	}
+	blocks.resize(end);
+	if (blocks.size() < PARALLEL_BLOCKS || threads_ == 0) {
+		decodeRange(blocks, 0, blocks.size(), from, to, &result);
+	}
+	else {
+		// Each thread, this one included, decodes a contiguous run of blocks into its own vector; the runs are
+		// joined in order.
+		std::size_t threads = threads_ + 1;
+		std::size_t perThread = (blocks.size() + threads - 1) / threads;
+		std::vector< std::vector<Event> > parts(threads);
+		Join join;
+		join.left_ = 0;
+		for (std::size_t i = 1; i < threads && i * perThread < blocks.size(); i++) {
+			join.left_++;
+			pool_.post(boost::bind(&History::decodePart, boost::cref(blocks), i * perThread, std::min(blocks.size(), (i + 1) * perThread), from, to, &parts[i], &join));
+		}
+		decodeRange(blocks, 0, std::min(blocks.size(), perThread), from, to, &parts[0]);
+		{
+			boost::mutex::scoped_lock lock(join.mutex_);
+			while (join.left_ > 0) {
+				join.done_.wait(lock);
+			}
+		}
+		std::size_t total = 0;
+		for (std::size_t i = 0; i < parts.size(); i++) {
+			total += parts[i].size();
+		}
+		result.reserve(total + open.size());
+		for (std::size_t i = 0; i < parts.size(); i++) {
+			result.insert(result.end(), parts[i].begin(), parts[i].end());
+		}
+	}
+	result.insert(result.end(), open.begin(), open.end());
+	if (result.size() > max) {
+		result.resize(max);
+		return false;
+	}
+	return true;
+}
+
+void History::hourlyCounts(int64_t from, int64_t to, uint8_t type, Counts & result) const {
+	std::vector<BlockPtr> blocks;
+	std::vector<Event> events;
+	snapshot(from, to, blocks, events);
+	result.clear();
+	type %= TYPES;
+	for (std::size_t i = 0; i < blocks.size(); i++) {
+		const Block & block = *blocks[i];
+		if (from <= block.first_ && block.last_ < to) {
+			// The whole block is in range, so its summary is enough.
+			for (std::size_t j = 0; j < block.hours_[type].size(); j++) {
+				result[block.hours_[type][j].first] += block.hours_[type][j].second;
+			}
+		}
+		else {
+			decodeRange(blocks, i, i + 1, from, to, &events);
+		}
+	}
+	for (std::size_t i = 0; i < events.size(); i++) {
+		if (events[i].type_ == type) {
+			result[hourOf(events[i].time_)]++;
+		}
+	}
+}
+
+History::BlockPtr History::encode(const std::vector<Event> & events) {
+	boost::shared_ptr<Block> block(new Block);
+	block->first_ = block->last_ = events.front().time_;
+	block->count_ = events.size();
+	std::vector<uint8_t> times, types;
+	int64_t prevDelta = 0;
+	for (std::size_t i = 0; i < events.size(); i++) {
+		block->first_ = std::min(block->first_, events[i].time_);
+		block->last_ = std::max(block->last_, events[i].time_);
+		if (i > 0) {
+			int64_t delta = events[i].time_ - events[i - 1].time_;
+			putVarint(times, zigzag(delta - prevDelta));
+			prevDelta = delta;
+		}
+	}
+	for (std::size_t i = 0; i < events.size(); ) {
+		std::size_t run = 1;
+		while (i + run < events.size() && events[i + run].type_ == events[i].type_) {
+			run++;
+		}
+		types.push_back(events[i].type_);
+		putVarint(types, run);
+		i += run;
+	}
+	// Layout: first timestamp, size of the timestamp section, timestamps, type runs.
+	putVarint(block->data_, zigzag(events.front().time_));
+	putVarint(block->data_, times.size());
+	block->data_.insert(block->data_.end(), times.begin(), times.end());
+	block->data_.insert(block->data_.end(), types.begin(), types.end());
+	summarize(*block, events);
+	return block;
+}
+
+void History::decode(const Block & block, std::vector<Event> & result) {
+	const uint8_t * p = block.data_.data(), * end = p + block.data_.size();
+	int64_t time = unzigzag(getVarint(p, end));
+	std::size_t timesSize = getVarint(p, end);
+	const uint8_t * types = std::min(p + timesSize, end);
+	std::size_t base = result.size();
+	result.resize(base + block.count_);
+	int64_t delta = 0;
+	for (std::size_t i = 0; i < block.count_; i++) {
+		if (i > 0) {
+			delta += unzigzag(getVarint(p, types));
+			time += delta;
+		}
+		result[base + i].time_ = time;
+	}
+	for (std::size_t i = 0; i < block.count_ && types != end; ) {
+		uint8_t type = *types++;
+		std::size_t run = std::min<uint64_t>(getVarint(types, end), block.count_ - i);
+		for (std::size_t j = 0; j < run; j++) {
+			result[base + i + j].type_ = type;
+		}
+		i += run;
+	}
+}
+
+void History::summarize(Block & block, const std::vector<Event> & events) {
+	std::map<int64_t, uint32_t> hours[TYPES];
+	for (std::size_t i = 0; i < events.size(); i++) {
+		hours[events[i].type_ % TYPES][hourOf(events[i].time_)]++;
+	}
+	for (unsigned int type = 0; type < TYPES; type++) {
+		block.hours_[type].assign(hours[type].begin(), hours[type].end());
+	}
+}
+
+void History::decodeRange(const std::vector<BlockPtr> & blocks, std::size_t begin, std::size_t end, int64_t from, int64_t to, std::vector<Event> * result) {
+	std::vector<Event> events;
+	for (std::size_t i = begin; i < end; i++) {
+		events.clear();
+		decode(*blocks[i], events);
+		for (std::size_t j = 0; j < events.size(); j++) {
+			if (from <= events[j].time_ && events[j].time_ < to) {
+				result->push_back(events[j]);
+			}
+		}
+	}
+}
+
+void History::decodePart(const std::vector<BlockPtr> & blocks, std::size_t begin, std::size_t end, int64_t from, int64_t to, std::vector<Event> * result, Join * join) {
+	decodeRange(blocks, begin, end, from, to, result);
+	boost::mutex::scoped_lock lock(join->mutex_);
+	if (--join->left_ == 0) {
+		join->done_.notify_all();
+	}
+}
+
+void History::load() {
+	std::ifstream file(path_.c_str(), std::ios::binary);
+	std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	std::size_t pos = 0;
+	std::vector<Event> events;
+	// Record: magic, size, checksum, then first, last, count and the encoded data.
+	while (data.size() - pos >= 12 && std::memcmp(&data[pos], BLOCK_MAGIC, 4) == 0) {
+		uint32_t size, sum;
+		std::memcpy(&size, &data[pos + 4], 4);
+		std::memcpy(&sum, &data[pos + 8], 4);
+		if (size < 20 || data.size() - pos - 12 < size || checksum(&data[pos + 12], size) != sum) {
+			break;
+		}
+		boost::shared_ptr<Block> block(new Block);
+		std::memcpy(&block->first_, &data[pos + 12], 8);
+		std::memcpy(&block->last_, &data[pos + 20], 8);
+		std::memcpy(&block->count_, &data[pos + 28], 4);
+		block->data_.assign(data.begin() + pos + 32, data.begin() + pos + 12 + size);
+		events.clear();
+		decode(*block, events);
+		summarize(*block, events);
+		blocks_.push_back(block);
+		pos += 12 + size;
+	}
+	if (pos != data.size()) {
+		// Drop a torn block at the end, so the next one is appended after valid data.
+		::truncate(path_.c_str(), pos);
+	}
+}
+
+void History::sealLocked() {
+	if (open_.empty()) {
+		return;
+	}
+	BlockPtr block(encode(open_));
+	open_.clear();
+	// Keep the blocks sorted, in case the clock went backwards.
+	std::vector<BlockPtr>::iterator pos = blocks_.end();
+	while (pos != blocks_.begin() && (*(pos - 1))->first_ > block->first_) {
+		--pos;
+	}
+	blocks_.insert(pos, block);
+	if (fd_ >= 0) {
+		uint32_t size = 20 + block->data_.size();
+		std::vector<uint8_t> record(12 + size);
+		std::memcpy(&record[0], BLOCK_MAGIC, 4);
+		std::memcpy(&record[4], &size, 4);
+		std::memcpy(&record[12], &block->first_, 8);
+		std::memcpy(&record[20], &block->last_, 8);
+		std::memcpy(&record[28], &block->count_, 4);
+		std::copy(block->data_.begin(), block->data_.end(), record.begin() + 32);
+		uint32_t sum = checksum(&record[12], size);
+		std::memcpy(&record[8], &sum, 4);
+		if (::write(fd_, record.data(), record.size()) != ssize_t(record.size())) {
+			// The block stays in memory; a torn record is dropped on the next load.
+		}
+	}
+}
+
+void History::snapshot(int64_t from, int64_t to, std::vector<BlockPtr> & blocks, std::vector<Event> & open) const {
+	boost::mutex::scoped_lock lock(mutex_);
+	// Blocks are sorted by their first event, and don't overlap unless the clock went backwards.
+	// So start from the first block beginning in range, and step back over the ones that reach into it.
+	std::size_t begin = std::lower_bound(blocks_.begin(), blocks_.end(), from, FirstBefore()) - blocks_.begin();
+	while (begin > 0 && blocks_[begin - 1]->last_ >= from) {
+		begin--;
+	}
+	for (std::size_t i = begin; i < blocks_.size() && blocks_[i]->first_ < to; i++) {
+		if (blocks_[i]->last_ >= from) {
+			blocks.push_back(blocks_[i]);
+		}
+	}
+	for (std::size_t i = 0; i < open_.size(); i++) {
+		if (from <= open_[i].time_ && open_[i].time_ < to) {
+			open.push_back(open_[i]);
+		}
+	}
+}
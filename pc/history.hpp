@@ -0,0 +1,92 @@
+#ifndef HISTORY_HPP
+#define HISTORY_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/asio/io_service.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+// Time-indexed history of sensor events.
+// Events are collected into blocks of up to BLOCK_EVENTS. A sealed block is compressed (timestamps
+// delta-of-delta encoded, event types run-length encoded), appended to the data file and kept in memory
+// together with its time range and per-hour counts. Queries only decode the blocks that a range cuts
+// through; large ranges are decoded in parallel, by a fixed pool of threads that the querying thread joins in.
+// Thread-safe.
+class History {
+public:
+	enum {
+		BLOCK_EVENTS = 4096,
+		TYPES = 8 // Event types are 0 .. TYPES-1
+	};
+
+	struct Event {
+		int64_t time_; // ms since the epoch
+		uint8_t type_;
+	};
+
+	typedef std::map<int64_t, uint64_t> Counts; // Hour (ms since the epoch) -> number of events
+
+	History(const std::string & path, unsigned int threads); // Empty path: kept in memory only. threads decode in parallel.
+	~History();
+
+	void append(int64_t time, uint8_t type) { append(time, time, type, 1); }
+	// A batch of count events, the first and last at those times and the rest evenly between them.
+	void append(int64_t first, int64_t last, uint8_t type, uint32_t count);
+	void seal(int64_t olderThan); // Seals the open block if its first event is older than the given time
+
+	// Events with from <= time < to, in order, but only the first max of them. False if there were more.
+	bool events(int64_t from, int64_t to, std::size_t max, std::vector<Event> & result) const;
+	// Per-hour counts of one event type, for events with from <= time < to.
+	void hourlyCounts(int64_t from, int64_t to, uint8_t type, Counts & result) const;
+private:
+	enum {
+		HOUR = 3600 * 1000,
+		PARALLEL_BLOCKS = 16 // Decode in parallel when a query needs at least this many blocks
+	};
+
+	struct Block {
+		int64_t first_, last_;
+		uint32_t count_;
+		std::vector<uint8_t> data_;
+		std::vector< std::pair<int64_t, uint32_t> > hours_[TYPES]; // Per-hour counts, by type
+	};
+	typedef boost::shared_ptr<const Block> BlockPtr;
+
+	// The parts of a query that the pool decodes, until they're done
+	struct Join {
+		boost::mutex mutex_;
+		boost::condition_variable done_;
+		std::size_t left_;
+	};
+
+	History(const History &);
+	History & operator=(const History &);
+
+	static BlockPtr encode(const std::vector<Event> & events);
+	static void decode(const Block & block, std::vector<Event> & result);
+	static void summarize(Block & block, const std::vector<Event> & events);
+	static void decodeRange(const std::vector<BlockPtr> & blocks, std::size_t begin, std::size_t end, int64_t from, int64_t to, std::vector<Event> * result);
+	static void decodePart(const std::vector<BlockPtr> & blocks, std::size_t begin, std::size_t end, int64_t from, int64_t to, std::vector<Event> * result, Join * join);
+	void load();
+	void sealLocked();
+	// The blocks overlapping [from, to), and a copy of the matching events of the open block.
+	void snapshot(int64_t from, int64_t to, std::vector<BlockPtr> & blocks, std::vector<Event> & open) const;
+
+	std::string path_;
+	int fd_;
+	mutable boost::mutex mutex_;
+	std::vector<BlockPtr> blocks_; // Sorted by time
+	std::vector<Event> open_;
+	unsigned int threads_;
+	mutable boost::asio::io_service pool_;
+	boost::scoped_ptr<boost::asio::io_service::work> poolWork_;
+	boost::thread_group workers_;
+};
+
+#endif
@@ -0,0 +1,66 @@
+#include <iostream>
+#include <string>
+#include "history.hpp"
+
+// Checks of History that don't need pc_sw running. Exit status 1 if any fails.
+
+namespace {
+	const int64_t HOUR = 3600 * 1000;
+	const int64_t BASE = 1792278000LL * 1000; // On the hour
+	const uint8_t MOTION = 2, SMOKE_ON = 0;
+	int failures = 0;
+
+	void check(bool ok, const std::string & what) {
+		if (!ok) {
+			std::cerr << "FAILED: " << what << std::endl;
+			failures++;
+		}
+	}
+
+	uint64_t total(const History::Counts & counts) {
+		uint64_t sum = 0;
+		for (History::Counts::const_iterator it = counts.begin(); it != counts.end(); ++it) {
+			sum += it->second;
+		}
+		return sum;
+	}
+
+	// A batch of n motion events adds n to the hourly counts, in the open block and once it's sealed.
+	void batchCounts() {
+		History history("", 1);
+		history.append(BASE + 1000, MOTION);
+		history.append(BASE + 2000, BASE + 60000, MOTION, 50);
+		History::Counts counts;
+		history.hourlyCounts(BASE, BASE + HOUR, MOTION, counts);
+		check(counts[BASE] == 51, "a batch of 50 counts 50");
+		history.seal(BASE + 2 * HOUR);
+		history.hourlyCounts(BASE, BASE + HOUR, MOTION, counts);
+		check(counts[BASE] == 51, "a sealed batch of 50 counts 50");
+		history.hourlyCounts(BASE, BASE + HOUR, SMOKE_ON, counts);
+		check(total(counts) == 0, "a motion batch counts no other type");
+	}
+
+	// The events of a batch are spread over its time: the first and last at theirs, across hours and blocks.
+	void batchSpread() {
+		History history("", 2);
+		uint32_t n = 3 * History::BLOCK_EVENTS + 7;
+		history.append(BASE + HOUR / 2, BASE + 2 * HOUR + HOUR / 2, MOTION, n);
+		History::Counts counts;
+		history.hourlyCounts(BASE, BASE + 3 * HOUR, MOTION, counts);
+		check(total(counts) == n, "a batch spanning blocks counts every event");
+		check(counts.size() == 3 && counts[BASE] > 0 && counts[BASE + HOUR] > 0 && counts[BASE + 2 * HOUR] > 0, "a batch over three hours counts in each");
+		std::vector<History::Event> events;
+		history.events(BASE, BASE + 3 * HOUR, n, events);
+		check(events.size() == n && events.front().time_ == BASE + HOUR / 2 && events.back().time_ == BASE + 2 * HOUR + HOUR / 2, "a batch starts and ends at its times");
+	}
+}
+
+int main() {
+	batchCounts();
+	batchSpread();
+	if (failures) {
+		return 1;
+	}
+	std::cout << "history: ok" << std::endl;
+	return 0;
+}
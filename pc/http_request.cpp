@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include "http_request.hpp"
+
+HttpRequest::HttpRequest() {
+	reset();
+}
+
+void HttpRequest::reset() {
+	state_ = REQUEST_LINE;
+	line_.clear();
+	headerCount_ = 0;
+	bodyLeft_ = 0;
+	method_.clear();
+	path_.clear();
+	params_.clear();
+	headers_.clear();
+	keepAlive_ = true;
+}
+
+HttpRequest::Result HttpRequest::feed(const uint8_t * data, std::size_t size, std::size_t & consumed) {
+	consumed = 0;
+	while (consumed < size && state_ != DONE) {
+		if (state_ == BODY) {
+			std::size_t n = std::min(size - consumed, bodyLeft_);
+			consumed += n;
+			bodyLeft_ -= n;
+			if (bodyLeft_ == 0) {
+				state_ = DONE;
+			}
+			continue;
+		}
+		uint8_t c = data[consumed++];
+		if (c != '\n') {
+			if (line_.size() >= LINE_LEN_MAX) {
+				return BAD;
+			}
+			line_ += char(c);
+			continue;
+		}
+		if (!line_.empty() && line_[line_.size() - 1] == '\r') {
+			line_.erase(line_.size() - 1);
+		}
+		std::string line;
+		line.swap(line_);
+		if (state_ == REQUEST_LINE) {
+			if (line.empty()) {
+				// Stray CRLFs between requests are allowed.
+				continue;
+			}
+			if (!parseRequestLine(line)) {
+				return BAD;
+			}
+			state_ = HEADERS;
+		}
+		else if (!line.empty()) {
+			if (++headerCount_ > HEADERS_MAX || !parseHeader(line)) {
+				return BAD;
+			}
+		}
+		else {
+			state_ = bodyLeft_ ? BODY : DONE;
+		}
+	}
+	return state_ == DONE ? COMPLETE : INCOMPLETE;
+}
+
+std::string HttpRequest::param(const std::string & name) const {
+	std::map<std::string, std::string>::const_iterator it = params_.find(name);
+	return it == params_.end() ? std::string() : it->second;
+}
+
+std::string HttpRequest::header(const std::string & name) const {
+	std::map<std::string, std::string>::const_iterator it = headers_.find(name);
+	return it == headers_.end() ? std::string() : it->second;
+}
+
+std::string HttpRequest::urlDecode(const std::string & str) {
+	std::string result;
+	for (std::size_t i = 0; i < str.size(); i++) {
+		if (str[i] == '+') {
+			result += ' ';
+		}
+		else if (str[i] == '%' && i + 2 < str.size() && std::isxdigit(str[i + 1]) && std::isxdigit(str[i + 2])) {
+			result += char(std::strtoul(str.substr(i + 1, 2).c_str(), 0, 16));
+			i += 2;
+		}
+		else {
+			result += str[i];
+		}
+	}
+	return result;
+}
+
+bool HttpRequest::parseRequestLine(const std::string & line) {
+	// "<method> <target> HTTP/1.<minor>"
+	std::string::size_type space1 = line.find(' '), space2 = line.rfind(' ');
+	if (space1 == std::string::npos || space1 == space2) {
+		return false;
+	}
+	std::string version(line.substr(space2 + 1));
+	if (version.compare(0, 7, "HTTP/1.") != 0) {
+		return false;
+	}
+	keepAlive_ = (version != "HTTP/1.0");
+	method_ = line.substr(0, space1);
+	std::string target(line.substr(space1 + 1, space2 - space1 - 1));
+	std::string::size_type question = target.find('?');
+	path_ = urlDecode(target.substr(0, question));
+	if (question != std::string::npos) {
+		std::string query(target.substr(question + 1));
+		std::string::size_type begin = 0;
+		while (begin <= query.size()) {
+			std::string::size_type end = query.find('&', begin);
+			if (end == std::string::npos) {
+				end = query.size();
+			}
+			std::string pair(query.substr(begin, end - begin));
+			std::string::size_type eq = pair.find('=');
+			if (!pair.empty()) {
+				params_[urlDecode(pair.substr(0, eq))] = (eq == std::string::npos ? std::string() : urlDecode(pair.substr(eq + 1)));
+			}
+			begin = end + 1;
+		}
+	}
+	return true;
+}
+
+bool HttpRequest::parseHeader(const std::string & line) {
+	std::string::size_type colon = line.find(':');
+	if (colon == std::string::npos) {
+		return false;
+	}
+	std::string name(line.substr(0, colon)), value(line.substr(colon + 1));
+	std::string::size_type begin = value.find_first_not_of(" \t"), end = value.find_last_not_of(" \t");
+	value = (begin == std::string::npos ? std::string() : value.substr(begin, end - begin + 1));
+	for (std::string::iterator it = name.begin(); it != name.end(); ++it) {
+		*it = std::tolower(*it);
+	}
+	headers_[name] = value;
+	for (std::string::iterator it = value.begin(); it != value.end(); ++it) {
+		*it = std::tolower(*it);
+	}
+	if (name == "content-length") {
+		bodyLeft_ = std::strtoul(value.c_str(), 0, 10);
+	}
+	else if (name == "transfer-encoding") {
+		// Nothing here takes a body; a chunked one couldn't even be skipped.
+		return false;
+	}
+	else if (name == "connection") {
+		if (value.find("close") != std::string::npos) {
+			keepAlive_ = false;
+		}
+		else if (value.find("keep-alive") != std::string::npos) {
+			keepAlive_ = true;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,58 @@
+#ifndef HTTP_REQUEST_HPP
+#define HTTP_REQUEST_HPP
+
+#include <map>
+#include <string>
+#include <stdint.h>
+
+// Push-style parser of HTTP/1.x requests. Bytes are fed in as they arrive; a request is complete once its
+// headers (and the Content-Length body, which is skipped) are in. Only what the front end needs is kept:
+// the method, the path, the query parameters, the headers and whether the connection stays open.
+class HttpRequest {
+public:
+	enum Result {
+		INCOMPLETE,
+		COMPLETE,
+		BAD
+	};
+
+	enum {
+		LINE_LEN_MAX = 8192,
+		HEADERS_MAX = 64 // Lines
+	};
+
+	HttpRequest();
+	// Consumes bytes up to the end of a request at most; consumed tells how many.
+	// After COMPLETE or BAD, reset before feeding the next request.
+	Result feed(const uint8_t * data, std::size_t size, std::size_t & consumed);
+	void reset();
+
+	const std::string & method() const { return method_; }
+	const std::string & path() const { return path_; } // Decoded, without the query
+	std::string param(const std::string & name) const; // Decoded; empty if not there
+	bool hasParam(const std::string & name) const { return params_.count(name) != 0; }
+	std::string header(const std::string & name) const; // Name in lower case; empty if not there
+	bool keepAlive() const { return keepAlive_; }
+
+	static std::string urlDecode(const std::string & str);
+private:
+	enum State {
+		REQUEST_LINE,
+		HEADERS,
+		BODY,
+		DONE
+	};
+
+	bool parseRequestLine(const std::string & line);
+	bool parseHeader(const std::string & line);
+
+	State state_;
+	std::string line_;
+	std::size_t headerCount_;
+	std::size_t bodyLeft_;
+	std::string method_, path_;
+	std::map<std::string, std::string> params_, headers_;
+	bool keepAlive_;
+};
+
+#endif
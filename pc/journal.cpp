@@ -0,0 +1,288 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/crc.hpp>
+#include "journal.hpp"
+
+namespace {
+	const char JOURNAL_MAGIC[4] = { 'P', 'C', 'J', '1' };
+	const char SNAPSHOT_MAGIC[4] = { 'P', 'C', 'S', '2' };
+	const char SNAPSHOT_MAGIC_1[4] = { 'P', 'C', 'S', '1' }; // Without the offset
+
+	uint32_t checksum(const void * data, std::size_t size) {
+		boost::crc_32_type crc;
+		crc.process_bytes(data, size);
+		return crc.checksum();
+	}
+
+	void fsyncPath(const std::string & path) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd >= 0) {
+			::fsync(fd);
+			::close(fd);
+		}
+	}
+
+	std::string dirName(const std::string & path) {
+		std::string::size_type slash = path.rfind('/');
+		return slash == std::string::npos ? "." : path.substr(0, slash + 1);
+	}
+}
+
+Journal::Journal(const std::string & path)
+	:	path_(path + ".journal"),
+		snapshotPath_(path + ".snapshot"),
+		fd_(-1),
+		map_(),
+		mapSize_(),
+		end_(HEADER_SIZE),
+		syncedTo_(HEADER_SIZE),
+		records_(),
+		generation_() {
+	fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd_ < 0) {
+		throw std::runtime_error("cannot open " + path_);
+	}
+	struct stat st;
+	if (::fstat(fd_, &st) != 0) {
+		::close(fd_);
+		throw std::runtime_error("cannot stat " + path_);
+	}
+	std::size_t size = std::max<std::size_t>(CHUNK_SIZE, st.st_size);
+	if (std::size_t(st.st_size) < size && ::ftruncate(fd_, size) != 0) {
+		::close(fd_);
+		throw std::runtime_error("cannot grow " + path_);
+	}
+	map(size);
+}
+
+Journal::~Journal() {
+	syncLocked();
+	unmap();
+	::close(fd_);
+}
+
+void Journal::replay(boost::function<void(const std::string & snapshot)> onSnapshot, boost::function<void(const std::string & record)> onRecord) {
+	// The snapshot decides which journal generation is valid.
+	// Layout: magic, generation, checksum (of the rest), offset, state. The offset is where the snapshot's
+	// records start in the journal of the previous generation; 0 for none, as in PCS1 snapshots.
+	std::ifstream file(snapshotPath_.c_str(), std::ios::binary);
+	std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	uint64_t snapshotGeneration = 0, offset = 0;
+	bool hasOffset = (data.size() >= 24 && std::memcmp(data.data(), SNAPSHOT_MAGIC, 4) == 0);
+	if (hasOffset || (data.size() >= 16 && std::memcmp(data.data(), SNAPSHOT_MAGIC_1, 4) == 0)) {
+		uint64_t generation;
+		uint32_t sum;
+		std::memcpy(&generation, data.data() + 4, 8);
+		std::memcpy(&sum, data.data() + 12, 4);
+		if (checksum(data.data() + 16, data.size() - 16) == sum) {
+			if (hasOffset) {
+				std::memcpy(&offset, data.data() + 16, 8);
+			}
+			snapshotGeneration = generation;
+			onSnapshot(data.substr(hasOffset ? 24 : 16));
+		}
+	}
+
+	uint64_t generation;
+	std::memcpy(&generation, map_ + 8, 8);
+	if (std::memcmp(map_, JOURNAL_MAGIC, 4) == 0 && generation == snapshotGeneration) {
+		end_ = HEADER_SIZE;
+	}
+	else if (std::memcmp(map_, JOURNAL_MAGIC, 4) == 0 && offset >= HEADER_SIZE && offset <= mapSize_ && generation + 1 == snapshotGeneration) {
+		// The snapshot was written, but not the journal after it. Its records are still in this one.
+		end_ = offset;
+	}
+	else {
+		// Not written after this snapshot (or not written at all).
+		reset(snapshotGeneration);
+		return;
+	}
+	generation_ = generation;
+	records_ = 0;
+	while (end_ + RECORD_HEADER_SIZE <= mapSize_) {
+		uint32_t size, sum;
+		std::memcpy(&size, map_ + end_, 4);
+		std::memcpy(&sum, map_ + end_ + 4, 4);
+		const uint8_t * record = map_ + end_ + RECORD_HEADER_SIZE;
+		if (size == 0 || size > mapSize_ - end_ - RECORD_HEADER_SIZE || checksum(record, size) != sum) {
+			break;
+		}
+		onRecord(std::string(record, record + size));
+		end_ += RECORD_HEADER_SIZE + size;
+		records_++;
+	}
+	syncedTo_ = end_;
+	// Anything after end_ is a torn record; clear it, so it can't merge with the next one.
+	std::memset(map_ + end_, 0, std::min<std::size_t>(mapSize_ - end_, RECORD_HEADER_SIZE));
+}
+
+void Journal::append(const std::string & record) {
+	boost::mutex::scoped_lock lock(mutex_);
+	std::size_t need = RECORD_HEADER_SIZE + record.size();
+	if (end_ + need + RECORD_HEADER_SIZE > mapSize_) {
+		// Grow before the old mapping is dropped, so nothing appended so far is lost.
+		std::size_t size = mapSize_;
+		while (end_ + need + RECORD_HEADER_SIZE > size) {
+			size += CHUNK_SIZE;
+		}
+		syncLocked();
+		unmap();
+		if (::ftruncate(fd_, size) != 0) {
+			throw std::runtime_error("cannot grow " + path_);
+		}
+		map(size);
+	}
+	uint32_t size = record.size(), sum = checksum(record.data(), record.size());
+	std::memcpy(map_ + end_, &size, 4);
+	std::memcpy(map_ + end_ + 4, &sum, 4);
+	std::memcpy(map_ + end_ + RECORD_HEADER_SIZE, record.data(), record.size());
+	end_ += need;
+	records_++;
+}
+
+void Journal::sync() {
+	boost::mutex::scoped_lock lock(mutex_);
+	syncLocked();
+}
+
+bool Journal::isDirty() const {
+	boost::mutex::scoped_lock lock(mutex_);
+	return end_ > syncedTo_;
+}
+
+std::size_t Journal::records() const {
+	boost::mutex::scoped_lock lock(mutex_);
+	return records_;
+}
+
+Journal::Mark Journal::mark() const {
+	boost::mutex::scoped_lock lock(mutex_);
+	Mark mark = { generation_, end_, records_ };
+	return mark;
+}
+
+void Journal::syncLocked() {
+	if (end_ > syncedTo_) {
+		std::size_t page = ::sysconf(_SC_PAGESIZE), from = syncedTo_ / page * page;
+		::msync(map_ + from, end_ - from, MS_SYNC);
+		syncedTo_ = end_;
+	}
+}
+
+void Journal::snapshot(const std::string & state, const Mark & mark) {
+	// Nothing here needs the lock but the copying of the records after the mark, and the switch to the new
+	// journal; so appends go on while the files are written and synced.
+	std::string tmpPath(snapshotPath_ + ".tmp");
+	uint64_t generation = mark.generation_ + 1, offset = mark.end_;
+	std::string data(reinterpret_cast<const char *>(&offset), 8);
+	data += state;
+	uint32_t sum = checksum(data.data(), data.size());
+	{
+		std::ofstream file(tmpPath.c_str(), std::ios::binary | std::ios::trunc);
+		file.write(SNAPSHOT_MAGIC, 4);
+		file.write(reinterpret_cast<const char *>(&generation), 8);
+		file.write(reinterpret_cast<const char *>(&sum), 4);
+		file.write(data.data(), data.size());
+		if (!file.flush()) {
+			throw std::runtime_error("cannot write " + tmpPath);
+		}
+	}
+	fsyncPath(tmpPath);
+	if (::rename(tmpPath.c_str(), snapshotPath_.c_str()) != 0) {
+		throw std::runtime_error("cannot rename " + tmpPath);
+	}
+	fsyncPath(dirName(snapshotPath_));
+	// From here on the old journal is only read from the offset. The new one starts with the records after
+	// it, and replaces the old one by a rename, so that it's there whole or not at all.
+	std::vector<uint8_t> carried;
+	std::size_t copiedTo;
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (generation_ != mark.generation_) {
+			throw std::logic_error("concurrent snapshots of " + path_);
+		}
+		carried.assign(map_ + mark.end_, map_ + end_);
+		copiedTo = end_;
+	}
+	tmpPath = path_ + ".tmp";
+	int fd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		throw std::runtime_error("cannot open " + tmpPath);
+	}
+	uint8_t header[HEADER_SIZE] = { };
+	std::memcpy(header, JOURNAL_MAGIC, 4);
+	std::memcpy(header + 8, &generation, 8);
+	std::size_t size = (HEADER_SIZE + carried.size() + RECORD_HEADER_SIZE) / CHUNK_SIZE * CHUNK_SIZE + CHUNK_SIZE;
+	if (::ftruncate(fd, size) != 0
+			|| ::pwrite(fd, header, HEADER_SIZE, 0) != HEADER_SIZE
+			|| ::pwrite(fd, carried.data(), carried.size(), HEADER_SIZE) != ssize_t(carried.size())
+			|| ::fsync(fd) != 0) {
+		::close(fd);
+		throw std::runtime_error("cannot write " + tmpPath);
+	}
+	boost::mutex::scoped_lock lock(mutex_);
+	// What was appended meanwhile goes in the new map, to be synced as if just appended.
+	std::vector<uint8_t> more(map_ + copiedTo, map_ + end_);
+	std::size_t newEnd = HEADER_SIZE + carried.size() + more.size();
+	if (newEnd + RECORD_HEADER_SIZE > size) {
+		size = (newEnd + RECORD_HEADER_SIZE) / CHUNK_SIZE * CHUNK_SIZE + CHUNK_SIZE;
+		if (::ftruncate(fd, size) != 0) {
+			::close(fd);
+			throw std::runtime_error("cannot grow " + tmpPath);
+		}
+	}
+	if (::rename(tmpPath.c_str(), path_.c_str()) != 0) {
+		::close(fd);
+		throw std::runtime_error("cannot rename " + tmpPath);
+	}
+	unmap();
+	::close(fd_);
+	fd_ = fd;
+	map(size);
+	std::copy(more.begin(), more.end(), map_ + HEADER_SIZE + carried.size());
+	generation_ = generation;
+	syncedTo_ = HEADER_SIZE + carried.size();
+	end_ = newEnd;
+	records_ -= mark.records_;
+	lock.unlock();
+	fsyncPath(dirName(path_));
+	sync();
+}
+
+void Journal::map(std::size_t size) {
+	void * ptr = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+	if (ptr == MAP_FAILED) {
+		throw std::runtime_error("cannot map " + path_);
+	}
+	map_ = static_cast<uint8_t *>(ptr);
+	mapSize_ = size;
+}
+
+void Journal::unmap() {
+	if (map_) {
+		::munmap(map_, mapSize_);
+		map_ = NULL;
+	}
+}
+
+void Journal::reset(uint64_t generation) {
+	// Truncating zero-fills the file, so no stale record survives past the new end.
+	unmap();
+	if (::ftruncate(fd_, 0) != 0 || ::ftruncate(fd_, CHUNK_SIZE) != 0) {
+		throw std::runtime_error("cannot truncate " + path_);
+	}
+	map(CHUNK_SIZE);
+	std::memcpy(map_, JOURNAL_MAGIC, 4);
+	std::memcpy(map_ + 8, &generation, 8);
+	::msync(map_, HEADER_SIZE, MS_SYNC);
+	generation_ = generation;
+	end_ = syncedTo_ = HEADER_SIZE;
+	records_ = 0;
+}
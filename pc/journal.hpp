@@ -0,0 +1,62 @@
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include <string>
+#include <stdint.h>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+
+// An append-only log of records in a memory-mapped file, plus a snapshot file for compaction.
+// - Appending only copies into the map. sync() flushes everything appended since the previous sync,
+//   so the caller decides how often to pay for the disk (group commit).
+// - snapshot() atomically replaces the snapshot and starts an empty journal. Each journal belongs to
+//   one snapshot (its generation), so a crash between the two steps can't replay old records twice.
+// - Compaction can also run on another thread, while records are still appended: mark() where the state was
+//   taken, and then snapshot(state, mark). The snapshot tells where its records start in the marked journal,
+//   in case the crash comes before the records after the mark have been carried over to the next one.
+// - A torn record at the end (checksum mismatch) ends the replay.
+// Thread-safe, but only one snapshot at a time.
+class Journal {
+public:
+	struct Mark {
+		uint64_t generation_;
+		std::size_t end_, records_;
+	};
+
+	Journal(const std::string & path); // Uses path + ".journal" and path + ".snapshot"
+	~Journal();
+
+	// Calls onSnapshot with the snapshot data (if there is one), then onRecord for every valid record after it.
+	void replay(boost::function<void(const std::string & snapshot)> onSnapshot, boost::function<void(const std::string & record)> onRecord);
+	void append(const std::string & record);
+	void sync();
+	void snapshot(const std::string & state) { snapshot(state, mark()); }
+	Mark mark() const;
+	void snapshot(const std::string & state, const Mark & mark);
+
+	bool isDirty() const;
+	std::size_t records() const; // Appended since the last snapshot
+private:
+	enum {
+		HEADER_SIZE = 16,       // magic, padding, generation
+		RECORD_HEADER_SIZE = 8, // size, checksum
+		CHUNK_SIZE = 1 << 20    // The file grows by this much at a time
+	};
+
+	Journal(const Journal &);
+	Journal & operator=(const Journal &);
+
+	void map(std::size_t size);
+	void unmap();
+	void reset(uint64_t generation);
+	void syncLocked();
+
+	std::string path_, snapshotPath_;
+	mutable boost::mutex mutex_; // Of everything below
+	int fd_;
+	uint8_t * map_;
+	std::size_t mapSize_, end_, syncedTo_, records_;
+	uint64_t generation_; // Of the journal file, which is the snapshot's, or one less until a snapshot is done
+};
+
+#endif
@@ -0,0 +1,61 @@
+#include <algorithm>
+#include <vector>
+#include <boost/make_shared.hpp>
+#include "longpoll_encoder.hpp"
+
+SharedBuffer LongpollEncoder::frame(Protocol::MsgType type, const SharedBuffer & content) {
+	boost::shared_ptr<SharedBuffer::Data> message(boost::make_shared<SharedBuffer::Data>());
+	Protocol::appendMsg(*message, type, content.data(), content.size());
+	return SharedBuffer(message);
+}
+
+SharedBuffer LongpollEncoder::encode(Protocol::MsgType type, const SharedBuffer & content, AudioCodec::Type codec) {
+	if (type != Protocol::AUDIO_STREAM || codec == AudioCodec::PCM8) {
+		return frame(type, content);
+	}
+	return frame(codec == AudioCodec::MULAW ? Protocol::AUDIO_MULAW : Protocol::AUDIO_IMA_ADPCM, encodeAudio(content, codec));
+}
+
+SharedBuffer LongpollEncoder::encodeAudio(const SharedBuffer & audio, AudioCodec::Type codec) {
+	std::vector<int16_t> samples(audio.size());
+	for (std::size_t i = 0; i < audio.size(); i++) {
+		samples[i] = int16_t(int8_t(audio.data()[i]) * 256);
+	}
+	std::vector<uint8_t> encoded;
+	AudioCodec::encode(codec, samples.data(), samples.size(), encoded);
+	return SharedBuffer::copyOf(encoded.data(), encoded.size());
+}
+
+void LongpollEncoder::putMsg(GatherMessage & response, Protocol::MsgType type, const std::string & content) {
+	uint8_t header[Protocol::HEADER_SIZE];
+	std::size_t size = Protocol::putHeader(header, type, content.size());
+	response.append(header, sizeof(header));
+	response.append(content.data(), size);
+}
+
+void LongpollEncoder::putToken(GatherMessage & response, uint64_t token) {
+	std::string content;
+	Protocol::appendNumber(content, token);
+	putMsg(response, Protocol::TOKEN, content);
+}
+
+boost::shared_ptr<GatherMessage> LongpollEncoder::guiResponse(const std::string & text, uint64_t token, bool sse, boost::chrono::steady_clock::time_point origin) {
+	boost::shared_ptr<GatherMessage> msg(new GatherMessage);
+	msg->setOrigin(origin);
+	if (!sse) {
+		msg->append(text);
+		return msg;
+	}
+	std::string event("id: ");
+	Protocol::appendNumber(event, token);
+	event += '\n';
+	for (std::string::size_type begin = 0, end; begin < text.size(); begin = end + 1) {
+		end = std::min(text.find('\n', begin), text.size());
+		event += "data: ";
+		event.append(text, begin, end - begin);
+		event += '\n';
+	}
+	event += '\n';
+	msg->append(event);
+	return msg;
+}
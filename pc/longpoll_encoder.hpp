@@ -0,0 +1,31 @@
+#ifndef LONGPOLL_ENCODER_HPP
+#define LONGPOLL_ENCODER_HPP
+
+#include <string>
+#include <stdint.h>
+#include <boost/chrono.hpp>
+#include <boost/shared_ptr.hpp>
+#include "../common/audio_codec.hpp"
+#include "../common/protocol.hpp"
+#include "buffer.hpp"
+
+// How pc_sw puts its longpoll responses together, apart from the managers, so that the microbenchmarks
+// measure this very code.
+class LongpollEncoder {
+public:
+	// Sensor longpolls: one message of the protocol
+	static SharedBuffer frame(Protocol::MsgType type, const SharedBuffer & content);
+	// Audio is uploaded as PCM8, and sent in the node's codec; everything else as it is.
+	static SharedBuffer encode(Protocol::MsgType type, const SharedBuffer & content, AudioCodec::Type codec);
+	static SharedBuffer encodeAudio(const SharedBuffer & audio, AudioCodec::Type codec);
+	static void putMsg(GatherMessage & response, Protocol::MsgType type, const std::string & content);
+	static void putToken(GatherMessage & response, uint64_t token);
+
+	// GUI longpolls: the text of the lines, or with sse, the same lines as the data lines of one server-sent
+	// event, with the token as its id.
+	static boost::shared_ptr<GatherMessage> guiResponse(const std::string & text, uint64_t token, bool sse, boost::chrono::steady_clock::time_point origin = boost::chrono::steady_clock::time_point());
+private:
+	LongpollEncoder();
+};
+
+#endif
@@ -0,0 +1,126 @@
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include "metrics.hpp"
+
+namespace {
+	const std::size_t PAD = Metrics::CACHE_LINE / sizeof(boost::atomic<uint64_t>);
+}
+
+__thread unsigned int Metrics::threadNumber_ = 0;
+boost::atomic<unsigned int> Metrics::nextThread_(0);
+
+Metrics::Metrics() : used_(0) {
+	for (std::size_t i = 0; i <= SHARDS; i++) {
+		boost::atomic<uint64_t> * cells = new boost::atomic<uint64_t>[PAD + SLOTS + PAD];
+		for (std::size_t j = 0; j < PAD + SLOTS + PAD; j++) {
+			cells[j].store(0, boost::memory_order_relaxed);
+		}
+		shards_[i] = cells + PAD;
+	}
+}
+
+Metrics::~Metrics() {
+	for (std::size_t i = 0; i <= SHARDS; i++) {
+		delete[] (shards_[i] - PAD);
+	}
+}
+
+uint64_t Metrics::Histogram::lowerBound(std::size_t bucket) {
+	if (bucket < SUB_BUCKETS) {
+		return bucket;
+	}
+	unsigned int bits = bucket / SUB_BUCKETS + SUB_BITS - 1;
+	return uint64_t(SUB_BUCKETS + bucket % SUB_BUCKETS) << (bits - SUB_BITS);
+}
+
+Metrics::Counter Metrics::counter(const std::string & name, const std::string & help, const std::string & labels) {
+	return Counter(this, allocate(COUNTER, name, help, labels, 1, 1));
+}
+
+Metrics::Gauge Metrics::gauge(const std::string & name, const std::string & help, const std::string & labels) {
+	return Gauge(this, allocate(GAUGE, name, help, labels, 1, 1));
+}
+
+Metrics::Histogram Metrics::histogram(const std::string & name, const std::string & help, double unit, const std::string & labels) {
+	return Histogram(this, allocate(HISTOGRAM, name, help, labels, Histogram::BUCKETS + 2, unit));
+}
+
+std::size_t Metrics::allocate(Kind kind, const std::string & name, const std::string & help, const std::string & labels, std::size_t slots, double unit) {
+	if (SLOTS - used_ < slots) {
+		throw std::runtime_error("too many metrics");
+	}
+	Entry entry;
+	entry.kind_ = kind;
+	entry.name_ = name;
+	entry.help_ = help;
+	entry.labels_ = labels;
+	entry.slot_ = used_;
+	entry.unit_ = unit;
+	entries_.push_back(entry);
+	used_ += slots;
+	return entry.slot_;
+}
+
+uint64_t Metrics::sum(std::size_t slot) const {
+	uint64_t total = 0;
+	for (std::size_t i = 0; i <= SHARDS; i++) {
+		total += shards_[i][slot].load(boost::memory_order_relaxed);
+	}
+	return total;
+}
+
+std::string Metrics::render() const {
+	// The metrics of one name go together, under one HELP and TYPE, in the order they were first registered.
+	std::string out;
+	std::set<std::string> done;
+	for (std::vector<Entry>::const_iterator first = entries_.begin(); first != entries_.end(); ++first) {
+		if (!done.insert(first->name_).second) {
+			continue;
+		}
+		const char * type = (first->kind_ == COUNTER ? "counter" : first->kind_ == GAUGE ? "gauge" : "histogram");
+		out += "# HELP " + first->name_ + ' ' + first->help_ + '\n';
+		out += "# TYPE " + first->name_ + ' ' + type + '\n';
+		for (std::vector<Entry>::const_iterator it = first; it != entries_.end(); ++it) {
+			if (it->name_ != first->name_) {
+				continue;
+			}
+			if (it->kind_ == HISTOGRAM) {
+				renderHistogram(out, *it);
+				continue;
+			}
+			std::ostringstream line;
+			line << it->name_;
+			if (!it->labels_.empty()) {
+				line << '{' << it->labels_ << '}';
+			}
+			if (it->kind_ == GAUGE) {
+				line << ' ' << int64_t(sum(it->slot_)) << '\n';
+			}
+			else {
+				line << ' ' << sum(it->slot_) << '\n';
+			}
+			out += line.str();
+		}
+	}
+	return out;
+}
+
+void Metrics::renderHistogram(std::string & out, const Entry & entry) const {
+	// Cumulative counts at the upper bound of every bucket. Values are truncated, so that the ones in a bucket
+	// are all less than its upper bound, as Prometheus' "le" has it.
+	std::string labels(entry.labels_.empty() ? "" : entry.labels_ + ',');
+	std::ostringstream lines;
+	lines.precision(9);
+	uint64_t count = 0;
+	for (std::size_t bucket = 0; bucket < Histogram::BUCKETS; bucket++) {
+		count += sum(entry.slot_ + bucket);
+		lines << entry.name_ << "_bucket{" << labels << "le=\"" << double(Histogram::lowerBound(bucket + 1)) * entry.unit_ << "\"} " << count << '\n';
+	}
+	count += sum(entry.slot_ + Histogram::BUCKETS);
+	lines << entry.name_ << "_bucket{" << labels << "le=\"+Inf\"} " << count << '\n';
+	std::string suffix(entry.labels_.empty() ? "" : '{' + entry.labels_ + '}');
+	lines << entry.name_ << "_sum" << suffix << ' ' << double(sum(entry.slot_ + Histogram::BUCKETS + 1)) * entry.unit_ << '\n';
+	lines << entry.name_ << "_count" << suffix << ' ' << count << '\n';
+	out += lines.str();
+}
@@ -0,0 +1,133 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/atomic.hpp>
+
+// Counters, gauges and histograms that any thread can update without locks or allocation, rendered in the
+// Prometheus text format. The first SHARDS threads to record anything get a shard of cells each, which only
+// they write, so they neither fight over cache lines nor need atomic adds. Any threads after them share one
+// more shard, with atomic adds. Reading adds up the shards. The handles are small and copyable.
+// Metrics are registered before the threads start, and live as long as the registry.
+class Metrics {
+public:
+	enum {
+		SHARDS = 16, // Of single threads; more threads than that share the overflow shard
+		SLOTS = 1024, // Cells per shard; a counter or gauge takes one, a histogram BUCKETS + 2
+		CACHE_LINE = 64
+	};
+
+	class Counter {
+	public:
+		void add(uint64_t n = 1) { metrics_->add(slot_, n); }
+		uint64_t value() const { return metrics_->sum(slot_); }
+	private:
+		friend class Metrics;
+		Counter(Metrics * metrics, std::size_t slot) : metrics_(metrics), slot_(slot) { }
+		Metrics * metrics_;
+		std::size_t slot_;
+	};
+
+	class Gauge {
+	public:
+		void add(int64_t n) { metrics_->add(slot_, uint64_t(n)); }
+		int64_t value() const { return int64_t(metrics_->sum(slot_)); }
+	private:
+		friend class Metrics;
+		Gauge(Metrics * metrics, std::size_t slot) : metrics_(metrics), slot_(slot) { }
+		Metrics * metrics_;
+		std::size_t slot_;
+	};
+
+	// Log-linear buckets, as in HdrHistogram: 2^SUB_BITS of them per power of 2, so a value is known to within
+	// 1/2^SUB_BITS of itself. Values are whole units (say µs), truncated; from 2^MAX_BITS on they only count
+	// towards +Inf.
+	class Histogram {
+	public:
+		enum {
+			SUB_BITS = 3,
+			SUB_BUCKETS = 1 << SUB_BITS,
+			MAX_BITS = 32,
+			BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS // Then the overflow bucket, then the sum
+		};
+
+		void record(uint64_t value) {
+			metrics_->add(slot_ + bucketOf(value), 1);
+			metrics_->add(slot_ + BUCKETS + 1, value);
+		}
+
+		static std::size_t bucketOf(uint64_t value) {
+			if (value < SUB_BUCKETS) {
+				return value;
+			}
+			if (value >> MAX_BITS) {
+				return BUCKETS;
+			}
+			unsigned int bits = 63 - __builtin_clzll(value);
+			return (bits - SUB_BITS + 1) * SUB_BUCKETS + ((value >> (bits - SUB_BITS)) & (SUB_BUCKETS - 1));
+		}
+		static uint64_t lowerBound(std::size_t bucket); // The smallest value in it
+	private:
+		friend class Metrics;
+		Histogram(Metrics * metrics, std::size_t slot) : metrics_(metrics), slot_(slot) { }
+		Metrics * metrics_;
+		std::size_t slot_;
+	};
+
+	Metrics();
+	~Metrics();
+
+	// Labels are what goes between the braces, like "manager=\"history\"", or empty. Metrics of the same name
+	// have the same help and differ in their labels.
+	Counter counter(const std::string & name, const std::string & help, const std::string & labels = std::string());
+	Gauge gauge(const std::string & name, const std::string & help, const std::string & labels = std::string());
+	// unit is the size of a recorded unit in the metric's own, like 1e-6 for µs of a "_seconds" histogram.
+	Histogram histogram(const std::string & name, const std::string & help, double unit, const std::string & labels = std::string());
+
+	std::string render() const;
+private:
+	enum Kind {
+		COUNTER,
+		GAUGE,
+		HISTOGRAM
+	};
+
+	struct Entry {
+		Kind kind_;
+		std::string name_, help_, labels_;
+		std::size_t slot_;
+		double unit_;
+	};
+
+	Metrics(const Metrics &);
+	Metrics & operator=(const Metrics &);
+
+	void add(std::size_t slot, uint64_t n) {
+		if (threadNumber_ == 0) {
+			threadNumber_ = nextThread_.fetch_add(1, boost::memory_order_relaxed) + 1;
+		}
+		if (threadNumber_ <= SHARDS) {
+			// Nobody else writes it; readers see either value.
+			boost::atomic<uint64_t> & cell = shards_[threadNumber_ - 1][slot];
+			cell.store(cell.load(boost::memory_order_relaxed) + n, boost::memory_order_relaxed);
+		}
+		else {
+			shards_[SHARDS][slot].fetch_add(n, boost::memory_order_relaxed);
+		}
+	}
+	uint64_t sum(std::size_t slot) const;
+	std::size_t allocate(Kind kind, const std::string & name, const std::string & help, const std::string & labels, std::size_t slots, double unit);
+	void renderHistogram(std::string & out, const Entry & entry) const;
+
+	// Threads are numbered from 1 as they first record something; 0 until then. Shared by all registries.
+	static __thread unsigned int threadNumber_;
+	static boost::atomic<unsigned int> nextThread_;
+
+	boost::atomic<uint64_t> * shards_[SHARDS + 1]; // The last one is the overflow. Each padded by a cache line at both ends.
+	std::vector<Entry> entries_;
+	std::size_t used_; // Slots
+};
+
+#endif
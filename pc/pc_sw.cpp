@@ -1,15 +1,59 @@
-#define BOOST_ASIO_ENABLE_HANDLER_TRACKING
-
+#include <cctype>
+#include <cstring>
 #include <deque>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <set>
 #include <boost/asio.hpp>
+#include <boost/asio/high_resolution_timer.hpp>
 #include <boost/bind.hpp>
 #include <boost/chrono.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "../common/audio_codec.hpp"
+#include "../common/frame_decoder.hpp"
+#include "../common/protocol.hpp"
+#include "audio_channel.hpp"
+#include "buffer.hpp"
+#include "history.hpp"
+#include "http_request.hpp"
+#include "journal.hpp"
+#include "longpoll_encoder.hpp"
+#include "metrics.hpp"
 
 enum {
 	BUF_SIZE = 1024,
-	SE_LINE_LEN_MAX = 16,
-	GL_LINE_LEN_MAX = 80,
+	ACCEPT_RETRY_TIME = 100, // ms before accepting again after an error, like running out of file descriptors
+	SE_LINE_LEN_MAX = 128,
+	GL_LINE_LEN_MAX = 256,
 	GE_LINE_LEN_MAX = 80,
+	HQ_LINE_LEN_MAX = 80,
+	EVENT_LOG_SIZE = 256, // Events kept for clients that resume with a token
+	SENSOR_SHARDS = 16, // Of the sensor nodes' states
+	SHARD_CHANNELS_MAX = 4096, // In a shard, before the idle channels without a state of their own are dropped
+	JOURNAL_SYNC_TIME = 100, // ms between group commits of the journal
+	JOURNAL_COMPACT_RECORDS = 4096, // Journal records after which a new snapshot is taken
+	HISTORY_SEAL_TIME = 60, // s after which a partial history block is written out anyway
+	HISTORY_THREADS = 2, // Answering history queries, off the io threads
+	HISTORY_EVENTS_MAX = 65536, // Events in the answer to one query; the rest need another
+	HISTORY_BATCH_MAX = 65536, // Events of one sensor event line that go into the history; hours of steady motion
+	LINK_HEARTBEAT_TIME = 5, // s between heartbeats on a node link
+	LINK_TIMEOUT = 15, // s without anything from the node, after which the link is dropped
+	LINK_QUEUE_MAX = 256, // Responses queued for a node link that doesn't keep up, before it's dropped
+	HTTP_BUF_SIZE = 4096, // On the stack, while reading a request
+	HTTP_PIPELINE_MAX = 65536, // Bytes a client may send ahead while its request is being answered
+	STREAM_QUEUE_MAX = 64, // Responses queued for a GUI stream that doesn't keep up, before it's dropped
+	STREAM_SEND_BUFFER = 65536, // Bytes; the kernel's share of what a slow GUI stream can hold up
+	STREAM_KEEPALIVE_TIME = 15, // s; comments on an idle GUI stream, so that proxies keep it and dead clients get noticed
 };
 
 typedef boost::asio::local::stream_protocol strm;
@@ -22,6 +66,14 @@ public:
 			sensorEventAddr_,
 			guiLongpollAddr_,
 			guiEventAddr_;
+		unsigned int threads_; // Number of threads running the io_service
+		std::string stateDir_; // Where the longpoll states (and the history) are saved. Empty if they aren't.
+		std::string historyAddr_; // The history query socket. Empty if no history is kept.
+		std::string nodeLinkAddr_; // Where nodes connect for a persistent link. Empty if they only longpoll.
+		std::string httpAddr_; // "[<host>:]<port>" of the built-in HTTP front end. Empty if there's none.
+		std::string wwwDir_; // Where the front end finds gui.html and the robot_say samples
+		std::string metricsAddr_; // Where the metrics are served. Empty if they aren't (they're kept anyway).
+		Config() : threads_(1), wwwDir_("www") { }
 		static Config fromArgv(int argc, char const * const * argv);
 	};
 	
@@ -29,64 +81,215 @@ public:
 	~Program();
 	void operator()();
 private:
-	enum SensorEvent {
-		SMOKE_ON,
-		SMOKE_OFF,
-		MOTION
-	};
+	typedef Protocol::SensorEvent SensorEvent;
 	
-	enum GuiEvent {
-		LED = 1,
-		SIREN_CTRL,
-		SMOKE_SLEEP,
-		AUDIO_STREAM,
-		
-		TOKEN // not an actual event, but reported at the end of longpolls
-	};
+	static const char * sensorEventName(SensorEvent evt) { return Protocol::sensorEventName(evt); }
+	static bool parseSensorEvent(const std::string & name, SensorEvent & evt) { return Protocol::parseSensorEvent(name.data(), name.size(), evt); }
+	static bool isNodeName(const std::string & name) { return Protocol::isNodeName(name); }
+	
+	// The node named by "node=<name>" in the options of a request line ("" if none), and the groups of
+	// "groups=<name>,<name>,...".
+	static std::string parseNode(const std::string & options, std::set<std::string> & groups);
+	
+	typedef Protocol::MsgType GuiEvent; // What goes to the nodes
+	
+	static std::string managerLabel(const std::string & name) { return "manager=\"" + name + '"'; } // Of the metrics
 	
+	// The name is the one of its metrics.
 	class Mgr {
 	public:
-		Mgr(Program & program, const std::string & addr);
+		Mgr(Program & program, const std::string & addr, const std::string & name);
 		virtual ~Mgr();
 	protected:
 		boost::asio::io_service & getIo() { return program_.io_; }
-		void startAccept();
-		virtual void onAccept(boost::shared_ptr<strm::socket>, const boost::system::error_code & error) = 0;
+		boost::asio::io_service::strand & getStrand() { return strand_; }
+		// Called for every accepted connection. Accepting continues meanwhile, so this usually just starts a session.
+		virtual void onAccept(boost::shared_ptr<strm::socket> sock) = 0;
 		Program & program_;
+		boost::asio::io_service::strand strand_; // Serializes the manager's own state; sessions of stateless managers don't need it.
 		strm::acceptor acceptor_;
+		Metrics::Counter accepts_, written_; // Connections, and bytes written to them
+	private:
+		void startAccept();
+		void handleAccept(boost::shared_ptr<strm::socket> sock, const boost::system::error_code & error);
+		void onAcceptTimer(const boost::system::error_code & error);
+		boost::asio::high_resolution_timer acceptTimer_; // Accepting again after an error
+	};
+	
+	typedef boost::shared_ptr<const GatherMessage> LongpollResponse; // Encoded once, shared by every client it is written to.
+	
+	// A longpoll: whatever sent the request line, and gets the one response to it.
+	class Poller {
+	public:
+		virtual ~Poller() { }
+		virtual void onResponse(LongpollResponse response) = 0; // Called on the manager's strand
 	};
 	
+	// The state of one or more channels (like the sensor nodes), for longpolls and subscribers. Each channel has
+	// its own state and event log. Channels live in hash tables sharded by name, each shard with its own strand
+	// (and journal), so that lots of them don't all wait on one.
 	template <typename State, typename Event>
 	class LongpollMgr
 		:	public Mgr {
 	public:
-		LongpollMgr(Program & program, const std::string & addr);
-		//virtual ~LongpollMgr();
+		typedef LongpollResponse Response;
+		
+		// Gets the full state, and then every event as it happens, instead of polling for them.
+		class Subscriber {
+		public:
+			virtual ~Subscriber() { }
+			virtual void onResponse(Response response) = 0; // Called on the strand of the channel's shard
+		};
+		
+		// Where an event goes: one channel, the channels in a group, or all of them (and the ones that come later).
+		struct Target {
+			enum Kind {
+				ALL,
+				CHANNEL,
+				GROUP
+			};
+			Kind kind_;
+			std::string name_;
+			Target() : kind_(ALL) { }
+			Target(Kind kind, const std::string & name) : kind_(kind), name_(name) { }
+		};
+		
+		LongpollMgr(Program & program, const std::string & addr, const std::string & name, std::size_t shards = 1);
+		virtual ~LongpollMgr();
+		// Restores the state saved there, and saves every change from now on. Shards after the first one add
+		// their number to the path.
+		void openJournal(const std::string & path);
+		// Thread-safe. The options are those of a longpoll request line. With a token still in the log, the
+		// subscriber resumes after it, instead of getting the full state.
+		void subscribe(boost::shared_ptr<Subscriber> subscriber, const std::string & options, const std::string & token = std::string());
+		void unsubscribe(boost::shared_ptr<Subscriber> subscriber, const std::string & options); // The same options
+		// Thread-safe. For longpolls that come some other way than the manager's socket, like HTTP.
+		// The line is a longpoll request line without the newline.
+		void poll(boost::shared_ptr<Poller> poller, const std::string & line);
+		void cancelPoll(boost::shared_ptr<Poller> poller, const std::string & line); // The client went away
 	protected:
-		virtual void onEvent(const Event & evt);
+		
+		// The most recent events, addressed by 64-bit sequence numbers. Tokens are the sequence number of the
+		// last event the client has seen, so a client can resume from wherever it left off.
+		// Grows as events come, so that idle channels stay small.
+		class EventLog {
+		public:
+			EventLog(uint64_t lastSeq) : lastSeq_(lastSeq), count_() { }
+			uint64_t lastSeq() const { return lastSeq_; }
+			// True if every event after the token is still in the log.
+			bool covers(uint64_t token) const { return token <= lastSeq_ && lastSeq_ - token <= count_; }
+			const Event & at(uint64_t seq) const { return events_[seq % EVENT_LOG_SIZE]; }
+			void push(const Event & evt) {
+				if (events_.size() < EVENT_LOG_SIZE) {
+					events_.resize(EVENT_LOG_SIZE);
+				}
+				events_[++lastSeq_ % EVENT_LOG_SIZE] = evt;
+				count_ = std::min<uint64_t>(count_ + 1, EVENT_LOG_SIZE);
+			}
+		private:
+			std::vector<Event> events_;
+			uint64_t lastSeq_, count_;
+		};
+		
+		void postEvent(const Event & evt, const Target & target = Target()); // Thread-safe
 		virtual void updateState(State & state, const Event & evt) = 0;
-		virtual std::string stateResponse(const State & state, uint8_t token) = 0;
-		virtual std::string eventResponse(const State & state, uint8_t token, const std::deque<Event> & eventQueue) = 0;
+		// The channel that the options of a request line are about, and the groups it's in.
+		virtual std::string parseChannel(const std::string & options, std::set<std::string> & groups) { (void) options; (void) groups; return std::string(); }
+		// Clients may ask for a response format of their own, with options after the token on the request line.
+		virtual int parseFormat(const std::string & options) { (void) options; return 0; }
+		// With resync set, the client's token was too old (or bogus), so it has to drop what it knows.
+		virtual Response stateResponse(const State & state, uint64_t token, bool resync, int format) = 0;
+		// Reports the events after since, up to token.
+		virtual Response eventResponse(const State & state, uint64_t token, const EventLog & log, uint64_t since, int format) = 0;
+		
+		// Persistence. Events that don't change the state return false and are not saved.
+		virtual bool saveEvent(const Event & evt, std::string & record) = 0;
+		virtual bool loadEvent(const std::string & record, Event & evt) = 0;
+		virtual std::string saveState(const State & state) = 0;
+		virtual bool loadState(const std::string & data, State & state) = 0;
 	private:
-		void onAccept(boost::shared_ptr<strm::socket>, const boost::system::error_code & error);
+		// One per connection: reads the token line, then either gets answered right away or waits for an event.
+		class Session
+			:	public Poller,
+				public boost::enable_shared_from_this<Session> {
+		public:
+			Session(LongpollMgr & mgr, boost::shared_ptr<strm::socket> sock);
+			void start() { startRead(); }
+			virtual void onResponse(Response response);
+		private:
+			void startRead();
+			void onRead(const boost::system::error_code & error, std::size_t bytes_transferred);
+			void startWatch();
+			void onWatch(const boost::system::error_code & error);
+			void startWrite(Response response);
+			void onWrite(const boost::system::error_code & error, std::size_t bytes_transferred, Response response);
+			
+			LongpollMgr & mgr_;
+			boost::shared_ptr<strm::socket> sock_;
+			std::string readBuf_;
+			std::string line_;
+			std::vector<uint8_t> data_;
+		};
+		
+		struct Channel {
+			State state_;
+			EventLog log_;
+			std::set<std::string> groups_;
+			std::map<boost::shared_ptr<Poller>, int> waiting_; // Waiting longpolls, with their formats
+			std::map<boost::shared_ptr<Subscriber>, int> subscribers_; // With their formats
+			Channel(const State & state, uint64_t lastSeq) : state_(state), log_(lastSeq) { }
+		};
+		
+		struct Shard {
+			boost::asio::io_service::strand strand_; // Everything about the shard's channels
+			boost::unordered_map<std::string, Channel> channels_;
+			std::size_t sweepAt_; // Channels at which the next new one sweeps out the idle ones
+			State defaults_; // The state of new channels: as of the events to all of them
+			boost::shared_ptr<Journal> journal_; // Null if the state isn't saved. Shared with a compaction under way.
+			boost::asio::high_resolution_timer syncTimer_;
+			bool syncPending_, compacting_;
+			Shard(boost::asio::io_service & io) : strand_(io), sweepAt_(SHARD_CHANNELS_MAX), syncTimer_(io), syncPending_(false), compacting_(false) { }
+		};
 		
-		void startRead(boost::shared_ptr<strm::socket> sock);
-		void onRead(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > data);
+		virtual void onAccept(boost::shared_ptr<strm::socket> sock);
 		
-		void startLongpoll(boost::shared_ptr<strm::socket> sock, const std::string & token);
+		Shard & getShard(const std::string & channel);
+		Channel & getChannel(Shard & shard, const std::string & name); // Made if it isn't there yet
+		Channel * findChannel(Shard & shard, const std::string & name);
+		// Drops the named channels that nobody waits for or subscribes to, and whose state is the default one:
+		// nothing is lost but their event logs (so their clients resync) and their groups, until they poll again.
+		// Any client can name a channel, so there's no other bound on them.
+		void sweepChannels(Shard & shard);
+		void parseLine(const std::string & line, std::string & token, std::string & options);
 		
-		void startWrite(boost::shared_ptr<strm::socket> sock, const std::string & data);
-		void onWrite(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> data);
+		void startLongpoll(Shard & shard, boost::shared_ptr<Poller> poller, const std::string & line);
+		void onWaitingClosed(Shard & shard, boost::shared_ptr<Poller> poller, std::string channel);
+		void onSubscribe(Shard & shard, boost::shared_ptr<Subscriber> subscriber, const std::string & options, const std::string & token);
+		void onUnsubscribe(Shard & shard, boost::shared_ptr<Subscriber> subscriber, std::string channel);
+		void onEvent(Shard & shard, const Event & evt, const Target & target);
+		void applyEvent(Channel & channel, const Event & evt);
 		
-		bool isLongpollActive() const { return longpollSock_; }
+		static bool parseToken(const std::string & str, uint64_t & token);
+		static uint64_t firstSeq();
 		
-		uint8_t nextToken();
+		// Records are "\xff<channel>\n<event>", where channel "*" is all of them. Snapshots start with SNAPSHOT_MAGIC.
+		// Records and snapshots without it are from before channels: the state of all of them.
+		void journalEvent(Shard & shard, const std::string & channel, const Event & evt);
+		std::string saveShard(const Shard & shard);
+		void onReplaySnapshot(Shard & shard, const std::string & data);
+		void onReplayRecord(Shard & shard, const std::string & record);
+		void onSyncTimer(Shard & shard, const boost::system::error_code & error);
+		// On the compaction thread, from the state as it was at the mark; then onCompacted on the shard's strand.
+		void compact(Shard & shard, boost::shared_ptr<Journal> journal, const std::string & state, const Journal::Mark & mark);
+		void onCompacted(Shard & shard, boost::shared_ptr<Journal> journal, const std::string & error);
 		
-		std::string readBuf_;
-		boost::shared_ptr<strm::socket> longpollSock_; // If not null, then the longpolling state is active.
-		uint8_t lastToken_;
-		State state_;
-		std::deque<Event> eventQueue_;
+		std::vector<boost::shared_ptr<Shard> > shards_;
+		// Compaction writes and syncs files, so it runs on a thread of its own rather than on a strand.
+		boost::asio::io_service compactIo_;
+		boost::scoped_ptr<boost::asio::io_service::work> compactWork_;
+		boost::thread compactThread_;
+		Metrics::Gauge parked_; // Longpolls in waiting_
+		Metrics::Gauge queued_; // Events posted to a shard, and not applied yet
 	};
 	
 	// Hack. C++ doesn't seem to support nested classes as template parameters of parent classes.
@@ -94,25 +297,42 @@ private:
 		std::string led_, sirenCtrl_;
 	};
 	
+	// An event goes to any number of nodes, and is encoded once for each format (codec) they ask for.
+	struct SensorLongpollMgr_Encoded {
+		boost::mutex mutex_; // Shards encode in parallel
+		std::map<int, SharedBuffer> messages_;
+	};
+	
 	struct SensorLongpollMgr_Event {
 		GuiEvent event_;
-		std::vector<uint8_t> content_;
+		SharedBuffer content_; // Referenced, never copied, all the way to the sensor's socket
+		boost::shared_ptr<SensorLongpollMgr_Encoded> encoded_;
 	};
 	
+	// One channel per node, named on the request line. Commands go to every node, to a group, or to one node.
 	class SensorLongpollMgr
 		:	public LongpollMgr<SensorLongpollMgr_State, SensorLongpollMgr_Event> {
 	public:
 		SensorLongpollMgr(Program & program, const std::string & addr);
 		//virtual ~SensorLongpollMgr();
+		// "<command>[ node=<name>| group=<name>]\n<content>\n"
 		void onGuiCommand(const std::string & command);
-		void onGuiAudio(const std::vector<uint8_t> & audio);
+		void onGuiAudio(const SharedBuffer & audio); // To every node
 	private:
 		typedef SensorLongpollMgr_State State;
 		typedef SensorLongpollMgr_Event Event;
+		typedef SensorLongpollMgr_Encoded Encoded;
 		
 		virtual void updateState(State & state, const Event & evt);
-		virtual std::string stateResponse(const State & state, uint8_t token);
-		virtual std::string eventResponse(const State & state, uint8_t token, const std::deque<Event> & eventQueue);
+		virtual std::string parseChannel(const std::string & options, std::set<std::string> & groups) { return parseNode(options, groups); }
+		virtual int parseFormat(const std::string & options);
+		virtual Response stateResponse(const State & state, uint64_t token, bool resync, int format);
+		virtual Response eventResponse(const State & state, uint64_t token, const EventLog & log, uint64_t since, int format);
+		
+		virtual bool saveEvent(const Event & evt, std::string & record);
+		virtual bool loadEvent(const std::string & record, Event & evt);
+		virtual std::string saveState(const State & state);
+		virtual bool loadState(const std::string & data, State & state);
 	};
 	
 	class SensorEventMgr
@@ -120,27 +340,42 @@ private:
 	public:
 		SensorEventMgr(Program & program, const std::string & addr);
 		//virtual ~SensorEventMgr();
+		// "[node=<name> ]<event>[ <count> <first_age> <last_age>]\n"
+		void processLine(const std::string & line); // Also used for the events that come over HTTP
+		void processEvent(const Protocol::EventLine & evt); // An event line, already parsed
 	private:
-		virtual void onAccept(boost::shared_ptr<strm::socket>, const boost::system::error_code & error);
-		
-		void startRead(boost::shared_ptr<strm::socket> sock);
-		void onRead(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > data);
+		// One per connection: reads event lines until the sensor closes the connection.
+		class Session
+			:	public boost::enable_shared_from_this<Session> {
+		public:
+			Session(SensorEventMgr & mgr, boost::shared_ptr<strm::socket> sock);
+			void start() { startRead(); }
+		private:
+			void startRead();
+			void onRead(const boost::system::error_code & error, std::size_t bytes_transferred);
+			
+			SensorEventMgr & mgr_;
+			boost::shared_ptr<strm::socket> sock_;
+			std::string readBuf_;
+			std::vector<uint8_t> data_;
+		};
 		
-		void processLine(const std::string & line);
-		
-		std::string readBuf_;
+		virtual void onAccept(boost::shared_ptr<strm::socket> sock);
 	};
 	
 	// Hack. C++ doesn't seem to support nested classes as template parameters of parent classes.
 	struct GuiLongpollMgr_State {
 		bool smokeState_, hasLastSmokeEvent_, hasLastMotion_;
 		boost::chrono::system_clock::time_point lastSmokeEvent_, lastMotion_;
+		std::string lastSmokeNode_, lastMotionNode_;
 		GuiLongpollMgr_State() : smokeState_(), hasLastSmokeEvent_(false), hasLastMotion_(false) { }
 	};
 	
 	struct GuiLongpollMgr_Event {
 		boost::chrono::system_clock::time_point time_;
 		SensorEvent event_;
+		std::string node_; // Empty for a node without a name
+		boost::chrono::steady_clock::time_point received_; // For timing its delivery; not saved
 	};
 	
 	class GuiLongpollMgr
@@ -148,20 +383,27 @@ private:
 	public:
 		GuiLongpollMgr(Program & program, const std::string & addr);
 		//virtual ~GuiLongpollMgr();
-		void onSensorEvent(SensorEvent evt);
+		// A batch of count events, the first and last of them that many ms ago.
+		void onSensorEvent(const std::string & node, SensorEvent evt, unsigned int count, unsigned int firstAge, unsigned int lastAge);
 	private:
 		typedef GuiLongpollMgr_State State;
 		typedef GuiLongpollMgr_Event Event;
 		
-		static std::string timeToString(const boost::chrono::system_clock::time_point & time) {
-			std::ostringstream result;
-			result << boost::chrono::duration_cast<boost::chrono::seconds>(time.time_since_epoch()).count();
-			return result.str();
-		}
+		enum Format {
+			TEXT,
+			SSE // Server-sent events: each response is one event, with the token as its id
+		};
 		
 		virtual void updateState(State & state, const Event & evt);
-		virtual std::string stateResponse(const State & state, uint8_t token);
-		virtual std::string eventResponse(const State & state, uint8_t token, const std::deque<Event> & eventQueue);
+		virtual int parseFormat(const std::string & options);
+		virtual Response stateResponse(const State & state, uint64_t token, bool resync, int format);
+		virtual Response eventResponse(const State & state, uint64_t token, const EventLog & log, uint64_t since, int format);
+		static void appendEventLine(std::string & text, const boost::chrono::system_clock::time_point & time, SensorEvent evt, const std::string & node);
+		
+		virtual bool saveEvent(const Event & evt, std::string & record);
+		virtual bool loadEvent(const std::string & record, Event & evt);
+		virtual std::string saveState(const State & state);
+		virtual bool loadState(const std::string & data, State & state);
 	};
 	
 	class GuiEventMgr
@@ -170,37 +412,272 @@ private:
 		GuiEventMgr(Program & program, const std::string & addr);
 		//virtual ~GuiEventMgr();
 	private:
-		virtual void onAccept(boost::shared_ptr<strm::socket>, const boost::system::error_code & error);
+		// One per connection: reads the command line, then either the command content or an audio stream.
+		class Session
+			:	public boost::enable_shared_from_this<Session> {
+		public:
+			Session(GuiEventMgr & mgr, boost::shared_ptr<strm::socket> sock);
+			void start() { startRead(&Session::onReadFirstLine); }
+		private:
+			void startRead(void(Session::*handler)(const boost::system::error_code & error, std::size_t bytes_transferred));
+			void onReadFirstLine(const boost::system::error_code & error, std::size_t bytes_transferred);
+			void onReadTheRest(const boost::system::error_code & error, std::size_t bytes_transferred);
+			void handleTheRest(const boost::system::error_code & error, std::size_t offset, std::size_t size);
+			
+			GuiEventMgr & mgr_;
+			boost::shared_ptr<strm::socket> sock_;
+			std::string readBuf_;
+			std::string command_;
+			bool audioStream_;
+			AudioChannel::StreamPtr audio_; // Reading is paused while the channel has enough of it queued.
+			boost::shared_ptr<SharedBuffer::Data> data_; // Audio is passed on by reference, so a new one is needed after that.
+		};
+		
+		virtual void onAccept(boost::shared_ptr<strm::socket> sock);
+	};
+	
+	// Persistent links to sensor nodes, instead of longpolls and event connections. Both ways carry messages
+	// like those of sensor longpolls. The node starts with a HELLO, then gets the full state and every event
+	// as it happens, and sends its sensor events up the same link. Both ends send heartbeats.
+	class NodeLinkMgr
+		:	public Mgr {
+	public:
+		NodeLinkMgr(Program & program, const std::string & addr);
+		//virtual ~NodeLinkMgr();
+	private:
+		typedef SensorLongpollMgr::Response Response;
+		
+		class Session
+			:	public SensorLongpollMgr::Subscriber,
+				public boost::enable_shared_from_this<Session> {
+		public:
+			Session(NodeLinkMgr & mgr, boost::shared_ptr<strm::socket> sock);
+			void start();
+			virtual void onResponse(Response response);
+		private:
+			void startRead();
+			void onRead(const boost::system::error_code & error, std::size_t bytes_transferred);
+			void onMessage(uint8_t type, const uint8_t * content, std::size_t size);
+			void send(Response response);
+			void startWrite();
+			void onWrite(const boost::system::error_code & error, std::size_t bytes_transferred);
+			void startHeartbeat();
+			void onHeartbeat(const boost::system::error_code & error);
+			void close();
+			
+			NodeLinkMgr & mgr_;
+			boost::shared_ptr<strm::socket> sock_;
+			boost::asio::io_service::strand strand_; // Reads, writes and the heartbeat
+			std::vector<uint8_t> data_;
+			FrameDecoder decoder_;
+			std::deque<Response> queue_; // Front is being written
+			boost::asio::high_resolution_timer heartbeatTimer_;
+			boost::chrono::steady_clock::time_point lastReceived_;
+			std::string options_; // Of the HELLO
+			std::string node_; // Of the HELLO; the node of every event that comes over the link
+			bool subscribed_, closed_;
+		};
+		
+		virtual void onAccept(boost::shared_ptr<strm::socket> sock);
+		
+		static Response heartbeat();
+	};
+	
+	// Answers queries on the sensor event history, one query per connection:
+	// - "events <from> <to>": the events in that range of unix times, one "<time> <event>" line each. After
+	//   HISTORY_EVENTS_MAX of them, a "more" line cuts the answer off.
+	// - "hourly <from> <to> [<event>]": "<hour> <count>" lines, counting motion if no event is given.
+	// Queries run on HISTORY_THREADS threads of their own, so that a long one doesn't hold up an io thread.
+	class HistoryMgr
+		:	public Mgr {
+	public:
+		typedef boost::function<void(boost::shared_ptr<std::string> response)> QueryHandler;
+		
+		HistoryMgr(Program & program, const std::string & addr, History & history);
+		virtual ~HistoryMgr();
+		// The handler is called on a query thread. Also used by the HTTP front end.
+		void asyncQuery(const std::string & line, QueryHandler handler);
+	private:
+		class Session
+			:	public boost::enable_shared_from_this<Session> {
+		public:
+			Session(HistoryMgr & mgr, boost::shared_ptr<strm::socket> sock);
+			void start() { startRead(); }
+		private:
+			void startRead();
+			void onRead(const boost::system::error_code & error, std::size_t bytes_transferred);
+			void onQuery(boost::shared_ptr<std::string> response);
+			void onWrite(std::size_t bytes_transferred, boost::shared_ptr<std::string> response);
+			
+			HistoryMgr & mgr_;
+			boost::shared_ptr<strm::socket> sock_;
+			std::string readBuf_;
+			std::vector<uint8_t> data_;
+		};
+		
+		virtual void onAccept(boost::shared_ptr<strm::socket> sock);
+		
+		std::string query(const std::string & line);
+		void runQuery(const std::string & line, QueryHandler handler);
+		void startSealTimer();
+		void onSealTimer(const boost::system::error_code & error);
+		
+		History & history_;
+		boost::asio::high_resolution_timer sealTimer_;
+		boost::asio::io_service queryIo_;
+		boost::scoped_ptr<boost::asio::io_service::work> queryWork_;
+		boost::thread_group queryThreads_;
+	};
+	
+	// Writes the metrics in the Prometheus text format to every connection, and closes it.
+	class MetricsMgr
+		:	public Mgr {
+	public:
+		MetricsMgr(Program & program, const std::string & addr);
+		//virtual ~MetricsMgr();
+	private:
+		virtual void onAccept(boost::shared_ptr<strm::socket> sock);
+		void onWrite(boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> response, const boost::system::error_code & error, std::size_t bytes_transferred);
+	};
+	
+	// Built-in HTTP/1.1 front end, in place of a web server running the PHP scripts: the same endpoints,
+	// on top of the same managers, and gui.html. Connections are kept alive, and the requests on one are
+	// answered in order. A parked longpoll costs only its session: requests are read into a buffer on the
+	// stack once the socket is readable, and responses are written straight from the longpoll's buffers.
+	// /gui_stream pushes the GUI events as server-sent events on one open response, instead of a longpoll per
+	// event. Each stream has its own queue of (shared) responses; a client that lets it fill up is dropped.
+	class HttpMgr {
+	public:
+		HttpMgr(Program & program, const std::string & addr, const std::string & wwwDir);
+		//~HttpMgr();
+	private:
+		typedef boost::asio::ip::tcp tcp;
+		
+		class Session
+			:	public Poller,
+				public GuiLongpollMgr::Subscriber,
+				public boost::enable_shared_from_this<Session> {
+		public:
+			Session(HttpMgr & mgr, boost::shared_ptr<tcp::socket> sock);
+			void start();
+			virtual void onResponse(LongpollResponse response); // As a poller or as a subscriber
+		private:
+			enum Polling {
+				NONE,
+				SENSOR,
+				GUI,
+				GUI_STREAM // Subscribed, for good
+			};
+			
+			// Only streams have one, so that a parked longpoll stays small.
+			struct Stream {
+				std::deque<LongpollResponse> queue_;
+				std::vector<LongpollResponse> writing_;
+				boost::asio::high_resolution_timer keepAliveTimer_;
+				Stream(boost::asio::io_service & io) : keepAliveTimer_(io) { }
+			};
+			
+			void startWait();
+			void onReadable(const boost::system::error_code & error);
+			void feed(const uint8_t * data, std::size_t size);
+			void handleRequest();
+			void onPollResponse(LongpollResponse response);
+			void onHistory(boost::shared_ptr<std::string> response);
+			void respond(unsigned int status, const char * contentType, LongpollResponse body);
+			void respond(unsigned int status, const char * contentType, const std::string & body);
+			void onWrite(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<std::string> header, LongpollResponse body);
+			void startStream(const std::string & token);
+			void pushStream(LongpollResponse response);
+			void startStreamWrite();
+			void onStreamWrite(const boost::system::error_code & error, std::size_t bytes_transferred);
+			void startKeepAlive();
+			void onKeepAlive(const boost::system::error_code & error);
+			void close();
+			
+			HttpMgr & mgr_;
+			boost::shared_ptr<tcp::socket> sock_;
+			boost::asio::io_service::strand strand_;
+			HttpRequest request_;
+			std::vector<uint8_t> leftover_; // Pipelined bytes read while a request was being answered; usually none
+			Polling polling_; // Parked on that manager
+			std::string pollLine_; // The request line it was parked with
+			bool waiting_, busy_, keepAlive_, closed_;
+			boost::scoped_ptr<Stream> stream_;
+		};
+		
+		void startAccept();
+		void handleAccept(boost::shared_ptr<tcp::socket> sock, const boost::system::error_code & error);
+		void onAcceptTimer(const boost::system::error_code & error);
+		void robotSay(const std::string & text);
 		
-		void startRead(boost::shared_ptr<strm::socket> sock, void(GuiEventMgr::*handler)(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > data));
-		void onReadFirstLine(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > data);
-		void onReadTheRest(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > data);
+		static tcp::endpoint parseEndpoint(const std::string & addr);
+		static bool readFile(const std::string & path, std::string & data);
 		
-		std::string readBuf_;
-		std::string command_;
-		bool audioStream_;
+		Program & program_;
+		tcp::acceptor acceptor_;
+		// Loaded at startup, read-only afterwards
+		std::string guiHtml_;
+		std::map<char, SharedBuffer> robotSay_;
+		LongpollResponse streamHeader_, streamKeepAlive_;
+		Metrics::Counter accepts_, written_;
+		boost::asio::high_resolution_timer acceptTimer_; // Accepting again after an error
 	};
 	
 	void onSignal(const boost::system::error_code & error, int signal_number);
+	void runIo() { io_.run(); }
 	
-	void onSensorEvent(SensorEvent evt) { gl_.onSensorEvent(evt); }
+	// These may be called from any thread.
+	void onSensorEvent(const std::string & node, SensorEvent evt, unsigned int count, unsigned int firstAge, unsigned int lastAge) { gl_.onSensorEvent(node, evt, count, firstAge, lastAge); }
 	void onGuiCommand(const std::string & command) { sl_.onGuiCommand(command); }
-	void onGuiAudio(const std::vector<uint8_t> & audio) { sl_.onGuiAudio(audio); }
+	void onGuiAudio(const SharedBuffer & audio) { audioOut_.add(audio.size()); sl_.onGuiAudio(audio); } // Paced frames from audio_
+	void onDelivered(const LongpollResponse & response); // A response has been written to a GUI
 	
 	boost::asio::io_service io_;
 	boost::asio::signal_set signals_;
+	const Config config_;
+	Metrics metrics_;
+	Metrics::Counter audioIn_, audioOut_; // Bytes into audio_, and out of it to the nodes
+	Metrics::Histogram delivery_; // From a sensor event coming in to a GUI having it, in µs
 	SensorLongpollMgr sl_;
 	SensorEventMgr    se_;
 	GuiLongpollMgr    gl_;
 	GuiEventMgr       ge_;
+	AudioChannel audio_; // GUI audio uploads, on their way to the sensor
+	boost::scoped_ptr<History>    history_; // Null if no history is kept
+	boost::scoped_ptr<HistoryMgr> hm_;
+	boost::scoped_ptr<NodeLinkMgr> nl_; // Null if nodes only longpoll
+	boost::scoped_ptr<HttpMgr> http_; // Null if there's no HTTP front end
+	boost::scoped_ptr<MetricsMgr> mm_; // Null if the metrics aren't served
 };
 
 Program::Program(const Config & config)
 	:	signals_(io_, SIGINT, SIGTERM),
+		config_(config),
+		audioIn_(metrics_.counter("pc_sw_audio_in_bytes_total", "Audio bytes uploaded by the GUI (or robot_say) for the nodes.")),
+		audioOut_(metrics_.counter("pc_sw_audio_out_bytes_total", "Audio bytes passed on to the nodes, once paced and mixed.")),
+		delivery_(metrics_.histogram("pc_sw_event_delivery_seconds", "Time from a sensor event coming in to its GUI longpoll or stream response having been written.", 1e-6)),
 		sl_(*this, config.sensorLongpollAddr_),
 		se_(*this, config.sensorEventAddr_   ),
 		gl_(*this, config.guiLongpollAddr_   ),
-		ge_(*this, config.guiEventAddr_      ) {
+		ge_(*this, config.guiEventAddr_      ),
+		audio_(io_, boost::bind(&Program::onGuiAudio, this, _1)) {
+	if (!config.stateDir_.empty()) {
+		sl_.openJournal(config.stateDir_ + "/sensor_longpoll");
+		gl_.openJournal(config.stateDir_ + "/gui_longpoll");
+	}
+	if (!config.historyAddr_.empty()) {
+		history_.reset(new History(config.stateDir_.empty() ? "" : config.stateDir_ + "/history", std::max(1u, boost::thread::hardware_concurrency())));
+		hm_.reset(new HistoryMgr(*this, config.historyAddr_, *history_));
+	}
+	if (!config.nodeLinkAddr_.empty()) {
+		nl_.reset(new NodeLinkMgr(*this, config.nodeLinkAddr_));
+	}
+	if (!config.httpAddr_.empty()) {
+		http_.reset(new HttpMgr(*this, config.httpAddr_, config.wwwDir_));
+	}
+	if (!config.metricsAddr_.empty()) {
+		mm_.reset(new MetricsMgr(*this, config.metricsAddr_));
+	}
 	signals_.async_wait(boost::bind(&Program::onSignal, this, boost::asio::placeholders::error, boost::asio::placeholders::signal_number));
 }
 
@@ -208,7 +685,20 @@ Program::~Program() {
 }
 
 void Program::operator()() {
-	io_.run();
+	// The managers only share state through their strands, so any number of threads can run the handlers.
+	boost::thread_group workers;
+	for (unsigned int i = 1; i < config_.threads_; i++) {
+		workers.create_thread(boost::bind(&Program::runIo, this));
+	}
+	runIo();
+	workers.join_all();
+}
+
+void Program::onDelivered(const LongpollResponse & response) {
+	// Only GUI event responses are timed.
+	if (response->origin() != boost::chrono::steady_clock::time_point()) {
+		delivery_.record(boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::steady_clock::now() - response->origin()).count());
+	}
 }
 
 void Program::onSignal(const boost::system::error_code & error, int signal_number) {
@@ -219,20 +709,79 @@ void Program::onSignal(const boost::system::error_code & error, int signal_numbe
 }
 
 Program::Config Program::Config::fromArgv(int argc, char const * const * argv) {
-	if (argc != 5) {
-		throw std::runtime_error("argc != 5");
-	}
 	Config config;
-	config.sensorLongpollAddr_ = argv[1];
-	config.sensorEventAddr_    = argv[2];
-	config.guiLongpollAddr_    = argv[3];
-	config.guiEventAddr_       = argv[4];
+	std::vector<std::string> addrs;
+	for (int i = 1; i < argc; i++) {
+		std::string arg(argv[i]);
+		if (arg.compare(0, 2, "--") == 0) {
+			std::string::size_type eq = arg.find('=');
+			std::string name(arg.substr(2, eq - 2)), value(eq == std::string::npos ? "" : arg.substr(eq + 1));
+			if (name == "threads") {
+				config.threads_ = std::max(1u, boost::lexical_cast<unsigned int>(value));
+			}
+			else if (name == "state-dir") {
+				config.stateDir_ = value;
+			}
+			else if (name == "history") {
+				config.historyAddr_ = value;
+			}
+			else if (name == "node-link") {
+				config.nodeLinkAddr_ = value;
+			}
+			else if (name == "http") {
+				config.httpAddr_ = value;
+			}
+			else if (name == "www") {
+				config.wwwDir_ = value;
+			}
+			else if (name == "metrics") {
+				config.metricsAddr_ = value;
+			}
+			else {
+				throw std::runtime_error("unknown option " + arg);
+			}
+		}
+		else {
+			addrs.push_back(arg);
+		}
+	}
+	if (addrs.size() != 4) {
+		throw std::runtime_error("expected 4 socket addresses");
+	}
+	config.sensorLongpollAddr_ = addrs[0];
+	config.sensorEventAddr_    = addrs[1];
+	config.guiLongpollAddr_    = addrs[2];
+	config.guiEventAddr_       = addrs[3];
 	return config;
 }
 
-Program::Mgr::Mgr(Program & program, const std::string & addr)
+std::string Program::parseNode(const std::string & options, std::set<std::string> & groups) {
+	std::istringstream in(options);
+	std::string option, node;
+	while (in >> option) {
+		if (option.compare(0, 5, "node=") == 0 && isNodeName(option.substr(5))) {
+			node = option.substr(5);
+		}
+		else if (option.compare(0, 7, "groups=") == 0) {
+			std::istringstream names(option.substr(7));
+			std::string name;
+			while (std::getline(names, name, ',')) {
+				if (isNodeName(name)) {
+					groups.insert(name);
+				}
+			}
+		}
+	}
+	return node;
+}
+
+Program::Mgr::Mgr(Program & program, const std::string & addr, const std::string & name)
 	:	program_(program),
-		acceptor_(getIo(), strm::endpoint(addr)) {
+		strand_(getIo()),
+		acceptor_(getIo(), strm::endpoint(addr)),
+		accepts_(program.metrics_.counter("pc_sw_accepts_total", "Connections accepted.", managerLabel(name))),
+		written_(program.metrics_.counter("pc_sw_written_bytes_total", "Bytes written to connections.", managerLabel(name))),
+		acceptTimer_(getIo()) {
 	startAccept();
 }
 
@@ -241,334 +790,918 @@ Program::Mgr::~Mgr() {
 
 void Program::Mgr::startAccept() {
 	boost::shared_ptr<strm::socket> sock(new strm::socket(getIo()));
-	acceptor_.async_accept(*sock, boost::bind(&Mgr::onAccept, this, sock, boost::asio::placeholders::error));
-}
-
-template <typename State, typename Event>
-Program::LongpollMgr<State, Event>::LongpollMgr(Program & program, const std::string & addr)
-	:	Mgr(program, addr),
-		lastToken_() {
+	acceptor_.async_accept(*sock, boost::bind(&Mgr::handleAccept, this, sock, boost::asio::placeholders::error));
 }
 
-template <typename State, typename Event>
-void Program::LongpollMgr<State, Event>::onEvent(const Event & evt) {
-	updateState(state_, evt);
-	if (isLongpollActive()) {
-		std::deque<Event> q;
-		q.push_back(evt);
-		startWrite(longpollSock_, eventResponse(state_, nextToken(), q)); // TODO: token
-		longpollSock_.reset();
+void Program::Mgr::handleAccept(boost::shared_ptr<strm::socket> sock, const boost::system::error_code & error) {
+	if (!error) {
+		// Keep accepting right away; the accepted connection is served by its own session.
+		startAccept();
+		accepts_.add();
+		onAccept(sock);
 	}
-	else {
-		eventQueue_.push_back(evt);
+	else if (error != boost::asio::error::operation_aborted) {
+		// Errors like EMFILE last until connections are closed; accepting again at once would just spin.
+		std::cerr << "Accept error: " << error.message() << std::endl;
+		acceptTimer_.expires_from_now(boost::chrono::milliseconds(int(ACCEPT_RETRY_TIME)));
+		acceptTimer_.async_wait(boost::bind(&Mgr::onAcceptTimer, this, boost::asio::placeholders::error));
 	}
 }
 
-template <typename State, typename Event>
-void Program::LongpollMgr<State, Event>::onAccept(boost::shared_ptr<strm::socket> sock, const boost::system::error_code & error) {
+void Program::Mgr::onAcceptTimer(const boost::system::error_code & error) {
 	if (!error) {
-		startRead(sock);
-	}
-	else {
-		// TODO: error
+		startAccept();
 	}
 }
 
 template <typename State, typename Event>
-void Program::LongpollMgr<State, Event>::startRead(boost::shared_ptr<strm::socket> sock) {
-	boost::shared_ptr< std::vector<uint8_t> > data(new std::vector<uint8_t>(GL_LINE_LEN_MAX));
-	sock->async_read_some(boost::asio::buffer(*data), boost::bind(&LongpollMgr<State, Event>::onRead, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, sock, data));
-}
-
-template <typename State, typename Event>
-void Program::LongpollMgr<State, Event>::onRead(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > data) {
-	// TODO
-	bool handleError = false;
-	bool finishRead = false;
-	std::string token;
-	for (size_t i = 0; i < bytes_transferred; i++) {
-		uint8_t c = (*data)[i];
-		readBuf_ += c;
-		if (c == '\n') {
-			token = readBuf_.substr(0, readBuf_.size()-1);
-			readBuf_.clear();
-			finishRead = true;
-			break;
-		}
-		else if (readBuf_.size() >= GL_LINE_LEN_MAX) {
-			handleError = true;
-			break;
-		}
-	}
-	// We can try even if we have an error.
-	if (finishRead) {
-		startLongpoll(sock, token);
-	}
-	else if (error || handleError) {
-		// error.
-		// Close the current connection and start listening for a new one.
-		sock->close();
-		sock.reset();
-		startAccept();
+Program::LongpollMgr<State, Event>::LongpollMgr(Program & program, const std::string & addr, const std::string & name, std::size_t shards)
+	:	Mgr(program, addr, name),
+		parked_(program.metrics_.gauge("pc_sw_parked_longpolls", "Longpolls waiting for an event.", managerLabel(name))),
+		queued_(program.metrics_.gauge("pc_sw_queued_events", "Events posted to the shards of a longpoll manager, and not applied yet.", managerLabel(name))) {
+	for (std::size_t i = 0; i < shards; i++) {
+		shards_.push_back(boost::shared_ptr<Shard>(new Shard(program.io_)));
 	}
+	// The channel of clients that don't name one is always there.
+	getChannel(getShard(""), "");
 }
 
 template <typename State, typename Event>
-void Program::LongpollMgr<State, Event>::startLongpoll(boost::shared_ptr<strm::socket> sock, const std::string & token) {
-	// TODO. For example, handle tokens correctly.
-	longpollSock_.reset();
-	if (token.empty()) {
-		startWrite(sock, stateResponse(state_, nextToken()));
-		eventQueue_.clear();
-	}
-	else {
-		if (eventQueue_.empty()) {
-			// Go into waiting state
-			longpollSock_ = sock;
-		}
-		else {
-			startWrite(sock, eventResponse(state_, nextToken(), eventQueue_));
-			eventQueue_.clear();
-		}
+Program::LongpollMgr<State, Event>::~LongpollMgr() {
+	// A compaction under way is finished; the ones that didn't start aren't needed, the journals have it all.
+	compactWork_.reset();
+	compactIo_.stop();
+	if (compactThread_.joinable()) {
+		compactThread_.join();
 	}
 }
 
 template <typename State, typename Event>
-void Program::LongpollMgr<State, Event>::startWrite(boost::shared_ptr<strm::socket> sock, const std::string & data) {
-	boost::shared_ptr<std::string> dataPtr(new std::string(data));
-	boost::asio::async_write(*sock, boost::asio::buffer(*dataPtr), boost::bind(&LongpollMgr<State, Event>::onWrite, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, sock, dataPtr));
+uint64_t Program::LongpollMgr<State, Event>::firstSeq() {
+	// Start numbering from the clock, so that tokens from an earlier run are always too old and get a resync.
+	return boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::system_clock::now().time_since_epoch()).count();
 }
 
 template <typename State, typename Event>
-void Program::LongpollMgr<State, Event>::onWrite(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> data) {
-	(void) data;
-	sock->close();
-	sock.reset();
-	// Start listening for a new connection
-	startAccept();
+typename Program::LongpollMgr<State, Event>::Shard & Program::LongpollMgr<State, Event>::getShard(const std::string & channel) {
+	// The unnamed channel is in the first shard, so that a journal from before channels is still found.
+	return *shards_[channel.empty() ? 0 : boost::hash<std::string>()(channel) % shards_.size()];
 }
 
 template <typename State, typename Event>
-uint8_t Program::LongpollMgr<State, Event>::nextToken() {
-	if (++lastToken_ == 0) {
-		++lastToken_;
+typename Program::LongpollMgr<State, Event>::Channel & Program::LongpollMgr<State, Event>::getChannel(Shard & shard, const std::string & name) {
+	typename boost::unordered_map<std::string, Channel>::iterator it = shard.channels_.find(name);
+	if (it == shard.channels_.end()) {
+		if (shard.channels_.size() >= shard.sweepAt_) {
+			sweepChannels(shard);
+		}
+		it = shard.channels_.insert(std::make_pair(name, Channel(shard.defaults_, firstSeq()))).first;
 	}
-	return lastToken_;
+	return it->second;
 }
 
-Program::SensorLongpollMgr::SensorLongpollMgr(Program & program, const std::string & addr)
-	:	LongpollMgr<State, Event>(program, addr) {
+template <typename State, typename Event>
+typename Program::LongpollMgr<State, Event>::Channel * Program::LongpollMgr<State, Event>::findChannel(Shard & shard, const std::string & name) {
+	typename boost::unordered_map<std::string, Channel>::iterator it = shard.channels_.find(name);
+	return it == shard.channels_.end() ? NULL : &it->second;
 }
 
-void Program::SensorLongpollMgr::onGuiCommand(const std::string & command) {
-	std::string cmdLine(command.substr(0, command.find('\n'))), content(command.substr(cmdLine.size()+1));
-	Event evt;
-	evt.content_.assign(content.begin(), content.end());
-	if (cmdLine == "led") {
-		evt.event_ = LED;
-		onEvent(evt);
-	}
-	else if (cmdLine == "siren_ctrl") {
-		evt.event_ = SIREN_CTRL;
-		onEvent(evt);
-	}
-	else if (cmdLine == "smoke_sleep") {
-		evt.event_ = SMOKE_SLEEP;
-		onEvent(evt);
-	}
-	//else if (cmdLine == "audio_stream") {
-	//}
-	else {
-		// error?
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::sweepChannels(Shard & shard) {
+	std::string defaults(saveState(shard.defaults_));
+	for (typename boost::unordered_map<std::string, Channel>::iterator it = shard.channels_.begin(); it != shard.channels_.end(); ) {
+		const Channel & channel = it->second;
+		if (!it->first.empty() && channel.waiting_.empty() && channel.subscribers_.empty() && saveState(channel.state_) == defaults) {
+			it = shard.channels_.erase(it);
+		}
+		else {
+			++it;
+		}
 	}
+	// What's left is in use. Sweep again once there are as many more, so that a sweep's cost is spread over them.
+	shard.sweepAt_ = std::max<std::size_t>(SHARD_CHANNELS_MAX, shard.channels_.size() * 2);
 }
 
-void Program::SensorLongpollMgr::onGuiAudio(const std::vector<uint8_t> & audio) {
-	Event evt;
-	evt.event_ = AUDIO_STREAM;
-	evt.content_ = audio;
-	onEvent(evt);
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::parseLine(const std::string & line, std::string & token, std::string & options) {
+	// "<token>[ <options>]"
+	std::string::size_type space = line.find(' ');
+	token = line.substr(0, space);
+	options = (space == std::string::npos ? std::string() : line.substr(space + 1));
 }
 
-void Program::SensorLongpollMgr::updateState(State & state, const Event & evt) {
-	switch (evt.event_) {
-	case LED:
-		state.led_ = std::string(evt.content_.begin(), evt.content_.end());
-		break;
-	case SIREN_CTRL:
-		state.sirenCtrl_ = std::string(evt.content_.begin(), evt.content_.end());
-		break;
-	default:
-		break;
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::openJournal(const std::string & path) {
+	for (std::size_t i = 0; i < shards_.size(); i++) {
+		Shard & shard = *shards_[i];
+		shard.journal_.reset(new Journal(i == 0 ? path : path + "." + boost::lexical_cast<std::string>(i)));
+		shard.journal_->replay(boost::bind(&LongpollMgr<State, Event>::onReplaySnapshot, this, boost::ref(shard), _1), boost::bind(&LongpollMgr<State, Event>::onReplayRecord, this, boost::ref(shard), _1));
+		// Start from a compact snapshot, so the next startup is fast too.
+		shard.journal_->snapshot(saveShard(shard));
 	}
+	compactWork_.reset(new boost::asio::io_service::work(compactIo_));
+	compactThread_ = boost::thread(boost::bind(&boost::asio::io_service::run, &compactIo_));
 }
 
-std::string Program::SensorLongpollMgr::stateResponse(const State & state, uint8_t token) {
-	std::ostringstream response;
-	response << uint8_t(LED       ) << uint8_t(state.led_.size()       >> 8) << uint8_t(state.led_.size()      ) << state.led_.substr      (0, 0xffff);
-	response << uint8_t(SIREN_CTRL) << uint8_t(state.sirenCtrl_.size() >> 8) << uint8_t(state.sirenCtrl_.size()) << state.sirenCtrl_.substr(0, 0xffff);
-	response << uint8_t(TOKEN) << uint8_t(0) << uint8_t(1) << token;
-	return response.str();
-}
-
-std::string Program::SensorLongpollMgr::eventResponse(const State & state, uint8_t token, const std::deque<Event> & eventQueue) {
-	(void) state;
-	std::ostringstream response;
-	for (std::deque<Event>::const_iterator it = eventQueue.begin(); it != eventQueue.end(); ++it) {
-		const Event & item = *it;
-		response << uint8_t(item.event_) << uint8_t(item.content_.size() >> 8) << uint8_t(item.content_.size()) << std::string(item.content_.begin(), item.content_.begin() + std::min<std::string::size_type>(0xffff, item.content_.size()));
+namespace {
+	const std::string SNAPSHOT_MAGIC("\xff" "channels\n");
+	
+	void putField(std::string & data, const std::string & field) {
+		uint32_t size = field.size();
+		data.append(reinterpret_cast<const char *>(&size), sizeof(size));
+		data.append(field);
+	}
+	
+	bool getField(const std::string & data, std::size_t & pos, std::string & field) {
+		uint32_t size;
+		if (data.size() - pos < sizeof(size)) {
+			return false;
+		}
+		std::memcpy(&size, data.data() + pos, sizeof(size));
+		pos += sizeof(size);
+		if (data.size() - pos < size) {
+			return false;
+		}
+		field = data.substr(pos, size);
+		pos += size;
+		return true;
 	}
-	response << uint8_t(TOKEN) << uint8_t(0) << uint8_t(1) << token;
-	return response.str();
 }
 
-Program::SensorEventMgr::SensorEventMgr(Program & program, const std::string & addr)
-	:	Mgr(program, addr) {
+template <typename State, typename Event>
+std::string Program::LongpollMgr<State, Event>::saveShard(const Shard & shard) {
+	// The defaults as channel "*", then every channel: name, groups (comma-separated), state
+	std::string data(SNAPSHOT_MAGIC);
+	putField(data, "*");
+	putField(data, "");
+	putField(data, saveState(shard.defaults_));
+	for (typename boost::unordered_map<std::string, Channel>::const_iterator it = shard.channels_.begin(); it != shard.channels_.end(); ++it) {
+		std::string groups;
+		for (std::set<std::string>::const_iterator group = it->second.groups_.begin(); group != it->second.groups_.end(); ++group) {
+			groups += (groups.empty() ? "" : ",") + *group;
+		}
+		putField(data, it->first);
+		putField(data, groups);
+		putField(data, saveState(it->second.state_));
+	}
+	return data;
 }
 
-void Program::SensorEventMgr::onAccept(boost::shared_ptr<strm::socket> sock, const boost::system::error_code & error) {
-	if (!error) {
-		startRead(sock);
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::onReplaySnapshot(Shard & shard, const std::string & data) {
+	State state;
+	if (data.compare(0, SNAPSHOT_MAGIC.size(), SNAPSHOT_MAGIC) != 0) {
+		if (loadState(data, state)) {
+			shard.defaults_ = state;
+			getChannel(shard, "").state_ = state;
+		}
+		return;
 	}
-	else {
-		// TODO: error
+	std::size_t pos = SNAPSHOT_MAGIC.size();
+	std::string name, groups, stateData;
+	while (getField(data, pos, name) && getField(data, pos, groups) && getField(data, pos, stateData)) {
+		if (!loadState(stateData, state)) {
+			continue;
+		}
+		if (name == "*") {
+			shard.defaults_ = state;
+			continue;
+		}
+		Channel & channel = getChannel(shard, name);
+		channel.state_ = state;
+		std::istringstream in(groups);
+		std::string group;
+		while (std::getline(in, group, ',')) {
+			channel.groups_.insert(group);
+		}
 	}
 }
 
-void Program::SensorEventMgr::startRead(boost::shared_ptr<strm::socket> sock) {
-	boost::shared_ptr< std::vector<uint8_t> > data(new std::vector<uint8_t>(SE_LINE_LEN_MAX));
-	sock->async_read_some(boost::asio::buffer(*data), boost::bind(&SensorEventMgr::onRead, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, sock, data));
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::onReplayRecord(Shard & shard, const std::string & record) {
+	Event evt;
+	std::string name("*"), eventRecord(record);
+	if (!record.empty() && record[0] == '\xff') {
+		std::string::size_type newline = record.find('\n');
+		if (newline == std::string::npos) {
+			return;
+		}
+		name = record.substr(1, newline - 1);
+		eventRecord = record.substr(newline + 1);
+	}
+	if (!loadEvent(eventRecord, evt)) {
+		return;
+	}
+	if (name != "*") {
+		updateState(getChannel(shard, name).state_, evt);
+		return;
+	}
+	updateState(shard.defaults_, evt);
+	for (typename boost::unordered_map<std::string, Channel>::iterator it = shard.channels_.begin(); it != shard.channels_.end(); ++it) {
+		updateState(it->second.state_, evt);
+	}
 }
 
-void Program::SensorEventMgr::onRead(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > data) {
-	bool handleError = false;
-	for (size_t i = 0; i < bytes_transferred; i++) {
-		uint8_t c = (*data)[i];
-		readBuf_ += c;
-		if (c == '\n') {
-			processLine(readBuf_);
-			readBuf_.clear();
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::journalEvent(Shard & shard, const std::string & channel, const Event & evt) {
+	std::string record;
+	if (!shard.journal_ || !saveEvent(evt, record)) {
+		return;
+	}
+	try {
+		shard.journal_->append('\xff' + channel + '\n' + record);
+		if (shard.journal_->records() >= JOURNAL_COMPACT_RECORDS && !shard.compacting_) {
+			// The state is copied here, on the strand, as of the mark; the rest is done off it.
+			shard.compacting_ = true;
+			compactIo_.post(boost::bind(&LongpollMgr<State, Event>::compact, this, boost::ref(shard), shard.journal_, saveShard(shard), shard.journal_->mark()));
 		}
-		else if (readBuf_.size() >= SE_LINE_LEN_MAX) {
-			handleError = true;
+		if (!shard.syncPending_) {
+			// Everything appended until the timer goes off gets flushed with a single sync.
+			shard.syncPending_ = true;
+			shard.syncTimer_.expires_from_now(boost::chrono::milliseconds(int(JOURNAL_SYNC_TIME)));
+			shard.syncTimer_.async_wait(shard.strand_.wrap(boost::bind(&LongpollMgr<State, Event>::onSyncTimer, this, boost::ref(shard), boost::asio::placeholders::error)));
 		}
 	}
-	if (error || handleError) {
-		// error.
-		// Close the current connection and start listening for a new one.
-		sock->close();
-		sock.reset();
-		startAccept();
-	}
-	else {
-		startRead(sock);
+	catch (const std::exception & e) {
+		std::cerr << "Journal error, the state is no longer saved: " << e.what() << std::endl;
+		shard.journal_.reset();
 	}
 }
 
-void Program::SensorEventMgr::processLine(const std::string & line) {
-	// TODO
-	if (line == "smoke_on\n") {
-		program_.onSensorEvent(SMOKE_ON);
-	}
-	else if (line == "smoke_off\n") {
-		program_.onSensorEvent(SMOKE_OFF);
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::compact(Shard & shard, boost::shared_ptr<Journal> journal, const std::string & state, const Journal::Mark & mark) {
+	std::string error;
+	try {
+		journal->snapshot(state, mark);
 	}
-	else if (line == "motion\n") {
-		program_.onSensorEvent(MOTION);
+	catch (const std::exception & e) {
+		error = e.what();
 	}
-	else {
-		// error...?
+	shard.strand_.post(boost::bind(&LongpollMgr<State, Event>::onCompacted, this, boost::ref(shard), journal, error));
+}
+
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::onCompacted(Shard & shard, boost::shared_ptr<Journal> journal, const std::string & error) {
+	shard.compacting_ = false;
+	if (!error.empty() && shard.journal_ == journal) {
+		std::cerr << "Journal error, the state is no longer saved: " << error << std::endl;
+		shard.journal_.reset();
 	}
 }
 
-Program::GuiLongpollMgr::GuiLongpollMgr(Program & program, const std::string & addr)
-	:	LongpollMgr<State, Event>(program, addr) {
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::onSyncTimer(Shard & shard, const boost::system::error_code & error) {
+	shard.syncPending_ = false;
+	if (!error && shard.journal_) {
+		shard.journal_->sync();
+	}
 }
 
-void Program::GuiLongpollMgr::onSensorEvent(Program::SensorEvent evt) {
-	Event timedEvent;
-	timedEvent.time_ = boost::chrono::system_clock::now();
-	timedEvent.event_ = evt;
-	onEvent(timedEvent);
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::postEvent(const Event & evt, const Target & target) {
+	if (target.kind_ == Target::CHANNEL) {
+		Shard & shard = getShard(target.name_);
+		queued_.add(1);
+		shard.strand_.dispatch(boost::bind(&LongpollMgr<State, Event>::onEvent, this, boost::ref(shard), evt, target));
+		return;
+	}
+	// The event is the same for every shard, so whatever it references is shared by all of them.
+	queued_.add(shards_.size());
+	for (std::size_t i = 0; i < shards_.size(); i++) {
+		shards_[i]->strand_.dispatch(boost::bind(&LongpollMgr<State, Event>::onEvent, this, boost::ref(*shards_[i]), evt, target));
+	}
 }
 
-void Program::GuiLongpollMgr::updateState(State & state, const Event & evt) {
-	switch (evt.event_) {
-	case SMOKE_ON:
-		state.smokeState_ = true;
-		state.hasLastSmokeEvent_ = true;
-		state.lastSmokeEvent_ = evt.time_;
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::onEvent(Shard & shard, const Event & evt, const Target & target) {
+	queued_.add(-1);
+	switch (target.kind_) {
+	case Target::CHANNEL:
+		journalEvent(shard, target.name_, evt);
+		applyEvent(getChannel(shard, target.name_), evt);
 		break;
-	case SMOKE_OFF:
-		state.smokeState_ = false;
-		state.hasLastSmokeEvent_ = true;
-		state.lastSmokeEvent_ = evt.time_;
+	case Target::GROUP:
+		for (typename boost::unordered_map<std::string, Channel>::iterator it = shard.channels_.begin(); it != shard.channels_.end(); ++it) {
+			if (it->second.groups_.count(target.name_)) {
+				journalEvent(shard, it->first, evt);
+				applyEvent(it->second, evt);
+			}
+		}
 		break;
-	case MOTION:
-		state.hasLastMotion_ = true;
-		state.lastMotion_ = evt.time_;
+	case Target::ALL:
+		updateState(shard.defaults_, evt);
+		journalEvent(shard, "*", evt);
+		for (typename boost::unordered_map<std::string, Channel>::iterator it = shard.channels_.begin(); it != shard.channels_.end(); ++it) {
+			applyEvent(it->second, evt);
+		}
 		break;
 	}
 }
 
-std::string Program::GuiLongpollMgr::stateResponse(const State & state, uint8_t token) {
-	std::ostringstream response;
-	(state.hasLastSmokeEvent_ ? (response << timeToString(state.lastSmokeEvent_)) : (response << '-')) << ' ' << (state.smokeState_ ? "smoke_on" : "smoke_off") << '\n';
-	if (state.hasLastMotion_) {
-		response << timeToString(state.lastMotion_) << ' ' << "motion" << '\n';
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::applyEvent(Channel & channel, const Event & evt) {
+	updateState(channel.state_, evt);
+	channel.log_.push(evt);
+	// Waiting clients and subscribers have seen everything before this event.
+	// So all the clients asking for the same format get the same bytes, and those are encoded only once.
+	std::map<int, Response> responses;
+	if (!channel.waiting_.empty()) {
+		std::map<boost::shared_ptr<Poller>, int> pollers;
+		pollers.swap(channel.waiting_);
+		parked_.add(-int64_t(pollers.size()));
+		for (std::map<boost::shared_ptr<Poller>, int>::const_iterator it = pollers.begin(); it != pollers.end(); ++it) {
+			Response & response = responses[it->second];
+			if (!response) {
+				response = eventResponse(channel.state_, channel.log_.lastSeq(), channel.log_, channel.log_.lastSeq() - 1, it->second);
+			}
+			it->first->onResponse(response);
+		}
 	}
-	response << "token:" << static_cast<unsigned int>(token) << '\n';
-	return response.str();
-}
-
-std::string Program::GuiLongpollMgr::eventResponse(const State & state, uint8_t token, const std::deque<Event> & eventQueue) {
-	(void) state;
-	std::ostringstream response;
-	for (std::deque<Event>::const_iterator it = eventQueue.begin(); it != eventQueue.end(); ++it) {
-		const Event & item = *it;
-		std::string eventType;
-		switch (item.event_) {
-		case SMOKE_ON:  eventType = "smoke_on" ; break;
-		case SMOKE_OFF: eventType = "smoke_off"; break;
-		case MOTION:    eventType = "motion"   ; break;
+	for (typename std::map<boost::shared_ptr<Subscriber>, int>::const_iterator it = channel.subscribers_.begin(); it != channel.subscribers_.end(); ++it) {
+		Response & response = responses[it->second];
+		if (!response) {
+			response = eventResponse(channel.state_, channel.log_.lastSeq(), channel.log_, channel.log_.lastSeq() - 1, it->second);
 		}
-		response << timeToString(item.time_) << ' ' << eventType << '\n';
+		it->first->onResponse(response);
 	}
-	response << "token:" << static_cast<unsigned int>(token) << '\n';
-	return response.str();
 }
 
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::subscribe(boost::shared_ptr<Subscriber> subscriber, const std::string & options, const std::string & token) {
+	std::set<std::string> groups;
+	Shard & shard = getShard(parseChannel(options, groups));
+	shard.strand_.dispatch(boost::bind(&LongpollMgr<State, Event>::onSubscribe, this, boost::ref(shard), subscriber, options, token));
+}
 
-Program::GuiEventMgr::GuiEventMgr(Program & program, const std::string & addr)
-	:	Mgr(program, addr) {
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::unsubscribe(boost::shared_ptr<Subscriber> subscriber, const std::string & options) {
+	std::set<std::string> groups;
+	std::string channel(parseChannel(options, groups));
+	Shard & shard = getShard(channel);
+	shard.strand_.dispatch(boost::bind(&LongpollMgr<State, Event>::onUnsubscribe, this, boost::ref(shard), subscriber, channel));
 }
 
-void Program::GuiEventMgr::onAccept(boost::shared_ptr<strm::socket> sock, const boost::system::error_code & error) {
-	if (!error) {
-		startRead(sock, &GuiEventMgr::onReadFirstLine);
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::onSubscribe(Shard & shard, boost::shared_ptr<Subscriber> subscriber, const std::string & options, const std::string & token) {
+	std::set<std::string> groups;
+	Channel & channel = getChannel(shard, parseChannel(options, groups));
+	channel.groups_.swap(groups);
+	int format = parseFormat(options);
+	channel.subscribers_[subscriber] = format;
+	uint64_t since;
+	if (parseToken(token, since) && channel.log_.covers(since)) {
+		if (since != channel.log_.lastSeq()) {
+			subscriber->onResponse(eventResponse(channel.state_, channel.log_.lastSeq(), channel.log_, since, format));
+		}
 	}
 	else {
-		// TODO: error
+		subscriber->onResponse(stateResponse(channel.state_, channel.log_.lastSeq(), !token.empty(), format));
 	}
 }
 
-void Program::GuiEventMgr::startRead(boost::shared_ptr<strm::socket> sock, void(GuiEventMgr::*handler)(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > data)) {
-	boost::shared_ptr< std::vector<uint8_t> > data(new std::vector<uint8_t>(BUF_SIZE));
-	sock->async_read_some(boost::asio::buffer(*data), boost::bind(handler, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, sock, data));
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::onUnsubscribe(Shard & shard, boost::shared_ptr<Subscriber> subscriber, std::string channel) {
+	if (Channel * found = findChannel(shard, channel)) {
+		found->subscribers_.erase(subscriber);
+	}
 }
 
-void Program::GuiEventMgr::onReadFirstLine(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > data) {
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::poll(boost::shared_ptr<Poller> poller, const std::string & line) {
+	std::string token, options;
+	std::set<std::string> groups;
+	parseLine(line, token, options);
+	Shard & shard = getShard(parseChannel(options, groups));
+	shard.strand_.dispatch(boost::bind(&LongpollMgr<State, Event>::startLongpoll, this, boost::ref(shard), poller, line));
+}
+
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::cancelPoll(boost::shared_ptr<Poller> poller, const std::string & line) {
+	std::string token, options;
+	std::set<std::string> groups;
+	parseLine(line, token, options);
+	std::string channel(parseChannel(options, groups));
+	Shard & shard = getShard(channel);
+	shard.strand_.dispatch(boost::bind(&LongpollMgr<State, Event>::onWaitingClosed, this, boost::ref(shard), poller, channel));
+}
+
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::onAccept(boost::shared_ptr<strm::socket> sock) {
+	boost::shared_ptr<Session> session(new Session(*this, sock));
+	session->start();
+}
+
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::startLongpoll(Shard & shard, boost::shared_ptr<Poller> poller, const std::string & line) {
+	std::string token, options;
+	std::set<std::string> groups;
+	parseLine(line, token, options);
+	Channel & channel = getChannel(shard, parseChannel(options, groups));
+	channel.groups_.swap(groups);
+	int format = parseFormat(options);
+	uint64_t since;
+	if (token.empty()) {
+		poller->onResponse(stateResponse(channel.state_, channel.log_.lastSeq(), false, format));
+	}
+	else if (!parseToken(token, since) || !channel.log_.covers(since)) {
+		// The events after the token are gone (or never existed), so start over from the full state.
+		poller->onResponse(stateResponse(channel.state_, channel.log_.lastSeq(), true, format));
+	}
+	else if (since == channel.log_.lastSeq()) {
+		// Go into waiting state
+		if (channel.waiting_.insert(std::make_pair(poller, format)).second) {
+			parked_.add(1);
+		}
+	}
+	else {
+		poller->onResponse(eventResponse(channel.state_, channel.log_.lastSeq(), channel.log_, since, format));
+	}
+}
+
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::onWaitingClosed(Shard & shard, boost::shared_ptr<Poller> poller, std::string channel) {
+	if (Channel * found = findChannel(shard, channel)) {
+		parked_.add(-int64_t(found->waiting_.erase(poller)));
+	}
+}
+
+template <typename State, typename Event>
+Program::LongpollMgr<State, Event>::Session::Session(LongpollMgr & mgr, boost::shared_ptr<strm::socket> sock)
+	:	mgr_(mgr),
+		sock_(sock),
+		data_(GL_LINE_LEN_MAX) {
+}
+
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::Session::startRead() {
+	sock_->async_read_some(boost::asio::buffer(data_), mgr_.getStrand().wrap(boost::bind(&Session::onRead, this->shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::Session::onRead(const boost::system::error_code & error, std::size_t bytes_transferred) {
+	// TODO
+	bool handleError = false;
+	bool finishRead = false;
+	for (size_t i = 0; i < bytes_transferred; i++) {
+		uint8_t c = data_[i];
+		readBuf_ += c;
+		if (c == '\n') {
+			line_ = readBuf_.substr(0, readBuf_.size()-1);
+			readBuf_.clear();
+			finishRead = true;
+			break;
+		}
+		else if (readBuf_.size() >= GL_LINE_LEN_MAX) {
+			handleError = true;
+			break;
+		}
+	}
+	// We can try even if we have an error.
+	if (finishRead) {
+		// Until it's answered, a completed read means the client went away.
+		startWatch();
+		mgr_.poll(this->shared_from_this(), line_);
+	}
+	else if (error || handleError) {
+		// error.
+		sock_->close();
+	}
+	else {
+		startRead();
+	}
+}
+
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::Session::startWatch() {
+	// The client sends nothing more while waiting, so a completed read means it went away.
+	sock_->async_read_some(boost::asio::buffer(data_, 1), mgr_.getStrand().wrap(boost::bind(&Session::onWatch, this->shared_from_this(), boost::asio::placeholders::error)));
+}
+
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::Session::onWatch(const boost::system::error_code & error) {
+	// If this session has already been answered, the read was just cancelled by the close.
+	if (error != boost::asio::error::operation_aborted) {
+		mgr_.cancelPoll(this->shared_from_this(), line_);
+		sock_->close();
+	}
+}
+
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::Session::onResponse(Response response) {
+	// From the shard's strand, over to the one of the socket
+	mgr_.getStrand().dispatch(boost::bind(&Session::startWrite, this->shared_from_this(), response));
+}
+
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::Session::startWrite(Response response) {
+	if (!sock_->is_open()) {
+		return;
+	}
+	boost::asio::async_write(*sock_, response->buffers(), mgr_.getStrand().wrap(boost::bind(&Session::onWrite, this->shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, response)));
+}
+
+template <typename State, typename Event>
+void Program::LongpollMgr<State, Event>::Session::onWrite(const boost::system::error_code & error, std::size_t bytes_transferred, Response response) {
+	mgr_.written_.add(bytes_transferred);
+	if (!error) {
+		mgr_.program_.onDelivered(response);
+	}
+	sock_->close();
+}
+
+template <typename State, typename Event>
+bool Program::LongpollMgr<State, Event>::parseToken(const std::string & str, uint64_t & token) {
+	if (str.empty() || str.size() > 19) { // 19 digits always fit in 64 bits
+		return false;
+	}
+	token = 0;
+	for (std::string::const_iterator it = str.begin(); it != str.end(); ++it) {
+		if (*it < '0' || *it > '9') {
+			return false;
+		}
+		token = token * 10 + (*it - '0');
+	}
+	return true;
+}
+
+Program::SensorLongpollMgr::SensorLongpollMgr(Program & program, const std::string & addr)
+	:	LongpollMgr<State, Event>(program, addr, "sensor_longpoll", SENSOR_SHARDS) {
+}
+
+void Program::SensorLongpollMgr::onGuiCommand(const std::string & command) {
+	std::string cmdLine(command.substr(0, command.find('\n'))), content(command.substr(cmdLine.size()+1));
+	std::istringstream in(cmdLine);
+	std::string name, target;
+	in >> name >> target;
+	Target to;
+	if (target.compare(0, 5, "node=") == 0 && isNodeName(target.substr(5))) {
+		to = Target(Target::CHANNEL, target.substr(5));
+	}
+	else if (target.compare(0, 6, "group=") == 0 && isNodeName(target.substr(6))) {
+		to = Target(Target::GROUP, target.substr(6));
+	}
+	else if (!target.empty()) {
+		// error?
+		return;
+	}
+	Event evt;
+	evt.content_ = SharedBuffer::copyOf(content);
+	evt.encoded_.reset(new Encoded);
+	if (name == "led") {
+		evt.event_ = Protocol::LED;
+		postEvent(evt, to);
+	}
+	else if (name == "siren_ctrl") {
+		evt.event_ = Protocol::SIREN_CTRL;
+		postEvent(evt, to);
+	}
+	else if (name == "smoke_sleep") {
+		evt.event_ = Protocol::SMOKE_SLEEP;
+		postEvent(evt, to);
+	}
+	//else if (name == "audio_stream") {
+	//}
+	else {
+		// error?
+	}
+}
+
+void Program::SensorLongpollMgr::onGuiAudio(const SharedBuffer & audio) {
+	Event evt;
+	evt.event_ = Protocol::AUDIO_STREAM;
+	evt.content_ = audio;
+	evt.encoded_.reset(new Encoded);
+	postEvent(evt);
+}
+
+void Program::SensorLongpollMgr::updateState(State & state, const Event & evt) {
+	switch (evt.event_) {
+	case Protocol::LED:
+		state.led_ = evt.content_.str();
+		break;
+	case Protocol::SIREN_CTRL:
+		state.sirenCtrl_ = evt.content_.str();
+		break;
+	default:
+		break;
+	}
+}
+
+int Program::SensorLongpollMgr::parseFormat(const std::string & options) {
+	// The format is the audio codec: the first of "codecs=<name>,<name>,..." that we know, but mu-law. The audio
+	// is uploaded as 8-bit PCM, so mu-law would be no smaller than pcm8, and only lose quality.
+	std::istringstream in(options);
+	std::string option;
+	while (in >> option) {
+		if (option.compare(0, 7, "codecs=") == 0) {
+			std::istringstream names(option.substr(7));
+			std::string name;
+			AudioCodec::Type codec;
+			while (std::getline(names, name, ',')) {
+				if (AudioCodec::parse(name, codec) && codec != AudioCodec::MULAW) {
+					return codec;
+				}
+			}
+		}
+	}
+	return AudioCodec::PCM8;
+}
+
+Program::SensorLongpollMgr::Response Program::SensorLongpollMgr::stateResponse(const State & state, uint64_t token, bool resync, int format) {
+	(void) format;
+	boost::shared_ptr<GatherMessage> response(new GatherMessage);
+	if (resync) {
+		LongpollEncoder::putMsg(*response, Protocol::RESYNC, "");
+	}
+	LongpollEncoder::putMsg(*response, Protocol::LED, state.led_);
+	LongpollEncoder::putMsg(*response, Protocol::SIREN_CTRL, state.sirenCtrl_);
+	LongpollEncoder::putToken(*response, token);
+	return response;
+}
+
+Program::SensorLongpollMgr::Response Program::SensorLongpollMgr::eventResponse(const State & state, uint64_t token, const EventLog & log, uint64_t since, int format) {
+	(void) state;
+	// The events are referenced, as encoded for the first node that needed them; only the token is the node's own.
+	boost::shared_ptr<GatherMessage> response(new GatherMessage);
+	for (uint64_t seq = since + 1; seq <= log.lastSeq(); seq++) {
+		const Event & item = log.at(seq);
+		if (!item.encoded_) {
+			response->append(LongpollEncoder::encode(item.event_, item.content_, AudioCodec::Type(format)));
+			continue;
+		}
+		boost::mutex::scoped_lock lock(item.encoded_->mutex_);
+		SharedBuffer & message = item.encoded_->messages_[format];
+		if (message.size() == 0) {
+			message = LongpollEncoder::encode(item.event_, item.content_, AudioCodec::Type(format));
+		}
+		response->append(message);
+	}
+	LongpollEncoder::putToken(*response, token);
+	return response;
+}
+
+bool Program::SensorLongpollMgr::saveEvent(const Event & evt, std::string & record) {
+	if (evt.event_ != Protocol::LED && evt.event_ != Protocol::SIREN_CTRL) {
+		return false;
+	}
+	record.assign(1, char(evt.event_));
+	record.append(evt.content_.str());
+	return true;
+}
+
+bool Program::SensorLongpollMgr::loadEvent(const std::string & record, Event & evt) {
+	if (record.empty()) {
+		return false;
+	}
+	evt.event_ = GuiEvent(uint8_t(record[0]));
+	evt.content_ = SharedBuffer::copyOf(record.substr(1));
+	evt.encoded_.reset(new Encoded);
+	return true;
+}
+
+std::string Program::SensorLongpollMgr::saveState(const State & state) {
+	uint32_t size = state.led_.size();
+	std::string data(reinterpret_cast<const char *>(&size), sizeof(size));
+	return data + state.led_ + state.sirenCtrl_;
+}
+
+bool Program::SensorLongpollMgr::loadState(const std::string & data, State & state) {
+	uint32_t size;
+	if (data.size() < sizeof(size)) {
+		return false;
+	}
+	std::memcpy(&size, data.data(), sizeof(size));
+	if (data.size() - sizeof(size) < size) {
+		return false;
+	}
+	state.led_ = data.substr(sizeof(size), size);
+	state.sirenCtrl_ = data.substr(sizeof(size) + size);
+	return true;
+}
+
+Program::SensorEventMgr::SensorEventMgr(Program & program, const std::string & addr)
+	:	Mgr(program, addr, "sensor_event") {
+}
+
+void Program::SensorEventMgr::onAccept(boost::shared_ptr<strm::socket> sock) {
+	boost::shared_ptr<Session> session(new Session(*this, sock));
+	session->start();
+}
+
+Program::SensorEventMgr::Session::Session(SensorEventMgr & mgr, boost::shared_ptr<strm::socket> sock)
+	:	mgr_(mgr),
+		sock_(sock),
+		data_(SE_LINE_LEN_MAX) {
+}
+
+void Program::SensorEventMgr::Session::startRead() {
+	sock_->async_read_some(boost::asio::buffer(data_), boost::bind(&Session::onRead, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+}
+
+void Program::SensorEventMgr::Session::onRead(const boost::system::error_code & error, std::size_t bytes_transferred) {
+	bool handleError = false;
+	for (size_t i = 0; i < bytes_transferred; i++) {
+		uint8_t c = data_[i];
+		readBuf_ += c;
+		if (c == '\n') {
+			mgr_.processLine(readBuf_);
+			readBuf_.clear();
+		}
+		else if (readBuf_.size() >= SE_LINE_LEN_MAX) {
+			handleError = true;
+		}
+	}
+	if (error || handleError) {
+		// error.
+		sock_->close();
+	}
+	else {
+		startRead();
+	}
+}
+
+void Program::SensorEventMgr::processLine(const std::string & line) {
+	Protocol::EventLine evt;
+	if (!Protocol::parseEventLine(line.data(), line.size(), evt)) {
+		// error...?
+		return;
+	}
+	processEvent(evt);
+}
+
+void Program::SensorEventMgr::processEvent(const Protocol::EventLine & evt) {
+	program_.onSensorEvent(evt.node_, evt.event_, evt.count_, evt.firstAge_, evt.lastAge_);
+}
+
+Program::GuiLongpollMgr::GuiLongpollMgr(Program & program, const std::string & addr)
+	:	LongpollMgr<State, Event>(program, addr, "gui_longpoll") {
+}
+
+void Program::GuiLongpollMgr::onSensorEvent(const std::string & node, Program::SensorEvent evt, unsigned int count, unsigned int firstAge, unsigned int lastAge) {
+	// The GUI only needs to hear about the batch once, as of its last event.
+	boost::chrono::system_clock::time_point now = boost::chrono::system_clock::now();
+	Event timedEvent;
+	timedEvent.time_ = now - boost::chrono::milliseconds(lastAge);
+	timedEvent.event_ = evt;
+	timedEvent.node_ = node;
+	timedEvent.received_ = boost::chrono::steady_clock::now(); // SensorEventMgr::processEvent() calls this right after parsing the line
+	if (program_.history_) {
+		// Every event of the batch counts, not only the ones the GUI hears about. The count comes from the node,
+		// so it's bounded.
+		int64_t nowMs = boost::chrono::duration_cast<boost::chrono::milliseconds>(now.time_since_epoch()).count();
+		program_.history_->append(nowMs - firstAge, nowMs - lastAge, evt, std::min<unsigned int>(count, HISTORY_BATCH_MAX));
+	}
+	postEvent(timedEvent);
+}
+
+void Program::GuiLongpollMgr::updateState(State & state, const Event & evt) {
+	switch (evt.event_) {
+	case Protocol::SMOKE_ON:
+		state.smokeState_ = true;
+		state.hasLastSmokeEvent_ = true;
+		state.lastSmokeEvent_ = evt.time_;
+		state.lastSmokeNode_ = evt.node_;
+		break;
+	case Protocol::SMOKE_OFF:
+		state.smokeState_ = false;
+		state.hasLastSmokeEvent_ = true;
+		state.lastSmokeEvent_ = evt.time_;
+		state.lastSmokeNode_ = evt.node_;
+		break;
+	case Protocol::MOTION:
+		state.hasLastMotion_ = true;
+		state.lastMotion_ = evt.time_;
+		state.lastMotionNode_ = evt.node_;
+		break;
+	}
+}
+
+int Program::GuiLongpollMgr::parseFormat(const std::string & options) {
+	std::istringstream in(options);
+	std::string option;
+	while (in >> option) {
+		if (option == "stream=sse") {
+			return SSE;
+		}
+	}
+	return TEXT;
+}
+
+Program::GuiLongpollMgr::Response Program::GuiLongpollMgr::stateResponse(const State & state, uint64_t token, bool resync, int format) {
+	std::string response;
+	if (resync) {
+		response += "resync\n";
+	}
+	if (state.hasLastSmokeEvent_) {
+		appendEventLine(response, state.lastSmokeEvent_, state.smokeState_ ? Protocol::SMOKE_ON : Protocol::SMOKE_OFF, state.lastSmokeNode_);
+	}
+	else {
+		response += state.smokeState_ ? "- smoke_on\n" : "- smoke_off\n";
+	}
+	if (state.hasLastMotion_) {
+		appendEventLine(response, state.lastMotion_, Protocol::MOTION, state.lastMotionNode_);
+	}
+	Protocol::appendGuiToken(response, token);
+	return LongpollEncoder::guiResponse(response, token, format == SSE);
+}
+
+Program::GuiLongpollMgr::Response Program::GuiLongpollMgr::eventResponse(const State & state, uint64_t token, const EventLog & log, uint64_t since, int format) {
+	(void) state;
+	std::string response;
+	// Enough for most lines, so that it's allocated once
+	response.reserve((log.lastSeq() - since) * (24 + Protocol::NODE_NAME_LEN_MAX) + 32);
+	for (uint64_t seq = since + 1; seq <= log.lastSeq(); seq++) {
+		const Event & item = log.at(seq);
+		appendEventLine(response, item.time_, item.event_, item.node_);
+	}
+	Protocol::appendGuiToken(response, token);
+	// Timed as of the newest event, so that a client catching up doesn't count the time it was away.
+	return LongpollEncoder::guiResponse(response, token, format == SSE, log.at(log.lastSeq()).received_);
+}
+
+void Program::GuiLongpollMgr::appendEventLine(std::string & text, const boost::chrono::system_clock::time_point & time, SensorEvent evt, const std::string & node) {
+	Protocol::appendGuiEventLine(text, boost::chrono::duration_cast<boost::chrono::seconds>(time.time_since_epoch()).count(), evt, node);
+}
+
+bool Program::GuiLongpollMgr::saveEvent(const Event & evt, std::string & record) {
+	int64_t time = evt.time_.time_since_epoch().count();
+	record.assign(1, char(evt.event_));
+	record.append(reinterpret_cast<const char *>(&time), sizeof(time));
+	record.append(evt.node_);
+	return true;
+}
+
+bool Program::GuiLongpollMgr::loadEvent(const std::string & record, Event & evt) {
+	int64_t time;
+	if (record.size() < 1 + sizeof(time)) {
+		return false;
+	}
+	std::memcpy(&time, record.data() + 1, sizeof(time));
+	evt.node_ = record.substr(1 + sizeof(time));
+	evt.event_ = SensorEvent(uint8_t(record[0]));
+	evt.time_ = boost::chrono::system_clock::time_point(boost::chrono::system_clock::duration(time));
+	return true;
+}
+
+std::string Program::GuiLongpollMgr::saveState(const State & state) {
+	int64_t times[2] = { state.lastSmokeEvent_.time_since_epoch().count(), state.lastMotion_.time_since_epoch().count() };
+	std::string data(1, char(state.smokeState_ | state.hasLastSmokeEvent_ << 1 | state.hasLastMotion_ << 2));
+	data.append(reinterpret_cast<const char *>(times), sizeof(times));
+	return data + state.lastSmokeNode_ + '\n' + state.lastMotionNode_;
+}
+
+bool Program::GuiLongpollMgr::loadState(const std::string & data, State & state) {
+	int64_t times[2];
+	if (data.size() < 1 + sizeof(times)) {
+		return false;
+	}
+	std::memcpy(times, data.data() + 1, sizeof(times));
+	// The nodes are missing from states saved before there were any.
+	std::string nodes(data.substr(1 + sizeof(times)));
+	std::string::size_type newline = nodes.find('\n');
+	state.lastSmokeNode_  = nodes.substr(0, newline);
+	state.lastMotionNode_ = (newline == std::string::npos ? std::string() : nodes.substr(newline + 1));
+	state.smokeState_        = data[0] & 1;
+	state.hasLastSmokeEvent_ = data[0] & 2;
+	state.hasLastMotion_     = data[0] & 4;
+	state.lastSmokeEvent_ = boost::chrono::system_clock::time_point(boost::chrono::system_clock::duration(times[0]));
+	state.lastMotion_     = boost::chrono::system_clock::time_point(boost::chrono::system_clock::duration(times[1]));
+	return true;
+}
+
+Program::GuiEventMgr::GuiEventMgr(Program & program, const std::string & addr)
+	:	Mgr(program, addr, "gui_event") {
+}
+
+void Program::GuiEventMgr::onAccept(boost::shared_ptr<strm::socket> sock) {
+	boost::shared_ptr<Session> session(new Session(*this, sock));
+	session->start();
+}
+
+Program::GuiEventMgr::Session::Session(GuiEventMgr & mgr, boost::shared_ptr<strm::socket> sock)
+	:	mgr_(mgr),
+		sock_(sock),
+		audioStream_(false) {
+}
+
+void Program::GuiEventMgr::Session::startRead(void(Session::*handler)(const boost::system::error_code & error, std::size_t bytes_transferred)) {
+	if (!data_ || !data_.unique()) {
+		data_.reset(new SharedBuffer::Data(BUF_SIZE));
+	}
+	sock_->async_read_some(boost::asio::buffer(*data_), boost::bind(handler, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+}
+
+void Program::GuiEventMgr::Session::onReadFirstLine(const boost::system::error_code & error, std::size_t bytes_transferred) {
 	// TODO
 	bool handleError = false;
 	for (size_t i = 0; i < bytes_transferred; i++) {
-		uint8_t c = (*data)[i];
+		uint8_t c = (*data_)[i];
 		readBuf_ += c;
 		if (c == '\n') {
 			command_ = readBuf_.substr(0, readBuf_.size());
 			audioStream_ = (command_ == "audio_stream\n");
 			readBuf_.clear();
-			data->erase(data->begin(), data->begin() + i + 1);
-			onReadTheRest(error, bytes_transferred - (i + 1), sock, data); // Hacky
+			handleTheRest(error, i + 1, bytes_transferred - (i + 1));
 			return;
 		}
 		else if (readBuf_.size() >= GE_LINE_LEN_MAX) {
@@ -577,59 +1710,795 @@ void Program::GuiEventMgr::onReadFirstLine(const boost::system::error_code & err
 	}
 	if (error || handleError) {
 		// error.
-		// Close the current connection and start listening for a new one.
-		sock->close();
-		sock.reset();
-		startAccept();
+		sock_->close();
 	}
+	else {
+		startRead(&Session::onReadFirstLine);
+	}
+}
+
+void Program::GuiEventMgr::Session::onReadTheRest(const boost::system::error_code & error, std::size_t bytes_transferred) {
+	handleTheRest(error, 0, bytes_transferred);
 }
 
-void Program::GuiEventMgr::onReadTheRest(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > data) {
+void Program::GuiEventMgr::Session::handleTheRest(const boost::system::error_code & error, std::size_t offset, std::size_t size) {
 	// TODO
+	const uint8_t * data = data_->data() + offset;
 	if (audioStream_) {
-		program_.onGuiAudio(*data);
-		if (!error) {
-			startRead(sock, &GuiEventMgr::onReadTheRest);
+		AudioChannel & channel = mgr_.program_.audio_;
+		if (!audio_) {
+			audio_ = channel.open();
+		}
+		mgr_.program_.audioIn_.add(size);
+		if (error) {
+			channel.push(audio_, SharedBuffer(data_, offset, size), AudioChannel::Resume());
+			channel.close(audio_);
+			sock_->close();
 		}
 		else {
-			sock->close();
-			sock.reset();
-			startAccept();
+			// The next read waits until the channel can take more.
+			channel.push(audio_, SharedBuffer(data_, offset, size), boost::bind(&Session::startRead, shared_from_this(), &Session::onReadTheRest));
 		}
 	}
 	else {
 		bool handleError = false;
 		bool finishRead = false;
-		std::string token;
-		for (size_t i = 0; i < bytes_transferred; i++) {
-			uint8_t c = (*data)[i];
+		for (size_t i = 0; i < size; i++) {
+			uint8_t c = data[i];
 			command_ += c;
 			if (c == '\n') {
 				finishRead = true;
 				break;
 			}
-			else if (readBuf_.size() >= GL_LINE_LEN_MAX) {
+			else if (command_.size() >= 2 * GE_LINE_LEN_MAX) {
+				// The command line and its content line, each shorter than GE_LINE_LEN_MAX
 				handleError = true;
 				break;
 			}
 		}
 		if (finishRead) {
-			program_.onGuiCommand(command_);
+			mgr_.program_.onGuiCommand(command_);
 			command_.clear();
 		}
 		if (finishRead || error || handleError) {
 			// error.
-			// Close the current connection and start listening for a new one.
-			sock->close();
-			sock.reset();
-			startAccept();
+			sock_->close();
 		}
 		else {
-			startRead(sock, &GuiEventMgr::onReadTheRest);
+			startRead(&Session::onReadTheRest);
 		}
 	}
 }
 
+Program::NodeLinkMgr::NodeLinkMgr(Program & program, const std::string & addr)
+	:	Mgr(program, addr, "node_link") {
+}
+
+void Program::NodeLinkMgr::onAccept(boost::shared_ptr<strm::socket> sock) {
+	boost::shared_ptr<Session> session(new Session(*this, sock));
+	session->start();
+}
+
+Program::NodeLinkMgr::Response Program::NodeLinkMgr::heartbeat() {
+	boost::shared_ptr<GatherMessage> msg(new GatherMessage);
+	uint8_t header[3] = { uint8_t(Protocol::HEARTBEAT), 0, 0 };
+	msg->append(header, sizeof(header));
+	return msg;
+}
+
+Program::NodeLinkMgr::Session::Session(NodeLinkMgr & mgr, boost::shared_ptr<strm::socket> sock)
+	:	mgr_(mgr),
+		sock_(sock),
+		strand_(mgr.getIo()),
+		data_(BUF_SIZE),
+		decoder_(boost::bind(&Session::onMessage, this, _1, _2, _3)),
+		heartbeatTimer_(mgr.getIo()),
+		lastReceived_(boost::chrono::steady_clock::now()),
+		subscribed_(false),
+		closed_(false) {
+}
+
+void Program::NodeLinkMgr::Session::start() {
+	strand_.dispatch(boost::bind(&Session::startRead, shared_from_this()));
+	strand_.dispatch(boost::bind(&Session::startHeartbeat, shared_from_this()));
+}
+
+void Program::NodeLinkMgr::Session::onResponse(Response response) {
+	strand_.dispatch(boost::bind(&Session::send, shared_from_this(), response));
+}
+
+void Program::NodeLinkMgr::Session::startRead() {
+	sock_->async_read_some(boost::asio::buffer(data_), strand_.wrap(boost::bind(&Session::onRead, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void Program::NodeLinkMgr::Session::onRead(const boost::system::error_code & error, std::size_t bytes_transferred) {
+	if (closed_) {
+		return;
+	}
+	lastReceived_ = boost::chrono::steady_clock::now();
+	decoder_.feed(data_.data(), bytes_transferred);
+	if (error) {
+		close();
+	}
+	else if (!closed_) {
+		startRead();
+	}
+}
+
+void Program::NodeLinkMgr::Session::onMessage(uint8_t type, const uint8_t * content, std::size_t size) {
+	switch (type) {
+	case Protocol::HELLO:
+		if (!subscribed_) {
+			subscribed_ = true;
+			options_.assign(content, content + size);
+			std::set<std::string> groups;
+			std::string node(parseNode(options_, groups));
+			if (!node.empty()) {
+				node_ = node;
+			}
+			mgr_.program_.sl_.subscribe(shared_from_this(), options_);
+		}
+		break;
+	case Protocol::SENSOR_EVENT:
+		{
+			// An event line, whose node is the link's, if it has one
+			Protocol::EventLine evt;
+			if (Protocol::parseEventLine(reinterpret_cast<const char *>(content), size, evt) && (node_.empty() || evt.node_.empty())) {
+				if (!node_.empty()) {
+					evt.node_ = node_;
+				}
+				mgr_.program_.se_.processEvent(evt);
+			}
+		}
+		break;
+	case Protocol::HEARTBEAT:
+		break;
+	default:
+		// error.
+		close();
+		break;
+	}
+}
+
+void Program::NodeLinkMgr::Session::send(Response response) {
+	if (closed_) {
+		return;
+	}
+	if (queue_.size() >= LINK_QUEUE_MAX) {
+		// The node doesn't keep up. Once it's back, it starts over from the full state.
+		close();
+		return;
+	}
+	queue_.push_back(response);
+	if (queue_.size() == 1) {
+		startWrite();
+	}
+}
+
+void Program::NodeLinkMgr::Session::startWrite() {
+	boost::asio::async_write(*sock_, queue_.front()->buffers(), strand_.wrap(boost::bind(&Session::onWrite, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void Program::NodeLinkMgr::Session::onWrite(const boost::system::error_code & error, std::size_t bytes_transferred) {
+	mgr_.written_.add(bytes_transferred);
+	if (closed_) {
+		return;
+	}
+	queue_.pop_front();
+	if (error) {
+		close();
+	}
+	else if (!queue_.empty()) {
+		startWrite();
+	}
+}
+
+void Program::NodeLinkMgr::Session::startHeartbeat() {
+	if (closed_) {
+		return;
+	}
+	heartbeatTimer_.expires_from_now(boost::chrono::seconds(int(LINK_HEARTBEAT_TIME)));
+	heartbeatTimer_.async_wait(strand_.wrap(boost::bind(&Session::onHeartbeat, shared_from_this(), boost::asio::placeholders::error)));
+}
+
+void Program::NodeLinkMgr::Session::onHeartbeat(const boost::system::error_code & error) {
+	if (error || closed_) {
+		return;
+	}
+	if (boost::chrono::steady_clock::now() - lastReceived_ > boost::chrono::seconds(int(LINK_TIMEOUT))) {
+		close();
+		return;
+	}
+	send(heartbeat());
+	startHeartbeat();
+}
+
+void Program::NodeLinkMgr::Session::close() {
+	if (closed_) {
+		return;
+	}
+	closed_ = true;
+	if (subscribed_) {
+		mgr_.program_.sl_.unsubscribe(shared_from_this(), options_);
+	}
+	heartbeatTimer_.cancel();
+	sock_->close();
+	queue_.clear();
+}
+
+Program::HistoryMgr::HistoryMgr(Program & program, const std::string & addr, History & history)
+	:	Mgr(program, addr, "history"),
+		history_(history),
+		sealTimer_(program.io_),
+		queryWork_(new boost::asio::io_service::work(queryIo_)) {
+	for (unsigned int i = 0; i < HISTORY_THREADS; i++) {
+		queryThreads_.create_thread(boost::bind(&boost::asio::io_service::run, &queryIo_));
+	}
+	startSealTimer();
+}
+
+Program::HistoryMgr::~HistoryMgr() {
+	// Queries that didn't start are dropped, with their connections.
+	queryWork_.reset();
+	queryIo_.stop();
+	queryThreads_.join_all();
+}
+
+void Program::HistoryMgr::asyncQuery(const std::string & line, QueryHandler handler) {
+	queryIo_.post(boost::bind(&HistoryMgr::runQuery, this, line, handler));
+}
+
+void Program::HistoryMgr::runQuery(const std::string & line, QueryHandler handler) {
+	handler(boost::make_shared<std::string>(query(line)));
+}
+
+void Program::HistoryMgr::onAccept(boost::shared_ptr<strm::socket> sock) {
+	boost::shared_ptr<Session> session(new Session(*this, sock));
+	session->start();
+}
+
+std::string Program::HistoryMgr::query(const std::string & line) {
+	std::istringstream in(line);
+	std::string command, name("motion");
+	int64_t from = 0, to = 0;
+	std::ostringstream response;
+	in >> command >> from >> to;
+	// Times are in s and History's in ms.
+	const int64_t timeMax = std::numeric_limits<int64_t>::max() / 1000;
+	if (!in || from > to || from < -timeMax || to > timeMax) {
+		return "error\n";
+	}
+	if (command == "events") {
+		std::vector<History::Event> events;
+		bool all = history_.events(from * 1000, to * 1000, HISTORY_EVENTS_MAX, events);
+		for (std::size_t i = 0; i < events.size(); i++) {
+			response << events[i].time_ / 1000 << ' ' << sensorEventName(SensorEvent(events[i].type_)) << '\n';
+		}
+		if (!all) {
+			response << "more\n";
+		}
+	}
+	else if (command == "hourly") {
+		SensorEvent evt;
+		in >> name;
+		if (!parseSensorEvent(name, evt)) {
+			return "error\n";
+		}
+		History::Counts counts;
+		history_.hourlyCounts(from * 1000, to * 1000, evt, counts);
+		for (History::Counts::const_iterator it = counts.begin(); it != counts.end(); ++it) {
+			response << it->first / 1000 << ' ' << it->second << '\n';
+		}
+	}
+	else {
+		return "error\n";
+	}
+	return response.str();
+}
+
+void Program::HistoryMgr::startSealTimer() {
+	sealTimer_.expires_from_now(boost::chrono::seconds(int(HISTORY_SEAL_TIME)));
+	sealTimer_.async_wait(boost::bind(&HistoryMgr::onSealTimer, this, boost::asio::placeholders::error));
+}
+
+void Program::HistoryMgr::onSealTimer(const boost::system::error_code & error) {
+	if (!error) {
+		// Write out quiet periods too, so little is lost if the server goes down.
+		boost::chrono::system_clock::time_point before = boost::chrono::system_clock::now() - boost::chrono::seconds(int(HISTORY_SEAL_TIME));
+		history_.seal(boost::chrono::duration_cast<boost::chrono::milliseconds>(before.time_since_epoch()).count());
+		startSealTimer();
+	}
+}
+
+Program::HistoryMgr::Session::Session(HistoryMgr & mgr, boost::shared_ptr<strm::socket> sock)
+	:	mgr_(mgr),
+		sock_(sock),
+		data_(HQ_LINE_LEN_MAX) {
+}
+
+void Program::HistoryMgr::Session::startRead() {
+	sock_->async_read_some(boost::asio::buffer(data_), boost::bind(&Session::onRead, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+}
+
+void Program::HistoryMgr::Session::onRead(const boost::system::error_code & error, std::size_t bytes_transferred) {
+	for (size_t i = 0; i < bytes_transferred; i++) {
+		uint8_t c = data_[i];
+		if (c == '\n') {
+			mgr_.asyncQuery(readBuf_, boost::bind(&Session::onQuery, shared_from_this(), _1));
+			return;
+		}
+		readBuf_ += c;
+		if (readBuf_.size() >= HQ_LINE_LEN_MAX) {
+			sock_->close();
+			return;
+		}
+	}
+	if (error) {
+		sock_->close();
+	}
+	else {
+		startRead();
+	}
+}
+
+void Program::HistoryMgr::Session::onQuery(boost::shared_ptr<std::string> response) {
+	// Nothing else uses the socket meanwhile, so the write can start from the query thread.
+	boost::asio::async_write(*sock_, boost::asio::buffer(*response), boost::bind(&Session::onWrite, shared_from_this(), boost::asio::placeholders::bytes_transferred, response));
+}
+
+void Program::HistoryMgr::Session::onWrite(std::size_t bytes_transferred, boost::shared_ptr<std::string> response) {
+	// Written or not, the connection was for this one answer.
+	(void) response;
+	mgr_.written_.add(bytes_transferred);
+	sock_->close();
+}
+
+Program::MetricsMgr::MetricsMgr(Program & program, const std::string & addr)
+	:	Mgr(program, addr, "metrics") {
+}
+
+void Program::MetricsMgr::onAccept(boost::shared_ptr<strm::socket> sock) {
+	boost::shared_ptr<std::string> response(new std::string(program_.metrics_.render()));
+	boost::asio::async_write(*sock, boost::asio::buffer(*response), boost::bind(&MetricsMgr::onWrite, this, sock, response, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+}
+
+void Program::MetricsMgr::onWrite(boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> response, const boost::system::error_code & error, std::size_t bytes_transferred) {
+	(void) response;
+	(void) error;
+	written_.add(bytes_transferred);
+	sock->close();
+}
+
+Program::HttpMgr::HttpMgr(Program & program, const std::string & addr, const std::string & wwwDir)
+	:	program_(program),
+		acceptor_(program.io_, parseEndpoint(addr)),
+		accepts_(program.metrics_.counter("pc_sw_accepts_total", "Connections accepted.", managerLabel("http"))),
+		written_(program.metrics_.counter("pc_sw_written_bytes_total", "Bytes written to connections.", managerLabel("http"))),
+		acceptTimer_(program.io_) {
+	if (!readFile(wwwDir + "/gui.html", guiHtml_)) {
+		std::cerr << "No " << wwwDir << "/gui.html to serve" << std::endl;
+	}
+	const std::string chars("abcdefghijklmnopqrstuvwxyz0123456789");
+	for (std::size_t i = 0; i < chars.size(); i++) {
+		std::string data;
+		if (readFile(wwwDir + "/robot_say/" + chars[i] + ".raw", data)) {
+			robotSay_[chars[i]] = SharedBuffer::copyOf(data);
+		}
+	}
+	boost::shared_ptr<GatherMessage> header(new GatherMessage), keepAlive(new GatherMessage);
+	// No length: the response lasts as long as the connection. The client reconnects after retry ms.
+	header->append("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: keep-alive\r\n\r\nretry: 1000\n\n");
+	keepAlive->append(":\n\n");
+	streamHeader_ = header;
+	streamKeepAlive_ = keepAlive;
+	startAccept();
+}
+
+void Program::HttpMgr::startAccept() {
+	boost::shared_ptr<tcp::socket> sock(new tcp::socket(program_.io_));
+	acceptor_.async_accept(*sock, boost::bind(&HttpMgr::handleAccept, this, sock, boost::asio::placeholders::error));
+}
+
+void Program::HttpMgr::handleAccept(boost::shared_ptr<tcp::socket> sock, const boost::system::error_code & error) {
+	if (!error) {
+		startAccept();
+		accepts_.add();
+		boost::shared_ptr<Session> session(new Session(*this, sock));
+		session->start();
+	}
+	else if (error != boost::asio::error::operation_aborted) {
+		// As in Mgr::handleAccept
+		std::cerr << "HTTP accept error: " << error.message() << std::endl;
+		acceptTimer_.expires_from_now(boost::chrono::milliseconds(int(ACCEPT_RETRY_TIME)));
+		acceptTimer_.async_wait(boost::bind(&HttpMgr::onAcceptTimer, this, boost::asio::placeholders::error));
+	}
+}
+
+void Program::HttpMgr::onAcceptTimer(const boost::system::error_code & error) {
+	if (!error) {
+		startAccept();
+	}
+}
+
+void Program::HttpMgr::robotSay(const std::string & text) {
+	// As gui_event.php did: the samples of the characters, one after another, as one upload.
+	AudioChannel::StreamPtr stream = program_.audio_.open();
+	for (std::string::const_iterator it = text.begin(); it != text.end(); ++it) {
+		std::map<char, SharedBuffer>::const_iterator sample = robotSay_.find(*it);
+		if (sample != robotSay_.end()) {
+			program_.audioIn_.add(sample->second.size());
+			program_.audio_.push(stream, sample->second, AudioChannel::Resume());
+		}
+	}
+	program_.audio_.close(stream);
+}
+
+Program::HttpMgr::tcp::endpoint Program::HttpMgr::parseEndpoint(const std::string & addr) {
+	std::string::size_type colon = addr.rfind(':');
+	std::string host(colon == std::string::npos ? "0.0.0.0" : addr.substr(0, colon));
+	unsigned short port = boost::lexical_cast<unsigned short>(colon == std::string::npos ? addr : addr.substr(colon + 1));
+	return tcp::endpoint(boost::asio::ip::address::from_string(host), port);
+}
+
+bool Program::HttpMgr::readFile(const std::string & path, std::string & data) {
+	std::ifstream in(path.c_str(), std::ios::binary);
+	if (!in) {
+		return false;
+	}
+	std::ostringstream contents;
+	contents << in.rdbuf();
+	data = contents.str();
+	return true;
+}
+
+Program::HttpMgr::Session::Session(HttpMgr & mgr, boost::shared_ptr<tcp::socket> sock)
+	:	mgr_(mgr),
+		sock_(sock),
+		strand_(mgr.program_.io_),
+		polling_(NONE),
+		waiting_(false),
+		busy_(false),
+		keepAlive_(true),
+		closed_(false) {
+}
+
+void Program::HttpMgr::Session::start() {
+	boost::system::error_code error;
+	sock_->non_blocking(true, error);
+	strand_.dispatch(boost::bind(&Session::startWait, shared_from_this()));
+}
+
+void Program::HttpMgr::Session::onResponse(LongpollResponse response) {
+	strand_.dispatch(boost::bind(&Session::onPollResponse, shared_from_this(), response));
+}
+
+void Program::HttpMgr::Session::startWait() {
+	if (waiting_ || closed_) {
+		return;
+	}
+	waiting_ = true;
+	sock_->async_wait(tcp::socket::wait_read, strand_.wrap(boost::bind(&Session::onReadable, shared_from_this(), boost::asio::placeholders::error)));
+}
+
+void Program::HttpMgr::Session::onReadable(const boost::system::error_code & error) {
+	waiting_ = false;
+	if (closed_) {
+		return;
+	}
+	if (error) {
+		close();
+		return;
+	}
+	boost::system::error_code readError;
+	uint8_t buf[HTTP_BUF_SIZE];
+	std::size_t n = sock_->read_some(boost::asio::buffer(buf), readError);
+	if (readError == boost::asio::error::would_block) {
+		startWait();
+	}
+	else if (readError) {
+		close();
+	}
+	else if (busy_) {
+		// Watching for the client going away; what it pipelines meanwhile is kept for after the response.
+		if (leftover_.size() + n > HTTP_PIPELINE_MAX) {
+			close();
+			return;
+		}
+		leftover_.insert(leftover_.end(), buf, buf + n);
+		startWait();
+	}
+	else {
+		feed(buf, n);
+	}
+}
+
+void Program::HttpMgr::Session::feed(const uint8_t * data, std::size_t size) {
+	while (size > 0 && !busy_ && !closed_) {
+		std::size_t consumed;
+		HttpRequest::Result result = request_.feed(data, size, consumed);
+		data += consumed;
+		size -= consumed;
+		if (result == HttpRequest::BAD) {
+			keepAlive_ = false;
+			busy_ = true;
+			respond(400, "text/plain", "bad request\n");
+		}
+		else if (result == HttpRequest::COMPLETE) {
+			handleRequest();
+		}
+	}
+	leftover_.assign(data, data + size);
+	if (!closed_) {
+		// While busy, just to notice the client going away.
+		startWait();
+	}
+}
+
+void Program::HttpMgr::Session::handleRequest() {
+	busy_ = true;
+	keepAlive_ = request_.keepAlive();
+	std::string path(request_.path());
+	if (path.size() > 4 && path.compare(path.size() - 4, 4, ".php") == 0) {
+		// The same URLs as with the PHP scripts
+		path.erase(path.size() - 4);
+	}
+	Program & program = mgr_.program_;
+	if (request_.method() != "GET") {
+		respond(405, "text/plain", "only GET\n");
+	}
+	else if (path == "/" || path == "/gui.html") {
+		if (mgr_.guiHtml_.empty()) {
+			respond(404, "text/plain", "not found\n");
+		}
+		else {
+			respond(200, "text/html; charset=utf-8", mgr_.guiHtml_);
+		}
+	}
+	else if (path == "/sensor_longpoll" || path == "/gui_longpoll") {
+		// The same request line as on the sockets. The token is a single word, so it can't smuggle in options.
+		std::string token(request_.param("token"));
+		std::string line(token.substr(0, token.find_first_of(" \t\r\n")));
+		if (path == "/sensor_longpoll") {
+			std::string codecs;
+			const std::string given(request_.param("codecs"));
+			for (std::string::const_iterator it = given.begin(); it != given.end(); ++it) {
+				if ((*it >= 'a' && *it <= 'z') || (*it >= '0' && *it <= '9') || *it == '_' || *it == ',') {
+					codecs += *it;
+				}
+			}
+			if (request_.hasParam("codecs")) {
+				line += " codecs=" + codecs;
+			}
+			std::string node(request_.param("node"));
+			if (isNodeName(node)) {
+				line += " node=" + node;
+			}
+			std::string groups, group;
+			std::istringstream in(request_.param("groups"));
+			while (std::getline(in, group, ',')) {
+				if (isNodeName(group)) {
+					groups += (groups.empty() ? "" : ",") + group;
+				}
+			}
+			if (!groups.empty()) {
+				line += " groups=" + groups;
+			}
+			polling_ = SENSOR;
+			pollLine_ = line;
+			program.sl_.poll(shared_from_this(), line);
+		}
+		else {
+			polling_ = GUI;
+			pollLine_ = line;
+			program.gl_.poll(shared_from_this(), line);
+		}
+	}
+	else if (path == "/gui_stream") {
+		// A reconnecting EventSource tells the id of the last event it got.
+		std::string token(request_.header("last-event-id"));
+		if (token.empty()) {
+			token = request_.param("token");
+		}
+		startStream(token.substr(0, token.find_first_of(" \t\r\n")));
+	}
+	else if (path == "/sensor_event") {
+		// One event line, or a batch of them separated by newlines, from the node named by "node"
+		std::string node(request_.param("node"));
+		std::string prefix(isNodeName(node) ? "node=" + node + ' ' : "");
+		std::istringstream lines(request_.param("event"));
+		std::string line;
+		while (std::getline(lines, line)) {
+			program.se_.processLine(prefix + line + '\n');
+		}
+		respond(200, "text/plain", "");
+	}
+	else if (path == "/gui_event") {
+		std::string evt(request_.param("event")), content(request_.param("content"));
+		std::string node(request_.param("node")), group(request_.param("group"));
+		if (evt == "led" || evt == "siren_ctrl" || evt == "smoke_sleep") {
+			std::string target(isNodeName(node) ? " node=" + node : isNodeName(group) ? " group=" + group : "");
+			program.onGuiCommand(evt + target + '\n' + content.substr(0, content.find('\n')) + '\n');
+		}
+		else if (evt == "robot_say") {
+			mgr_.robotSay(content);
+		}
+		respond(200, "text/plain", "");
+	}
+	else if (path == "/metrics") {
+		respond(200, "text/plain; version=0.0.4", program.metrics_.render());
+	}
+	else if (path == "/history" && program.hm_) {
+		std::string query(request_.param("query"));
+		std::replace(query.begin(), query.end(), '\n', ' ');
+		// The session stays busy until the answer comes.
+		program.hm_->asyncQuery(query, strand_.wrap(boost::bind(&Session::onHistory, shared_from_this(), _1)));
+	}
+	else {
+		respond(404, "text/plain", "not found\n");
+	}
+	request_.reset();
+}
+
+void Program::HttpMgr::Session::onHistory(boost::shared_ptr<std::string> response) {
+	if (!closed_) {
+		respond(200, "text/plain", *response);
+	}
+}
+
+void Program::HttpMgr::Session::onPollResponse(LongpollResponse response) {
+	if (closed_ || polling_ == NONE) {
+		return;
+	}
+	if (polling_ == GUI_STREAM) {
+		pushStream(response);
+		return;
+	}
+	const char * contentType = (polling_ == SENSOR ? "application/octet-stream" : "text/plain; charset=utf-8");
+	polling_ = NONE;
+	respond(200, contentType, response);
+}
+
+void Program::HttpMgr::Session::respond(unsigned int status, const char * contentType, const std::string & body) {
+	boost::shared_ptr<GatherMessage> msg(new GatherMessage);
+	msg->append(body);
+	respond(status, contentType, msg);
+}
+
+void Program::HttpMgr::Session::respond(unsigned int status, const char * contentType, LongpollResponse body) {
+	const char * reason = "OK";
+	switch (status) {
+	case 400: reason = "Bad Request"       ; break;
+	case 404: reason = "Not Found"         ; break;
+	case 405: reason = "Method Not Allowed"; break;
+	}
+	std::ostringstream header;
+	header << "HTTP/1.1 " << status << ' ' << reason << "\r\n";
+	header << "Content-Type: " << contentType << "\r\n";
+	header << "Content-Length: " << body->size() << "\r\n";
+	header << "Cache-Control: no-cache\r\n";
+	header << "Connection: " << (keepAlive_ ? "keep-alive" : "close") << "\r\n";
+	header << "\r\n";
+	boost::shared_ptr<std::string> headerPtr(new std::string(header.str()));
+	// The body goes out of the buffers it's in, which other clients may be writing from too.
+	std::vector<boost::asio::const_buffer> buffers;
+	buffers.reserve(1 + body->buffers().size());
+	buffers.push_back(boost::asio::buffer(*headerPtr));
+	buffers.insert(buffers.end(), body->buffers().begin(), body->buffers().end());
+	boost::asio::async_write(*sock_, buffers, strand_.wrap(boost::bind(&Session::onWrite, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, headerPtr, body)));
+}
+
+void Program::HttpMgr::Session::onWrite(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<std::string> header, LongpollResponse body) {
+	(void) header;
+	mgr_.written_.add(bytes_transferred);
+	if (!error) {
+		mgr_.program_.onDelivered(body);
+	}
+	if (closed_) {
+		return;
+	}
+	if (error || !keepAlive_) {
+		close();
+		return;
+	}
+	busy_ = false;
+	std::vector<uint8_t> leftover;
+	leftover.swap(leftover_);
+	if (!leftover.empty()) {
+		feed(leftover.data(), leftover.size());
+	}
+	else {
+		startWait();
+	}
+}
+
+void Program::HttpMgr::Session::startStream(const std::string & token) {
+	keepAlive_ = false;
+	polling_ = GUI_STREAM;
+	boost::system::error_code ignored;
+	sock_->set_option(tcp::socket::send_buffer_size(STREAM_SEND_BUFFER), ignored);
+	stream_.reset(new Stream(mgr_.program_.io_));
+	pushStream(mgr_.streamHeader_);
+	mgr_.program_.gl_.subscribe(shared_from_this(), "stream=sse", token);
+	startKeepAlive();
+}
+
+void Program::HttpMgr::Session::pushStream(LongpollResponse response) {
+	if (stream_->queue_.size() >= STREAM_QUEUE_MAX) {
+		// Slow consumer. It can reconnect, and resume from the last event it did get.
+		close();
+		return;
+	}
+	stream_->queue_.push_back(response);
+	if (stream_->writing_.empty()) {
+		startStreamWrite();
+	}
+}
+
+void Program::HttpMgr::Session::startStreamWrite() {
+	// Everything queued, in one write
+	std::vector<boost::asio::const_buffer> buffers;
+	while (!stream_->queue_.empty()) {
+		LongpollResponse response = stream_->queue_.front();
+		stream_->queue_.pop_front();
+		buffers.insert(buffers.end(), response->buffers().begin(), response->buffers().end());
+		stream_->writing_.push_back(response);
+	}
+	boost::asio::async_write(*sock_, buffers, strand_.wrap(boost::bind(&Session::onStreamWrite, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void Program::HttpMgr::Session::onStreamWrite(const boost::system::error_code & error, std::size_t bytes_transferred) {
+	mgr_.written_.add(bytes_transferred);
+	if (closed_) {
+		return;
+	}
+	for (std::size_t i = 0; i < stream_->writing_.size() && !error; i++) {
+		mgr_.program_.onDelivered(stream_->writing_[i]);
+	}
+	stream_->writing_.clear();
+	if (error) {
+		close();
+	}
+	else if (!stream_->queue_.empty()) {
+		startStreamWrite();
+	}
+}
+
+void Program::HttpMgr::Session::startKeepAlive() {
+	stream_->keepAliveTimer_.expires_from_now(boost::chrono::seconds(int(STREAM_KEEPALIVE_TIME)));
+	stream_->keepAliveTimer_.async_wait(strand_.wrap(boost::bind(&Session::onKeepAlive, shared_from_this(), boost::asio::placeholders::error)));
+}
+
+void Program::HttpMgr::Session::onKeepAlive(const boost::system::error_code & error) {
+	if (error || closed_) {
+		return;
+	}
+	if (stream_->queue_.empty() && stream_->writing_.empty()) {
+		pushStream(mgr_.streamKeepAlive_);
+	}
+	startKeepAlive();
+}
+
+void Program::HttpMgr::Session::close() {
+	if (closed_) {
+		return;
+	}
+	closed_ = true;
+	if (polling_ == SENSOR) {
+		mgr_.program_.sl_.cancelPoll(shared_from_this(), pollLine_);
+	}
+	else if (polling_ == GUI) {
+		mgr_.program_.gl_.cancelPoll(shared_from_this(), pollLine_);
+	}
+	else if (polling_ == GUI_STREAM) {
+		mgr_.program_.gl_.unsubscribe(shared_from_this(), "stream=sse");
+		stream_->keepAliveTimer_.cancel();
+	}
+	polling_ = NONE;
+	boost::system::error_code ignored;
+	sock_->shutdown(tcp::socket::shutdown_both, ignored);
+	sock_->close(ignored);
+}
+
 int main(int argc, char const * const * argv) {
 	(Program(Program::Config::fromArgv(argc, argv)))();
 }
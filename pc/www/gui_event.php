@@ -8,9 +8,17 @@ switch ($evt) {
 case 'led':
 case 'siren_ctrl':
 case 'smoke_sleep':
+	// To the node named by "node", the nodes of the group named by "group", or else to every node
+	$target = '';
+	if (array_key_exists('node', $_GET) && preg_match(NODE_NAME_PATTERN, $_GET['node'])) {
+		$target = ' node=' . $_GET['node'];
+	}
+	else if (array_key_exists('group', $_GET) && preg_match(NODE_NAME_PATTERN, $_GET['group'])) {
+		$target = ' group=' . $_GET['group'];
+	}
 	$sock = fsockopen('unix://' . GUI_EVENT_SOCK);
 	if ($sock) {
-		fwrite($sock, $evt . "\n");
+		fwrite($sock, $evt . $target . "\n");
 		fwrite($sock, $_GET['content'] . "\n");
 		fclose($sock);
 	}
@@ -0,0 +1,18 @@
+<?php
+
+require_once('settings.inc');
+
+$sock = fsockopen('unix://' . HISTORY_SOCK);
+
+if ($sock) {
+	if (array_key_exists('query', $_GET)) {
+		fwrite($sock, str_replace("\n", ' ', $_GET['query']));
+	}
+	
+	fwrite($sock, "\n");
+	fflush($sock);
+	
+	fpassthru($sock);
+}
+
+?>
@@ -2,18 +2,25 @@
 
 require_once('settings.inc');
 
-$evt = $_GET['event'];
+// One event line, or a batch of them separated by newlines:
+// "<event>[ <count> <first_age_ms> <last_age_ms>]", from the node named by "node", if any
+$prefix = '';
+if (array_key_exists('node', $_GET) && preg_match(NODE_NAME_PATTERN, $_GET['node'])) {
+	$prefix = 'node=' . $_GET['node'] . ' ';
+}
+$lines = '';
+foreach (explode("\n", $_GET['event']) as $line) {
+	if (preg_match('/^(smoke_on|smoke_off|motion)( [0-9]+ [0-9]+ [0-9]+)?$/', $line)) {
+		$lines .= $prefix . $line . "\n";
+	}
+}
 
-switch ($evt) {
-case 'smoke_on':
-case 'smoke_off':
-case 'motion':
+if ($lines !== '') {
 	$sock = fsockopen('unix://' . SENSOR_EVENT_SOCK);
 	if ($sock) {
-		fwrite($sock, $evt . "\n");
+		fwrite($sock, $lines);
 		fclose($sock);
 	}
-	break;
 }
 
 ?>
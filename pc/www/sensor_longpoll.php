@@ -8,6 +8,15 @@ if ($sock) {
 	if (array_key_exists('token', $_GET)) {
 		fwrite($sock, $_GET['token']);
 	}
+	if (array_key_exists('codecs', $_GET)) {
+		fwrite($sock, ' codecs=' . preg_replace('/[^a-z0-9_,]/', '', $_GET['codecs']));
+	}
+	if (array_key_exists('node', $_GET) && preg_match(NODE_NAME_PATTERN, $_GET['node'])) {
+		fwrite($sock, ' node=' . $_GET['node']);
+	}
+	if (array_key_exists('groups', $_GET)) {
+		fwrite($sock, ' groups=' . implode(',', preg_grep(NODE_NAME_PATTERN, explode(',', $_GET['groups']))));
+	}
 	
 	fwrite($sock, "\n");
 	fflush($sock);
@@ -0,0 +1,304 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include "gpio_backend.hpp"
+
+#if defined(__FreeBSD__) && !defined(SENSOR_SIM)
+#include <libgpio.h>
+#endif
+
+#if defined(__linux__) && !defined(SENSOR_SIM)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/gpio.h>
+#endif
+
+PollingGpioBackend::PollingGpioBackend(TimerWheel & wheel)
+	:	timer_(wheel) {
+}
+
+void PollingGpioBackend::startPolling(const std::vector<unsigned int> & inputs, EdgeHandler handler) {
+	handler_ = handler;
+	for (std::vector<unsigned int>::const_iterator it = inputs.begin(); it != inputs.end(); ++it) {
+		levels_[*it] = read(*it);
+	}
+	pollTime_ = Clock::now() + boost::chrono::milliseconds(int(POLL_TIME));
+	timer_.expiresAt(pollTime_, boost::bind(&PollingGpioBackend::onPollTimer, this));
+}
+
+void PollingGpioBackend::onPollTimer() {
+	poll();
+	pollTime_ += boost::chrono::milliseconds(int(POLL_TIME));
+	timer_.expiresAt(pollTime_, boost::bind(&PollingGpioBackend::onPollTimer, this));
+}
+
+void PollingGpioBackend::poll() {
+	Clock::time_point now = Clock::now();
+	for (std::map<unsigned int, bool>::iterator it = levels_.begin(); it != levels_.end(); ++it) {
+		bool level = read(it->first);
+		if (level != it->second) {
+			it->second = level;
+			handler_(it->first, level, now);
+		}
+	}
+}
+
+void FakeGpioBackend::open(const std::vector<unsigned int> & inputs, const std::vector<unsigned int> & outputs, EdgeHandler handler) {
+	handler_ = handler;
+	for (std::vector<unsigned int>::const_iterator it = inputs.begin(); it != inputs.end(); ++it) {
+		levels_.insert(std::make_pair(*it, false));
+	}
+	for (std::vector<unsigned int>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+		levels_[*it] = false;
+	}
+}
+
+bool FakeGpioBackend::get(unsigned int pin) {
+	std::map<unsigned int, bool>::const_iterator it = levels_.find(pin);
+	return it != levels_.end() && it->second;
+}
+
+void FakeGpioBackend::set(unsigned int pin, bool level) {
+	bool & current = levels_[pin];
+	if (level != current) {
+		current = level;
+		if (outputHandler_) {
+			outputHandler_(pin, level, Clock::now());
+		}
+	}
+}
+
+void FakeGpioBackend::setInput(unsigned int pin, bool level) {
+	io_.post(boost::bind(&FakeGpioBackend::onSetInput, this, pin, level, Clock::now()));
+}
+
+void FakeGpioBackend::onSetInput(unsigned int pin, bool level, Clock::time_point time) {
+	bool & current = levels_[pin];
+	if (level != current) {
+		current = level;
+		if (handler_) {
+			handler_(pin, level, time);
+		}
+	}
+}
+
+namespace {
+#if defined(__FreeBSD__) && !defined(SENSOR_SIM)
+	class LibgpioBackend
+		:	public PollingGpioBackend {
+	public:
+		LibgpioBackend(TimerWheel & wheel, unsigned int unit) : PollingGpioBackend(wheel), unit_(unit), gpio_(GPIO_INVALID_HANDLE) { }
+		~LibgpioBackend() {
+			if (gpio_ != GPIO_INVALID_HANDLE) {
+				gpio_close(gpio_);
+			}
+		}
+
+		virtual void open(const std::vector<unsigned int> & inputs, const std::vector<unsigned int> & outputs, EdgeHandler handler) {
+			gpio_ = gpio_open(unit_);
+			if (gpio_ == GPIO_INVALID_HANDLE) {
+				throw std::runtime_error("gpio_open failed");
+			}
+			for (std::vector<unsigned int>::const_iterator it = inputs.begin(); it != inputs.end(); ++it) {
+				gpio_pin_input(gpio_, *it);
+			}
+			for (std::vector<unsigned int>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+				gpio_pin_output(gpio_, *it);
+			}
+			startPolling(inputs, handler);
+		}
+
+		virtual void set(unsigned int pin, bool level) {
+			gpio_pin_set(gpio_, pin, level ? GPIO_PIN_HIGH : GPIO_PIN_LOW);
+		}
+	protected:
+		virtual bool read(unsigned int pin) {
+			return gpio_pin_get(gpio_, pin) == GPIO_PIN_HIGH;
+		}
+	private:
+		unsigned int unit_;
+		gpio_handle_t gpio_;
+	};
+#endif
+
+#if defined(__linux__) && !defined(SENSOR_SIM)
+	// GPIO character device, uAPI v2. The inputs and the outputs are two line requests. Edge events carry
+	// CLOCK_MONOTONIC timestamps (the kernel's default), which is what steady_clock reads on Linux.
+	class GpiochipBackend
+		:	public PollingGpioBackend {
+	public:
+		GpiochipBackend(TimerWheel & wheel, const std::string & device) : PollingGpioBackend(wheel), device_(device), events_(wheel.io()), outputFd_(-1) { }
+		~GpiochipBackend() {
+			if (outputFd_ >= 0) {
+				::close(outputFd_);
+			}
+		}
+
+		virtual void open(const std::vector<unsigned int> & inputs, const std::vector<unsigned int> & outputs, EdgeHandler handler) {
+			int chipFd = ::open(device_.c_str(), O_RDWR | O_CLOEXEC);
+			if (chipFd < 0) {
+				throw std::runtime_error("can't open " + device_ + ": " + std::strerror(errno));
+			}
+			inputs_ = inputs;
+			outputs_ = outputs;
+			handler_ = handler;
+			bool edges = true;
+			int inputFd = requestLines(chipFd, inputs, GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING);
+			if (inputFd < 0) {
+				// Not every chip can detect edges
+				edges = false;
+				inputFd = requestLines(chipFd, inputs, GPIO_V2_LINE_FLAG_INPUT);
+			}
+			outputFd_ = requestLines(chipFd, outputs, GPIO_V2_LINE_FLAG_OUTPUT);
+			int requestErrno = errno;
+			::close(chipFd);
+			if (inputFd < 0 || outputFd_ < 0) {
+				if (inputFd >= 0) {
+					::close(inputFd);
+				}
+				throw std::runtime_error("can't request the lines of " + device_ + ": " + std::strerror(requestErrno));
+			}
+			events_.assign(inputFd);
+			if (edges) {
+				startRead();
+			}
+			else {
+				startPolling(inputs, handler);
+			}
+		}
+
+		virtual bool get(unsigned int pin) {
+			bool level = false;
+			getLine(events_.native_handle(), inputs_, pin, level) || getLine(outputFd_, outputs_, pin, level);
+			return level;
+		}
+
+		virtual void set(unsigned int pin, bool level) {
+			std::vector<unsigned int>::const_iterator it = std::find(outputs_.begin(), outputs_.end(), pin);
+			if (it == outputs_.end()) {
+				return;
+			}
+			gpio_v2_line_values values;
+			values.mask = uint64_t(1) << (it - outputs_.begin());
+			values.bits = (level ? values.mask : 0);
+			ioctl(outputFd_, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+		}
+	protected:
+		virtual bool read(unsigned int pin) {
+			bool level = false;
+			getLine(events_.native_handle(), inputs_, pin, level);
+			return level;
+		}
+	private:
+		enum {
+			EVENT_BUF_SIZE = 16
+		};
+
+		static int requestLines(int chipFd, const std::vector<unsigned int> & pins, uint64_t flags) {
+			gpio_v2_line_request req;
+			std::memset(&req, 0, sizeof(req));
+			for (std::size_t i = 0; i < pins.size() && i < GPIO_V2_LINES_MAX; i++) {
+				req.offsets[i] = pins[i];
+			}
+			req.num_lines = std::min<std::size_t>(pins.size(), GPIO_V2_LINES_MAX);
+			std::strncpy(req.consumer, "sensor_sw", sizeof(req.consumer) - 1);
+			req.config.flags = flags;
+			return ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &req) < 0 ? -1 : req.fd;
+		}
+
+		static bool getLine(int fd, const std::vector<unsigned int> & pins, unsigned int pin, bool & level) {
+			std::vector<unsigned int>::const_iterator it = std::find(pins.begin(), pins.end(), pin);
+			if (it == pins.end()) {
+				return false;
+			}
+			gpio_v2_line_values values;
+			values.mask = uint64_t(1) << (it - pins.begin());
+			values.bits = 0;
+			if (ioctl(fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0) {
+				return false;
+			}
+			level = (values.bits & values.mask) != 0;
+			return true;
+		}
+
+		void startRead() {
+			events_.async_read_some(boost::asio::buffer(eventBuf_), boost::bind(&GpiochipBackend::onRead, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+		}
+
+		void onRead(const boost::system::error_code & error, std::size_t bytes_transferred) {
+			if (error == boost::asio::error::operation_aborted) {
+				return;
+			}
+			if (error) {
+				// The line values can still be read, so the inputs go on being watched, just less precisely. An edge
+				// between the last event and the first poll is missed, but the level it left is what polls start from.
+				std::cerr << "Can't read the GPIO events of " << device_ << ", polling instead: " << error.message() << std::endl;
+				startPolling(inputs_, handler_);
+				return;
+			}
+			// The kernel only hands out whole events.
+			for (std::size_t i = 0; i < bytes_transferred / sizeof(eventBuf_[0]); i++) {
+				const gpio_v2_line_event & event = eventBuf_[i];
+				handler_(event.offset, event.id == GPIO_V2_LINE_EVENT_RISING_EDGE, Clock::time_point(boost::chrono::nanoseconds(event.timestamp_ns)));
+			}
+			startRead();
+		}
+
+		std::string device_;
+		std::vector<unsigned int> inputs_, outputs_; // In the order of the requests' lines
+		boost::asio::posix::stream_descriptor events_; // The input lines' request
+		int outputFd_;
+		EdgeHandler handler_;
+		gpio_v2_line_event eventBuf_[EVENT_BUF_SIZE];
+	};
+#endif
+}
+
+GpioBackend * GpioBackend::create(TimerWheel & wheel, const std::string & spec) {
+	std::string::size_type colon = spec.find(':');
+	std::string name(spec.substr(0, colon)), arg(colon == std::string::npos ? "" : spec.substr(colon + 1));
+	if (name == "fake") {
+		// "<pin>=<level>,..."
+		std::map<unsigned int, bool> levels;
+		std::string::size_type begin = 0;
+		while (begin < arg.size()) {
+			std::string::size_type end = std::min(arg.find(',', begin), arg.size());
+			std::string pair(arg.substr(begin, end - begin));
+			std::string::size_type eq = pair.find('=');
+			if (eq == std::string::npos) {
+				throw std::runtime_error("bad fake GPIO level " + pair);
+			}
+			levels[boost::lexical_cast<unsigned int>(pair.substr(0, eq))] = (pair.substr(eq + 1) != "0");
+			begin = end + 1;
+		}
+		return new FakeGpioBackend(wheel.io(), levels);
+	}
+#if defined(__FreeBSD__) && !defined(SENSOR_SIM)
+	if (name == "libgpio") {
+		return new LibgpioBackend(wheel, arg.empty() ? 0 : boost::lexical_cast<unsigned int>(arg));
+	}
+#endif
+#if defined(__linux__) && !defined(SENSOR_SIM)
+	if (name == "gpiochip") {
+		return new GpiochipBackend(wheel, arg.empty() ? "/dev/gpiochip0" : arg);
+	}
+#endif
+	throw std::runtime_error("unknown or unsupported GPIO backend " + spec);
+}
+
+const char * GpioBackend::defaultSpec() {
+#if defined(SENSOR_SIM)
+	return "fake";
+#elif defined(__linux__)
+	return "gpiochip";
+#elif defined(__FreeBSD__)
+	return "libgpio";
+#else
+	return "fake";
+#endif
+}
@@ -0,0 +1,81 @@
+#ifndef GPIO_BACKEND_HPP
+#define GPIO_BACKEND_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include "node_clock.hpp"
+#include "timer_wheel.hpp"
+
+// Access to the GPIO pins: inputs report their changes, outputs are set. Pins are numbered as the device
+// numbers them (line offsets, on a Linux gpiochip).
+// - "libgpio[:<unit>]": FreeBSD's libgpio. It can't wait for edges, so the inputs are polled.
+// - "gpiochip[:<device>]": a Linux GPIO character device (default /dev/gpiochip0). The kernel reports the edges,
+//   with timestamps, and they're read asynchronously. Inputs are polled if the chip can't detect edges.
+// - "fake[:<pin>=<level>[,...]]": pins in memory, for tests and simulation, with the inputs' starting levels
+//   (0 unless given). See FakeGpioBackend.
+// A simulation build (SENSOR_SIM) only has the fake one.
+class GpioBackend {
+public:
+	typedef NodeClock Clock;
+	// The pin, its new level, and when it changed
+	typedef boost::function<void(unsigned int pin, bool level, Clock::time_point time)> EdgeHandler;
+
+	virtual ~GpioBackend() { }
+	// Once, before anything else. Throws if the pins can't be had. The handler is called through the io_service.
+	virtual void open(const std::vector<unsigned int> & inputs, const std::vector<unsigned int> & outputs, EdgeHandler handler) = 0;
+	virtual bool get(unsigned int pin) = 0;
+	virtual void set(unsigned int pin, bool level) = 0;
+
+	static GpioBackend * create(TimerWheel & wheel, const std::string & spec);
+	static const char * defaultSpec();
+};
+
+// For devices that can't report edges: the inputs are read every POLL_TIME ms, and changes reported as edges
+// (timestamped when they're found).
+class PollingGpioBackend
+	:	public GpioBackend {
+public:
+	enum {
+		POLL_TIME = 50
+	};
+
+	virtual bool get(unsigned int pin) { return read(pin); }
+protected:
+	PollingGpioBackend(TimerWheel & wheel);
+	void startPolling(const std::vector<unsigned int> & inputs, EdgeHandler handler);
+	virtual bool read(unsigned int pin) = 0;
+private:
+	void poll();
+	void onPollTimer();
+
+	TimerWheel::Timer timer_;
+	Clock::time_point pollTime_; // The next one, so polls keep their pace
+	std::map<unsigned int, bool> levels_; // Of the inputs, as last read
+	EdgeHandler handler_;
+};
+
+// Inputs are changed by setInput, as if by the hardware; outputs can be checked with get, or watched.
+class FakeGpioBackend
+	:	public GpioBackend {
+public:
+	FakeGpioBackend(boost::asio::io_service & io) : io_(io) { }
+	FakeGpioBackend(boost::asio::io_service & io, const std::map<unsigned int, bool> & levels) : io_(io), levels_(levels) { }
+	virtual void open(const std::vector<unsigned int> & inputs, const std::vector<unsigned int> & outputs, EdgeHandler handler);
+	virtual bool get(unsigned int pin);
+	virtual void set(unsigned int pin, bool level);
+	// Thread-safe. Reports an edge if the level changes.
+	void setInput(unsigned int pin, bool level);
+	// Called when an output changes.
+	void setOutputHandler(EdgeHandler handler) { outputHandler_ = handler; }
+private:
+	void onSetInput(unsigned int pin, bool level, Clock::time_point time);
+
+	boost::asio::io_service & io_;
+	std::map<unsigned int, bool> levels_; // Only touched on the io_service, after open
+	EdgeHandler handler_, outputHandler_;
+};
+
+#endif
@@ -1,28 +1,59 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
 #include <iostream>
+#include <sstream>
 #include <boost/bind.hpp>
 #include "http.hpp"
 
 enum {
-	BUF_SIZE = 2048
+	BUF_SIZE = 2048,
+	HEADER_LINE_MAX = 8192, // Of the status line and headers
+	PIPELINE_MAX = 8, // Requests written without their responses yet
+	DEFAULT_TIMEOUT = 10000, // ms
+	MAX_ATTEMPTS = 2
 };
 
 Http::~Http() {
 }
 
-void Http::sendReq(const Http::Req & req, boost::function<void(const Res & res)> handler) {
-	if (state_ != CONNECTED || requestBusy_) {
-		io_.post(boost::bind(handler, Res())); // Empty error result
+void Http::sendReq(const Http::Req & req, Handler handler) {
+	std::ostringstream msg;
+	msg << "GET " << req.path_ << " HTTP/1.1\r\n";
+	msg << "Host: " << host_ << "\r\n";
+	msg << "Connection: " << (req.connectionClose_ ? "close" : "keep-alive") << "\r\n";
+	msg << "\r\n";
+	Pending pending;
+	pending.msg_ = msg.str();
+	pending.handler_ = handler;
+	pending.deadline_ = NodeClock::now() + boost::chrono::milliseconds(req.timeout_ ? req.timeout_ : int(DEFAULT_TIMEOUT));
+	pending.failures_ = 0;
+	pending.retry_ = req.retry_;
+	pending_.push_back(pending);
+	startTimer();
+	if (state_ == DEAD) {
+		connect(0);
 	}
-	else {
-		requestBusy_ = true;
-		std::ostringstream msg;
-		msg << "GET " << req.path_ << " HTTP/1.1\r\n";
-		msg << "Host: " << host_ << "\r\n";
-		msg << "Connection: " << (req.connectionClose_ ? "close" : "keep-alive") << "\r\n";
-		msg << "\r\n";
-		boost::shared_ptr<std::string> msgPtr(new std::string(msg.str()));
-		boost::asio::async_write(sock_, boost::asio::buffer(*msgPtr), boost::bind(&Http::onSendReq, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, msgPtr, handler));
+	else if (state_ == CONNECTED) {
+		startWrite();
+	}
+}
+
+std::string Http::urlEncode(const std::string & str) {
+	static const char HEX[] = "0123456789ABCDEF";
+	std::string result;
+	for (std::string::const_iterator it = str.begin(); it != str.end(); ++it) {
+		unsigned char c = *it;
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' || c == '~') {
+			result += c;
+		}
+		else {
+			result += '%';
+			result += HEX[c >> 4];
+			result += HEX[c & 0xf];
+		}
 	}
+	return result;
 }
 
 Http::Http(boost::asio::io_service & io, const std::string & host, const std::string & port)
@@ -31,58 +62,378 @@ Http::Http(boost::asio::io_service & io, const std::string & host, const std::st
 		sock_(io_),
 		host_(host),
 		port_(port),
-		state_(RESOLVING),
-		requestBusy_(false) {
+		state_(DEAD),
+		generation_(0),
+		timer_(io_),
+		written_(0),
+		writing_(false),
+		writeCount_(0),
+		readBuf_(BUF_SIZE),
+		parseState_(STATUS_LINE),
+		bodyLeft_(0),
+		chunked_(false),
+		hasLength_(false),
+		closeAfter_(false) {
 }
 
 void Http::start(boost::function<void(const boost::system::error_code & error)> connectHandler) {
-	boost::asio::ip::tcp::resolver::query q(host_, port_);
-	resolver_.async_resolve(q, boost::bind(&Http::onResolve, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::iterator, connectHandler));
+	connect(connectHandler);
+}
+
+void Http::connect(boost::function<void(const boost::system::error_code & error)> connectHandler) {
+	if (endpoints_.empty()) {
+		state_ = RESOLVING;
+		boost::asio::ip::tcp::resolver::query q(host_, port_);
+		resolver_.async_resolve(q, boost::bind(&Http::onResolve, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::iterator, connectHandler));
+	}
+	else {
+		state_ = CONNECTING;
+		boost::asio::async_connect(sock_, endpoints_.begin(), endpoints_.end(), boost::bind(&Http::onConnect, shared_from_this(), boost::asio::placeholders::error, connectHandler));
+	}
 }
 
 void Http::onResolve(const boost::system::error_code & error, boost::asio::ip::tcp::resolver::iterator iterator, boost::function<void(const boost::system::error_code & error)> connectHandler) {
 	if (!error) {
-		state_ = CONNECTING;
-		boost::asio::async_connect(sock_, iterator, boost::bind(&Http::onConnect, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::iterator, connectHandler));
+		endpoints_.assign(iterator, boost::asio::ip::tcp::resolver::iterator());
+		connect(connectHandler);
 	}
 	else {
-		state_ = DEAD;
-		connectHandler(error);
+		disconnect(false);
+		if (connectHandler) {
+			connectHandler(error);
+		}
 	}
 }
 
-void Http::onConnect(const boost::system::error_code & error, boost::asio::ip::tcp::resolver::iterator iterator, boost::function<void(const boost::system::error_code & error)> connectHandler) {
-	(void) iterator;
+void Http::onConnect(const boost::system::error_code & error, boost::function<void(const boost::system::error_code & error)> connectHandler) {
 	if (!error) {
 		state_ = CONNECTED;
 		std::cout << "HTTP Connected" << std::endl;
-		boost::shared_ptr< std::vector<uint8_t> > data(new std::vector<uint8_t>(BUF_SIZE));
-		sock_.async_read_some(boost::asio::buffer(*data), boost::bind(&Http::onReceive, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, data));
+		startReceive();
+		startWrite();
 	}
 	else {
-		state_ = DEAD;
+		// Maybe the address changed. Resolve again next time.
+		endpoints_.clear();
+		disconnect(false);
+	}
+	if (connectHandler) {
+		connectHandler(error);
 	}
-	connectHandler(error);
 }
 
-void Http::onSendReq(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<std::string> reqMsg, boost::function<void(const Res & res)> handler) {
-	reqMsg.reset();
+void Http::startWrite() {
+	if (writing_ || state_ != CONNECTED) {
+		return;
+	}
+	// All the requests that fit into the pipeline go in one write.
+	writeBuf_.clear();
+	writeCount_ = 0;
+	for (std::size_t i = written_; i < pending_.size() && i < PIPELINE_MAX; i++) {
+		writeBuf_ += pending_[i].msg_;
+		writeCount_++;
+	}
+	if (writeCount_ == 0) {
+		return;
+	}
+	writing_ = true;
+	boost::asio::async_write(sock_, boost::asio::buffer(writeBuf_), boost::bind(&Http::onSendReq, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, generation_));
+}
+
+void Http::onSendReq(const boost::system::error_code & error, std::size_t bytes_transferred, unsigned int generation) {
+	(void) bytes_transferred;
+	if (generation != generation_) {
+		return;
+	}
+	writing_ = false;
 	if (!error) {
-		// TODO!?
+		written_ += writeCount_;
+		startWrite();
 	}
 	else {
-		state_ = DEAD;
-		handler(Res()); // Empty error result
+		disconnect(true);
 	}
 }
 
-void Http::onReceive(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr< std::vector<uint8_t> > data) {
+void Http::startReceive() {
+	sock_.async_read_some(boost::asio::buffer(readBuf_), boost::bind(&Http::onReceive, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, generation_));
+}
+
+void Http::onReceive(const boost::system::error_code & error, std::size_t bytes_transferred, unsigned int generation) {
+	if (generation != generation_) {
+		return;
+	}
+	parse(readBuf_.data(), bytes_transferred);
+	if (generation != generation_) {
+		// The response asked for the connection to be closed, or was broken.
+		return;
+	}
 	if (!error) {
-		// TODO: process the HTTP data
+		startReceive();
 	}
 	else {
-		// TODO!?
-		state_ = DEAD;
+		if (error == boost::asio::error::eof && parseState_ == BODY_UNTIL_CLOSE && !pending_.empty()) {
+			onResponse(); // Which disconnects
+		}
+		else {
+			disconnect(true);
+		}
 	}
 }
 
+void Http::parse(const uint8_t * data, std::size_t size) {
+	unsigned int generation = generation_;
+	const uint8_t * end = data + size;
+	while (data != end && generation == generation_) {
+		if (written_ + (writing_ ? writeCount_ : 0) == 0) {
+			// Nothing was asked for.
+			disconnect(true);
+			return;
+		}
+		switch (parseState_) {
+		case BODY:
+		case CHUNK_DATA: {
+			std::size_t n = std::min<std::size_t>(end - data, bodyLeft_);
+			res_.content_.insert(res_.content_.end(), data, data + n);
+			data += n;
+			bodyLeft_ -= n;
+			if (bodyLeft_ == 0) {
+				if (parseState_ == BODY) {
+					onResponse();
+				}
+				else {
+					parseState_ = CHUNK_END;
+				}
+			}
+			break;
+		}
+		case BODY_UNTIL_CLOSE:
+			res_.content_.insert(res_.content_.end(), data, end);
+			data = end;
+			break;
+		default:
+			// The line-based states
+			while (data != end && *data != '\n' && line_.size() < HEADER_LINE_MAX) {
+				line_ += char(*data++);
+			}
+			if (line_.size() >= HEADER_LINE_MAX) {
+				disconnect(true);
+				return;
+			}
+			if (data != end) {
+				data++; // The '\n'
+				if (!line_.empty() && line_[line_.size() - 1] == '\r') {
+					line_.erase(line_.size() - 1);
+				}
+				std::string line;
+				line.swap(line_);
+				if (!parseLine(line)) {
+					disconnect(true);
+					return;
+				}
+			}
+			break;
+		}
+	}
+}
+
+bool Http::parseLine(const std::string & line) {
+	switch (parseState_) {
+	case STATUS_LINE: {
+		if (line.empty()) {
+			// A stray CRLF between responses
+			return true;
+		}
+		if (line.compare(0, 7, "HTTP/1.") != 0 || line.size() < 12) {
+			return false;
+		}
+		res_.status_ = std::strtoul(line.c_str() + 9, 0, 10);
+		res_.headers_ = line + "\r\n";
+		res_.content_.clear();
+		chunked_ = false;
+		hasLength_ = false;
+		closeAfter_ = (line[7] == '0'); // HTTP/1.0 closes unless it says otherwise
+		parseState_ = HEADERS;
+		return true;
+	}
+	case HEADERS: {
+		if (!line.empty()) {
+			res_.headers_ += line + "\r\n";
+			std::string::size_type colon = line.find(':');
+			if (colon == std::string::npos) {
+				return false;
+			}
+			std::string name(line.substr(0, colon)), value(line.substr(colon + 1));
+			for (std::string::iterator it = name.begin(); it != name.end(); ++it) {
+				*it = std::tolower(*it);
+			}
+			for (std::string::iterator it = value.begin(); it != value.end(); ++it) {
+				*it = std::tolower(*it);
+			}
+			if (name == "content-length") {
+				hasLength_ = true;
+				bodyLeft_ = std::strtoul(value.c_str(), 0, 10);
+			}
+			else if (name == "transfer-encoding") {
+				chunked_ = (value.find("chunked") != std::string::npos);
+			}
+			else if (name == "connection") {
+				if (value.find("close") != std::string::npos) {
+					closeAfter_ = true;
+				}
+				else if (value.find("keep-alive") != std::string::npos) {
+					closeAfter_ = false;
+				}
+			}
+			return true;
+		}
+		res_.headers_ += "\r\n";
+		if (res_.status_ / 100 == 1) {
+			// Interim response; the real one follows.
+			parseState_ = STATUS_LINE;
+		}
+		else if (res_.status_ == 204 || res_.status_ == 304) {
+			onResponse();
+		}
+		else if (chunked_) {
+			parseState_ = CHUNK_SIZE;
+		}
+		else if (hasLength_) {
+			parseState_ = BODY;
+			if (bodyLeft_ == 0) {
+				onResponse();
+			}
+		}
+		else {
+			parseState_ = BODY_UNTIL_CLOSE;
+			closeAfter_ = true;
+		}
+		return true;
+	}
+	case CHUNK_SIZE: {
+		char * end;
+		bodyLeft_ = std::strtoul(line.c_str(), &end, 16);
+		if (end == line.c_str()) {
+			return false;
+		}
+		parseState_ = bodyLeft_ ? CHUNK_DATA : TRAILERS;
+		return true;
+	}
+	case CHUNK_END:
+		parseState_ = CHUNK_SIZE;
+		return line.empty();
+	case TRAILERS:
+		if (line.empty()) {
+			onResponse();
+		}
+		return true;
+	default:
+		return false;
+	}
+}
+
+void Http::onResponse() {
+	Handler handler(pending_.front().handler_);
+	pending_.pop_front();
+	// The server may answer before we've heard that the write is done.
+	if (written_ > 0) {
+		written_--;
+	}
+	else {
+		writeCount_--;
+	}
+	Res res;
+	std::swap(res, res_);
+	parseState_ = STATUS_LINE;
+	startTimer();
+	handler(res);
+	if (closeAfter_) {
+		// Nothing else is answered on this connection; that's no fault of the next request.
+		written_ = 0;
+		writing_ = false;
+		disconnect(true);
+	}
+}
+
+void Http::disconnect(bool retry) {
+	// Only the response that was due can have been the trouble; the ones behind it just go again.
+	std::size_t sent = written_ + (writing_ ? writeCount_ : 0);
+	if (!pending_.empty() && sent > 0) {
+		pending_.front().failures_++;
+	}
+	boost::system::error_code ignored;
+	sock_.close(ignored);
+	generation_++;
+	state_ = DEAD;
+	writing_ = false;
+	written_ = 0;
+	parseState_ = STATUS_LINE;
+	line_.clear();
+	res_ = Res();
+	std::vector<Handler> failed;
+	std::deque<Pending> kept;
+	for (std::size_t i = 0; i < pending_.size(); i++) {
+		const Pending & it = pending_[i];
+		if (retry && it.failures_ < MAX_ATTEMPTS && (it.retry_ || i >= sent)) {
+			kept.push_back(it);
+		}
+		else {
+			failed.push_back(it.handler_);
+		}
+	}
+	pending_.swap(kept);
+	startTimer();
+	if (!pending_.empty()) {
+		connect(0);
+	}
+	for (std::size_t i = 0; i < failed.size(); i++) {
+		failed[i](Res()); // Empty error result
+	}
+}
+
+void Http::startTimer() {
+	if (pending_.empty()) {
+		timer_.cancel();
+		return;
+	}
+	NodeClock::time_point deadline = pending_.front().deadline_;
+	for (std::size_t i = 1; i < pending_.size(); i++) {
+		deadline = std::min(deadline, pending_[i].deadline_);
+	}
+	timer_.expires_at(deadline);
+	timer_.async_wait(boost::bind(&Http::onTimer, shared_from_this(), boost::asio::placeholders::error));
+}
+
+void Http::onTimer(const boost::system::error_code & error) {
+	if (error) {
+		return;
+	}
+	NodeClock::time_point now = NodeClock::now();
+	std::vector<Handler> failed;
+	std::deque<Pending> kept;
+	bool lostWritten = false;
+	for (std::size_t i = 0; i < pending_.size(); i++) {
+		if (pending_[i].deadline_ <= now) {
+			failed.push_back(pending_[i].handler_);
+			lostWritten = lostWritten || i < written_ || (writing_ && i < written_ + writeCount_);
+		}
+		else {
+			kept.push_back(pending_[i]);
+		}
+	}
+	if (failed.empty()) {
+		startTimer();
+		return;
+	}
+	pending_.swap(kept);
+	if (lostWritten) {
+		// The answers would still come, in their places. Start over on a new connection.
+		disconnect(true);
+	}
+	else {
+		startTimer();
+	}
+	for (std::size_t i = 0; i < failed.size(); i++) {
+		failed[i](Res()); // Empty error result
+	}
+}
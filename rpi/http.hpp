@@ -1,47 +1,108 @@
+#include <deque>
 #include <boost/asio.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/function.hpp>
+#include "node_clock.hpp"
 
-class Http 
+// HTTP/1.1 client on one keep-alive connection. Requests are pipelined: written as they come (up to
+// PIPELINE_MAX unanswered), answered in order. Responses are parsed as they arrive, with Content-Length,
+// chunked or read-until-close bodies. A lost connection is made again, to the endpoint resolved the first
+// time. Requests not yet written go on the new one. The ones that were written may have been carried out, so
+// they're only sent again if they say that's safe (retry_); the rest fail. A request that loses MAX_ATTEMPTS
+// connections while its response is due fails too.
+// A request that times out fails, and so does the connection, as a pipelined request can't be taken back.
+class Http
 	:	public boost::enable_shared_from_this<Http> {
 public:
 	struct Req {
 		std::string path_;
 		bool connectionClose_;
+		unsigned int timeout_; // ms; 0 for the default
+		bool retry_; // Sent again if the connection is lost after it was written; only if it has no side effects
+		Req() : connectionClose_(false), timeout_(0), retry_(false) { }
 	};
-	
+
 	struct Res {
+		unsigned int status_;
 		std::string headers_; // Empty on error
 		std::vector<uint8_t> content_;
+		Res() : status_(0) { }
 	};
-	
+
+	typedef boost::function<void(const Res & res)> Handler;
+
 	static boost::shared_ptr<Http> create(boost::asio::io_service & io, const std::string & host, const std::string & port) {
 		boost::shared_ptr<Http> ptr(new Http(io, host, port));
 		return ptr;
 	}
+	// Connecting in advance is optional; sendReq connects when needed.
 	void start(boost::function<void(const boost::system::error_code & error)> connectHandler);
-	
+
 	~Http();
-	void sendReq(const Req & req, boost::function<void(const Res & res)> handler);
+	void sendReq(const Req & req, Handler handler);
+
+	static std::string urlEncode(const std::string & str);
 private:
 	enum State {
 		RESOLVING,
 		CONNECTING,
 		CONNECTED,
-		DEAD
+		DEAD // Not connected; the next request connects again
+	};
+
+	enum ParseState {
+		STATUS_LINE,
+		HEADERS,
+		BODY, // Content-Length bytes
+		BODY_UNTIL_CLOSE,
+		CHUNK_SIZE,
+		CHUNK_DATA,
+		CHUNK_END, // The CRLF after the data
+		TRAILERS
+	};
+
+	struct Pending {
+		std::string msg_;
+		Handler handler_;
+		NodeClock::time_point deadline_;
+		unsigned int failures_; // Connections lost while waiting for its response
+		bool retry_;
 	};
-	
+
 	Http(boost::asio::io_service & io, const std::string & host, const std::string & port);
-	
+
+	void connect(boost::function<void(const boost::system::error_code & error)> connectHandler);
 	void onResolve(const boost::system::error_code & error, boost::asio::ip::tcp::resolver::iterator iterator, boost::function<void(const boost::system::error_code & error)> connectHandler);
-	void onConnect(const boost::system::error_code & error, boost::asio::ip::tcp::resolver::iterator iterator, boost::function<void(const boost::system::error_code & error)> connectHandler);
-	void onSendReq(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<std::string> reqMsg, boost::function<void(const Res & res)> handler);
-	void onReceive(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr< std::vector<uint8_t> > data);
-	
+	void onConnect(const boost::system::error_code & error, boost::function<void(const boost::system::error_code & error)> connectHandler);
+	void startWrite();
+	void onSendReq(const boost::system::error_code & error, std::size_t bytes_transferred, unsigned int generation);
+	void startReceive();
+	void onReceive(const boost::system::error_code & error, std::size_t bytes_transferred, unsigned int generation);
+	void parse(const uint8_t * data, std::size_t size);
+	bool parseLine(const std::string & line);
+	void onResponse();
+	void disconnect(bool retry); // Unanswered requests are retried if they can be, or else failed
+	void startTimer();
+	void onTimer(const boost::system::error_code & error);
+
 	boost::asio::io_service & io_;
 	boost::asio::ip::tcp::resolver resolver_;
 	boost::asio::ip::tcp::socket sock_;
 	std::string host_, port_;
 	State state_;
-	bool requestBusy_;
+	unsigned int generation_; // Of the connection. Callbacks for earlier ones are stale.
+	std::vector<boost::asio::ip::tcp::endpoint> endpoints_; // Resolved once, reused for reconnecting
+	NodeTimer timer_; // The earliest deadline of the pending requests
+	std::deque<Pending> pending_; // In order; the first written_ of them have been written
+	std::size_t written_;
+	bool writing_;
+	std::string writeBuf_; // The requests being written, writeCount_ of them
+	std::size_t writeCount_;
+	std::vector<uint8_t> readBuf_;
+	// The response being parsed, for pending_.front()
+	ParseState parseState_;
+	std::string line_;
+	Res res_;
+	std::size_t bodyLeft_; // Of the body or chunk
+	bool chunked_, hasLength_, closeAfter_;
 };
@@ -0,0 +1,110 @@
+#include <algorithm>
+#include "mixer.hpp"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define MIXER_NEON
+#include <arm_neon.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#define MIXER_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+	int16_t mixSample(int16_t out, int16_t in, int16_t gain) {
+		int32_t sample = out + ((int32_t(in) * gain + 0x4000) >> 15);
+		return int16_t(std::min<int32_t>(32767, std::max<int32_t>(-32768, sample)));
+	}
+
+	void mixScalar(int16_t * out, const int16_t * in, std::size_t count, int16_t gain) {
+		for (std::size_t i = 0; i < count; i++) {
+			out[i] = mixSample(out[i], in[i], gain);
+		}
+	}
+
+#ifdef MIXER_NEON
+	void mixNeon(int16_t * out, const int16_t * in, std::size_t count, int16_t gain) {
+		int16x8_t g = vdupq_n_s16(gain);
+		std::size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			// vqrdmulh: (in * gain * 2 + 0x8000) >> 16, the same rounding as mixSample.
+			vst1q_s16(out + i, vqaddq_s16(vld1q_s16(out + i), vqrdmulhq_s16(vld1q_s16(in + i), g)));
+		}
+		mixScalar(out + i, in + i, count - i, gain);
+	}
+#endif
+
+#ifdef MIXER_X86
+	void mixSse2(int16_t * out, const int16_t * in, std::size_t count, int16_t gain) {
+		__m128i g = _mm_set1_epi16(gain), round = _mm_set1_epi32(0x4000);
+		std::size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			// SSE2 has no rounding multiply, so build the 32-bit products from their halves.
+			__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+			__m128i lo = _mm_mullo_epi16(x, g), hi = _mm_mulhi_epi16(x, g);
+			__m128i p0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round), 15);
+			__m128i p1 = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round), 15);
+			__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(out + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_adds_epi16(y, _mm_packs_epi32(p0, p1)));
+		}
+		mixScalar(out + i, in + i, count - i, gain);
+	}
+
+	__attribute__((target("avx2")))
+	void mixAvx2(int16_t * out, const int16_t * in, std::size_t count, int16_t gain) {
+		__m256i g = _mm256_set1_epi16(gain);
+		std::size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			// mulhrs: (in * gain + 0x4000) >> 15. The gain is never -32768, so it can't overflow.
+			__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+			__m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(out + i));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_adds_epi16(y, _mm256_mulhrs_epi16(x, g)));
+		}
+		mixSse2(out + i, in + i, count - i, gain);
+	}
+
+	bool hasAvx2() {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+	}
+#endif
+
+	struct Kernels {
+		Mixer::KernelInfo list_[3];
+		std::size_t count_;
+
+		Kernels() : count_() {
+			add("scalar", &mixScalar);
+#ifdef MIXER_NEON
+			add("neon", &mixNeon);
+#endif
+#ifdef MIXER_X86
+			add("sse2", &mixSse2);
+			if (hasAvx2()) {
+				add("avx2", &mixAvx2);
+			}
+#endif
+		}
+
+		void add(const char * name, Mixer::Kernel kernel) {
+			list_[count_].name_ = name;
+			list_[count_].kernel_ = kernel;
+			count_++;
+		}
+	};
+
+	// Set up before main, so the audio thread only ever reads it.
+	const Kernels KERNELS;
+}
+
+int16_t Mixer::gain(unsigned int percent) {
+	return int16_t(std::min(32767u, std::min(100u, percent) * 32768u / 100u));
+}
+
+const Mixer::KernelInfo * Mixer::kernels(std::size_t & count) {
+	count = KERNELS.count_;
+	return KERNELS.list_;
+}
+
+Mixer::Kernel Mixer::best() {
+	return KERNELS.list_[KERNELS.count_ - 1].kernel_;
+}
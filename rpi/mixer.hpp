@@ -0,0 +1,27 @@
+#ifndef MIXER_HPP
+#define MIXER_HPP
+
+#include <cstddef>
+#include <stdint.h>
+
+// Block mixing of 16-bit audio: out[i] = saturate(out[i] + in[i] * gain), with the gain in Q15
+// (32767 is just under 1). Every kernel rounds the same way, so they give the same results.
+// NEON is used on ARM, AVX2 (if the CPU has it) or SSE2 on x86, and plain C++ elsewhere.
+class Mixer {
+public:
+	typedef void (*Kernel)(int16_t * out, const int16_t * in, std::size_t count, int16_t gain);
+	struct KernelInfo {
+		const char * name_;
+		Kernel kernel_;
+	};
+
+	static void mix(int16_t * out, const int16_t * in, std::size_t count, int16_t gain) { best()(out, in, count, gain); }
+	static int16_t gain(unsigned int percent); // At most 100
+	// The kernels this build and CPU can run, the scalar one first. For benchmarks.
+	static const KernelInfo * kernels(std::size_t & count);
+private:
+	Mixer();
+	static Kernel best();
+};
+
+#endif
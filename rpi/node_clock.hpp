@@ -0,0 +1,55 @@
+#ifndef NODE_CLOCK_HPP
+#define NODE_CLOCK_HPP
+
+#include <boost/asio/basic_waitable_timer.hpp>
+#include <boost/chrono.hpp>
+
+// The clock that the node's timers and timestamps go by, and its timer. Normally the steady clock.
+#if defined(SENSOR_SIM)
+// A simulation build has a virtual clock instead: whenever the io_service would wait for a timer, the time
+// it would have waited passes at once, so runs only take as long as their handlers do. Nothing but timers
+// may be waited for, and asio must use its select reactor (build with BOOST_ASIO_DISABLE_EPOLL and
+// BOOST_ASIO_DISABLE_KQUEUE): the others ask for the wait when a timer is set, not when they're about to wait.
+class SimClock {
+public:
+	typedef boost::chrono::nanoseconds duration;
+	typedef duration::rep rep;
+	typedef duration::period period;
+	typedef boost::chrono::time_point<SimClock> time_point;
+	BOOST_STATIC_CONSTEXPR bool is_steady = true;
+
+	static time_point now() { return current(); }
+	// Times the time has jumped ahead: how often a real node would have woken up.
+	static unsigned long long wakeups() { return jumps(); }
+
+	struct WaitTraits {
+		static duration to_wait_duration(const duration & d) {
+			if (d > duration::zero()) {
+				current() += d;
+				jumps()++;
+			}
+			return duration::zero();
+		}
+		static duration to_wait_duration(const time_point & t) {
+			return to_wait_duration(t - now());
+		}
+	};
+private:
+	static time_point & current() {
+		static time_point time;
+		return time;
+	}
+	static unsigned long long & jumps() {
+		static unsigned long long count;
+		return count;
+	}
+};
+
+typedef SimClock NodeClock;
+typedef boost::asio::basic_waitable_timer<SimClock, SimClock::WaitTraits> NodeTimer;
+#else
+typedef boost::chrono::steady_clock NodeClock;
+typedef boost::asio::basic_waitable_timer<NodeClock> NodeTimer;
+#endif
+
+#endif
@@ -1,59 +1,102 @@
 //#include <cstdlib>
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <deque>
+#include <fstream>
 #include <iostream>
 #include <sstream>
-#include <queue>
 
 #include <boost/asio.hpp>
-#include <boost/asio/high_resolution_timer.hpp>
+#include <boost/atomic.hpp>
 #include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
 //#include <boost/date_time/posix_time/posix_time.hpp>
 //#include <boost/iostreams/device/array.hpp>
 //#include <boost/iostreams/stream.hpp>
 
+#if !defined(SENSOR_SIM)
 #include <portaudio.h>
+#endif
 
-// FreeBSD's GPIO library
-#include <libgpio.h>
-
+#include "../common/audio_codec.hpp"
+#include "../common/frame_decoder.hpp"
+#include "../common/protocol.hpp"
+#include "gpio_backend.hpp"
 #include "http.hpp"
+#include "mixer.hpp"
+#include "node_clock.hpp"
+#include "signal_chain.hpp"
+#include "signal_input.hpp"
+#include "siren.hpp"
+#include "spsc_ring.hpp"
+#include "timer_wheel.hpp"
 
 // Functionality:
 // - GPIO
-//   - polling sensors
+//   - sensor edges (or polling, where the device can't report them)
 //   - LED output
 // - HTTP
 //   - Longpoll incoming events
 //     - Also receive audio, in small chunks
 //   - Send sensor events
+// - Or instead, a persistent link to pc_sw carrying both
 // - Audio
 //   - Output the data received from HTTP
-
-template<typename To, typename From> To & typepun(From & a) {
-	return *static_cast<To*>(static_cast<void*>(&a));
-}
-
-template<typename To, typename From> const To & typepun(const From & a) {
-	return *static_cast<const To*>(static_cast<const void*>(&a));
-}
+//
+// Built with SENSOR_SIM, it's a simulation instead: no hardware and no pc_sw, a virtual clock, GPIO inputs
+// and commands replayed from a trace, and the audio rendered into a file. See Program::Sim.
 
 enum {
 	BUF_SIZE = 1024,
 	GPIO_FIRE_ALARM_PIN = 2,
 	GPIO_MOTION_PIN = 3,
 	GPIO_LED_PIN = 4,
-	SMOKE_STOP_TIME = 1000,
-	MOTION_DELAY_TIME = 200,
+	SMOKE_STOP_TIME = 1000, // ms after the smoke sensor goes quiet, before smoke is over (in the default SMOKE_CHAIN)
+	MOTION_DELAY_TIME = 200, // ms between motion events, while the sensor stays on (in the default MOTION_CHAIN)
+	LED_TICK_TIME = 50, // ms; the unit of the LED's on and off times, unless the command gives one
 	AUDIO_SAMPLE_RATE = 8000,
-	AUDIO_BUFFER_SIZE = 1024,
-	AUDIO_QUEUE_SIZE = 40000
+	AUDIO_QUEUE_SIZE = 40000,
+	AUDIO_UNDERRUN_GAP = AUDIO_SAMPLE_RATE / 2, // Audio resuming after a shorter gap than this had run dry
+	AUDIO_STATS_TIME = 1000, // ms after audio comes in, before underruns are reported
+	AUDIO_MIX_BLOCK = 1024, // Samples the callback takes from the ring at a time; also the simulation's block
+	LINK_HEARTBEAT_TIME = 5000,
+	LINK_TIMEOUT = 15000, // ms without anything from pc_sw, after which the link is reconnected
+	LINK_RECONNECT_TIME = 1000,
+	LINK_PENDING_MAX = 64, // Lines of sensor events kept while the link is down; past it, the oldest motion lines are merged
+	EVENT_QUEUE_MAX = 64, // Lines of motion events kept while pc_sw can't be reached
+	EVENT_RETRY_MIN = 100, // ms; doubled after every failed send, up to EVENT_RETRY_MAX
+	EVENT_RETRY_MAX = 5000,
+	SMOKE_TIMEOUT = 2000, // ms that sending smoke events may take, before they're sent again
+	SMOKE_RETRY_MAX = 500, // ms; the backoff of smoke events stops there
+	LONGPOLL_RETRY_TIME = 1000, // ms after a failed longpoll
+	HTTP_LONGPOLL_TIMEOUT = 120000 // ms; longer than the server holds a longpoll
 };
 
-/*namespace {
+// The sensors' signal conditioning: chains of stages from signal_chain.hpp, on a sample every ms. Installs with
+// other detectors build with chains of their own, e.g.
+// -DMOTION_CHAIN="Signal::Chain<Signal::Majority<5>, Signal::Lockout<MOTION_DELAY_TIME> >".
+#if !defined(SMOKE_CHAIN)
+// Active low. Smoke while the output is on.
+#define SMOKE_CHAIN Signal::Chain<Signal::Invert, Signal::Hold<SMOKE_STOP_TIME> >
+#endif
+#if !defined(MOTION_CHAIN)
+// A motion event whenever the output goes on.
+#define MOTION_CHAIN Signal::Lockout<MOTION_DELAY_TIME>
+#endif
+
+namespace {
+	// The audio codecs we ask for, most preferred first. Not mulaw: it's no smaller than the 8-bit audio pc_sw has.
+	const char * AUDIO_CODECS = "ima_adpcm";
+}
+
+namespace {
+	// With --http
 	const char
-		*LONGPOLL_ADDR = "192.168.42.1",
-		*LONGPOLL_PORT = "http",
-		*LONGPOLL_PATH = "sensor_longpoll.php";
-}*/
+		*LONGPOLL_PATH = "/sensor_longpoll.php",
+		*EVENT_PATH = "/sensor_event.php";
+}
 
 typedef boost::asio::local::stream_protocol strm;
 
@@ -62,7 +105,29 @@ public:
 	struct Config {
 		std::string
 			longpollAddr_,
-			eventAddr_;
+			eventAddr_,
+			linkAddr_, // If set, the longpoll and event sockets aren't used
+			httpHost_, // If set, longpolls and events go to the PHP scripts of this server instead of the sockets
+			httpPort_,
+			gpio_, // GPIO backend; see GpioBackend
+			gpioRecord_, // If set, the input edges are written into this file, as a trace for the simulation
+			node_, // The name of this node, if pc_sw serves more than one
+			groups_; // Comma-separated names of the groups it's in, for commands to a group
+#if defined(SENSOR_SIM)
+		std::string
+			trace_, // The trace to replay; see Sim
+			simLog_, // Where the node's doings are logged; stdout if not set
+			audioOut_; // Where the audio is rendered into, as raw 16-bit samples (/dev/null to only render it); not rendered if not set
+#endif
+		unsigned int audioLatency_; // Target output latency in ms; 0 for the device's default
+		unsigned int streamGain_, sirenGain_; // Volume of the streamed audio and of the siren, in percent
+		unsigned int eventBatch_; // ms that motion events are collected for before they're sent; smoke events go at once
+		Config() : gpio_(GpioBackend::defaultSpec()), audioLatency_(0), streamGain_(100), sirenGain_(100), eventBatch_(250) {
+#if defined(SENSOR_SIM)
+			// The smoke sensor's pin idles high.
+			gpio_ += ":" + boost::lexical_cast<std::string>(int(GPIO_FIRE_ALARM_PIN)) + "=1";
+#endif
+		}
 		static Config fromArgv(int argc, char const * const * argv);
 	};
 	
@@ -70,47 +135,95 @@ public:
 	~Program();
 	void operator()();
 private:
-	typedef int8_t AudioSample;
+	typedef int16_t AudioSample;
 	typedef std::vector<AudioSample> AudioVec;
 	
-	enum Event {
-		SMOKE_ON,
-		SMOKE_OFF,
-		MOTION
-	};
+	typedef Protocol::SensorEvent Event;
+	typedef Protocol::MsgType MsgCode;
 	
+	// Driven by the sensors' edges and by timers, so nothing runs while nothing happens.
 	class Gpio {
 	public:
 		Gpio(Program & program);
 		~Gpio();
-		void led(unsigned int onTime, unsigned int offTime);
+		void led(unsigned int onTime, unsigned int offTime); // ms
 		void smokeSleep(unsigned int time);
+		GpioBackend * backend() const { return backend_.get(); }
 	private:
-		void sampleGpio();
+		typedef GpioBackend::Clock Clock;
+		typedef SMOKE_CHAIN SmokeChain;
+		typedef MOTION_CHAIN MotionChain;
+		
+		void onInput(unsigned int pin, bool level, Clock::time_point time);
+		void onSmoke(bool smoke, Clock::time_point time);
+		void onMotion(bool motion, Clock::time_point time); // Only ever on
+		void onSmokeSleepTimer();
+		void startLedTimer();
+		void onLedTimer();
 		
 		Program & program_;
-		gpio_handle_t gpio_;
-		boost::asio::high_resolution_timer gpioTimer_;
-		bool smokeState_, ledState_;
-		unsigned int onTime_, offTime_, smokeSleep_, smokeStopCounter_, ledCounter_, motionDelayCounter_;
+		boost::scoped_ptr<GpioBackend> backend_; // Null if there's no GPIO
+		std::ofstream record_; // Open if recording
+		Clock::time_point recordStart_;
+		SignalInput<SmokeChain> smoke_;
+		SignalInput<MotionChain, Signal::RISING> motion_;
+		TimerWheel::Timer smokeSleepTimer_, ledTimer_;
+		bool smokeState_, smokeSleeping_, ledState_;
+		unsigned int onTime_, offTime_; // ms
 	};
 	
+	// PortAudio pulls the samples from its own thread, through a callback. pushAudio feeds it via a lock-free
+	// ring, and the siren is mixed in by the callback itself, which never allocates, locks or blocks.
 	class AudioOut {
 	public:
-		AudioOut(boost::asio::io_service & io);
+		AudioOut(TimerWheel & wheel, const Config & config);
 		~AudioOut();
 		void pushAudio(const AudioVec & av);
 		void sirenState(bool state);
 		void sirenEnable(bool enable);
+		void sirenPattern(Siren::Pattern pattern);
+		// Times the output ran dry while playing, or PortAudio reported that it had to.
+		uint64_t underruns() const { return underruns_.load(boost::memory_order_relaxed); }
+#if defined(SENSOR_SIM)
+		uint64_t rendered() const { return rendered_; } // Samples
+#endif
 	private:
-		void timeStep();
+#if defined(SENSOR_SIM)
+		// Instead of PortAudio, a timer takes a block at a time, as fast as it would be played.
+		void startSinkTimer();
+		void onSinkTimer();
+#else
+		static int paCallback(const void * input, void * output, unsigned long frameCount, const PaStreamCallbackTimeInfo * timeInfo, PaStreamCallbackFlags statusFlags, void * userData);
+#endif
+		void fill(AudioSample * out, std::size_t count, bool underflow);
+		void onStatsTimer();
 		
-		bool paInitialized_, sirenState_, sirenEnable_;
-		unsigned int sirenCounter_;
-		boost::asio::io_service & io_;
-		boost::asio::high_resolution_timer stepTimer_;
+#if !defined(SENSOR_SIM)
+		bool paInitialized_;
+#endif
+		boost::atomic<bool> sirenState_, sirenEnable_;
+		boost::atomic<int> sirenPattern_;
+		boost::atomic<uint64_t> underruns_;
+		const int16_t streamGain_, sirenGain_; // Q15
+		TimerWheel::Timer statsTimer_;
+		uint64_t reportedUnderruns_;
+#if defined(SENSOR_SIM)
+		TimerWheel::Timer sinkTimer_;
+		NodeClock::time_point sinkTime_; // When the next block is due
+		std::ofstream sink_;
+		AudioVec sinkBlock_;
+		uint64_t rendered_;
+#else
 		PaStream * paStream_;
-		std::queue<AudioSample> audioQueue_;
+#endif
+		SpscRing<AudioSample> ring_;
+		const Siren siren_;
+		// Only touched by the callback
+		AudioVec block_; // Taken from the ring, to be mixed in
+		bool lastSirenState_;
+		int lastSirenPattern_;
+		std::size_t sirenPos_;
+		std::size_t gap_; // Samples of silence since audio last played
 	};
 	
 	class Longpoll {
@@ -118,65 +231,204 @@ private:
 		Longpoll(Program & program);
 		~Longpoll();
 	private:
-		enum MsgCode {
-			LED = 1,
-			SIREN_CTRL,
-			SMOKE_SLEEP,
-			AUDIO_STREAM,
-			TOKEN
-		};
-		
 		void startLongpoll(const std::string & token);
 		void onConnect(const boost::system::error_code & error, boost::shared_ptr<strm::socket> sock, const std::string & token);
-		void onWrite(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> msgOut);
-		void startRead(boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > allDataIn);
-		void onRead(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > allDataIn, boost::shared_ptr< std::vector<uint8_t> > dataIn);
-		void onEof(boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > allDataIn);
-		void startTimer(const std::string & token);
+		void onWrite(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> msgOut, const std::string & token);
+		void startRead(boost::shared_ptr<strm::socket> sock, const std::string & token);
+		void onRead(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, const std::string & token);
+		void onResponse(const Http::Res & res, const std::string & token);
+		void onMessage(uint8_t type, const uint8_t * content, std::size_t size);
+		void startTimer(const std::string & token, unsigned int time);
 		void onTimer(const std::string & token);
 		
 		Program & program_;
-		boost::asio::high_resolution_timer timer_;
+		boost::shared_ptr<Http> http_; // Null if longpolling the socket
+		TimerWheel::Timer timer_;
+		// Messages are handled as they arrive, and all of these are reused from one longpoll to the next.
+		std::vector<uint8_t> readBuf_;
+		FrameDecoder decoder_;
+		std::string token_; // The token of the response being read
 	};
 	
+	// One connection to pc_sw for as long as it lasts: commands and audio come down it, sensor events go up.
+	// Both ends send heartbeats, and a link that went quiet is dropped and connected again. Sensor events
+	// wait while the link is down, consecutive motion events coalesced as in EventOut, and past LINK_PENDING_MAX
+	// lines the oldest motion lines merged; smoke events are never dropped. Events are forgotten once written. Their lines are made as they're written, so that the ages are the ones at that time.
+	class Link {
+	public:
+		Link(Program & program);
+		~Link();
+		void pushEvent(Event event, NodeClock::time_point time);
+	private:
+		void connect();
+		void onConnect(const boost::system::error_code & error, boost::shared_ptr<strm::socket> sock);
+		void startRead();
+		void onRead(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock);
+		void onMessage(uint8_t type, const uint8_t * content, std::size_t size);
+		void send(MsgCode type, const std::string & content);
+		void startWrite();
+		void onWrite(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock);
+		void startHeartbeat();
+		void onHeartbeat();
+		void disconnect();
+		
+		static std::string frame(MsgCode type, const std::string & content);
+		
+		struct Pending {
+			Event event_;
+			unsigned int count_;
+			NodeClock::time_point first_, last_;
+		};
+		static bool isMotion(const Pending & pending) { return pending.event_ == Protocol::MOTION; }
+		
+		Program & program_;
+		boost::shared_ptr<strm::socket> sock_; // Null while disconnected. Callbacks for any other socket are stale.
+		TimerWheel::Timer heartbeatTimer_, reconnectTimer_;
+		std::vector<uint8_t> readBuf_;
+		FrameDecoder decoder_;
+		std::deque<std::string> queue_; // Other frames to send, which go before the events. Not kept over links.
+		std::deque<Pending> events_; // The first writingEvents_ of them are being written
+		std::size_t writingEvents_;
+		std::string writeBuf_; // Being written while writing_
+		bool connected_, writing_;
+		NodeClock::time_point lastReceived_;
+	};
+	
+	// Sends sensor events, one connection and one write (or one request) per batch, on two lanes that don't
+	// wait for each other, each with its own connection. Motion events are batched for eventBatch_ ms, and
+	// consecutive ones are coalesced into one line with their count and the ages of the first and last of them.
+	// Smoke events are never coalesced or dropped, and go at once: they only wait for the smoke events sent
+	// before them, which keeps them in order. Unsent events are kept while pc_sw can't be reached, and retried
+	// with backoff, which stops at SMOKE_RETRY_MAX for smoke. Past EVENT_QUEUE_MAX lines of motion, the oldest
+	// two are coalesced.
 	class EventOut {
 	public:
 		EventOut(Program & program);
 		~EventOut();
-		void pushEvent(Event event);
+		void pushEvent(Event event, NodeClock::time_point time);
 	private:
-		void onConnect(const boost::system::error_code & error, boost::shared_ptr<strm::socket> sock, Event event);
-		void onWrite(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> msgOut);
+		typedef NodeClock Clock;
+		
+		struct Pending {
+			Event event_;
+			unsigned int count_;
+			Clock::time_point first_, last_;
+		};
+		
+		struct Lane {
+			boost::shared_ptr<Http> http_; // Null if sending to the socket. Not shared with the longpoll, which would hold events up.
+			TimerWheel::Timer timer_; // Batching, or waiting to retry
+			std::deque<Pending> queue_;
+			std::size_t sending_; // Events at the front of queue_ being sent; 0 if none
+			unsigned int retryTime_;
+			const unsigned int retryMax_, timeout_; // ms; a timeout of 0 is Http's default
+			Lane(TimerWheel & wheel, unsigned int retryMax, unsigned int timeout) : timer_(wheel), sending_(0), retryTime_(EVENT_RETRY_MIN), retryMax_(retryMax), timeout_(timeout) { }
+		};
+		
+		void flush(Lane & lane);
+		void onConnect(Lane & lane, const boost::system::error_code & error, boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> msgOut);
+		void onWrite(Lane & lane, const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> msgOut);
+		void onResponse(Lane & lane, const Http::Res & res);
+		void onSent(Lane & lane);
+		void onFailure(Lane & lane);
+		void startTimer(Lane & lane, unsigned int time);
+		
+		Program & program_;
+		Lane smoke_, motion_;
+	};
 	
+#if defined(SENSOR_SIM)
+	// Replays a trace on the virtual clock, and logs what the node does: its sensor events and LED changes,
+	// each line "<ms> <what>". A trace has one entry per line, "<ms> <what> [<args>]", where the time is from
+	// the start, or from the previous entry with a '+'. Empty lines and '#' comments are skipped.
+	// - "pin <pin> <level>": an input's level, as recorded with --gpio-record
+	// - "smoke <0|1>", "motion <0|1>": the sensors, whichever level their pins have
+	// - "led <on> <off>", "siren <enable> [<pattern>]", "smoke_sleep <ms>": commands, as from pc_sw
+	// - "siren_state <0|1>": sounding the siren, which nothing else does yet
+	// - "tone <ms> <Hz>": streamed audio
+	// - "end": the end of the run, which is otherwise the last entry
+	class Sim {
+	public:
+		Sim(Program & program);
+		~Sim();
+		void start(); // Once the rest of the program is there
+		void run(); // Reports the times taken when the run is over
+		void onSensorEvent(Event event, NodeClock::time_point time);
+	private:
+		struct Entry {
+			uint64_t time_; // ms
+			std::string what_, args_;
+		};
+		
+		void load(const std::string & path);
+		void startEntry();
+		void onEntry();
+		void apply(const Entry & entry);
+		void onOutput(unsigned int pin, bool level, NodeClock::time_point time);
+		std::ostream & log(NodeClock::time_point time);
+		
 		Program & program_;
+		std::vector<Entry> entries_;
+		std::size_t next_;
+		TimerWheel::Timer timer_;
+		NodeClock::time_point start_;
+		FakeGpioBackend * gpio_;
+		std::ofstream logFile_; // Open unless logging to stdout
+		std::ostream * log_;
 	};
+#endif
 	
 	void onSignal(const boost::system::error_code & error, int signal_number);
+	void onSensorEvent(Event event, NodeClock::time_point time); // When the sensor saw it
+	void onMessage(uint8_t type, const uint8_t * content, std::size_t size); // Commands and audio, however they came
+	
+	static const char * eventName(Event event) { return Protocol::sensorEventName(event); }
+	// The options of longpoll request lines and HELLOs: the codecs, and the node's name and groups
+	std::string requestOptions() const;
 	
 	boost::asio::io_service io_;
+	TimerWheel wheel_; // Every timer of the node is on it
 	boost::asio::signal_set signals_;
 	const Config config_;
+	// These come before gpio_, which may report events as soon as it's constructed.
+#if defined(SENSOR_SIM)
+	boost::scoped_ptr<Sim> sim_;
+#endif
+	EventOut eventOut_;
+	boost::scoped_ptr<Link> link_; // Null if using longpolls and event connections
 	Gpio gpio_;
 	AudioOut audioOut_;
-	Longpoll longpoll_;
-	EventOut eventOut_;
+	boost::scoped_ptr<Longpoll> longpoll_; // Null if using the link
+	AudioVec audio_; // Decoded audio, reused from one message to the next
 };
 
 Program::Program(const Config & config)
-	:	signals_(io_, SIGINT, SIGTERM),
+	:	wheel_(io_),
+		signals_(io_, SIGINT, SIGTERM),
 		config_(config),
+#if defined(SENSOR_SIM)
+		sim_(new Sim(*this)),
+#endif
+		eventOut_(*this),
+		link_(config.linkAddr_.empty() ? 0 : new Link(*this)),
 		gpio_(*this),
-		audioOut_(io_),
-		longpoll_(*this),
-		eventOut_(*this) {
+		audioOut_(wheel_, config),
+		longpoll_(config.linkAddr_.empty() && !(config.httpHost_.empty() && config.longpollAddr_.empty()) ? new Longpoll(*this) : 0) {
 	signals_.async_wait(boost::bind(&Program::onSignal, this, boost::asio::placeholders::error, boost::asio::placeholders::signal_number));
+#if defined(SENSOR_SIM)
+	sim_->start();
+#endif
 }
 
 Program::~Program() {
 }
 
 void Program::operator()() {
+#if defined(SENSOR_SIM)
+	sim_->run();
+#else
 	io_.run();
+#endif
 }
 
 void Program::onSignal(const boost::system::error_code & error, int signal_number) {
@@ -186,135 +438,304 @@ void Program::onSignal(const boost::system::error_code & error, int signal_numbe
 	}
 }
 
-Program::Config Program::Config::fromArgv(int argc, char const * const * argv) {
-	if (argc != 3) {
-		throw std::runtime_error("argc != 3");
+void Program::onSensorEvent(Event event, NodeClock::time_point time) {
+#if defined(SENSOR_SIM)
+	sim_->onSensorEvent(event, time);
+	return;
+#endif
+	if (link_) {
+		link_->pushEvent(event, time);
+	}
+	else {
+		eventOut_.pushEvent(event, time);
+	}
+}
+
+void Program::onMessage(uint8_t type, const uint8_t * content, std::size_t size) {
+	unsigned int numbers[3] = { 0, 0, 0 };
+	switch (MsgCode(type)) {
+	case Protocol::LED:
+		// "<on> <off> [<unit>]": each at least one unit of ms
+		if (Protocol::parseNumbers(content, size, numbers, 3) < 3 || numbers[2] == 0) {
+			numbers[2] = LED_TICK_TIME;
+		}
+		gpio_.led(std::max(numbers[0], 1u) * numbers[2], std::max(numbers[1], 1u) * numbers[2]);
+		break;
+	case Protocol::SIREN_CTRL:
+		// "<enable> [<pattern>]"
+		switch (Protocol::parseNumbers(content, size, numbers, 2)) {
+		case 2:
+			if (numbers[1] < Siren::PATTERNS) {
+				audioOut_.sirenPattern(Siren::Pattern(numbers[1]));
+			}
+			// fall through
+		case 1:
+			audioOut_.sirenEnable(bool(numbers[0]));
+			break;
+		}
+		break;
+	case Protocol::SMOKE_SLEEP:
+		Protocol::parseNumbers(content, size, numbers, 1);
+		gpio_.smokeSleep(numbers[0]);
+		break;
+	case Protocol::AUDIO_STREAM:
+	case Protocol::AUDIO_MULAW:
+	case Protocol::AUDIO_IMA_ADPCM:
+		audio_.clear();
+		AudioCodec::decode(type == Protocol::AUDIO_MULAW ? AudioCodec::MULAW : type == Protocol::AUDIO_IMA_ADPCM ? AudioCodec::IMA_ADPCM : AudioCodec::PCM8, content, size, audio_);
+		audioOut_.pushAudio(audio_);
+		break;
+	default:
+		break;
 	}
+}
+
+std::string Program::requestOptions() const {
+	std::string options(std::string("codecs=") + AUDIO_CODECS);
+	if (!config_.node_.empty()) {
+		options += " node=" + config_.node_;
+	}
+	if (!config_.groups_.empty()) {
+		options += " groups=" + config_.groups_;
+	}
+	return options;
+}
+
+Program::Config Program::Config::fromArgv(int argc, char const * const * argv) {
 	Config config;
-	config.longpollAddr_ = argv[1];
-	config.eventAddr_    = argv[2];
+	std::vector<std::string> addrs;
+	for (int i = 1; i < argc; i++) {
+		std::string arg(argv[i]);
+		if (arg.compare(0, 2, "--") == 0) {
+			std::string::size_type eq = arg.find('=');
+			std::string name(arg.substr(2, eq - 2)), value(eq == std::string::npos ? "" : arg.substr(eq + 1));
+			if (name == "audio-latency") {
+				config.audioLatency_ = boost::lexical_cast<unsigned int>(value);
+			}
+			else if (name == "stream-gain") {
+				config.streamGain_ = boost::lexical_cast<unsigned int>(value);
+			}
+			else if (name == "siren-gain") {
+				config.sirenGain_ = boost::lexical_cast<unsigned int>(value);
+			}
+			else if (name == "event-batch") {
+				config.eventBatch_ = boost::lexical_cast<unsigned int>(value);
+			}
+			else if (name == "http") {
+				std::string::size_type colon = value.rfind(':');
+				config.httpHost_ = value.substr(0, colon);
+				config.httpPort_ = (colon == std::string::npos ? "http" : value.substr(colon + 1));
+			}
+			else if (name == "link") {
+				config.linkAddr_ = value;
+			}
+			else if (name == "gpio") {
+				config.gpio_ = value;
+			}
+			else if (name == "gpio-record") {
+				config.gpioRecord_ = value;
+			}
+#if defined(SENSOR_SIM)
+			else if (name == "trace") {
+				config.trace_ = value;
+			}
+			else if (name == "sim-log") {
+				config.simLog_ = value;
+			}
+			else if (name == "audio-out") {
+				config.audioOut_ = value;
+			}
+#endif
+			else if (name == "node") {
+				config.node_ = value;
+			}
+			else if (name == "groups") {
+				config.groups_ = value;
+			}
+			else {
+				throw std::runtime_error("unknown option " + arg);
+			}
+		}
+		else {
+			addrs.push_back(arg);
+		}
+	}
+#if defined(SENSOR_SIM)
+	// Only timers may be waited for on the virtual clock.
+	if (!addrs.empty() || !config.linkAddr_.empty() || !config.httpHost_.empty()) {
+		throw std::runtime_error("a simulation doesn't connect to pc_sw");
+	}
+	if (config.trace_.empty()) {
+		throw std::runtime_error("expected --trace");
+	}
+#else
+	if ((!config.linkAddr_.empty() || !config.httpHost_.empty()) && addrs.empty()) {
+		return config;
+	}
+	if (addrs.size() != 2) {
+		throw std::runtime_error("expected 2 socket addresses, or --link or --http");
+	}
+	config.longpollAddr_ = addrs[0];
+	config.eventAddr_    = addrs[1];
+#endif
 	return config;
 }
 
 Program::Gpio::Gpio(Program & program)
 	:	program_(program),
-		gpioTimer_(program.io_),
+		smoke_(program.wheel_, boost::bind(&Gpio::onSmoke, this, _1, _2)),
+		motion_(program.wheel_, boost::bind(&Gpio::onMotion, this, _1, _2)),
+		smokeSleepTimer_(program.wheel_),
+		ledTimer_(program.wheel_),
 		smokeState_(false),
+		smokeSleeping_(false),
 		ledState_(false),
-		onTime_(0),
-		offTime_(1000),
-		smokeSleep_(0),
-		smokeStopCounter_(0),
-		ledCounter_(0),
-		motionDelayCounter_(0) {
-	gpio_ = gpio_open(0);
-	if (gpio_ == GPIO_INVALID_HANDLE) {
-//		throw std::runtime_error("gpio_open fail");
+		onTime_(LED_TICK_TIME),
+		offTime_(1000 * LED_TICK_TIME) {
+	std::vector<unsigned int> inputs, outputs;
+	inputs.push_back(GPIO_FIRE_ALARM_PIN);
+	inputs.push_back(GPIO_MOTION_PIN);
+	outputs.push_back(GPIO_LED_PIN);
+	try {
+		backend_.reset(GpioBackend::create(program.wheel_, program.config_.gpio_));
+		backend_->open(inputs, outputs, boost::bind(&Gpio::onInput, this, _1, _2, _3));
 	}
-	else {
-		gpio_pin_input (gpio_, GPIO_FIRE_ALARM_PIN);
-		gpio_pin_input (gpio_, GPIO_MOTION_PIN    );
-		gpio_pin_output(gpio_, GPIO_LED_PIN       );
-		sampleGpio();
+	catch (const std::exception & e) {
+		std::cerr << "No GPIO: " << e.what() << std::endl;
+		backend_.reset();
+		return;
 	}
+	Clock::time_point now = Clock::now();
+	if (!program.config_.gpioRecord_.empty()) {
+		record_.open(program.config_.gpioRecord_.c_str());
+		if (!record_) {
+			std::cerr << "Can't record into " << program.config_.gpioRecord_ << std::endl;
+		}
+		recordStart_ = now;
+	}
+	// The levels the sensors start at count as edges.
+	onInput(GPIO_FIRE_ALARM_PIN, backend_->get(GPIO_FIRE_ALARM_PIN), now);
+	onInput(GPIO_MOTION_PIN, backend_->get(GPIO_MOTION_PIN), now);
+	startLedTimer();
 }
 
 Program::Gpio::~Gpio() {
-	gpio_close(gpio_);
 }
 
 void Program::Gpio::led(unsigned int onTime, unsigned int offTime) {
-	// TODO
 	onTime_ = onTime;
 	offTime_ = offTime;
+	if (backend_) {
+		startLedTimer();
+	}
 }
 
 void Program::Gpio::smokeSleep(unsigned int time) {
-	// TODO
-	smokeSleep_ = time;
-}
-
-void Program::Gpio::sampleGpio() {
-	//gpio_value_t val;
-	int val;
-	
-	val = gpio_pin_get(gpio_, GPIO_FIRE_ALARM_PIN);
-	bool nowSmoke = (val != GPIO_PIN_HIGH);
-	
-	val = gpio_pin_get(gpio_, GPIO_MOTION_PIN);
-	bool nowMotion = (val != GPIO_PIN_LOW);
-	
-	if (smokeSleep_ > 0) {
-		smokeSleep_ -= std::min<unsigned int>(50, smokeSleep_);
+	// While asleep, there's no smoke. Once awake, smoke that's still there is reported again.
+	smokeSleeping_ = (time > 0);
+	if (!smokeSleeping_) {
+		smokeSleepTimer_.cancel();
+		onSmokeSleepTimer();
+		return;
 	}
-	if (smokeStopCounter_ > 0) {
-		smokeStopCounter_ -= std::min<unsigned int>(50, smokeStopCounter_);
+	if (smokeState_) {
+		smokeState_ = false;
+		program_.onSensorEvent(Protocol::SMOKE_OFF, Clock::now());
 	}
-	
-	if (nowSmoke) {
-		smokeStopCounter_ = SMOKE_STOP_TIME;
-	}
-	
-	if (smokeState_ == true) {
-		if (smokeSleep_ > 0 || smokeStopCounter_ == 0) {
-			smokeState_ = false;
-			program_.eventOut_.pushEvent(SMOKE_OFF);
-		}
+	smokeSleepTimer_.expiresFromNow(boost::chrono::milliseconds(time), boost::bind(&Gpio::onSmokeSleepTimer, this));
+}
+
+void Program::Gpio::onInput(unsigned int pin, bool level, Clock::time_point time) {
+	if (record_.is_open()) {
+		// A kernel timestamp may be a little older than the start.
+		Clock::duration age = std::max(Clock::duration::zero(), time - recordStart_);
+		record_ << boost::chrono::duration_cast<boost::chrono::milliseconds>(age).count() << " pin " << pin << ' ' << level << std::endl;
 	}
-	else {
-		if (nowSmoke && smokeSleep_ == 0) {
-			smokeState_ = true;
-			program_.eventOut_.pushEvent(SMOKE_ON);
-		}
+	if (pin == GPIO_FIRE_ALARM_PIN) {
+		smoke_.onEdge(level, time);
 	}
-	
-	if (motionDelayCounter_ > 0) {
-		motionDelayCounter_ -= std::min<unsigned int>(50, motionDelayCounter_);
+	else if (pin == GPIO_MOTION_PIN) {
+		motion_.onEdge(level, time);
 	}
-	
-	if (nowMotion && motionDelayCounter_ == 0) {
-		program_.eventOut_.pushEvent(MOTION);
-		motionDelayCounter_ = MOTION_DELAY_TIME;
+}
+
+void Program::Gpio::onSmoke(bool smoke, Clock::time_point time) {
+	if (smoke && !smokeState_ && !smokeSleeping_) {
+		smokeState_ = true;
+		program_.onSensorEvent(Protocol::SMOKE_ON, time);
 	}
-	
-	ledCounter_++;
-	
-	if (ledState_ == true) {
-		if (ledCounter_ >= onTime_) {
-			ledState_ = !ledState_;
-			ledCounter_ = 0;
-		}
+	else if (!smoke && smokeState_) {
+		smokeState_ = false;
+		program_.onSensorEvent(Protocol::SMOKE_OFF, time);
 	}
-	else {
-		if (ledCounter_ >= offTime_) {
-			ledState_ = !ledState_;
-			ledCounter_ = 0;
-		}
+}
+
+void Program::Gpio::onMotion(bool, Clock::time_point time) {
+	program_.onSensorEvent(Protocol::MOTION, time);
+}
+
+void Program::Gpio::onSmokeSleepTimer() {
+	smokeSleeping_ = false;
+	if (smoke_.out() && !smokeState_) {
+		smokeState_ = true;
+		program_.onSensorEvent(Protocol::SMOKE_ON, Clock::now());
 	}
-	
-	gpio_pin_set(gpio_, GPIO_LED_PIN, ledState_ ? GPIO_PIN_HIGH : GPIO_PIN_LOW);
-	
-	gpioTimer_.expires_from_now(boost::chrono::milliseconds(50));
-	gpioTimer_.async_wait(boost::bind(&Gpio::sampleGpio, this));
 }
 
-Program::AudioOut::AudioOut(boost::asio::io_service & io)
+void Program::Gpio::startLedTimer() {
+	backend_->set(GPIO_LED_PIN, ledState_);
+	ledTimer_.expiresFromNow(boost::chrono::milliseconds(ledState_ ? onTime_ : offTime_), boost::bind(&Gpio::onLedTimer, this));
+}
+
+void Program::Gpio::onLedTimer() {
+	ledState_ = !ledState_;
+	startLedTimer();
+}
+
+Program::AudioOut::AudioOut(TimerWheel & wheel, const Config & config)
 	:	sirenState_(false),
 		sirenEnable_(true),
-		sirenCounter_(0),
-		io_(io),
-		stepTimer_(io_),
-		paStream_() {
+		sirenPattern_(Siren::LEGACY),
+		underruns_(0),
+		streamGain_(Mixer::gain(config.streamGain_)),
+		sirenGain_(Mixer::gain(config.sirenGain_)),
+		statsTimer_(wheel),
+		reportedUnderruns_(0),
+#if defined(SENSOR_SIM)
+		sinkTimer_(wheel),
+		sinkBlock_(AUDIO_MIX_BLOCK),
+		rendered_(0),
+#else
+		paStream_(),
+#endif
+		ring_(AUDIO_QUEUE_SIZE),
+		siren_(AUDIO_SAMPLE_RATE),
+		block_(AUDIO_MIX_BLOCK),
+		lastSirenState_(false),
+		lastSirenPattern_(Siren::LEGACY),
+		sirenPos_(0),
+		gap_(AUDIO_UNDERRUN_GAP) {
+#if defined(SENSOR_SIM)
+	if (!config.audioOut_.empty()) {
+		sink_.open(config.audioOut_.c_str(), std::ios::binary);
+		if (!sink_) {
+			throw std::runtime_error("can't write " + config.audioOut_);
+		}
+		sinkTime_ = NodeClock::now();
+		startSinkTimer();
+	}
+#else
+	unsigned int latency = config.audioLatency_;
 	if (paInitialized_ = (Pa_Initialize() == paNoError)) {
-		// http://portaudio.com/docs/v19-doxydocs/blocking_read_write.html
+		// http://portaudio.com/docs/v19-doxydocs/writing_a_callback.html
 		PaStreamParameters outParams = { };
 		outParams.device = Pa_GetDefaultOutputDevice();
 		outParams.channelCount = 1;
-		outParams.sampleFormat = paInt8;
-		outParams.suggestedLatency = Pa_GetDeviceInfo(outParams.device)->defaultHighOutputLatency;
+		outParams.sampleFormat = paInt16;
+		outParams.suggestedLatency = latency ? latency / 1000.0 : Pa_GetDeviceInfo(outParams.device)->defaultLowOutputLatency;
 		outParams.hostApiSpecificStreamInfo = NULL;
 		
-		if (Pa_OpenStream(&paStream_, NULL, &outParams, AUDIO_SAMPLE_RATE, AUDIO_BUFFER_SIZE, paClipOff, NULL, NULL) != paNoError) {
+		if (Pa_OpenStream(&paStream_, NULL, &outParams, AUDIO_SAMPLE_RATE, paFramesPerBufferUnspecified, paClipOff, &AudioOut::paCallback, this) != paNoError) {
 			Pa_Terminate() == paNoError || (std::cout << "Pa_Terminate error" << std::endl);
 			paInitialized_ = false;
 		}
@@ -326,71 +747,119 @@ Program::AudioOut::AudioOut(boost::asio::io_service & io)
 		else {
 			// All OK
 			std::cout << "Audio init success" << std::endl;
-			timeStep();
 		}
 	}
+#endif
 }
 
 Program::AudioOut::~AudioOut() {
+#if !defined(SENSOR_SIM)
 	if (paInitialized_) {
 		Pa_StopStream(paStream_) == paNoError || (std::cout << "Pa_StopStream error" << std::endl);
 		Pa_CloseStream(paStream_) == paNoError || (std::cout << "Pa_CloseStream error" << std::endl);
 		Pa_Terminate() == paNoError || (std::cout << "Pa_Terminate error" << std::endl);
 	}
+#endif
 }
 
 void Program::AudioOut::pushAudio(const Program::AudioVec & av) {
-	/*signed long num = Pa_GetStreamWriteAvailable(paStream_);
-	if (num > 0) {
-		if (av.size() < num) {
-			num = av.size();
+	// Whatever doesn't fit is dropped.
+	if (!av.empty()) {
+		ring_.push(av.data(), av.size());
+		// Underruns happen while audio plays, so that's when they're looked for.
+		if (!statsTimer_.pending()) {
+			statsTimer_.expiresFromNow(boost::chrono::milliseconds(int(AUDIO_STATS_TIME)), boost::bind(&AudioOut::onStatsTimer, this));
 		}
-		Pa_WriteStream(paStream_, reinterpret_cast<const void *>(av.data()), num);
-	}*/
-	size_t i = 0;
-	while (audioQueue_.size() < AUDIO_QUEUE_SIZE && i < av.size()) {
-		audioQueue_.push(av[i++]);
 	}
 }
 
 void Program::AudioOut::sirenState(bool state) {
-	if (state != sirenState_) {
-		sirenCounter_ = 0;
-	}
-	sirenState_ = state;
+	sirenState_.store(state, boost::memory_order_relaxed);
 }
 
 void Program::AudioOut::sirenEnable(bool enable) {
-	sirenEnable_ = enable;
-}
-
-void Program::AudioOut::timeStep() {
-	signed long num = Pa_GetStreamWriteAvailable(paStream_);
-	if (num > 0) {
-		AudioVec av(num);
-		for (size_t i = 0; i < av.size(); i++) {
-			int16_t sample = 0;
-			if (!audioQueue_.empty()) {
-				sample += audioQueue_.front();
-				audioQueue_.pop();
-			}
-			if (sirenEnable_ && sirenState_) {
-				if (((sirenCounter_ >> 10) & 0x3) != 0x3) {
-					sample += ((sirenCounter_ & 0x2) ? 127 : -128);
-				}
-				sirenCounter_++;
-			}
-			av[i] = AudioSample(std::min<int16_t>(127, std::max<int16_t>(-128, sample)));
+	sirenEnable_.store(enable, boost::memory_order_relaxed);
+}
+
+void Program::AudioOut::sirenPattern(Siren::Pattern pattern) {
+	sirenPattern_.store(pattern, boost::memory_order_relaxed);
+}
+
+#if defined(SENSOR_SIM)
+void Program::AudioOut::startSinkTimer() {
+	// A block's worth of time, to the nanosecond, so the rate doesn't drift.
+	sinkTime_ += boost::chrono::nanoseconds(int64_t(AUDIO_MIX_BLOCK) * 1000000000 / AUDIO_SAMPLE_RATE);
+	sinkTimer_.expiresAt(sinkTime_, boost::bind(&AudioOut::onSinkTimer, this));
+}
+
+void Program::AudioOut::onSinkTimer() {
+	fill(&sinkBlock_[0], sinkBlock_.size(), false);
+	sink_.write(reinterpret_cast<const char *>(&sinkBlock_[0]), sinkBlock_.size() * sizeof(AudioSample));
+	rendered_ += sinkBlock_.size();
+	startSinkTimer();
+}
+#else
+int Program::AudioOut::paCallback(const void * input, void * output, unsigned long frameCount, const PaStreamCallbackTimeInfo * timeInfo, PaStreamCallbackFlags statusFlags, void * userData) {
+	(void) input;
+	(void) timeInfo;
+	static_cast<AudioOut *>(userData)->fill(static_cast<AudioSample *>(output), frameCount, (statusFlags & paOutputUnderflow) != 0);
+	return paContinue;
+}
+#endif
+
+void Program::AudioOut::fill(AudioSample * out, std::size_t count, bool underflow) {
+	// PortAudio's thread, or the simulation's sink timer.
+	std::fill(out, out + count, 0);
+	std::size_t got = 0;
+	while (got < count) {
+		std::size_t n = ring_.pop(&block_[0], std::min(count - got, block_.size()));
+		if (n == 0) {
+			break;
+		}
+		Mixer::mix(out + got, &block_[0], n, streamGain_);
+		got += n;
+	}
+	if (underflow) {
+		underruns_.fetch_add(1, boost::memory_order_relaxed);
+	}
+	if (got > 0) {
+		if (gap_ > 0 && gap_ < AUDIO_UNDERRUN_GAP) {
+			underruns_.fetch_add(1, boost::memory_order_relaxed);
 		}
-		Pa_WriteStream(paStream_, reinterpret_cast<const void *>(av.data()), num);
+		gap_ = count - got;
+	}
+	else {
+		gap_ = std::min<std::size_t>(AUDIO_UNDERRUN_GAP, gap_ + count);
+	}
+	bool sirenState = sirenState_.load(boost::memory_order_relaxed);
+	int sirenPattern = sirenPattern_.load(boost::memory_order_relaxed);
+	if (sirenState != lastSirenState_ || sirenPattern != lastSirenPattern_) {
+		// Start the pattern from its beginning.
+		lastSirenState_ = sirenState;
+		lastSirenPattern_ = sirenPattern;
+		sirenPos_ = 0;
+	}
+	if (sirenState && sirenEnable_.load(boost::memory_order_relaxed)) {
+		siren_.mix(Siren::Pattern(sirenPattern), sirenPos_, out, count, sirenGain_);
+	}
+}
+
+void Program::AudioOut::onStatsTimer() {
+	uint64_t count = underruns();
+	if (count != reportedUnderruns_) {
+		std::cout << "Audio underruns: " << count << std::endl;
+		reportedUnderruns_ = count;
 	}
-	stepTimer_.expires_from_now(boost::chrono::milliseconds(50));
-	stepTimer_.async_wait(boost::bind(&AudioOut::timeStep, this));
 }
 
 Program::Longpoll::Longpoll(Program & program)
 	:	program_(program),
-		timer_(program_.io_) {
+		timer_(program_.wheel_),
+		readBuf_(BUF_SIZE),
+		decoder_(boost::bind(&Longpoll::onMessage, this, _1, _2, _3)) {
+	if (!program_.config_.httpHost_.empty()) {
+		http_ = Http::create(program_.io_, program_.config_.httpHost_, program_.config_.httpPort_);
+	}
 	startLongpoll("");
 }
 
@@ -398,98 +867,97 @@ Program::Longpoll::~Longpoll() {
 }
 
 void Program::Longpoll::startLongpoll(const std::string & token) {
+	if (http_) {
+		Http::Req req;
+		req.path_ = std::string(LONGPOLL_PATH) + "?token=" + Http::urlEncode(token) + "&codecs=" + Http::urlEncode(AUDIO_CODECS);
+		if (!program_.config_.node_.empty()) {
+			req.path_ += "&node=" + Http::urlEncode(program_.config_.node_);
+		}
+		if (!program_.config_.groups_.empty()) {
+			req.path_ += "&groups=" + Http::urlEncode(program_.config_.groups_);
+		}
+		req.timeout_ = HTTP_LONGPOLL_TIMEOUT;
+		req.retry_ = true; // A longpoll only reads
+		http_->sendReq(req, boost::bind(&Longpoll::onResponse, this, _1, token));
+		return;
+	}
 	boost::shared_ptr<strm::socket> sock(new strm::socket(program_.io_));
 	sock->async_connect(strm::endpoint(program_.config_.longpollAddr_), boost::bind(&Longpoll::onConnect, this, boost::asio::placeholders::error, sock, token));
 }
 
 void Program::Longpoll::onConnect(const boost::system::error_code & error, boost::shared_ptr<strm::socket> sock, const std::string & token) {
 	if (!error) {
-		boost::shared_ptr<std::string> msgOut(new std::string(token + "\n"));
-		boost::asio::async_write(*sock, boost::asio::buffer(*msgOut), boost::bind(&Longpoll::onWrite, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, sock, msgOut));
+		boost::shared_ptr<std::string> msgOut(new std::string(token + ' ' + program_.requestOptions() + '\n'));
+		boost::asio::async_write(*sock, boost::asio::buffer(*msgOut), boost::bind(&Longpoll::onWrite, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, sock, msgOut, token));
 	}
 	else {
-		// TODO: error
+		// pc_sw isn't there (yet). Try again with the same token, so no events are missed.
+		sock->close();
+		startTimer(token, LONGPOLL_RETRY_TIME);
 	}
 }
 
-void Program::Longpoll::onWrite(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> msgOut) {
+void Program::Longpoll::onWrite(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> msgOut, const std::string & token) {
 	if (!error) {
-		boost::shared_ptr< std::vector<uint8_t> > allDataIn(new std::vector<uint8_t>);
-		startRead(sock, allDataIn);
+		token_.clear();
+		decoder_.reset();
+		startRead(sock, token);
 	}
 	else {
-		// TODO: error
+		sock->close();
+		startTimer(token, LONGPOLL_RETRY_TIME);
 	}
 }
 
-void Program::Longpoll::startRead(boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > allDataIn) {
-	boost::shared_ptr< std::vector<uint8_t> > dataIn(new std::vector<uint8_t>(BUF_SIZE));
-	sock->async_read_some(boost::asio::buffer(*dataIn), boost::bind(&Longpoll::onRead, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, sock, allDataIn, dataIn));
+void Program::Longpoll::startRead(boost::shared_ptr<strm::socket> sock, const std::string & token) {
+	sock->async_read_some(boost::asio::buffer(readBuf_), boost::bind(&Longpoll::onRead, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, sock, token));
 }
 
-void Program::Longpoll::onRead(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > allDataIn, boost::shared_ptr< std::vector<uint8_t> > dataIn) {
-	allDataIn->insert(allDataIn->begin(), dataIn->begin(), dataIn->begin() + bytes_transferred);
+void Program::Longpoll::onRead(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, const std::string & token) {
+	decoder_.feed(readBuf_.data(), bytes_transferred);
 	if (!error) {
-		startRead(sock, allDataIn);
+		startRead(sock, token);
 	}
 	else if (error == boost::asio::error::eof) {
-		onEof(sock, allDataIn);
+		sock->close();
+		// Start new longpoll after a while
+		startTimer(token_.empty() ? token : token_, 50);
 	}
 	else {
-		// TODO: error
+		// The response was cut short. What came of it is applied, and the events after the old token come again.
+		sock->close();
+		startTimer(token, LONGPOLL_RETRY_TIME);
 	}
 }
 
-void Program::Longpoll::onEof(boost::shared_ptr<strm::socket> sock, boost::shared_ptr< std::vector<uint8_t> > allDataIn) {
-	sock->close();
-	sock.reset();
-	
-	// TODO: Process the data
-	std::istringstream stream(std::string(allDataIn->begin(), allDataIn->end()));
-	std::string token;
-	
-	uint8_t type, sizeBuf[2];
-	
-	while (stream.get(typepun<char>(type)).get(typepun<char>(sizeBuf[0])).get(typepun<char>(sizeBuf[1])).good()) {
-		std::size_t size = (std::size_t(sizeBuf[0]) << 8) | std::size_t(sizeBuf[1]);
-		std::vector<uint8_t> content(size);
-		if (stream.get(typepun<char*>(content.data()), size).gcount() != size) {
-			break;
-		}
-		else {
-			std::istringstream stream2(std::string(content.begin(), content.end()));
-			unsigned int u0 = 0, u1 = 0;
-			switch (MsgCode(type)) {
-			case LED:
-				stream >> u0 >> u1;
-				program_.gpio_.led(u0, u1);
-				break;
-			case SIREN_CTRL:
-				stream >> u0;
-				program_.audioOut_.sirenEnable(bool(u0));
-				break;
-			case SMOKE_SLEEP:
-				stream >> u0;
-				program_.gpio_.smokeSleep(u0);
-				break;
-			case AUDIO_STREAM:
-				// TODO
-				program_.audioOut_.pushAudio(typepun<AudioVec>(content)); // FIXME: dangerous typepun!
-				break;
-			case TOKEN:
-				token.assign(content.begin(), content.end());
-				break;
-			}
-		}
+void Program::Longpoll::onResponse(const Http::Res & res, const std::string & token) {
+	if (res.headers_.empty() || res.status_ != 200) {
+		// Try again with the same token, so no events are missed.
+		startTimer(token, LONGPOLL_RETRY_TIME);
+		return;
+	}
+	token_.clear();
+	decoder_.reset();
+	decoder_.feed(res.content_.data(), res.content_.size());
+	startTimer(token_.empty() ? token : token_, 50);
+}
+
+void Program::Longpoll::onMessage(uint8_t type, const uint8_t * content, std::size_t size) {
+	switch (MsgCode(type)) {
+	case Protocol::TOKEN:
+		token_.assign(content, content + size);
+		break;
+	case Protocol::RESYNC:
+		// Events were missed. Nothing to undo here, as the full state follows.
+		break;
+	default:
+		program_.onMessage(type, content, size);
+		break;
 	}
-	
-	// Start new longpoll after a while
-	startTimer(token);
 }
 
-void Program::Longpoll::startTimer(const std::string & token) {
-	timer_.expires_from_now(boost::chrono::milliseconds(50));
-	timer_.async_wait(boost::bind(&Longpoll::onTimer, this, token));
+void Program::Longpoll::startTimer(const std::string & token, unsigned int time) {
+	timer_.expiresFromNow(boost::chrono::milliseconds(time), boost::bind(&Longpoll::onTimer, this, token));
 }
 
 void Program::Longpoll::onTimer(const std::string & token) {
@@ -497,42 +965,469 @@ void Program::Longpoll::onTimer(const std::string & token) {
 }
 
 Program::EventOut::EventOut(Program & program)
-	:	program_(program) {
+	:	program_(program),
+		smoke_(program.wheel_, SMOKE_RETRY_MAX, SMOKE_TIMEOUT),
+		motion_(program.wheel_, EVENT_RETRY_MAX, 0) {
+	if (!program_.config_.httpHost_.empty()) {
+		smoke_.http_ = Http::create(program_.io_, program_.config_.httpHost_, program_.config_.httpPort_);
+		motion_.http_ = Http::create(program_.io_, program_.config_.httpHost_, program_.config_.httpPort_);
+	}
 }
 
 Program::EventOut::~EventOut() {
 }
 
-void Program::EventOut::pushEvent(Event event) {
+void Program::EventOut::pushEvent(Event event, Clock::time_point time) {
+	Pending pending = { event, 1, time, time };
+	if (event != Protocol::MOTION) {
+		smoke_.queue_.push_back(pending);
+		flush(smoke_);
+		return;
+	}
+	std::deque<Pending> & queue = motion_.queue_;
+	if (queue.size() > motion_.sending_) {
+		queue.back().count_++;
+		queue.back().last_ = time;
+	}
+	else {
+		if (queue.size() >= EVENT_QUEUE_MAX) {
+			// pc_sw has been gone for long, and every retry left a line behind. Merge the oldest two unsent ones.
+			std::deque<Pending>::iterator first = queue.begin() + motion_.sending_;
+			if (queue.end() - first >= 2) {
+				first[1].count_ += first[0].count_;
+				first[1].first_ = first[0].first_;
+				queue.erase(first);
+			}
+		}
+		queue.push_back(pending);
+	}
+	if (!motion_.timer_.pending() && motion_.sending_ == 0) {
+		startTimer(motion_, program_.config_.eventBatch_);
+	}
+}
+
+void Program::EventOut::flush(Lane & lane) {
+	if (lane.sending_ > 0 || lane.queue_.empty()) {
+		return;
+	}
+	lane.timer_.cancel();
+	lane.sending_ = lane.queue_.size();
+	// "<event> <count> <first_age> <last_age>\n", ages in ms, so the clocks of the two ends needn't agree.
+	Clock::time_point now = Clock::now();
+	boost::shared_ptr<std::string> msgOut(new std::string);
+	for (std::size_t i = 0; i < lane.sending_; i++) {
+		const Pending & pending = lane.queue_[i];
+		Protocol::EventLine line;
+		if (!lane.http_) {
+			// Over HTTP, the node goes in a field of its own.
+			line.node_ = program_.config_.node_;
+		}
+		line.event_ = pending.event_;
+		line.count_ = pending.count_;
+		line.firstAge_ = boost::chrono::duration_cast<boost::chrono::milliseconds>(now - pending.first_).count();
+		line.lastAge_ = boost::chrono::duration_cast<boost::chrono::milliseconds>(now - pending.last_).count();
+		Protocol::appendEventLine(*msgOut, line);
+	}
+	if (lane.http_) {
+		Http::Req req;
+		req.path_ = std::string(EVENT_PATH) + "?event=" + Http::urlEncode(msgOut->substr(0, msgOut->size() - 1));
+		if (!program_.config_.node_.empty()) {
+			req.path_ += "&node=" + Http::urlEncode(program_.config_.node_);
+		}
+		req.timeout_ = lane.timeout_;
+		// Not retry_: the server may have counted the events already. onFailure decides what's sent again.
+		lane.http_->sendReq(req, boost::bind(&EventOut::onResponse, this, boost::ref(lane), _1));
+		return;
+	}
 	boost::shared_ptr<strm::socket> sock(new strm::socket(program_.io_));
-	sock->async_connect(strm::endpoint(program_.config_.eventAddr_), boost::bind(&EventOut::onConnect, this, boost::asio::placeholders::error, sock, event));
+	sock->async_connect(strm::endpoint(program_.config_.eventAddr_), boost::bind(&EventOut::onConnect, this, boost::ref(lane), boost::asio::placeholders::error, sock, msgOut));
 }
 
-void Program::EventOut::onConnect(const boost::system::error_code & error, boost::shared_ptr<strm::socket> sock, Event event) {
+void Program::EventOut::onConnect(Lane & lane, const boost::system::error_code & error, boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> msgOut) {
 	if (!error) {
-		boost::shared_ptr<std::string> msgOut(new std::string);
-		switch (event) {
-		case SMOKE_ON:  *msgOut = "smoke_on\n" ; break;
-		case SMOKE_OFF: *msgOut = "smoke_off\n"; break;
-		case MOTION:    *msgOut = "motion\n"   ; break;
-		}
-		boost::asio::async_write(*sock, boost::asio::buffer(*msgOut), boost::bind(&EventOut::onWrite, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, sock, msgOut));
+		boost::asio::async_write(*sock, boost::asio::buffer(*msgOut), boost::bind(&EventOut::onWrite, this, boost::ref(lane), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, sock, msgOut));
 	}
 	else {
-		// TODO: error
+		onFailure(lane);
 	}
 }
 
-void Program::EventOut::onWrite(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> msgOut) {
+void Program::EventOut::onWrite(Lane & lane, const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock, boost::shared_ptr<std::string> msgOut) {
+	(void) bytes_transferred;
+	(void) msgOut;
+	sock->close();
 	if (!error) {
-		sock->close();
-		sock.reset();
+		onSent(lane);
+	}
+	else {
+		onFailure(lane);
+	}
+}
+
+void Program::EventOut::onResponse(Lane & lane, const Http::Res & res) {
+	if (!res.headers_.empty() && res.status_ == 200) {
+		onSent(lane);
+	}
+	else {
+		onFailure(lane);
+	}
+}
+
+void Program::EventOut::onSent(Lane & lane) {
+	lane.queue_.erase(lane.queue_.begin(), lane.queue_.begin() + lane.sending_);
+	lane.sending_ = 0;
+	lane.retryTime_ = EVENT_RETRY_MIN;
+	if (&lane == &smoke_) {
+		flush(lane);
+	}
+	else if (!lane.queue_.empty() && !lane.timer_.pending()) {
+		startTimer(lane, program_.config_.eventBatch_);
+	}
+}
+
+void Program::EventOut::onFailure(Lane & lane) {
+	// The whole batch stays queued, and goes again once the server is back.
+	lane.sending_ = 0;
+	startTimer(lane, lane.retryTime_);
+	lane.retryTime_ = std::min(lane.retryTime_ * 2, lane.retryMax_);
+}
+
+void Program::EventOut::startTimer(Lane & lane, unsigned int time) {
+	lane.timer_.expiresFromNow(boost::chrono::milliseconds(time), boost::bind(&EventOut::flush, this, boost::ref(lane)));
+}
+
+Program::Link::Link(Program & program)
+	:	program_(program),
+		heartbeatTimer_(program.wheel_),
+		reconnectTimer_(program.wheel_),
+		readBuf_(BUF_SIZE),
+		decoder_(boost::bind(&Link::onMessage, this, _1, _2, _3)),
+		writingEvents_(0),
+		connected_(false),
+		writing_(false) {
+	connect();
+}
+
+Program::Link::~Link() {
+}
+
+void Program::Link::pushEvent(Event event, NodeClock::time_point time) {
+	if (event == Protocol::MOTION && events_.size() > writingEvents_ && events_.back().event_ == Protocol::MOTION) {
+		events_.back().count_++;
+		events_.back().last_ = time;
+	}
+	else {
+		if (events_.size() - writingEvents_ >= LINK_PENDING_MAX) {
+			// The link has been down for long. Merge the oldest unsent motion line into the next one, across the
+			// smoke events between them; smoke events are never dropped, so only they can go past the limit.
+			std::deque<Pending>::iterator first = std::find_if(events_.begin() + writingEvents_, events_.end(), isMotion);
+			std::deque<Pending>::iterator next = (first == events_.end() ? first : std::find_if(first + 1, events_.end(), isMotion));
+			if (next != events_.end()) {
+				next->count_ += first->count_;
+				next->first_ = first->first_;
+				events_.erase(first);
+			}
+		}
+		Pending pending = { event, 1, time, time };
+		events_.push_back(pending);
+	}
+	if (connected_) {
+		startWrite();
+	}
+}
+
+void Program::Link::connect() {
+	boost::shared_ptr<strm::socket> sock(new strm::socket(program_.io_));
+	sock_ = sock;
+	sock->async_connect(strm::endpoint(program_.config_.linkAddr_), boost::bind(&Link::onConnect, this, boost::asio::placeholders::error, sock));
+}
+
+void Program::Link::onConnect(const boost::system::error_code & error, boost::shared_ptr<strm::socket> sock) {
+	if (sock != sock_) {
+		return;
+	}
+	if (error) {
+		disconnect();
+		return;
+	}
+	connected_ = true;
+	lastReceived_ = NodeClock::now();
+	decoder_.reset();
+	// pc_sw answers the HELLO with the full state, so it goes before any events that waited.
+	queue_.push_front(frame(Protocol::HELLO, program_.requestOptions()));
+	startWrite();
+	startRead();
+	startHeartbeat();
+}
+
+void Program::Link::startRead() {
+	sock_->async_read_some(boost::asio::buffer(readBuf_), boost::bind(&Link::onRead, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, sock_));
+}
+
+void Program::Link::onRead(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock) {
+	if (sock != sock_) {
+		return;
+	}
+	lastReceived_ = NodeClock::now();
+	decoder_.feed(readBuf_.data(), bytes_transferred);
+	if (!error) {
+		startRead();
 	}
 	else {
-		// TODO: error
+		disconnect();
+	}
+}
+
+void Program::Link::onMessage(uint8_t type, const uint8_t * content, std::size_t size) {
+	switch (MsgCode(type)) {
+	case Protocol::HEARTBEAT:
+	case Protocol::TOKEN:
+	case Protocol::RESYNC:
+		// The link is never behind, it's sent everything there is. Nothing to undo on a resync either.
+		break;
+	default:
+		program_.onMessage(type, content, size);
+		break;
 	}
 }
 
+void Program::Link::send(MsgCode type, const std::string & content) {
+	queue_.push_back(frame(type, content));
+	if (connected_) {
+		startWrite();
+	}
+}
+
+void Program::Link::startWrite() {
+	if (writing_ || (queue_.empty() && events_.empty())) {
+		return;
+	}
+	// Everything there is goes in one write.
+	writing_ = true;
+	writeBuf_.clear();
+	for (std::deque<std::string>::const_iterator it = queue_.begin(); it != queue_.end(); ++it) {
+		writeBuf_ += *it;
+	}
+	queue_.clear();
+	// The node is the link's, from the HELLO.
+	NodeClock::time_point now = NodeClock::now();
+	std::string line;
+	for (writingEvents_ = 0; writingEvents_ < events_.size(); writingEvents_++) {
+		const Pending & pending = events_[writingEvents_];
+		Protocol::EventLine evt;
+		evt.event_ = pending.event_;
+		evt.count_ = pending.count_;
+		evt.firstAge_ = boost::chrono::duration_cast<boost::chrono::milliseconds>(now - pending.first_).count();
+		evt.lastAge_ = boost::chrono::duration_cast<boost::chrono::milliseconds>(now - pending.last_).count();
+		line.clear();
+		Protocol::appendEventLine(line, evt);
+		Protocol::appendMsg(writeBuf_, Protocol::SENSOR_EVENT, line.data(), line.size() - 1);
+	}
+	boost::asio::async_write(*sock_, boost::asio::buffer(writeBuf_), boost::bind(&Link::onWrite, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, sock_));
+}
+
+void Program::Link::onWrite(const boost::system::error_code & error, std::size_t bytes_transferred, boost::shared_ptr<strm::socket> sock) {
+	(void) bytes_transferred;
+	if (sock != sock_) {
+		return;
+	}
+	writing_ = false;
+	if (error) {
+		// The events stay queued, and are sent again on the next link.
+		disconnect();
+		return;
+	}
+	events_.erase(events_.begin(), events_.begin() + writingEvents_);
+	writingEvents_ = 0;
+	startWrite();
+}
+
+void Program::Link::startHeartbeat() {
+	heartbeatTimer_.expiresFromNow(boost::chrono::milliseconds(int(LINK_HEARTBEAT_TIME)), boost::bind(&Link::onHeartbeat, this));
+}
+
+void Program::Link::onHeartbeat() {
+	if (!connected_) {
+		return;
+	}
+	if (NodeClock::now() - lastReceived_ > boost::chrono::milliseconds(int(LINK_TIMEOUT))) {
+		disconnect();
+		return;
+	}
+	send(Protocol::HEARTBEAT, "");
+	startHeartbeat();
+}
+
+void Program::Link::disconnect() {
+	if (!sock_) {
+		return;
+	}
+	sock_->close();
+	sock_.reset();
+	connected_ = false;
+	writing_ = false;
+	heartbeatTimer_.cancel();
+	// Only the sensor events are worth sending again; the next link starts with its own HELLO.
+	queue_.clear();
+	writingEvents_ = 0;
+	reconnectTimer_.expiresFromNow(boost::chrono::milliseconds(int(LINK_RECONNECT_TIME)), boost::bind(&Link::connect, this));
+}
+
+std::string Program::Link::frame(MsgCode type, const std::string & content) {
+	std::string msg;
+	Protocol::appendMsg(msg, type, content.data(), content.size());
+	return msg;
+}
+
+#if defined(SENSOR_SIM)
+Program::Sim::Sim(Program & program)
+	:	program_(program),
+		next_(0),
+		timer_(program.wheel_),
+		gpio_(),
+		log_(&std::cout) {
+	load(program.config_.trace_);
+	if (!program.config_.simLog_.empty()) {
+		logFile_.open(program.config_.simLog_.c_str());
+		if (!logFile_) {
+			throw std::runtime_error("can't write " + program.config_.simLog_);
+		}
+		log_ = &logFile_;
+	}
+}
+
+Program::Sim::~Sim() {
+}
+
+void Program::Sim::start() {
+	gpio_ = dynamic_cast<FakeGpioBackend *>(program_.gpio_.backend());
+	if (!gpio_) {
+		throw std::runtime_error("a simulation needs the fake GPIO");
+	}
+	gpio_->setOutputHandler(boost::bind(&Sim::onOutput, this, _1, _2, _3));
+	start_ = NodeClock::now();
+	startEntry();
+}
+
+void Program::Sim::run() {
+	boost::chrono::steady_clock::time_point wallStart = boost::chrono::steady_clock::now();
+	std::clock_t cpuStart = std::clock();
+	program_.io_.run();
+	double wall = boost::chrono::duration<double>(boost::chrono::steady_clock::now() - wallStart).count();
+	double cpu = double(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+	double simulated = boost::chrono::duration<double>(NodeClock::now() - start_).count();
+	log_->flush();
+	std::cout << "Simulated " << simulated << " s in " << wall << " s (" << cpu << " s of CPU)";
+	if (wall > 0) {
+		std::cout << ", " << simulated / wall << " times real time";
+	}
+	std::cout << "; " << SimClock::wakeups() << " wakeups";
+	if (simulated > 0) {
+		std::cout << " (" << SimClock::wakeups() / simulated << "/s)";
+	}
+	std::cout << "; " << program_.audioOut_.rendered() << " audio samples, " << program_.audioOut_.underruns() << " underruns" << std::endl;
+}
+
+void Program::Sim::onSensorEvent(Event event, NodeClock::time_point time) {
+	log(time) << eventName(event) << '\n';
+}
+
+void Program::Sim::load(const std::string & path) {
+	static const char * const WHATS[] = { "pin", "smoke", "motion", "led", "siren", "smoke_sleep", "siren_state", "tone", "end" };
+	std::ifstream in(path.c_str());
+	if (!in) {
+		throw std::runtime_error("can't read " + path);
+	}
+	std::string line;
+	uint64_t time = 0;
+	for (unsigned int n = 1; std::getline(in, line); n++) {
+		std::istringstream fields(line.substr(0, line.find('#')));
+		std::string timeStr;
+		Entry entry;
+		if (!(fields >> timeStr)) {
+			continue;
+		}
+		fields >> entry.what_;
+		std::getline(fields >> std::ws, entry.args_);
+		bool relative = (timeStr[0] == '+');
+		uint64_t value;
+		if (!boost::conversion::try_lexical_convert(timeStr.substr(relative ? 1 : 0), value)
+				|| std::find(WHATS, WHATS + sizeof(WHATS) / sizeof(WHATS[0]), entry.what_) == WHATS + sizeof(WHATS) / sizeof(WHATS[0])
+				|| (!relative && value < time)) {
+			throw std::runtime_error(path + ":" + boost::lexical_cast<std::string>(n) + ": bad entry");
+		}
+		time = (relative ? time + value : value);
+		entry.time_ = time;
+		entries_.push_back(entry);
+	}
+}
+
+void Program::Sim::startEntry() {
+	if (next_ == entries_.size()) {
+		// Whatever the last entry set off at its time still happens.
+		program_.io_.post(boost::bind(&boost::asio::io_service::stop, &program_.io_));
+		return;
+	}
+	timer_.expiresAt(start_ + boost::chrono::milliseconds(entries_[next_].time_), boost::bind(&Sim::onEntry, this));
+}
+
+void Program::Sim::onEntry() {
+	const Entry & entry = entries_[next_++];
+	if (entry.what_ == "end") {
+		program_.io_.stop();
+		return;
+	}
+	apply(entry);
+	startEntry();
+}
+
+void Program::Sim::apply(const Entry & entry) {
+	std::istringstream args(entry.args_);
+	unsigned int numbers[2] = { 0, 0 };
+	args >> numbers[0] >> numbers[1];
+	const uint8_t * content = reinterpret_cast<const uint8_t *>(entry.args_.data());
+	if (entry.what_ == "pin") {
+		gpio_->setInput(numbers[0], numbers[1] != 0);
+	}
+	else if (entry.what_ == "smoke") {
+		// Active low
+		gpio_->setInput(GPIO_FIRE_ALARM_PIN, numbers[0] == 0);
+	}
+	else if (entry.what_ == "motion") {
+		gpio_->setInput(GPIO_MOTION_PIN, numbers[0] != 0);
+	}
+	else if (entry.what_ == "led") {
+		program_.onMessage(Protocol::LED, content, entry.args_.size());
+	}
+	else if (entry.what_ == "siren") {
+		program_.onMessage(Protocol::SIREN_CTRL, content, entry.args_.size());
+	}
+	else if (entry.what_ == "smoke_sleep") {
+		program_.onMessage(Protocol::SMOKE_SLEEP, content, entry.args_.size());
+	}
+	else if (entry.what_ == "siren_state") {
+		program_.audioOut_.sirenState(numbers[0] != 0);
+	}
+	else if (entry.what_ == "tone") {
+		AudioVec tone(std::size_t(numbers[0]) * AUDIO_SAMPLE_RATE / 1000);
+		for (std::size_t i = 0; i < tone.size(); i++) {
+			tone[i] = AudioSample(8192 * std::sin(2 * 3.14159265358979 * numbers[1] * i / AUDIO_SAMPLE_RATE));
+		}
+		program_.audioOut_.pushAudio(tone);
+	}
+}
+
+void Program::Sim::onOutput(unsigned int pin, bool level, NodeClock::time_point time) {
+	if (pin == GPIO_LED_PIN) {
+		log(time) << (level ? "led_on" : "led_off") << '\n';
+	}
+}
+
+std::ostream & Program::Sim::log(NodeClock::time_point time) {
+	return *log_ << boost::chrono::duration_cast<boost::chrono::milliseconds>(time - start_).count() << ' ';
+}
+#endif
+
 int main(int argc, char const * const * argv) {
 	Program(Program::Config::fromArgv(argc, argv))();
 }
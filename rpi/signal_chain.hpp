@@ -0,0 +1,233 @@
+#ifndef SIGNAL_CHAIN_HPP
+#define SIGNAL_CHAIN_HPP
+
+#include <algorithm>
+#include <climits>
+#include <stdint.h>
+#include <boost/static_assert.hpp>
+
+// Conditioning of a binary sensor signal, sample by sample, by chains of stages put together at compile time,
+// e.g. Signal::Chain<Signal::Invert, Signal::Debounce<20>, Signal::Hold<1000> >. The stages are plain classes
+// with inline members, so a chain compiles into one small kernel, without virtual calls.
+//
+// Every stage (and chain) has:
+// - operator()(in): takes the next input sample, returns the output sample
+// - out(): the last output sample
+// - steady(in): how many more samples of in it takes without its output changing; FOREVER if it never would.
+//   A chain's can be less, as its stages may change without its output changing.
+// - MEMORY: when its output never changes for an input, that many samples of it bring the stage to rest,
+//   so a long run of one input can be cut down to MEMORY samples
+// The node takes a sample every ms (see SignalInput), so lengths are in ms there.
+namespace Signal {
+	const unsigned int FOREVER = UINT_MAX;
+
+	class Pass {
+	public:
+		enum { MEMORY = 0 };
+		Pass() : out_(false) { }
+		bool operator()(bool in) { return out_ = in; }
+		bool out() const { return out_; }
+		unsigned int steady(bool in) const { return in == out_ ? FOREVER : 0; }
+	private:
+		bool out_;
+	};
+
+	// For active low sensors
+	class Invert {
+	public:
+		enum { MEMORY = 0 };
+		Invert() : out_(false) { }
+		bool operator()(bool in) { return out_ = !in; }
+		bool out() const { return out_; }
+		unsigned int steady(bool in) const { return in != out_ ? FOREVER : 0; }
+	private:
+		bool out_;
+	};
+
+	// An integrator, counting up to Max while the input is on and down while it's off. The output goes on
+	// when the count gets to On, and off when it gets down to Off.
+	template <unsigned int Max, unsigned int On, unsigned int Off>
+	class Hysteresis {
+		BOOST_STATIC_ASSERT(Off < On && On <= Max);
+	public:
+		enum { MEMORY = Max };
+		Hysteresis() : count_(0), out_(false) { }
+		bool operator()(bool in) {
+			if (in) {
+				count_ += (count_ < Max);
+			}
+			else {
+				count_ -= (count_ > 0);
+			}
+			out_ = (count_ >= On) || (out_ && count_ > Off);
+			return out_;
+		}
+		bool out() const { return out_; }
+		unsigned int steady(bool in) const {
+			if (in && !out_) {
+				return On - count_ - 1;
+			}
+			if (!in && out_) {
+				return count_ - Off - 1;
+			}
+			return FOREVER;
+		}
+	private:
+		unsigned int count_;
+		bool out_;
+	};
+
+	// On after N samples more on than off, off after as many more off than on.
+	template <unsigned int N>
+	class Debounce
+		:	public Hysteresis<N, N, 0> {
+	};
+
+	// The majority of the last N samples.
+	template <unsigned int N>
+	class Majority {
+		BOOST_STATIC_ASSERT(N % 2 == 1 && N < 32);
+	public:
+		enum { MEMORY = N };
+		Majority() : history_(0), ones_(0), out_(false) { }
+		bool operator()(bool in) {
+			ones_ -= (history_ >> (N - 1)) & 1;
+			history_ = ((history_ << 1) | in) & MASK;
+			ones_ += in;
+			out_ = (ones_ > N / 2);
+			return out_;
+		}
+		bool out() const { return out_; }
+		unsigned int steady(bool in) const {
+			if (in == out_) {
+				return FOREVER;
+			}
+			// Every sample of in counts, unless it pushes out one of in, the oldest first.
+			unsigned int count = (in ? ones_ : N - ones_);
+			unsigned int i = 0;
+			for (; count <= N / 2; i++) {
+				count += (((history_ >> (N - 1 - i)) & 1) != uint32_t(in));
+			}
+			return i - 1;
+		}
+	private:
+		static const uint32_t MASK = (uint32_t(1) << N) - 1;
+
+		uint32_t history_; // The newest in the lowest bit
+		unsigned int ones_;
+		bool out_;
+	};
+
+	// Stays on for N samples after the input goes off.
+	template <unsigned int N>
+	class Hold {
+	public:
+		enum { MEMORY = N };
+		Hold() : left_(0), out_(false) { }
+		bool operator()(bool in) {
+			out_ = in || left_ > 0;
+			if (in) {
+				left_ = N;
+			}
+			else {
+				left_ -= (left_ > 0);
+			}
+			return out_;
+		}
+		bool out() const { return out_; }
+		unsigned int steady(bool in) const {
+			if (in) {
+				return out_ ? FOREVER : 0;
+			}
+			return out_ ? left_ : FOREVER;
+		}
+	private:
+		unsigned int left_;
+		bool out_;
+	};
+
+	// On for one sample while the input is on, then locked out for N samples: so on at once, and every N
+	// samples while the input stays on.
+	template <unsigned int N>
+	class Lockout {
+		BOOST_STATIC_ASSERT(N > 0);
+	public:
+		enum { MEMORY = N };
+		Lockout() : locked_(0), out_(false) { }
+		bool operator()(bool in) {
+			out_ = in && locked_ == 0;
+			if (out_) {
+				locked_ = N - 1;
+			}
+			else {
+				locked_ -= (locked_ > 0);
+			}
+			return out_;
+		}
+		bool out() const { return out_; }
+		unsigned int steady(bool in) const {
+			if (out_) {
+				// N == 1: on all along
+				return in && locked_ == 0 ? FOREVER : 0;
+			}
+			return in ? locked_ : FOREVER;
+		}
+	private:
+		unsigned int locked_;
+		bool out_;
+	};
+
+	enum EdgeKind {
+		RISING = 1,
+		FALLING = 2,
+		BOTH = RISING | FALLING
+	};
+
+	// On for one sample at the input's edges of that kind.
+	template <EdgeKind Kind>
+	class Edge {
+	public:
+		enum { MEMORY = 1 };
+		Edge() : last_(false), out_(false) { }
+		bool operator()(bool in) {
+			out_ = detect(last_, in);
+			last_ = in;
+			return out_;
+		}
+		bool out() const { return out_; }
+		unsigned int steady(bool in) const {
+			bool next = detect(last_, in);
+			if (next != out_) {
+				return 0;
+			}
+			return next ? 1 : FOREVER;
+		}
+	private:
+		static bool detect(bool last, bool in) {
+			return ((Kind & RISING) && in && !last) || ((Kind & FALLING) && !in && last);
+		}
+
+		bool last_, out_;
+	};
+
+	// The stages one after the other. A chain is a stage too, for longer ones.
+	template <typename A, typename B = Pass, typename C = Pass, typename D = Pass, typename E = Pass>
+	class Chain {
+	public:
+		enum { MEMORY = A::MEMORY + B::MEMORY + C::MEMORY + D::MEMORY + E::MEMORY };
+		bool operator()(bool in) { return e_(d_(c_(b_(a_(in))))); }
+		bool out() const { return e_.out(); }
+		unsigned int steady(bool in) const {
+			// Each stage's input stays what the stage before it gave last, as long as that stage is steady.
+			return std::min(std::min(std::min(a_.steady(in), b_.steady(a_.out())), std::min(c_.steady(b_.out()), d_.steady(c_.out()))), e_.steady(d_.out()));
+		}
+	private:
+		A a_;
+		B b_;
+		C c_;
+		D d_;
+		E e_;
+	};
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef SIGNAL_INPUT_HPP
+#define SIGNAL_INPUT_HPP
+
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <stdint.h>
+#include "signal_chain.hpp"
+#include "timer_wheel.hpp"
+
+// An input pin run through a signal conditioning chain (see signal_chain.hpp), a sample every ms. The pin's
+// level is only known from its edges, so there's no sampling as such: the samples since the last ones are run
+// in one go whenever there's an edge, or when the chain's output is due to change. The samples of an edge's
+// level start at its time. A steady chain doesn't wake the node at all, and neither do output changes of
+// other kinds than Changes.
+template <typename Chain, Signal::EdgeKind Changes = Signal::BOTH>
+class SignalInput
+	:	boost::noncopyable {
+public:
+	typedef TimerWheel::Clock Clock;
+	typedef boost::function<void(bool out, Clock::time_point time)> Handler; // Called when the output changes, for Changes
+
+	SignalInput(TimerWheel & wheel, Handler handler) : timer_(wheel), handler_(handler), level_(false), started_(false) { }
+	// The first one is the level the pin starts at.
+	void onEdge(bool level, Clock::time_point time) {
+		if (started_) {
+			run(time - Clock::duration(1));
+		}
+		started_ = true;
+		level_ = level;
+		sampled_ = time;
+		sample();
+		schedule();
+	}
+	bool out() const { return chain_.out(); }
+private:
+	static Clock::duration sampleTime() { return boost::chrono::milliseconds(1); }
+
+	static bool wanted(bool out) { return (Changes & (out ? Signal::RISING : Signal::FALLING)) != 0; }
+
+	void sample() {
+		bool out = chain_.out();
+		if (chain_(level_) != out && wanted(!out)) {
+			handler_(!out, sampled_);
+		}
+	}
+
+	// The samples after the last one, up to until.
+	void run(Clock::time_point until) {
+		if (until <= sampled_) {
+			return;
+		}
+		uint64_t count = (until - sampled_) / sampleTime();
+		while (count > 0) {
+			unsigned int steady = chain_.steady(level_);
+			if (steady == Signal::FOREVER || steady >= count) {
+				// Nothing happens on the way; the chain's state just has to be brought along.
+				uint64_t n = (steady == Signal::FOREVER ? std::min<uint64_t>(count, Chain::MEMORY) : count);
+				for (uint64_t i = 0; i < n; i++) {
+					chain_(level_);
+				}
+				sampled_ += sampleTime() * count;
+				return;
+			}
+			for (unsigned int i = 0; i < steady; i++) {
+				chain_(level_);
+			}
+			sampled_ += sampleTime() * (steady + 1);
+			count -= steady + 1;
+			sample();
+		}
+	}
+
+	void schedule() {
+		// The next wanted change, looked for on a copy of the chain.
+		Chain ahead(chain_);
+		uint64_t count = 0;
+		for (;;) {
+			unsigned int steady = ahead.steady(level_);
+			if (steady == Signal::FOREVER) {
+				timer_.cancel();
+				return;
+			}
+			for (unsigned int i = 0; i < steady; i++) {
+				ahead(level_);
+			}
+			count += steady + 1;
+			bool out = ahead.out();
+			if ((ahead(level_) != out && wanted(!out)) || count > Chain::MEMORY) {
+				// Or the chain's stages may be going round in circles: look again from there.
+				break;
+			}
+		}
+		timer_.expiresAt(sampled_ + sampleTime() * count, boost::bind(&SignalInput::onTimer, this));
+	}
+
+	void onTimer() {
+		run(Clock::now());
+		schedule();
+	}
+
+	TimerWheel::Timer timer_;
+	Handler handler_;
+	Chain chain_;
+	bool level_, started_;
+	Clock::time_point sampled_; // The time of the last sample
+};
+
+#endif
@@ -0,0 +1,50 @@
+#include <algorithm>
+#include <cmath>
+#include "mixer.hpp"
+#include "siren.hpp"
+
+namespace {
+	const double TONE_FREQUENCY = 3100; // Hz; at 8 kHz, 31 periods fit exactly in 80 samples
+	const double TONE_AMPLITUDE = 0.9 * 32767;
+	const unsigned int FADE_TIME = 2; // ms of fade in and out, so the tone doesn't click
+}
+
+Siren::Siren(unsigned int sampleRate)
+	:	sampleRate_(sampleRate) {
+	for (unsigned int i = 0; i < 4096; i++) {
+		tables_[LEGACY].push_back(((i >> 10) & 0x3) != 0x3 ? ((i & 0x2) ? 32767 : -32768) : 0);
+	}
+	for (unsigned int i = 0; i < 3; i++) {
+		addTone(tables_[TEMPORAL_3], 500, 500);
+	}
+	addTone(tables_[TEMPORAL_3], 0, 1000);
+	for (unsigned int i = 0; i < 4; i++) {
+		addTone(tables_[TEMPORAL_4], 100, 100);
+	}
+	addTone(tables_[TEMPORAL_4], 0, 5000);
+	tables_[CONTINUOUS].resize(sampleRate_);
+	for (unsigned int i = 0; i < sampleRate_; i++) {
+		tables_[CONTINUOUS][i] = int16_t(TONE_AMPLITUDE * std::sin(2 * M_PI * TONE_FREQUENCY * i / sampleRate_));
+	}
+}
+
+void Siren::addTone(std::vector<int16_t> & table, unsigned int onTime, unsigned int offTime) const {
+	std::size_t on = sampleRate_ * onTime / 1000, fade = std::max<std::size_t>(1, sampleRate_ * FADE_TIME / 1000);
+	for (std::size_t i = 0; i < on; i++) {
+		double envelope = std::min(1.0, double(std::min(i, on - 1 - i)) / fade);
+		table.push_back(int16_t(envelope * TONE_AMPLITUDE * std::sin(2 * M_PI * TONE_FREQUENCY * i / sampleRate_)));
+	}
+	table.resize(table.size() + sampleRate_ * offTime / 1000);
+}
+
+void Siren::mix(Pattern pattern, std::size_t & pos, int16_t * out, std::size_t count, int16_t gain) const {
+	const std::vector<int16_t> & table = tables_[pattern];
+	while (count > 0) {
+		pos %= table.size();
+		std::size_t n = std::min(count, table.size() - pos);
+		Mixer::mix(out, &table[pos], n, gain);
+		out += n;
+		pos += n;
+		count -= n;
+	}
+}
@@ -0,0 +1,30 @@
+#ifndef SIREN_HPP
+#define SIREN_HPP
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+// Alarm sounds. Every pattern is rendered once, a whole cycle of it, into a wavetable at startup;
+// playing it is then just mixing slices of the table.
+class Siren {
+public:
+	enum Pattern {
+		LEGACY,     // 2 kHz square wave, 3/4 on
+		TEMPORAL_3, // Smoke (ISO 8201): 3 x (0.5 s on, 0.5 s off), 1.5 s off
+		TEMPORAL_4, // CO: 4 x (0.1 s on, 0.1 s off), 5 s off
+		CONTINUOUS,
+		PATTERNS
+	};
+
+	Siren(unsigned int sampleRate);
+	// Mixes count samples of the pattern into out, from pos on, and advances pos (wrapping around).
+	void mix(Pattern pattern, std::size_t & pos, int16_t * out, std::size_t count, int16_t gain) const;
+private:
+	void addTone(std::vector<int16_t> & table, unsigned int onTime, unsigned int offTime) const;
+
+	unsigned int sampleRate_;
+	std::vector<int16_t> tables_[PATTERNS];
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <boost/atomic.hpp>
+
+// A fixed-size ring buffer for one producer thread and one consumer thread, without locks.
+// The storage is allocated up front. push and pop copy whole runs (at most two memcpys, as the ring wraps around),
+// so T has to be trivially copyable.
+// Each side only writes its own index, and publishes it with release ordering after copying the elements.
+template <typename T>
+class SpscRing {
+public:
+	SpscRing(std::size_t capacity) : buf_(roundUp(capacity)), mask_(buf_.size() - 1), head_(0), tail_(0) { }
+
+	std::size_t capacity() const { return buf_.size(); }
+	// Approximate unless called from the producer or the consumer.
+	std::size_t size() const { return head_.load(boost::memory_order_acquire) - tail_.load(boost::memory_order_acquire); }
+
+	// Producer side. Returns how many elements fit.
+	std::size_t push(const T * data, std::size_t count) {
+		std::size_t head = head_.load(boost::memory_order_relaxed), tail = tail_.load(boost::memory_order_acquire);
+		count = std::min(count, buf_.size() - (head - tail));
+		std::size_t pos = head & mask_, first = std::min(count, buf_.size() - pos);
+		std::memcpy(&buf_[pos], data, first * sizeof(T));
+		std::memcpy(&buf_[0], data + first, (count - first) * sizeof(T));
+		head_.store(head + count, boost::memory_order_release);
+		return count;
+	}
+
+	// Consumer side. Returns how many elements there were.
+	std::size_t pop(T * data, std::size_t count) {
+		std::size_t tail = tail_.load(boost::memory_order_relaxed), head = head_.load(boost::memory_order_acquire);
+		count = std::min(count, head - tail);
+		std::size_t pos = tail & mask_, first = std::min(count, buf_.size() - pos);
+		std::memcpy(data, &buf_[pos], first * sizeof(T));
+		std::memcpy(data + first, &buf_[0], (count - first) * sizeof(T));
+		tail_.store(tail + count, boost::memory_order_release);
+		return count;
+	}
+private:
+	SpscRing(const SpscRing &);
+	SpscRing & operator=(const SpscRing &);
+
+	static std::size_t roundUp(std::size_t capacity) {
+		std::size_t size = 1;
+		while (size < capacity) {
+			size <<= 1;
+		}
+		return size;
+	}
+
+	std::vector<T> buf_;
+	const std::size_t mask_;
+	// Free-running; they wrap around together, so head_ - tail_ is always the size.
+	boost::atomic<std::size_t> head_, tail_;
+};
+
+#endif
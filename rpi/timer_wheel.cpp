@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <boost/bind.hpp>
+#include "timer_wheel.hpp"
+
+void TimerWheel::Timer::expiresAt(Clock::time_point time, Handler handler) {
+	bool wasEarliest = pending_ && wheel_.armed_ && tick_ <= wheel_.armedTick_;
+	if (pending_) {
+		wheel_.remove(this);
+	}
+	// Rounded up, so it never goes off early
+	Clock::duration since = time - wheel_.start_;
+	boost::chrono::milliseconds ms(boost::chrono::duration_cast<boost::chrono::milliseconds>(since));
+	if (ms < since) {
+		ms += boost::chrono::milliseconds(1);
+	}
+	tick_ = (ms.count() > 0 ? uint64_t(ms.count()) : 0);
+	handler_ = handler;
+	wheel_.insert(this);
+	if (wasEarliest && !wheel_.turning_) {
+		wheel_.arm();
+	}
+}
+
+void TimerWheel::Timer::cancel() {
+	if (!pending_) {
+		return;
+	}
+	wheel_.remove(this);
+	handler_.clear();
+	// Rather than wake up for nothing
+	if (!wheel_.turning_ && wheel_.armed_ && tick_ <= wheel_.armedTick_) {
+		wheel_.arm();
+	}
+}
+
+TimerWheel::TimerWheel(boost::asio::io_service & io)
+	:	io_(io),
+		timer_(io),
+		start_(Clock::now()),
+		now_(0),
+		armed_(false),
+		turning_(false),
+		armedTick_(0),
+		wakeups_(0) {
+	std::fill(&slots_[0][0], &slots_[0][0] + LEVELS * SLOTS, static_cast<Timer *>(0));
+	std::fill(counts_, counts_ + LEVELS, 0);
+}
+
+TimerWheel::~TimerWheel() {
+}
+
+void TimerWheel::insert(Timer * timer) {
+	if (!turning_ && std::count(counts_, counts_ + LEVELS, 0) == LEVELS) {
+		// An empty wheel doesn't turn, so it may be far behind.
+		now_ = std::max<uint64_t>(now_, boost::chrono::duration_cast<boost::chrono::milliseconds>(Clock::now() - start_).count());
+	}
+	// Already due: the current slot, which goes off on the next turn (or on this one)
+	uint64_t tick = timer->tick_ = std::max(timer->tick_, now_);
+	uint64_t delta = tick - now_;
+	unsigned int level = 0;
+	while (level + 1 < LEVELS && (delta >> (SLOT_BITS * (level + 1))) != 0) {
+		level++;
+	}
+	uint64_t slotTick = tick;
+	if ((delta >> (SLOT_BITS * LEVELS)) != 0) {
+		// Beyond the wheel: the furthest slot, from where it's put back
+		slotTick = now_ + (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+	}
+	timer->level_ = level;
+	timer->slot_ = (slotTick >> (SLOT_BITS * level)) & (SLOTS - 1);
+	Timer *& head = slots_[level][timer->slot_];
+	timer->prev_ = 0;
+	timer->next_ = head;
+	if (head) {
+		head->prev_ = timer;
+	}
+	head = timer;
+	counts_[level]++;
+	timer->pending_ = true;
+	if (!turning_ && (!armed_ || tick < armedTick_)) {
+		armAt(tick);
+	}
+}
+
+void TimerWheel::remove(Timer * timer) {
+	if (timer->prev_) {
+		timer->prev_->next_ = timer->next_;
+	}
+	else {
+		slots_[timer->level_][timer->slot_] = timer->next_;
+	}
+	if (timer->next_) {
+		timer->next_->prev_ = timer->prev_;
+	}
+	timer->prev_ = timer->next_ = 0;
+	counts_[timer->level_]--;
+	timer->pending_ = false;
+}
+
+void TimerWheel::advance(uint64_t tick) {
+	expire();
+	while (now_ < tick) {
+		unsigned int level = 0;
+		while (level < LEVELS && counts_[level] == 0) {
+			level++;
+		}
+		if (level == LEVELS) {
+			now_ = tick;
+			break;
+		}
+		// Nothing can go off, or come down from above, before the next slot of the lowest level in use.
+		unsigned int shift = SLOT_BITS * level;
+		now_ = std::min(tick, ((now_ >> shift) + 1) << shift);
+		for (unsigned int i = 1; i < LEVELS && (now_ & ((uint64_t(1) << (SLOT_BITS * i)) - 1)) == 0; i++) {
+			cascade(i);
+		}
+		expire();
+	}
+}
+
+void TimerWheel::expire() {
+	// Handlers may set timers again, for this tick too.
+	Timer *& head = slots_[0][now_ & (SLOTS - 1)];
+	while (head) {
+		Timer * timer = head;
+		remove(timer);
+		Handler handler;
+		handler.swap(timer->handler_);
+		handler();
+	}
+}
+
+void TimerWheel::cascade(unsigned int level) {
+	Timer *& head = slots_[level][(now_ >> (SLOT_BITS * level)) & (SLOTS - 1)];
+	while (head) {
+		Timer * timer = head;
+		remove(timer);
+		insert(timer);
+	}
+}
+
+bool TimerWheel::earliest(uint64_t & tick) const {
+	bool found = false;
+	for (unsigned int level = 0; level < LEVELS; level++) {
+		if (counts_[level] == 0) {
+			continue;
+		}
+		// The slots from the current one on are in order (above the first level, the current one has already
+		// come down and holds the furthest deadlines), but far deadlines in the last level are anywhere.
+		unsigned int shift = SLOT_BITS * level;
+		unsigned int first = (level == 0 ? 0 : 1);
+		for (unsigned int i = first; i < first + SLOTS; i++) {
+			const Timer * timer = slots_[level][((now_ >> shift) + i) & (SLOTS - 1)];
+			if (!timer) {
+				continue;
+			}
+			for (; timer; timer = timer->next_) {
+				if (!found || timer->tick_ < tick) {
+					tick = timer->tick_;
+					found = true;
+				}
+			}
+			if (level + 1 < LEVELS) {
+				break;
+			}
+		}
+	}
+	return found;
+}
+
+void TimerWheel::arm() {
+	uint64_t tick;
+	if (!earliest(tick)) {
+		if (armed_) {
+			timer_.cancel();
+			armed_ = false;
+		}
+	}
+	else if (!armed_ || tick != armedTick_) {
+		armAt(tick);
+	}
+}
+
+void TimerWheel::armAt(uint64_t tick) {
+	armed_ = true;
+	armedTick_ = tick;
+	timer_.expires_at(start_ + boost::chrono::milliseconds(tick));
+	timer_.async_wait(boost::bind(&TimerWheel::onTimer, this, boost::asio::placeholders::error));
+}
+
+void TimerWheel::onTimer(const boost::system::error_code & error) {
+	if (error) {
+		return;
+	}
+	armed_ = false;
+	wakeups_++;
+	turning_ = true;
+	advance(boost::chrono::duration_cast<boost::chrono::milliseconds>(Clock::now() - start_).count());
+	turning_ = false;
+	arm();
+}
@@ -0,0 +1,75 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <stdint.h>
+#include "node_clock.hpp"
+
+// The node's deadlines, all on one asio timer. They're kept in a hierarchical timing wheel of 1 ms ticks:
+// LEVELS levels of SLOTS slots, each slot of a level as long as the whole level below it, so setting and
+// cancelling a deadline take constant time. The asio timer is only armed for the earliest deadline, and the
+// wheel only turns when it goes off, so the node sleeps until something is due (or I/O comes in).
+// Deadlines further off than the wheel reaches wait in its last slot and are put back.
+class TimerWheel
+	:	boost::noncopyable {
+public:
+	typedef NodeClock Clock;
+	typedef boost::function<void()> Handler;
+
+	enum {
+		SLOT_BITS = 6,
+		SLOTS = 1 << SLOT_BITS,
+		LEVELS = 5 // 2^30 ms: about 12 days
+	};
+
+	// A deadline, set again and again. Its handler is called through the io_service, at the first tick
+	// not before the deadline. Destroy timers before their wheel.
+	class Timer
+		:	boost::noncopyable {
+	public:
+		explicit Timer(TimerWheel & wheel) : wheel_(wheel), prev_(0), next_(0), tick_(0), pending_(false) { }
+		~Timer() { cancel(); }
+		void expiresAt(Clock::time_point time, Handler handler);
+		void expiresFromNow(Clock::duration duration, Handler handler) { expiresAt(Clock::now() + duration, handler); }
+		void cancel(); // The handler isn't called
+		bool pending() const { return pending_; }
+	private:
+		friend class TimerWheel;
+
+		TimerWheel & wheel_;
+		Timer * prev_, * next_; // In its slot
+		uint64_t tick_;
+		unsigned int level_, slot_;
+		Handler handler_;
+		bool pending_;
+	};
+
+	TimerWheel(boost::asio::io_service & io);
+	~TimerWheel();
+	boost::asio::io_service & io() { return io_; }
+	uint64_t wakeups() const { return wakeups_; } // Of the asio timer
+private:
+	void insert(Timer * timer);
+	void remove(Timer * timer);
+	void advance(uint64_t tick);
+	void cascade(unsigned int level);
+	void expire();
+	bool earliest(uint64_t & tick) const;
+	void arm();
+	void armAt(uint64_t tick);
+	void onTimer(const boost::system::error_code & error);
+
+	boost::asio::io_service & io_;
+	NodeTimer timer_;
+	Clock::time_point start_; // Of tick 0
+	uint64_t now_; // The last tick turned to
+	Timer * slots_[LEVELS][SLOTS];
+	std::size_t counts_[LEVELS]; // Timers in each level
+	bool armed_, turning_;
+	uint64_t armedTick_;
+	uint64_t wakeups_;
+};
+
+#endif